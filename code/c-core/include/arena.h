@@ -6,21 +6,42 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "logging.h"
 
 #define DEFAULT_ALIGNMENT (2 * sizeof(void *))
+// Reserved arenas are committed, and trimmed, this many bytes at a time. A
+// multiple of every page size the boards use (4, 16 and 64 KiB).
+#define ARENA_COMMIT_GRANULE (64 * 1024)
 
 /**
  * The core Arena structure.
  * Represents a linear block of memory that allocates by bumping a pointer.
+ *
+ * The block is either a buffer the caller provides (arena_init) or a range
+ * of address space the arena reserves itself (arena_reserve). A reserved
+ * arena only asks the kernel for memory as allocations reach it, so it can
+ * be sized for the worst case and cost what is actually used.
  */
 typedef struct {
   uint8_t *buffer;
   size_t length;
   size_t offset;
+
+  size_t committed; // readable and writable from buffer on; length if fixed
+  size_t dirty;     // past this, memory is known to be zero already
+  bool reserved;    // buffer is ours (arena_reserve), to arena_release
 } Arena;
 
+/**
+ * A position in an Arena, to go back to.
+ */
+typedef struct {
+  Arena *arena;
+  size_t offset;
+} ArenaMark;
+
 /**
  * A Slab is a specialized sub-arena.
  * It uses the "Header + Payload" pattern where the struct and its buffer
@@ -30,6 +51,7 @@ typedef struct {
   Arena sArena; // The embedded sub-arena
   Arena *parent_arena;
   int id;
+  int size_class; // slab.h's class, -1 if not from a SlabAllocator
 } Slab;
 
 /**
@@ -68,45 +90,174 @@ static inline void arena_init(Arena *a, void *buffer, size_t length) {
   a->buffer = (uint8_t *)buffer;
   a->length = length;
   a->offset = 0;
+  a->committed = length;
+  a->dirty = length; // whatever the caller left in it
+  a->reserved = false;
 }
 
 /**
- * Allocates memory from the Arena with a specific alignment.
+ * Reserves length bytes of address space (rounded up to
+ * ARENA_COMMIT_GRANULE) for the Arena. No memory is committed yet: the
+ * range is inaccessible until allocations reach it.
+ * * Returns:
+ * 0: Success.
+ * -1: The address space couldn't be reserved.
+ */
+static inline int arena_reserve(Arena *a, size_t length) {
+  length = align_forward(length, ARENA_COMMIT_GRANULE);
+  void *range = mmap(NULL, length, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (range == MAP_FAILED) {
+    LOG_SYS_ERROR("Failed to reserve %zu bytes for an arena", length);
+    return -1;
+  }
+  a->buffer = (uint8_t *)range;
+  a->length = length;
+  a->offset = 0;
+  a->committed = 0;
+  a->dirty = 0; // fresh anonymous pages are zero
+  a->reserved = true;
+  return 0;
+}
+
+/**
+ * Gives a reserved Arena's address space back. Everything allocated from it
+ * is gone. Does nothing to a fixed one.
+ */
+static inline void arena_release(Arena *a) {
+  if (a->reserved && a->buffer != NULL) {
+    munmap(a->buffer, a->length);
+    a->buffer = NULL;
+    a->length = a->offset = a->committed = a->dirty = 0;
+  }
+}
+
+// Makes [0, end) of a reserved arena usable. Returns false if it can't.
+static inline bool arena_commit(Arena *a, size_t end) {
+  if (!a->reserved) {
+    return false;
+  }
+  size_t target = align_forward(end, ARENA_COMMIT_GRANULE);
+  if (target > a->length) {
+    target = a->length;
+  }
+  if (mprotect(a->buffer + a->committed, target - a->committed,
+               PROT_READ | PROT_WRITE) != 0) {
+    LOG_SYS_ERROR("Failed to commit %zu bytes of an arena",
+                  target - a->committed);
+    return false;
+  }
+  a->committed = target;
+  return true;
+}
+
+/**
+ * Allocates memory from the Arena with a specific alignment, zeroed if zero
+ * is set. Only the part that may have been used before is cleared: fresh
+ * pages of a reserved arena already are zero.
  * Returns:
  * void*: Pointer to the aligned memory block.
  * NULL:  If the arena is out of memory.
  */
-static inline void *arena_alloc_align(Arena *a, size_t size, size_t align) {
+static inline void *arena_push(Arena *a, size_t size, size_t align,
+                               bool zero) {
   uintptr_t current_ptr = (uintptr_t)a->buffer + (uintptr_t)a->offset;
   uintptr_t offset_ptr = align_forward(current_ptr, align);
 
   // Convert back to relative offset for bounds checking
   offset_ptr -= (uintptr_t)a->buffer;
 
-  if (offset_ptr + size > a->length) {
+  size_t end = offset_ptr + size;
+  if (end > a->length || (end > a->committed && !arena_commit(a, end))) {
     LOG_ERROR("Could not allocate memory from arena: Arena OOM.");
     return NULL;
   }
 
   void *ptr = &a->buffer[offset_ptr];
-  a->offset = offset_ptr + size;
-  memset(ptr, 0, size);
+  a->offset = end;
+  if (zero && offset_ptr < a->dirty) {
+    memset(ptr, 0, (end < a->dirty ? end : a->dirty) - offset_ptr);
+  }
+  if (end > a->dirty) {
+    a->dirty = end;
+  }
   return ptr;
 }
 
 /**
- * Allocates memory from the Arena using the DEFAULT_ALIGNMENT.
+ * Allocates zeroed memory from the Arena with a specific alignment.
+ * Returns:
+ * void*: Pointer to the aligned memory block.
+ * NULL:  If the arena is out of memory.
+ */
+static inline void *arena_alloc_align(Arena *a, size_t size, size_t align) {
+  return arena_push(a, size, align, true);
+}
+
+/**
+ * Allocates zeroed memory from the Arena using the DEFAULT_ALIGNMENT.
  */
 static inline void *arena_alloc(Arena *a, size_t size) {
   return arena_alloc_align(a, size, DEFAULT_ALIGNMENT);
 }
 
+/**
+ * Like arena_alloc(), without clearing the memory: for buffers that are
+ * about to be overwritten anyway, on hot paths.
+ */
+static inline void *arena_alloc_nozero(Arena *a, size_t size) {
+  return arena_push(a, size, DEFAULT_ALIGNMENT, false);
+}
+
 /**
  * Resets the Arena offset to zero.
  * This effectively "frees" all memory allocated in this arena at once.
  */
 static inline void arena_reset(Arena *a) { a->offset = 0; }
 
+/**
+ * Remembers where the Arena is, for arena_restore(). Scratch memory for one
+ * message goes between the two: everything allocated after the mark is
+ * freed at once, and what came before it stays.
+ */
+static inline ArenaMark arena_save(Arena *a) {
+  ArenaMark m = {a, a->offset};
+  return m;
+}
+
+/**
+ * Frees everything allocated since m was saved.
+ */
+static inline void arena_restore(ArenaMark m) {
+  if (m.offset <= m.arena->offset) {
+    m.arena->offset = m.offset;
+  }
+}
+
+/**
+ * Returns the committed pages of a reserved Arena past its current offset to
+ * the OS (MADV_DONTNEED), after a burst is over. They stay usable, and read
+ * back as zero. Does nothing to a fixed Arena.
+ * * Returns:
+ * The number of bytes given back.
+ */
+static inline size_t arena_trim(Arena *a) {
+  if (!a->reserved) {
+    return 0;
+  }
+  // Pages past dirty were never touched: nothing to give back there
+  size_t from = align_forward(a->offset, ARENA_COMMIT_GRANULE);
+  size_t to = align_forward(a->dirty, ARENA_COMMIT_GRANULE);
+  if (to > a->committed) {
+    to = a->committed;
+  }
+  if (from >= to || madvise(a->buffer + from, to - from, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+  a->dirty = from;
+  return to - from;
+}
+
 // Macros for type-safe allocation
 #define ARENA_NEW(a, Type) ((Type *)arena_alloc(a, sizeof(Type)))
 #define ARENA_NEW_ARRAY(a, Type, Count)                                        \
@@ -149,6 +300,7 @@ static inline Slab *arena_create_slab(Arena *parent, size_t size, int id) {
 
   new_slab->parent_arena = parent;
   new_slab->id = id;
+  new_slab->size_class = -1;
 
   // Initialize the inner arena with the effective size
   arena_init(&new_slab->sArena, slab_buffer, effective_buffer_size);
@@ -218,11 +370,12 @@ static inline Slab *arena_slab_stack_pop(SlabStack *stack) {
  * it creates a new Slab from the parent Arena.
  * Warn: All Slabs in the stack must be of the same size class.
  * Mixing sizes will cause buffer overflows when reusing small Slabs for large
- * requests.
+ * requests. slab.h keeps one stack per size class for that.
  */
 static inline Slab *arena_acquire_slab(Arena *a, SlabStack *stack, size_t size,
                                        int id) {
-  Slab *s = arena_slab_stack_pop(stack);
+  // An empty stack is the normal case here, not an error worth logging
+  Slab *s = stack->count > 0 ? arena_slab_stack_pop(stack) : NULL;
 
   if (!s) {
     s = arena_create_slab(a, size, id);
@@ -235,10 +388,13 @@ static inline Slab *arena_acquire_slab(Arena *a, SlabStack *stack, size_t size,
 
 /**
  * Releases a Slab back to the stack.
- * If the stack is full, the Slab is abandoned
+ * * Returns:
+ * 0: Success.
+ * -1: The stack is full; the Slab is abandoned in the parent arena until it
+ *     is reset. slab.h sizes its stacks so this can't happen.
  */
-static inline void arena_release_slab(SlabStack *stack, Slab *s) {
-  arena_slab_stack_push(stack, s);
+static inline int arena_release_slab(SlabStack *stack, Slab *s) {
+  return arena_slab_stack_push(stack, s);
 }
 
 #endif // !ARENA_H
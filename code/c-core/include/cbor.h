@@ -0,0 +1,291 @@
+#ifndef CBOR_H
+#define CBOR_H
+
+/* ==========================================================================
+ *  Orange Sentry - Minimal CBOR (RFC 8949) writer and reader
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  The subset of CBOR our uplink records need: unsigned and negative
+ *  integers, byte and text strings, arrays, maps, booleans and null, all
+ *  with definite lengths. Integers always take the shortest encoding.
+ *
+ *  The writer fills a caller-provided buffer and never allocates; running
+ *  out of room sets a sticky overflow flag instead of failing every call,
+ *  so a record is written straight through and checked once at the end.
+ *  The reader walks a buffer in place; strings come back as slices of it.
+ *
+ *  USAGE INSTRUCTIONS:
+ *
+ *      uint8_t buf[64];
+ *      CborWriter w;
+ *      cbor_writer_init(&w, buf, sizeof(buf));
+ *      cbor_put_map(&w, 1);
+ *      cbor_put_uint(&w, 1);
+ *      cbor_put_text(&w, "up", 2);
+ *      if (w.overflow) return -1;
+ *
+ *      CborReader r = {buf, buf + w.len};
+ *      uint64_t pairs, key;
+ *      if (!cbor_get_map(&r, &pairs) || !cbor_get_uint(&r, &key)) ...
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+#define CBOR_FALSE 20
+#define CBOR_TRUE 21
+#define CBOR_NULL 22
+
+#define CBOR_MAX_DEPTH 8 // nesting cbor_skip() accepts
+
+typedef struct {
+  uint8_t *buf;
+  size_t cap;
+  size_t len;
+  bool overflow;
+} CborWriter;
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+} CborReader;
+
+// ---- writer ----
+
+static inline void cbor_writer_init(CborWriter *w, void *buf, size_t cap) {
+  w->buf = (uint8_t *)buf;
+  w->cap = cap;
+  w->len = 0;
+  w->overflow = false;
+}
+
+static inline void cbor_put_raw(CborWriter *w, const void *data, size_t len) {
+  if (w->overflow || w->cap - w->len < len) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+// Initial byte plus the shortest argument that holds value
+static inline void cbor_put_head(CborWriter *w, uint8_t major,
+                                 uint64_t value) {
+  uint8_t head[9];
+  size_t n;
+  if (value < 24) {
+    head[0] = (uint8_t)(major << 5 | value);
+    n = 1;
+  } else if (value <= UINT8_MAX) {
+    head[0] = (uint8_t)(major << 5 | 24);
+    n = 2;
+  } else if (value <= UINT16_MAX) {
+    head[0] = (uint8_t)(major << 5 | 25);
+    n = 3;
+  } else if (value <= UINT32_MAX) {
+    head[0] = (uint8_t)(major << 5 | 26);
+    n = 5;
+  } else {
+    head[0] = (uint8_t)(major << 5 | 27);
+    n = 9;
+  }
+  for (size_t i = 1; i < n; i++) {
+    head[i] = (uint8_t)(value >> (8 * (n - 1 - i)));
+  }
+  cbor_put_raw(w, head, n);
+}
+
+static inline void cbor_put_uint(CborWriter *w, uint64_t v) {
+  cbor_put_head(w, CBOR_UINT, v);
+}
+
+static inline void cbor_put_int(CborWriter *w, int64_t v) {
+  if (v >= 0) {
+    cbor_put_head(w, CBOR_UINT, (uint64_t)v);
+  } else {
+    cbor_put_head(w, CBOR_NEGINT, (uint64_t)(-(v + 1)));
+  }
+}
+
+static inline void cbor_put_bytes(CborWriter *w, const void *data,
+                                  size_t len) {
+  cbor_put_head(w, CBOR_BYTES, len);
+  cbor_put_raw(w, data, len);
+}
+
+static inline void cbor_put_text(CborWriter *w, const char *s, size_t len) {
+  cbor_put_head(w, CBOR_TEXT, len);
+  cbor_put_raw(w, s, len);
+}
+
+static inline void cbor_put_array(CborWriter *w, size_t count) {
+  cbor_put_head(w, CBOR_ARRAY, count);
+}
+
+static inline void cbor_put_map(CborWriter *w, size_t pairs) {
+  cbor_put_head(w, CBOR_MAP, pairs);
+}
+
+static inline void cbor_put_bool(CborWriter *w, bool v) {
+  cbor_put_head(w, CBOR_SIMPLE, v ? CBOR_TRUE : CBOR_FALSE);
+}
+
+static inline void cbor_put_null(CborWriter *w) {
+  cbor_put_head(w, CBOR_SIMPLE, CBOR_NULL);
+}
+
+// ---- reader ----
+
+/* *
+ * Reads one initial byte and its argument. Indefinite lengths are not
+ * supported and read as errors; floats come back as CBOR_SIMPLE with their
+ * raw bits.
+ */
+static inline bool cbor_get_head(CborReader *r, uint8_t *major,
+                                 uint64_t *value) {
+  if (r->p >= r->end) {
+    return false;
+  }
+  uint8_t ib = *r->p;
+  uint8_t info = ib & 0x1f;
+  *major = ib >> 5;
+
+  if (info < 24) {
+    *value = info;
+    r->p++;
+    return true;
+  }
+  if (info > 27) {
+    return false;
+  }
+
+  size_t n = (size_t)1 << (info - 24);
+  if ((size_t)(r->end - r->p) < 1 + n) {
+    return false;
+  }
+  uint64_t v = 0;
+  for (size_t i = 1; i <= n; i++) {
+    v = v << 8 | r->p[i];
+  }
+  r->p += 1 + n;
+  *value = v;
+  return true;
+}
+
+static inline bool cbor_peek_major(const CborReader *r, uint8_t *major) {
+  if (r->p >= r->end) {
+    return false;
+  }
+  *major = *r->p >> 5;
+  return true;
+}
+
+static inline bool cbor_get_uint(CborReader *r, uint64_t *v) {
+  uint8_t major;
+  return cbor_get_head(r, &major, v) && major == CBOR_UINT;
+}
+
+static inline bool cbor_get_int(CborReader *r, int64_t *v) {
+  uint8_t major;
+  uint64_t arg;
+  if (!cbor_get_head(r, &major, &arg) || arg > INT64_MAX) {
+    return false;
+  }
+  if (major == CBOR_UINT) {
+    *v = (int64_t)arg;
+    return true;
+  }
+  if (major == CBOR_NEGINT) {
+    *v = -1 - (int64_t)arg;
+    return true;
+  }
+  return false;
+}
+
+static inline bool cbor_get_string(CborReader *r, uint8_t want,
+                                   const uint8_t **data, size_t *len) {
+  uint8_t major;
+  uint64_t n;
+  if (!cbor_get_head(r, &major, &n) || major != want ||
+      n > (uint64_t)(r->end - r->p)) {
+    return false;
+  }
+  *data = r->p;
+  *len = (size_t)n;
+  r->p += n;
+  return true;
+}
+
+static inline bool cbor_get_bytes(CborReader *r, const uint8_t **data,
+                                  size_t *len) {
+  return cbor_get_string(r, CBOR_BYTES, data, len);
+}
+
+static inline bool cbor_get_text(CborReader *r, const char **s, size_t *len) {
+  return cbor_get_string(r, CBOR_TEXT, (const uint8_t **)s, len);
+}
+
+static inline bool cbor_get_array(CborReader *r, uint64_t *count) {
+  uint8_t major;
+  return cbor_get_head(r, &major, count) && major == CBOR_ARRAY;
+}
+
+static inline bool cbor_get_map(CborReader *r, uint64_t *pairs) {
+  uint8_t major;
+  return cbor_get_head(r, &major, pairs) && major == CBOR_MAP;
+}
+
+static inline bool cbor_skip_depth(CborReader *r, int depth) {
+  uint8_t major;
+  uint64_t arg;
+  if (depth > CBOR_MAX_DEPTH || !cbor_get_head(r, &major, &arg)) {
+    return false;
+  }
+
+  switch (major) {
+  case CBOR_BYTES:
+  case CBOR_TEXT:
+    if (arg > (uint64_t)(r->end - r->p)) {
+      return false;
+    }
+    r->p += arg;
+    return true;
+  case CBOR_MAP:
+    if (arg > UINT64_MAX / 2) {
+      return false;
+    }
+    arg *= 2;
+    // fall through
+  case CBOR_ARRAY:
+    for (uint64_t i = 0; i < arg; i++) {
+      if (!cbor_skip_depth(r, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  case CBOR_TAG:
+    return cbor_skip_depth(r, depth + 1);
+  default:
+    return true;
+  }
+}
+
+/* *
+ * Skips one complete data item, whatever its type.
+ */
+static inline bool cbor_skip(CborReader *r) { return cbor_skip_depth(r, 0); }
+
+#endif // CBOR_H
@@ -0,0 +1,9 @@
+#ifndef EXIT_CODES_H
+#define EXIT_CODES_H
+
+// Status codes shared by the Orange Sentry daemons, used both as process exit
+// codes and as return values of top-level functions.
+#define OS_EXIT_SUCCESS 0
+#define OS_EXIT_GEN_FAILURE 1
+
+#endif // EXIT_CODES_H
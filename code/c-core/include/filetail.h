@@ -0,0 +1,359 @@
+#ifndef FILETAIL_H
+#define FILETAIL_H
+
+/* ==========================================================================
+ *  Orange Sentry - Log file follower
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  "tail -F" for line-oriented logs (Suricata's eve.json, Cowrie's
+ *  cowrie.json), built to sit on a Reactor:
+ *  - the file is watched through its directory with inotify, which keeps
+ *    working across logrotate renames and for a file that doesn't exist yet;
+ *  - copytruncate is detected from the file size;
+ *  - a slow periodic filetail_check() catches anything inotify missed.
+ *
+ *  Lines are handed to the callback straight out of one read buffer taken
+ *  from an Arena; nothing is copied per line. A line cut by the end of a read
+ *  is moved to the front of the buffer and completed by the next read. Lines
+ *  longer than the buffer are dropped (and counted).
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. Define FILETAIL_IMPLEMENTATION in exactly one .c file before including.
+ *  2. filetail_open(), then watch filetail_fd() for EPOLLIN and call
+ *     filetail_process(); call filetail_check() from a ~1 s timer.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+
+typedef void (*FileTailLineHandler)(void *userdata, const char *line,
+                                    size_t len);
+
+typedef struct {
+  const char *path;
+  char name[256]; // basename of path, to filter directory events
+  int fd;         // -1 while the file does not exist
+  ino_t ino;
+  off_t offset;
+  int inotify_fd;
+
+  // line buffer, from the arena
+  char *buf;
+  size_t buf_size;
+  size_t buf_used;
+  bool skipping; // dropping the rest of an overlong (or cut) line
+
+  FileTailLineHandler on_line;
+  void *userdata;
+
+  // counters
+  uint64_t lines;
+  uint64_t overlong;
+  uint64_t truncated; // unfinished lines lost to a rotation
+  uint64_t rotations;
+  uint64_t bytes;
+} FileTail;
+
+/**
+ * Starts following path with a buf_size read buffer (also the longest line
+ * accepted). If from_start is false, only lines appended from now on are
+ * reported. A missing file is fine: it is picked up when created.
+ * Returns 0 on success, -1 on error.
+ */
+int filetail_open(FileTail *t, const char *path, Arena *a, size_t buf_size,
+                  bool from_start, FileTailLineHandler on_line,
+                  void *userdata);
+
+/**
+ * The inotify fd to wait on for EPOLLIN.
+ */
+static inline int filetail_fd(const FileTail *t) { return t->inotify_fd; }
+
+/**
+ * Handles pending inotify events: reads whatever was appended and follows
+ * rotations. Call when filetail_fd() is readable.
+ * Returns 0 on success, -1 on a fatal error.
+ */
+int filetail_process(FileTail *t);
+
+/**
+ * Safety net for lost inotify events: catches up with the file and notices a
+ * rotation or truncation by looking at it.
+ */
+void filetail_check(FileTail *t);
+
+void filetail_close(FileTail *t);
+
+#endif // FILETAIL_H
+
+// implementation (compile only once per program)
+#ifdef FILETAIL_IMPLEMENTATION
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Splits the buffer into lines and keeps the unfinished one for later
+static void filetail_consume(FileTail *t) {
+  char *p = t->buf;
+  char *end = t->buf + t->buf_used;
+
+  while (p < end) {
+    char *nl = memchr(p, '\n', (size_t)(end - p));
+    if (nl == NULL) {
+      break;
+    }
+    if (t->skipping) {
+      t->skipping = false; // that was the tail of a line we don't want
+    } else if (nl > p) {
+      t->lines++;
+      t->on_line(t->userdata, p, (size_t)(nl - p));
+    }
+    p = nl + 1;
+  }
+
+  size_t rest = (size_t)(end - p);
+  if (rest == t->buf_size) {
+    // A whole buffer without a newline: no log record is that long
+    t->overlong++;
+    t->skipping = true;
+    rest = 0;
+  } else if (rest > 0 && p != t->buf) {
+    memmove(t->buf, p, rest);
+  }
+  t->buf_used = rest;
+}
+
+// Reads everything up to the current end of the file
+static void filetail_read_to_eof(FileTail *t) {
+  if (t->fd == -1) {
+    return;
+  }
+
+  while (1) {
+    ssize_t n = read(t->fd, t->buf + t->buf_used, t->buf_size - t->buf_used);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_SYS_ERROR("Failed to read %s", t->path);
+      return;
+    }
+    if (n == 0) {
+      return;
+    }
+    t->offset += n;
+    t->bytes += (uint64_t)n;
+    t->buf_used += (size_t)n;
+    filetail_consume(t);
+  }
+}
+
+static void filetail_close_file(FileTail *t) {
+  if (t->fd != -1) {
+    close(t->fd);
+    t->fd = -1;
+  }
+  if (t->buf_used > 0) {
+    t->truncated++; // the writer never finished that line
+  }
+  t->buf_used = 0;
+  t->skipping = false;
+}
+
+static int filetail_open_file(FileTail *t, bool from_start) {
+  int fd = open(t->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      LOG_SYS_ERROR("Failed to open %s", t->path);
+    }
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    LOG_SYS_ERROR("Failed to stat %s", t->path);
+    close(fd);
+    return -1;
+  }
+
+  t->fd = fd;
+  t->ino = st.st_ino;
+  t->offset = from_start ? 0 : st.st_size;
+  if (lseek(fd, t->offset, SEEK_SET) == -1) {
+    LOG_SYS_ERROR("Failed to seek in %s", t->path);
+  }
+
+  // Starting at the end is only mid-line if the writer is mid-line
+  char last = '\n';
+  if (t->offset > 0 && pread(fd, &last, 1, t->offset - 1) != 1) {
+    last = '\n';
+  }
+  t->skipping = last != '\n';
+  return 0;
+}
+
+// Finishes the old file (the writer may still have flushed into it) and
+// moves to the new one from its beginning
+static void filetail_reopen(FileTail *t) {
+  filetail_read_to_eof(t);
+  filetail_close_file(t);
+  if (filetail_open_file(t, true) == 0) {
+    t->rotations++;
+    LOG_INFO("Following new %s", t->path);
+    filetail_read_to_eof(t);
+  }
+}
+
+int filetail_open(FileTail *t, const char *path, Arena *a, size_t buf_size,
+                  bool from_start, FileTailLineHandler on_line,
+                  void *userdata) {
+  memset(t, 0, sizeof(FileTail));
+  t->path = path;
+  t->fd = -1;
+  t->inotify_fd = -1;
+  t->on_line = on_line;
+  t->userdata = userdata;
+
+  t->buf_size = buf_size;
+  t->buf = arena_alloc(a, buf_size);
+  if (t->buf == NULL) {
+    LOG_ERROR("Failed to allocate the read buffer for %s", path);
+    return -1;
+  }
+
+  const char *slash = strrchr(path, '/');
+  const char *base = slash != NULL ? slash + 1 : path;
+  char dir[PATH_MAX];
+  if (slash == NULL) {
+    snprintf(dir, sizeof(dir), ".");
+  } else if (slash == path) {
+    snprintf(dir, sizeof(dir), "/");
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+  }
+  if (strlen(base) >= sizeof(t->name)) {
+    LOG_ERROR("File name too long: %s", base);
+    return -1;
+  }
+  snprintf(t->name, sizeof(t->name), "%s", base);
+
+  t->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (t->inotify_fd == -1) {
+    LOG_SYS_ERROR("Failed to create inotify instance");
+    return -1;
+  }
+
+  // Watching the directory rather than the file keeps working across
+  // rotations, and also covers a file that doesn't exist yet
+  if (inotify_add_watch(t->inotify_fd, dir,
+                        IN_MODIFY | IN_CREATE | IN_MOVED_TO) == -1) {
+    LOG_SYS_ERROR("Failed to watch %s", dir);
+    close(t->inotify_fd);
+    t->inotify_fd = -1;
+    return -1;
+  }
+
+  if (filetail_open_file(t, from_start) != 0) {
+    LOG_WARN("%s doesn't exist yet, waiting for it", path);
+  }
+  return 0;
+}
+
+int filetail_process(FileTail *t) {
+  // Big enough for a burst of events; the kernel coalesces repeated
+  // IN_MODIFY on the same file anyway
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool modified = false;
+  bool replaced = false;
+
+  while (1) {
+    ssize_t n = read(t->inotify_fd, events, sizeof(events));
+    if (n < 0) {
+      if (errno == EAGAIN) {
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_SYS_ERROR("Failed to read inotify events");
+      return -1;
+    }
+
+    for (char *p = events; p < events + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        replaced = true; // lost track, let the check sort it out
+        continue;
+      }
+      if (ev->len == 0 || strcmp(ev->name, t->name) != 0) {
+        continue;
+      }
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        replaced = true;
+      } else if (ev->mask & IN_MODIFY) {
+        modified = true;
+      }
+    }
+  }
+
+  if (replaced) {
+    filetail_check(t);
+  } else if (modified) {
+    uint64_t bytes_before = t->bytes;
+    filetail_read_to_eof(t);
+    if (t->bytes == bytes_before) {
+      filetail_check(t); // modified but not longer: truncated?
+    }
+  }
+  return 0;
+}
+
+void filetail_check(FileTail *t) {
+  struct stat st;
+  if (stat(t->path, &st) == -1) {
+    // Rotated away and not recreated yet: keep draining the old file
+    filetail_read_to_eof(t);
+    return;
+  }
+
+  if (t->fd == -1 || st.st_ino != t->ino) {
+    filetail_reopen(t);
+    return;
+  }
+
+  if (st.st_size < t->offset) {
+    // copytruncate: same file, starting over
+    LOG_INFO("%s was truncated, reading from the start", t->path);
+    t->rotations++;
+    t->offset = 0;
+    t->buf_used = 0;
+    t->skipping = false;
+    if (lseek(t->fd, 0, SEEK_SET) == -1) {
+      LOG_SYS_ERROR("Failed to seek in %s", t->path);
+    }
+  }
+  filetail_read_to_eof(t);
+}
+
+void filetail_close(FileTail *t) {
+  filetail_close_file(t);
+  if (t->inotify_fd != -1) {
+    close(t->inotify_fd);
+    t->inotify_fd = -1;
+  }
+}
+
+#endif // FILETAIL_IMPLEMENTATION
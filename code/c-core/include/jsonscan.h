@@ -0,0 +1,241 @@
+#ifndef JSONSCAN_H
+#define JSONSCAN_H
+
+/* ==========================================================================
+ *  Orange Sentry - In-place JSON scanner
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Just enough JSON to walk the one-object-per-line logs that Suricata and
+ *  Cowrie write, and pull a few scalars out of them, without allocating or
+ *  copying: strings come back as raw slices of the input (escapes are not
+ *  decoded, so a slice can be copied verbatim into other JSON).
+ *
+ *  USAGE INSTRUCTIONS:
+ *
+ *      JsonScan s = {line, line + len};
+ *      bool ok = true;
+ *      if (!json_expect(&s, '{')) return -1;
+ *      do {
+ *        const char *key, *val;
+ *        size_t klen, vlen;
+ *        if (!json_scan_string(&s, &key, &klen) || !json_expect(&s, ':'))
+ *          return -1;
+ *        if (JSON_KEY_IS(key, klen, "name")) {
+ *          if (!json_scan_string(&s, &val, &vlen)) return -1;
+ *        } else if (!json_skip_value(&s)) {
+ *          return -1;
+ *        }
+ *      } while (json_next_member(&s, &ok));
+ *      if (!ok) return -1;
+ *
+ *  Objects must not be empty when walked like this; check for '}' first
+ *  where that can happen.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+  const char *p;
+  const char *end;
+} JsonScan;
+
+#define JSON_KEY_IS(key, len, lit)                                             \
+  ((len) == sizeof(lit) - 1 && memcmp((key), (lit), sizeof(lit) - 1) == 0)
+
+static inline void json_skip_ws(JsonScan *s) {
+  while (s->p < s->end &&
+         (*s->p == ' ' || *s->p == '\t' || *s->p == '\r' || *s->p == '\n')) {
+    s->p++;
+  }
+}
+
+static inline bool json_expect(JsonScan *s, char c) {
+  json_skip_ws(s);
+  if (s->p < s->end && *s->p == c) {
+    s->p++;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * At a '"': returns the raw contents and moves past the closing quote.
+ * Returns false if there is no complete string here.
+ */
+static inline bool json_scan_string(JsonScan *s, const char **str,
+                                    size_t *len) {
+  json_skip_ws(s);
+  if (s->p >= s->end || *s->p != '"') {
+    return false;
+  }
+  const char *start = ++s->p;
+  while (s->p < s->end) {
+    const char *q = memchr(s->p, '"', (size_t)(s->end - s->p));
+    if (q == NULL) {
+      return false;
+    }
+    // A quote preceded by an odd number of backslashes is escaped
+    size_t slashes = 0;
+    while (q - slashes > start && q[-1 - (ptrdiff_t)slashes] == '\\') {
+      slashes++;
+    }
+    s->p = q + 1;
+    if (slashes % 2 == 0) {
+      *str = start;
+      *len = (size_t)(q - start);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Reads an unsigned integer. Returns false if there are no digits here.
+ */
+static inline bool json_scan_uint(JsonScan *s, uint64_t *out) {
+  json_skip_ws(s);
+  const char *start = s->p;
+  uint64_t v = 0;
+  while (s->p < s->end && *s->p >= '0' && *s->p <= '9') {
+    v = v * 10 + (uint64_t)(*s->p - '0');
+    s->p++;
+  }
+  *out = v;
+  return s->p != start;
+}
+
+/**
+ * Skips any value, nested objects and arrays included.
+ */
+static inline bool json_skip_value(JsonScan *s) {
+  json_skip_ws(s);
+  if (s->p >= s->end) {
+    return false;
+  }
+
+  if (*s->p == '"') {
+    const char *str;
+    size_t len;
+    return json_scan_string(s, &str, &len);
+  }
+
+  if (*s->p != '{' && *s->p != '[') {
+    // number, true, false, null
+    while (s->p < s->end && *s->p != ',' && *s->p != '}' && *s->p != ']') {
+      s->p++;
+    }
+    return true;
+  }
+
+  int depth = 0;
+  while (s->p < s->end) {
+    char c = *s->p;
+    if (c == '"') {
+      const char *str;
+      size_t len;
+      if (!json_scan_string(s, &str, &len)) {
+        return false;
+      }
+      continue;
+    }
+    s->p++;
+    if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (--depth == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Moves past the ',' between object members.
+ * Returns true if another member follows, false at the closing '}' (ok
+ * untouched) or on a syntax error (ok set to false).
+ */
+static inline bool json_next_member(JsonScan *s, bool *ok) {
+  json_skip_ws(s);
+  if (s->p < s->end && *s->p == ',') {
+    s->p++;
+    return true;
+  }
+  if (s->p < s->end && *s->p == '}') {
+    s->p++;
+    return false;
+  }
+  *ok = false;
+  return false;
+}
+
+static inline int json_digits(const char *p, int n) {
+  int v = 0;
+  for (int i = 0; i < n; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      return -1;
+    }
+    v = v * 10 + (p[i] - '0');
+  }
+  return v;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+static inline int64_t json_days_from_civil(int y, int m, int d) {
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+/**
+ * Parses an ISO 8601 timestamp as the logs write them
+ * ("2024-01-15T10:23:45.123456+0100", "...Z", "...+01:00").
+ * Returns ms since the epoch (UTC), 0 if unparsable.
+ */
+static inline uint64_t json_parse_timestamp_ms(const char *p, size_t len) {
+  if (len < 19 || p[4] != '-' || p[7] != '-' || p[10] != 'T' ||
+      p[13] != ':' || p[16] != ':') {
+    return 0;
+  }
+  int year = json_digits(p, 4), mon = json_digits(p + 5, 2);
+  int day = json_digits(p + 8, 2), hour = json_digits(p + 11, 2);
+  int min = json_digits(p + 14, 2), sec = json_digits(p + 17, 2);
+  if (year < 1970 || mon < 1 || mon > 12 || day < 1 || hour < 0 || min < 0 ||
+      sec < 0) {
+    return 0;
+  }
+
+  size_t i = 19;
+  int ms = 0;
+  if (i < len && p[i] == '.') {
+    int scale = 100;
+    for (i++; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
+      ms += (p[i] - '0') * scale;
+      scale /= 10;
+    }
+  }
+
+  int64_t offset_min = 0;
+  if (i + 3 <= len && (p[i] == '+' || p[i] == '-')) {
+    int oh = json_digits(p + i + 1, 2);
+    size_t m = i + 3 < len && p[i + 3] == ':' ? i + 4 : i + 3;
+    int om = m + 2 <= len ? json_digits(p + m, 2) : 0;
+    if (oh >= 0 && om >= 0) {
+      offset_min = (p[i] == '-' ? -1 : 1) * (oh * 60 + om);
+    }
+  }
+
+  int64_t secs = json_days_from_civil(year, mon, day) * 86400 + hour * 3600 +
+                 min * 60 + sec - offset_min * 60;
+  return (uint64_t)secs * 1000 + (uint64_t)ms;
+}
+
+#endif // JSONSCAN_H
@@ -0,0 +1,4 @@
+// The asynchronous logging backend. Programs built with LOG_ASYNC link this
+// in (src/logging.mk does it for the modules); without LOG_ASYNC it's empty.
+#define LOGGING_IMPLEMENTATION
+#include "logging.h"
@@ -20,10 +20,13 @@
  *  - Systemd Integration: Prefixes logs with <N> for journald filtering.
  *  - Errno Automation: LOG_SYS_ERROR automatically prints strerror(errno).
  *  - Compile-time Debug: LOG_DEBUG is stripped out unless -DDEBUG is set.
+ *  - Optional asynchronous backend (-DLOG_ASYNC, see below).
  *
  *  USAGE INSTRUCTIONS:
  *  1. Define MODULE_NAME *before* including this header.
  *  2. Use specific macros for specific error types (Logic vs System).
+ *  3. With LOG_ASYNC, link include/logging.c into the program (and
+ *     -lpthread); the modules' Makefiles do both through src/logging.mk.
  *
  *  EXAMPLE:
  *
@@ -65,6 +68,30 @@
  *      // Output: [MQTT-Client] DBG (client.c:42): Packet payload size: 256
  * bytes
  *
+ *  ASYNCHRONOUS BACKEND (-DLOG_ASYNC):
+ *  The synchronous macros block on the terminal, the pipe or journald, so
+ *  a stalled journal stalls whoever logs. With LOG_ASYNC the same macros
+ *  never block and never format:
+ *  - each call site gets a static LogSite (format, priority, file, line);
+ *  - the call copies its arguments raw (numbers, and strings by value)
+ *    into a fixed-size record in a ring of the calling thread's own, with
+ *    one producer and one consumer, so no lock and no contention;
+ *  - a flusher thread formats the records and sends them to journald's
+ *    native socket with structured fields (PRIORITY, CODE_FILE, CODE_LINE,
+ *    CODE_FUNC, ERRNO, OS_MODULE...) when stdout is the journal, and
+ *    writes the usual lines to stdout/stderr otherwise. While records
+ *    keep coming it drains every LOG_FLUSH_INTERVAL_MS; once a drain
+ *    finds every ring empty it sleeps on a futex, and only the record
+ *    that finds it asleep makes a system call to wake it;
+ *  - a full ring drops the record and counts it, reported by the flusher;
+ *  - a call site logging more than LOG_SITE_RATE records in a second has
+ *    the rest dropped and counted; the next record that goes through says
+ *    how many were suppressed.
+ *  Without a flusher (before the first log, after exit, or more threads
+ *  than LOG_MAX_THREADS) a record is formatted and written at once.
+ *  %n is not supported, and a record holds LOG_RECORD_SIZE bytes of
+ *  arguments: longer strings are truncated.
+ *
  * ========================================================================== */
 
 // Systemd priority definitions
@@ -81,6 +108,8 @@
 #define MODULE_NAME "GENERIC"
 #endif
 
+#ifndef LOG_ASYNC
+
 // generic log macros
 #define LOG_INFO(fmt, ...)                                                     \
   fprintf(stdout, LOG_LVL_INFO "[%s] " fmt "\n", MODULE_NAME, ##__VA_ARGS__)
@@ -110,4 +139,686 @@
   } while (0)
 #endif
 
+#else // LOG_ASYNC
+
+#include <stdint.h>
+
+#ifndef LOG_SITE_RATE
+#define LOG_SITE_RATE 100 // records per second and call site
+#endif
+#define LOG_RECORD_SIZE 256
+#ifndef LOG_RING_RECORDS
+#define LOG_RING_RECORDS 512 // per thread, a power of two: 128 KiB
+#endif
+#define LOG_MAX_THREADS 8
+#define LOG_FLUSH_INTERVAL_MS 10 // between drains while records keep coming
+
+typedef struct {
+  const char *fmt;
+  const char *kind; // "WARN: ", "ERROR: "... in the line, "" for info
+  const char *module;
+  const char *file;
+  const char *func;
+  int line;
+  uint8_t priority; // 0-7
+  // rate limit, shared by every thread logging from here
+  uint64_t window_s;
+  uint32_t count;
+  uint32_t suppressed;
+} LogSite;
+
+void log_async_write(LogSite *site, ...);
+
+// Records how many were dropped and suppressed so far, for every thread
+void log_async_stats(uint64_t *dropped, uint64_t *suppressed);
+
+// Formats and sends whatever is queued and stops the flusher; later
+// records are written synchronously. Runs at exit by itself.
+void log_async_stop(void);
+
+#define LOG_ASYNC_EMIT(prio, kind_, fmt_, ...)                                 \
+  do {                                                                         \
+    static LogSite log_site_ = {.fmt = fmt_,                                   \
+                                .kind = kind_,                                 \
+                                .module = MODULE_NAME,                         \
+                                .file = __FILE__,                              \
+                                .func = __func__,                              \
+                                .line = __LINE__,                              \
+                                .priority = prio};                             \
+    log_async_write(&log_site_, ##__VA_ARGS__);                                \
+  } while (0)
+
+#define LOG_INFO(fmt, ...) LOG_ASYNC_EMIT(6, "", fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_ASYNC_EMIT(4, "WARN: ", fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_ASYNC_EMIT(3, "ERROR: ", fmt, ##__VA_ARGS__)
+// errno is captured with the record too, for journald's ERRNO field
+#define LOG_SYS_ERROR(fmt, ...)                                                \
+  LOG_ASYNC_EMIT(3, "SYS_ERR: ", fmt ": %s", ##__VA_ARGS__, strerror(errno))
+
+#ifdef DEBUG
+#define LOG_DEBUG(fmt, ...) LOG_ASYNC_EMIT(7, "DBG: ", fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...)                                                    \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#endif // LOG_ASYNC
+
 #endif // LOGGING_H
+
+
+/* ==========================================================================
+ *  Asynchronous backend implementation
+ * ========================================================================== */
+#if defined(LOG_ASYNC) && defined(LOGGING_IMPLEMENTATION) &&                  \
+    !defined(LOGGING_IMPLEMENTED)
+#define LOGGING_IMPLEMENTED
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef LOG_IDENTIFIER
+#define LOG_IDENTIFIER "orange-sentry" // SYSLOG_IDENTIFIER in the journal
+#endif
+#define LOG_JOURNAL_SOCKET "/run/systemd/journal/socket"
+#define LOG_ARGS_SIZE (LOG_RECORD_SIZE - 32)
+#define LOG_LINE_MAX 1024
+
+typedef struct {
+  LogSite *site;
+  uint64_t time_us;    // CLOCK_REALTIME, when logged
+  uint32_t suppressed; // by the site's rate limit since its last record
+  int32_t err;         // errno, when logged
+  uint16_t len;        // bytes of args in use
+  uint8_t truncated;   // the arguments didn't all fit
+  uint8_t args[LOG_ARGS_SIZE];
+} LogRecord;
+
+enum { LOG_RING_FREE = 0, LOG_RING_OWNED, LOG_RING_CLOSING };
+
+// One producer (the owning thread) and one consumer (the flusher)
+typedef struct {
+  LogRecord records[LOG_RING_RECORDS];
+  uint32_t head __attribute__((aligned(64))); // written by the owner
+  uint32_t tail __attribute__((aligned(64))); // written by the flusher
+  uint64_t dropped;
+  uint8_t state;
+} LogRing;
+
+static LogRing log_rings[LOG_MAX_THREADS];
+static __thread LogRing *log_ring;
+static __thread bool log_ring_none; // every ring was taken
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static pthread_t log_flusher;
+static bool log_running;  // records go through the rings
+static bool log_stopping; // the flusher drains what's left and exits
+static uint32_t log_sleeping; // the flusher found the rings empty: a futex
+static int log_journal_fd = -1;
+static uint64_t log_suppressed_total;
+
+// ---- conversions ----
+
+typedef struct {
+  char spec[32]; // the conversion as written, without length modifier
+  char conv;     // 0: not a conversion we know
+  char length;   // 'H': hh, 'h', 'l', 'q': ll, 'j', 'z', 't', 'L', 0: none
+  int stars;     // '*' width and precision taken from the arguments
+} LogConv;
+
+// Parses the conversion starting at fmt[0] == '%'. Returns its length.
+static size_t log_parse_conv(const char *fmt, LogConv *c) {
+  size_t i = 1, n = 1;
+  c->spec[0] = '%';
+  c->conv = 0;
+  c->length = 0;
+  c->stars = 0;
+  while (fmt[i] != '\0' && strchr("-+ #0'", fmt[i]) != NULL && n < 24) {
+    c->spec[n++] = fmt[i++];
+  }
+  for (int part = 0; part < 2; part++) {
+    if (part == 1) {
+      if (fmt[i] != '.') {
+        break;
+      }
+      c->spec[n++] = fmt[i++];
+    }
+    if (fmt[i] == '*') {
+      c->stars++;
+      c->spec[n++] = fmt[i++];
+    }
+    while (fmt[i] >= '0' && fmt[i] <= '9' && n < 24) {
+      c->spec[n++] = fmt[i++];
+    }
+  }
+  if (fmt[i] == 'h' || fmt[i] == 'l') {
+    c->length = fmt[i++];
+    if (fmt[i] == c->length) {
+      c->length = c->length == 'h' ? 'H' : 'q';
+      i++;
+    }
+  } else if (fmt[i] != '\0' && strchr("jztL", fmt[i]) != NULL) {
+    c->length = fmt[i++];
+  }
+  if (fmt[i] != '\0' && strchr("diuoxXcpsneEfFgGaA%", fmt[i]) != NULL &&
+      n < 24) {
+    c->conv = fmt[i];
+    c->spec[n++] = fmt[i++];
+  }
+  c->spec[n] = '\0';
+  return i;
+}
+
+static bool log_put(LogRecord *r, const void *v, size_t size) {
+  if (r->truncated || r->len + size > LOG_ARGS_SIZE) {
+    r->truncated = 1;
+    return false;
+  }
+  memcpy(r->args + r->len, v, size);
+  r->len += (uint16_t)size;
+  return true;
+}
+
+static bool log_put_u64(LogRecord *r, uint64_t v) {
+  return log_put(r, &v, sizeof(v));
+}
+
+static bool log_put_str(LogRecord *r, const char *s) {
+  if (s == NULL) {
+    s = "(null)";
+  }
+  size_t room = LOG_ARGS_SIZE - r->len;
+  size_t len = strnlen(s, room > 0 ? room - 1 : 0);
+  if (r->truncated || room == 0) {
+    r->truncated = 1;
+    return false;
+  }
+  memcpy(r->args + r->len, s, len);
+  r->args[r->len + len] = '\0';
+  r->len += (uint16_t)(len + 1);
+  if (s[len] != '\0') { // what fit is kept; the "..." says it was cut
+    r->truncated = 1;
+    return false;
+  }
+  return true;
+}
+
+// Copies the arguments fmt takes, as they are: no formatting here
+static void log_capture(LogRecord *r, const char *fmt, va_list ap) {
+  for (const char *p = fmt; *p != '\0';) {
+    if (*p != '%') {
+      p++;
+      continue;
+    }
+    LogConv c;
+    p += log_parse_conv(p, &c);
+    for (int i = 0; i < c.stars; i++) {
+      log_put_u64(r, (uint64_t)(int64_t)va_arg(ap, int));
+    }
+    uint64_t v;
+    switch (c.conv) {
+    case 'd':
+    case 'i':
+      switch (c.length) {
+      case 'H': v = (uint64_t)(int64_t)(signed char)va_arg(ap, int); break;
+      case 'h': v = (uint64_t)(int64_t)(short)va_arg(ap, int); break;
+      case 'l': v = (uint64_t)(int64_t)va_arg(ap, long); break;
+      case 'q': v = (uint64_t)(int64_t)va_arg(ap, long long); break;
+      case 'j': v = (uint64_t)(int64_t)va_arg(ap, intmax_t); break;
+      case 'z': v = (uint64_t)(int64_t)va_arg(ap, ssize_t); break;
+      case 't': v = (uint64_t)(int64_t)va_arg(ap, ptrdiff_t); break;
+      default: v = (uint64_t)(int64_t)va_arg(ap, int); break;
+      }
+      log_put_u64(r, v);
+      break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+      switch (c.length) {
+      case 'H': v = (unsigned char)va_arg(ap, unsigned); break;
+      case 'h': v = (unsigned short)va_arg(ap, unsigned); break;
+      case 'l': v = va_arg(ap, unsigned long); break;
+      case 'q': v = va_arg(ap, unsigned long long); break;
+      case 'j': v = va_arg(ap, uintmax_t); break;
+      case 'z': v = va_arg(ap, size_t); break;
+      case 't': v = (uint64_t)va_arg(ap, ptrdiff_t); break;
+      default: v = va_arg(ap, unsigned); break;
+      }
+      log_put_u64(r, v);
+      break;
+    case 'c':
+      log_put_u64(r, (uint64_t)va_arg(ap, int));
+      break;
+    case 'p':
+      log_put_u64(r, (uint64_t)(uintptr_t)va_arg(ap, void *));
+      break;
+    case 's':
+      log_put_str(r, va_arg(ap, const char *));
+      break;
+    case 'n':
+      (void)va_arg(ap, void *);
+      break;
+    case '%':
+    case 0:
+      break;
+    default: { // floating point
+      double d = c.length == 'L' ? (double)va_arg(ap, long double)
+                                 : va_arg(ap, double);
+      log_put(r, &d, sizeof(d));
+      break;
+    }
+    }
+  }
+}
+
+static const uint8_t *log_get(const LogRecord *r, size_t *off, size_t size) {
+  if (*off + size > r->len) {
+    return NULL;
+  }
+  const uint8_t *p = r->args + *off;
+  *off += size;
+  return p;
+}
+
+// Formats the message the way printf would have, from the copies
+static size_t log_format(const LogRecord *r, char *out, size_t size) {
+  size_t len = 0, off = 0;
+  bool short_args = false;
+  for (const char *p = r->site->fmt; *p != '\0' && len + 1 < size;) {
+    if (*p != '%') {
+      out[len++] = *p++;
+      continue;
+    }
+    LogConv c;
+    const char *start = p;
+    p += log_parse_conv(p, &c);
+    if (c.conv == '%' || c.conv == 'n') {
+      if (c.conv == '%') {
+        out[len++] = '%';
+      }
+      continue;
+    }
+    if (c.conv == 0) { // unknown: as written
+      size_t n = (size_t)(p - start);
+      n = n < size - 1 - len ? n : size - 1 - len;
+      memcpy(out + len, start, n);
+      len += n;
+      continue;
+    }
+
+    int star[2] = {0, 0};
+    const uint8_t *a = NULL;
+    for (int i = 0; i < c.stars; i++) {
+      a = log_get(r, &off, sizeof(uint64_t));
+      if (a == NULL) {
+        break;
+      }
+      uint64_t v;
+      memcpy(&v, a, sizeof(v));
+      star[i] = (int)(int64_t)v;
+    }
+    const char *str = NULL;
+    if (c.stars == 0 || a != NULL) {
+      if (c.conv == 's') {
+        str = off < r->len ? (const char *)r->args + off : NULL;
+        a = (const uint8_t *)str;
+        off += str != NULL ? strlen(str) + 1 : 0;
+      } else {
+        a = log_get(r, &off, sizeof(uint64_t));
+      }
+    }
+    if (a == NULL) {
+      short_args = true;
+      break;
+    }
+
+    // Integers were widened to 64 bits: say so to snprintf
+    char spec[36];
+    size_t sl = strlen(c.spec);
+    memcpy(spec, c.spec, sl + 1);
+    if (strchr("diuoxX", c.conv) != NULL) {
+      memcpy(spec + sl - 1, "ll", 2);
+      spec[sl + 1] = c.conv;
+      spec[sl + 2] = '\0';
+    }
+
+    uint64_t u = 0;
+    double d = 0;
+    if (c.conv != 's') {
+      memcpy(&u, a, sizeof(u));
+      memcpy(&d, a, sizeof(d));
+    }
+    char *o = out + len;
+    size_t room = size - len;
+    int n;
+#define LOG_PRINT(v)                                                           \
+  (c.stars == 0   ? snprintf(o, room, spec, v)                                 \
+   : c.stars == 1 ? snprintf(o, room, spec, star[0], v)                        \
+                  : snprintf(o, room, spec, star[0], star[1], v))
+    switch (c.conv) {
+    case 's': n = LOG_PRINT(str); break;
+    case 'c': n = LOG_PRINT((int)u); break;
+    case 'p': n = LOG_PRINT((void *)(uintptr_t)u); break;
+    case 'd':
+    case 'i': n = LOG_PRINT((long long)u); break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': n = LOG_PRINT((unsigned long long)u); break;
+    default: n = LOG_PRINT(d); break;
+    }
+#undef LOG_PRINT
+    if (n > 0) {
+      len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+  }
+  if ((r->truncated || short_args) && len + 4 < size) {
+    memcpy(out + len, "...", 3);
+    len += 3;
+  }
+  if (r->suppressed > 0 && len < size) {
+    int n = snprintf(out + len, size - len, " (%u similar suppressed)",
+                     r->suppressed);
+    if (n > 0) {
+      len += (size_t)n < size - len ? (size_t)n : size - len - 1;
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
+
+// ---- output ----
+
+static bool log_journal_send(const LogRecord *r, const char *msg) {
+  char buf[LOG_LINE_MAX + 512];
+  const LogSite *s = r->site;
+  int n = snprintf(buf, sizeof(buf),
+                   "PRIORITY=%u\nSYSLOG_IDENTIFIER=%s\nOS_MODULE=%s\n"
+                   "CODE_FILE=%s\nCODE_LINE=%d\nCODE_FUNC=%s\n"
+                   "OS_TIME_US=%llu\n",
+                   s->priority, LOG_IDENTIFIER, s->module, s->file, s->line,
+                   s->func, (unsigned long long)r->time_us);
+  if (n > 0 && s->priority <= 3 && r->err != 0 &&
+      strcmp(s->kind, "SYS_ERR: ") == 0) {
+    n += snprintf(buf + n, sizeof(buf) - (size_t)n, "ERRNO=%d\n", r->err);
+  }
+  if (n > 0 && r->suppressed > 0) {
+    n += snprintf(buf + n, sizeof(buf) - (size_t)n, "OS_SUPPRESSED=%u\n",
+                  r->suppressed);
+  }
+  if (n <= 0 || (size_t)n >= sizeof(buf)) {
+    return false;
+  }
+  // A MESSAGE with a newline in it needs the binary form: flatten instead
+  size_t len = (size_t)n;
+  int m = snprintf(buf + len, sizeof(buf) - len, "MESSAGE=%s%s\n", s->kind,
+                   msg);
+  if (m <= 0) {
+    return false;
+  }
+  size_t end = len + (size_t)m < sizeof(buf) ? len + (size_t)m
+                                             : sizeof(buf) - 1;
+  for (size_t i = len; i + 1 < end; i++) {
+    buf[i] = buf[i] == '\n' ? ' ' : buf[i];
+  }
+  buf[end - 1] = '\n';
+
+  struct sockaddr_un sa = {.sun_family = AF_UNIX};
+  memcpy(sa.sun_path, LOG_JOURNAL_SOCKET, sizeof(LOG_JOURNAL_SOCKET));
+  return sendto(log_journal_fd, buf, end, MSG_NOSIGNAL,
+                (const struct sockaddr *)&sa, sizeof(sa)) == (ssize_t)end;
+}
+
+static void log_emit(const LogRecord *r) {
+  char msg[LOG_LINE_MAX];
+  log_format(r, msg, sizeof(msg));
+  if (log_journal_fd >= 0 && log_journal_send(r, msg)) {
+    return;
+  }
+  const LogSite *s = r->site;
+  FILE *f = s->priority >= 6 ? stdout : stderr;
+  if (s->priority == 7) {
+    fprintf(f, "<7>[%s] DBG (%s:%d): %s\n", s->module, s->file, s->line, msg);
+  } else {
+    fprintf(f, "<%u>[%s] %s%s\n", s->priority, s->module, s->kind, msg);
+  }
+}
+
+// ---- rings ----
+
+static void log_ring_release(void *p) {
+  __atomic_store_n(&((LogRing *)p)->state, LOG_RING_CLOSING,
+                   __ATOMIC_RELEASE);
+}
+
+static LogRing *log_ring_get(void) {
+  if (log_ring != NULL || log_ring_none) {
+    return log_ring;
+  }
+  for (size_t i = 0; i < LOG_MAX_THREADS; i++) {
+    uint8_t expected = LOG_RING_FREE;
+    if (__atomic_compare_exchange_n(&log_rings[i].state, &expected,
+                                    LOG_RING_OWNED, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      log_ring = &log_rings[i];
+      pthread_setspecific(log_key, log_ring);
+      return log_ring;
+    }
+  }
+  log_ring_none = true; // this thread writes synchronously
+  return NULL;
+}
+
+// Emits what every ring holds. Returns the number of records.
+static size_t log_drain(void) {
+  size_t count = 0;
+  for (size_t i = 0; i < LOG_MAX_THREADS; i++) {
+    LogRing *ring = &log_rings[i];
+    uint8_t state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+    if (state == LOG_RING_FREE) {
+      continue;
+    }
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    for (; tail != head; tail++, count++) {
+      log_emit(&ring->records[tail & (LOG_RING_RECORDS - 1)]);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    if (state == LOG_RING_CLOSING) { // its thread is gone, all drained
+      __atomic_store_n(&ring->state, LOG_RING_FREE, __ATOMIC_RELEASE);
+    }
+  }
+  return count;
+}
+
+// Whether any ring holds a record the flusher hasn't emitted
+static bool log_pending(void) {
+  for (size_t i = 0; i < LOG_MAX_THREADS; i++) {
+    LogRing *ring = &log_rings[i];
+    if (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) != LOG_RING_FREE &&
+        __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Blocks until log_wake() or a spurious wake-up, unless something was queued
+// since the last drain
+static void log_sleep(void) {
+  __atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+  // Pairs with the fence in log_wake(): either this sees the record or the
+  // producer sees the flag
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (log_pending() || __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+    return;
+  }
+  // Returns at once if a producer cleared the flag in the meantime
+  syscall(SYS_futex, &log_sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Producers, after publishing a record: a system call only for the one that
+// finds the flusher asleep
+static void log_wake(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) != 0 &&
+      __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_ACQ_REL) != 0) {
+    syscall(SYS_futex, &log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+void log_async_stats(uint64_t *dropped, uint64_t *suppressed) {
+  *dropped = 0;
+  for (size_t i = 0; i < LOG_MAX_THREADS; i++) {
+    *dropped += __atomic_load_n(&log_rings[i].dropped, __ATOMIC_RELAXED);
+  }
+  *suppressed = __atomic_load_n(&log_suppressed_total, __ATOMIC_RELAXED);
+}
+
+static void *log_flush_main(void *arg) {
+  static LogSite drops_site = {.fmt = "%llu log records dropped, rings full",
+                               .kind = "WARN: ",
+                               .module = "LOG",
+                               .file = __FILE__,
+                               .func = "log_flush_main",
+                               .line = __LINE__,
+                               .priority = 4};
+  uint64_t reported = 0;
+  for (;;) {
+    bool stopping = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+    size_t n = log_drain();
+
+    uint64_t dropped, suppressed;
+    log_async_stats(&dropped, &suppressed);
+    if (dropped != reported) {
+      LogRecord r = {.site = &drops_site};
+      log_put_u64(&r, dropped - reported);
+      log_emit(&r);
+      reported = dropped;
+      n++;
+    }
+    if (n > 0) {
+      fflush(stdout);
+      fflush(stderr);
+      if (!stopping) {
+        // Let the next batch gather: the producers see no one asleep and
+        // don't make system calls meanwhile
+        struct timespec ts = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+        nanosleep(&ts, NULL);
+      }
+    } else if (stopping) {
+      break;
+    } else {
+      log_sleep();
+    }
+  }
+  return NULL;
+}
+
+void log_async_stop(void) {
+  if (!__atomic_exchange_n(&log_running, false, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  __atomic_store_n(&log_stopping, true, __ATOMIC_RELEASE);
+  log_wake();
+  pthread_join(log_flusher, NULL);
+}
+
+static void log_start(void) {
+  pthread_key_create(&log_key, log_ring_release);
+  // systemd says when stdout is the journal: talk to it directly then
+  if (getenv("JOURNAL_STREAM") != NULL) {
+    log_journal_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  }
+
+  // The flusher takes no signals: they're the reactors' (signalfd)
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int rc = pthread_create(&log_flusher, NULL, log_flush_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc == 0) {
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+    atexit(log_async_stop);
+  }
+}
+
+void log_async_write(LogSite *site, ...) {
+  int err = errno;
+
+  // Rate limit, per call site and second
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  uint64_t now_s = (uint64_t)ts.tv_sec;
+  uint64_t window = __atomic_load_n(&site->window_s, __ATOMIC_RELAXED);
+  if (window != now_s &&
+      __atomic_compare_exchange_n(&site->window_s, &window, now_s, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_SITE_RATE) {
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&log_suppressed_total, 1, __ATOMIC_RELAXED);
+    errno = err;
+    return;
+  }
+
+  pthread_once(&log_once, log_start);
+  LogRing *ring = log_ring_get();
+  bool async = ring != NULL && __atomic_load_n(&log_running, __ATOMIC_ACQUIRE);
+
+  LogRecord local;
+  LogRecord *r = &local;
+  uint32_t head = 0;
+  if (async) {
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+        LOG_RING_RECORDS) {
+      __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+      errno = err;
+      return;
+    }
+    r = &ring->records[head & (LOG_RING_RECORDS - 1)];
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r->site = site;
+  r->time_us = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+  r->suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  r->err = err;
+  r->len = 0;
+  r->truncated = 0;
+  va_list ap;
+  va_start(ap, site);
+  log_capture(r, site->fmt, ap);
+  va_end(ap);
+
+  if (async) {
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    log_wake();
+  } else {
+    log_emit(r);
+  }
+  errno = err;
+}
+
+#endif // LOGGING_IMPLEMENTATION
@@ -0,0 +1,258 @@
+#ifndef LZ_H
+#define LZ_H
+
+/* ==========================================================================
+ *  Orange Sentry - LZ block compression
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  A small, fast compressor for the LZ4 block format: sequences of
+ *  literals plus (offset, length) back-references into the last 64 KiB.
+ *  Anything produced here decodes with the stock lz4 block API
+ *  (LZ4_decompress_safe), so the receiving side needs no code of ours.
+ *
+ *  Matching is greedy with a single hash table of recent positions. It
+ *  gives up some ratio against the reference encoder but compresses the
+ *  repetitive records we publish (same keys, same addresses) several times
+ *  over. Neither side allocates: the caller provides the hash table, so it
+ *  can come from an Arena.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  Define LZ_IMPLEMENTATION in exactly one .c file before including.
+ *
+ *      uint32_t table[LZ_TABLE_SIZE];
+ *      size_t n = lz_compress(raw, raw_len, out, sizeof(out), table);
+ *      if (n == 0) ... doesn't fit, send raw instead
+ *
+ *      size_t len;
+ *      if (lz_decompress(out, n, back, sizeof(back), &len) != 0) ...
+ *
+ * ========================================================================== */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_TABLE_SIZE (1u << LZ_HASH_BITS) // uint32_t entries
+
+/* *
+ * Compresses len bytes of src into dst. table must hold LZ_TABLE_SIZE
+ * entries; it is overwritten.
+ * * Returns:
+ * Compressed size, or 0 if it doesn't fit in cap bytes.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap,
+                   uint32_t *table);
+
+/* *
+ * Decompresses one block. Every length and offset is checked, so a
+ * malformed block can't read or write out of bounds.
+ * * Returns:
+ * 0 on success with the decompressed size in *out_len, -1 if src is
+ * malformed or doesn't fit in cap bytes.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap,
+                  size_t *out_len);
+
+#endif // LZ_H
+
+#ifdef LZ_IMPLEMENTATION
+
+#include <stdbool.h>
+#include <string.h>
+
+// Limits from the LZ4 block format
+#define LZ_MINMATCH 4
+#define LZ_LAST_LITERALS 5 // the block always ends with this many literals
+#define LZ_MFLIMIT 12      // no match may start closer to the end than this
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length bytes that follow a nibble of 15: 255 while there is more
+static bool lz_put_length(uint8_t **op, const uint8_t *oend, size_t len) {
+  uint8_t *o = *op;
+  for (; len >= 255; len -= 255) {
+    if (o >= oend) {
+      return false;
+    }
+    *o++ = 255;
+  }
+  if (o >= oend) {
+    return false;
+  }
+  *o++ = (uint8_t)len;
+  *op = o;
+  return true;
+}
+
+// One sequence; a match_len of 0 writes the final, literals-only one
+static bool lz_put_sequence(uint8_t **op, const uint8_t *oend,
+                            const uint8_t *lit, size_t lit_len, size_t offset,
+                            size_t match_len) {
+  uint8_t *o = *op;
+  if (o >= oend) {
+    return false;
+  }
+
+  size_t ml = match_len > 0 ? match_len - LZ_MINMATCH : 0;
+  uint8_t *token = o++;
+  *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15));
+  if (lit_len >= 15 && !lz_put_length(&o, oend, lit_len - 15)) {
+    return false;
+  }
+  if ((size_t)(oend - o) < lit_len) {
+    return false;
+  }
+  memcpy(o, lit, lit_len);
+  o += lit_len;
+
+  if (match_len > 0) {
+    if (oend - o < 2) {
+      return false;
+    }
+    *o++ = (uint8_t)offset;
+    *o++ = (uint8_t)(offset >> 8);
+    if (ml >= 15 && !lz_put_length(&o, oend, ml - 15)) {
+      return false;
+    }
+  }
+  *op = o;
+  return true;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap,
+                   uint32_t *table) {
+  const uint8_t *in = (const uint8_t *)src;
+  const uint8_t *iend = in + len;
+  const uint8_t *ip = in;
+  const uint8_t *anchor = in; // start of the pending literals
+  uint8_t *op = (uint8_t *)dst;
+  const uint8_t *oend = op + cap;
+
+  // Stale entries are harmless: every candidate is compared before use
+  memset(table, 0, LZ_TABLE_SIZE * sizeof(uint32_t));
+
+  if (len > LZ_MFLIMIT) {
+    const uint8_t *mflimit = iend - LZ_MFLIMIT;
+    const uint8_t *matchlimit = iend - LZ_LAST_LITERALS;
+
+    while (ip <= mflimit) {
+      uint32_t seq = lz_read32(ip);
+      uint32_t h = lz_hash(seq);
+      const uint8_t *ref = in + table[h];
+      table[h] = (uint32_t)(ip - in);
+
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+        ip++;
+        continue;
+      }
+
+      // Grow the match backwards into the literals, then forwards
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t *end = ip + LZ_MINMATCH;
+      const uint8_t *rend = ref + LZ_MINMATCH;
+      while (end < matchlimit && *end == *rend) {
+        end++;
+        rend++;
+      }
+
+      if (!lz_put_sequence(&op, oend, anchor, (size_t)(ip - anchor),
+                           (size_t)(ip - ref), (size_t)(end - ip))) {
+        return 0;
+      }
+      ip = anchor = end;
+    }
+  }
+
+  if (!lz_put_sequence(&op, oend, anchor, (size_t)(iend - anchor), 0, 0)) {
+    return 0;
+  }
+  return (size_t)(op - (uint8_t *)dst);
+}
+
+static bool lz_get_length(const uint8_t **ip, const uint8_t *iend,
+                          size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= iend) {
+      return false;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap,
+                  size_t *out_len) {
+  const uint8_t *ip = (const uint8_t *)src;
+  const uint8_t *iend = ip + len;
+  uint8_t *ostart = (uint8_t *)dst;
+  uint8_t *op = ostart;
+  const uint8_t *oend = ostart + cap;
+
+  if (len == 0) {
+    return -1;
+  }
+
+  while (1) {
+    uint8_t token = *ip++;
+
+    size_t lit = token >> 4;
+    if (lit == 15 && !lz_get_length(&ip, iend, &lit)) {
+      return -1;
+    }
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+      return -1;
+    }
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+
+    if (ip == iend) {
+      break; // the last sequence has no match
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - ostart)) {
+      return -1;
+    }
+
+    size_t ml = token & 15;
+    if (ml == 15 && !lz_get_length(&ip, iend, &ml)) {
+      return -1;
+    }
+    ml += LZ_MINMATCH;
+    if (ml > (size_t)(oend - op) || ip >= iend) {
+      return -1;
+    }
+
+    // Byte by byte: the match may overlap what it is producing
+    const uint8_t *m = op - offset;
+    for (size_t i = 0; i < ml; i++) {
+      op[i] = m[i];
+    }
+    op += ml;
+  }
+
+  *out_len = (size_t)(op - ostart);
+  return 0;
+}
+
+#endif // LZ_IMPLEMENTATION
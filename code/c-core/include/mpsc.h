@@ -0,0 +1,145 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+/* ==========================================================================
+ *  Orange Sentry - Bounded multi-producer single-consumer queue
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Hands pointers from any number of threads to one consumer thread, e.g.
+ *  from Paho's callback threads to the mqtt-client's main loop, without a
+ *  lock and without ever blocking a producer.
+ *
+ *  A ring of capacity cells (a power of two), each with a sequence number
+ *  (D. Vyukov's bounded queue). A producer claims the next position with
+ *  one CAS on tail, writes its item into the cell and publishes it by
+ *  storing the cell's sequence (release); the consumer sees a cell is ready
+ *  from its sequence (acquire), so it never reads a half-written item and
+ *  needs no CAS of its own. A full ring makes mpsc_push() fail at once; what
+ *  to do then is up to the producer.
+ *
+ *  Waking the consumer is not part of the queue; pair it with an eventfd
+ *  (see mpsc_push() and mpsc_wake_needed()).
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. mpsc_init() from one thread before the others start.
+ *  2. mpsc_push() from any thread; mpsc_pop() from the consumer only.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define MPSC_CACHE_LINE 64
+
+typedef struct {
+  uint64_t seq; // pos: free for pos; pos + 1: holds the item pushed at pos
+  void *item;
+} MpscCell;
+
+typedef struct {
+  uint64_t tail __attribute__((aligned(MPSC_CACHE_LINE))); // producers
+  uint64_t head __attribute__((aligned(MPSC_CACHE_LINE))); // the consumer
+  uint32_t sleeping; // the consumer drained the queue and wants a wake-up
+
+  MpscCell *cells __attribute__((aligned(MPSC_CACHE_LINE)));
+  uint64_t mask; // capacity - 1
+} MpscQueue;
+
+/**
+ * Sets up a queue of capacity cells (a power of two) taken from a.
+ * Returns 0 on success, -1 on a bad capacity or if a is full.
+ */
+static inline int mpsc_init(MpscQueue *q, Arena *a, size_t capacity) {
+  memset(q, 0, sizeof(*q));
+  if (capacity < 2 || !is_power_of_two(capacity)) {
+    LOG_ERROR("MPSC queue capacity %zu isn't a power of two", capacity);
+    return -1;
+  }
+  q->cells = ARENA_NEW_ARRAY(a, MpscCell, capacity);
+  if (q->cells == NULL) {
+    LOG_ERROR("Not enough memory for an MPSC queue of %zu", capacity);
+    return -1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    q->cells[i].seq = i;
+  }
+  q->mask = capacity - 1;
+  q->sleeping = 1; // nobody has drained it yet
+  return 0;
+}
+
+/**
+ * Any thread: queues item (not NULL). Never blocks; retries only while
+ * other producers win the race for the same position.
+ * Returns 0 on success, -1 if the queue is full.
+ */
+static inline int mpsc_push(MpscQueue *q, void *item) {
+  uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    MpscCell *cell = &q->cells[pos & q->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->item = item;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 0;
+      }
+      // pos now holds the tail another producer moved on to
+    } else if (diff < 0) {
+      return -1; // the consumer hasn't freed this cell: full
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Producers, right after a successful mpsc_push(): whether the consumer
+ * has to be woken (it went to sleep on an empty queue and nobody woke it
+ * since). Only one producer gets true until the consumer sleeps again.
+ */
+static inline bool mpsc_wake_needed(MpscQueue *q) {
+  // Pairs with the fence in mpsc_pop(): either the consumer sees the item or
+  // this sees it asleep
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_exchange_n(&q->sleeping, 0, __ATOMIC_ACQ_REL) != 0;
+}
+
+/**
+ * The consumer: the oldest item, or NULL if the queue is empty. When it
+ * returns NULL, the next mpsc_push() will ask for a wake-up.
+ */
+static inline void *mpsc_pop(MpscQueue *q) {
+  MpscCell *cell = &q->cells[q->head & q->mask];
+  if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != q->head + 1) {
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != q->head + 1) {
+      return NULL;
+    }
+    // Pushed just now, maybe without a wake-up: take it while awake. Its
+    // producer may still wake us for nothing.
+    __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+  }
+  void *item = cell->item;
+  __atomic_store_n(&cell->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELAXED);
+  return item;
+}
+
+/**
+ * Items queued right now; exact from the consumer when no push is under
+ * way, a hint otherwise.
+ */
+static inline size_t mpsc_depth(const MpscQueue *q) {
+  return (size_t)(__atomic_load_n(&q->tail, __ATOMIC_RELAXED) -
+                  __atomic_load_n(&q->head, __ATOMIC_RELAXED));
+}
+
+#endif // MPSC_H
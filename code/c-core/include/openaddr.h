@@ -0,0 +1,112 @@
+#ifndef OPENADDR_H
+#define OPENADDR_H
+
+/* ==========================================================================
+ *  Orange Sentry - Open-addressing hash tables
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  The flow table, the Cowrie session table, the alert dedup table and the
+ *  firewall's ban list are the same kind of table: one array of slots taken
+ *  from an Arena at init, a power of two in size and at most half full,
+ *  linear probing, and backward shift deletion instead of tombstones. Each
+ *  keeps its own entry type, key and hash; this header holds what they
+ *  share, driven by an OpenAddrOps of callbacks. The functions are static
+ *  inline and meant to be called with a constant OpenAddrOps, so that the
+ *  callbacks are inlined into them.
+ *
+ *  Backward shift deletion: when a slot is emptied, each following entry of
+ *  the same run moves back into the hole, unless its home slot lies
+ *  cyclically between the hole and where it is, and the hole moves on to
+ *  the slot it left. No probe chain ever crosses an empty slot, so lookups
+ *  need no tombstones and none pile up. Entries can move: moved() is told
+ *  about each, for tables that keep slot numbers elsewhere (dedup's LRU
+ *  list), and a loop over the slots that removes slot i has to look at
+ *  slot i again.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. Allocate openaddr_capacity() zeroed slots: zero is a free slot.
+ *  2. openaddr_probe() to look a key up, or find the slot it goes into.
+ *  3. openaddr_remove() to empty a slot; the table keeps its own count.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * What a table tells the helpers about its entries. table is whatever the
+ * table passes in, typically its own struct (for a hash seed).
+ */
+typedef struct {
+  size_t entry_size;
+  // Whether the slot holds an entry
+  bool (*used)(const void *entry);
+  // Whether the entry in a used slot holds key
+  bool (*match)(const void *entry, const void *key);
+  // The entry's hash; its home slot is the hash masked to the capacity
+  uint64_t (*hash)(const void *table, const void *entry);
+  // Optional: the entry just moved into slot to
+  void (*moved)(void *table, size_t to);
+} OpenAddrOps;
+
+/**
+ * Slots for max_entries, keeping the load factor at or under 1/2 so that
+ * probe chains stay short. max_entries must be at most SIZE_MAX / 4.
+ */
+static inline size_t openaddr_capacity(size_t max_entries) {
+  size_t capacity = 2;
+  while (capacity < max_entries * 2) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
+
+/**
+ * Walks the probe chain of key from its home slot.
+ * Returns the slot holding key, or the empty slot ending the chain.
+ */
+static inline size_t openaddr_probe(const OpenAddrOps *ops, const void *slots,
+                                    size_t capacity, size_t home,
+                                    const void *key) {
+  size_t mask = capacity - 1;
+  for (size_t i = home & mask;; i = (i + 1) & mask) {
+    const void *e = (const uint8_t *)slots + i * ops->entry_size;
+    if (!ops->used(e) || ops->match(e, key)) {
+      return i;
+    }
+  }
+}
+
+/**
+ * Empties slot i (backward shift deletion). The entries after it in its
+ * run may move back, each reported to ops->moved.
+ */
+static inline void openaddr_remove(const OpenAddrOps *ops, void *table,
+                                   void *slots, size_t capacity, size_t i) {
+  uint8_t *base = slots;
+  size_t size = ops->entry_size;
+  size_t mask = capacity - 1;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (!ops->used(base + j * size)) {
+      break;
+    }
+    size_t k = ops->hash(table, base + j * size) & mask;
+    // Move j back to the hole unless its home lies cyclically in (i, j]
+    bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+    if (!stays) {
+      memcpy(base + i * size, base + j * size, size);
+      if (ops->moved != NULL) {
+        ops->moved(table, i);
+      }
+      i = j;
+    }
+  }
+  memset(base + i * size, 0, size);
+}
+
+#endif // OPENADDR_H
@@ -0,0 +1,433 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/* ==========================================================================
+ *  Orange Sentry - Event Reactor
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  A small single-threaded event loop built on epoll. Every wakeup source a
+ *  daemon cares about is turned into a file descriptor and registered here:
+ *  - IPC sockets (plain fds),
+ *  - shutdown/reload signals (signalfd),
+ *  - periodic work such as keepalives (timerfd).
+ *
+ *  The loop sleeps in epoll_wait() until one of them is ready, so an idle
+ *  daemon costs zero wakeups and a message is handled as soon as it lands.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. Define REACTOR_IMPLEMENTATION in exactly one .c file before including.
+ *  2. reactor_init() -> reactor_add_*() -> reactor_run() -> reactor_close().
+ *  3. Callbacks run on the loop thread and must not block.
+ *
+ *  EXAMPLE:
+ *
+ *      static void on_ipc(Reactor *r, int fd, uint32_t events, void *ud) {
+ *        if (events & (EPOLLHUP | EPOLLERR)) {
+ *          reactor_stop(r);
+ *          return;
+ *        }
+ *        ... drain fd ...
+ *      }
+ *
+ *      Reactor r;
+ *      reactor_init(&r);
+ *      reactor_add_fd(&r, sock_fd, EPOLLIN, on_ipc, ctx);
+ *      reactor_add_timer(&r, 30000, on_keepalive, ctx);
+ *      reactor_add_signals(&r, (int[]){SIGINT, SIGTERM}, 2, on_signal, NULL);
+ *      reactor_run(&r);
+ *      reactor_close(&r);
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "logging.h"
+
+// Max number of fds a single reactor can watch. Daemons here watch a handful.
+#ifndef REACTOR_MAX_HANDLERS
+#define REACTOR_MAX_HANDLERS 16
+#endif
+
+// Max number of events handled per epoll_wait() call.
+#ifndef REACTOR_MAX_EVENTS
+#define REACTOR_MAX_EVENTS 16
+#endif
+
+struct Reactor;
+
+typedef void (*ReactorCallback)(struct Reactor *r, int fd, uint32_t events,
+                                void *userdata);
+
+typedef struct {
+  int fd;     // -1 when the slot is free
+  bool owned; // created by the reactor (timerfd/signalfd), closed by it
+  uint32_t gen; // bumped every time the slot is freed
+  ReactorCallback cb;
+  void *userdata;
+} ReactorHandler;
+
+typedef struct Reactor {
+  int epoll_fd;
+  volatile bool running;
+  uint64_t wakeups;    // number of epoll_wait() returns, for instrumentation
+  uint64_t dispatched; // number of callbacks invoked
+  ReactorHandler handlers[REACTOR_MAX_HANDLERS];
+} Reactor;
+
+/**
+ * Creates the epoll instance and clears the handler table.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_init(Reactor *r);
+
+/**
+ * Watches an existing fd for the given epoll events (EPOLLIN, EPOLLOUT...).
+ * EPOLLHUP and EPOLLERR are always reported by the kernel.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_add_fd(Reactor *r, int fd, uint32_t events, ReactorCallback cb,
+                   void *userdata);
+
+/**
+ * Changes the event mask of an fd that is already being watched.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_mod_fd(Reactor *r, int fd, uint32_t events);
+
+/**
+ * Stops watching an fd. Reactor-owned fds (timers, signals) are closed.
+ * Safe to call from inside a callback, including the fd's own.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_del_fd(Reactor *r, int fd);
+
+/**
+ * Creates a periodic timerfd firing every interval_ms milliseconds.
+ * The callback must call reactor_timer_ack() to consume the expiration.
+ * Returns:
+ * >= 0: The timer fd (usable with reactor_del_fd / reactor_timer_set).
+ * -1: Error.
+ */
+int reactor_add_timer(Reactor *r, uint32_t interval_ms, ReactorCallback cb,
+                      void *userdata);
+
+/**
+ * Re-arms an existing timer with a new period. 0 disarms it.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_timer_set(int timer_fd, uint32_t interval_ms);
+
+/**
+ * Reads the expiration counter of a timer fd.
+ * Returns the number of expirations since the last ack (0 if none).
+ */
+uint64_t reactor_timer_ack(int timer_fd);
+
+/**
+ * Blocks the given signals for the process and routes them through a
+ * signalfd. The callback must call reactor_signal_read() to fetch the signo.
+ * Call this before spawning threads so they inherit the blocked mask.
+ * Returns:
+ * >= 0: The signal fd.
+ * -1: Error.
+ */
+int reactor_add_signals(Reactor *r, const int *signals, size_t count,
+                        ReactorCallback cb, void *userdata);
+
+/**
+ * Reads one pending signal from a signalfd.
+ * Returns the signal number, or 0 if none is pending.
+ */
+int reactor_signal_read(int signal_fd);
+
+/**
+ * Runs the loop until reactor_stop() is called.
+ * Returns 0 on a clean stop, -1 if epoll_wait() failed.
+ */
+int reactor_run(Reactor *r);
+
+/**
+ * Waits at most timeout_ms (-1 = forever) and dispatches ready handlers once.
+ * Returns the number of dispatched callbacks, or -1 on error.
+ */
+int reactor_run_once(Reactor *r, int timeout_ms);
+
+/**
+ * Makes reactor_run() return after the current dispatch round.
+ */
+static inline void reactor_stop(Reactor *r) { r->running = false; }
+
+/**
+ * Closes every reactor-owned fd and the epoll instance.
+ * Fds registered with reactor_add_fd() remain owned by the caller.
+ */
+void reactor_close(Reactor *r);
+
+#endif // REACTOR_H
+
+// implementation (compile only once per program)
+#ifdef REACTOR_IMPLEMENTATION
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static ReactorHandler *reactor_find(Reactor *r, int fd) {
+  for (size_t i = 0; i < REACTOR_MAX_HANDLERS; i++) {
+    if (r->handlers[i].fd == fd) {
+      return &r->handlers[i];
+    }
+  }
+  return NULL;
+}
+
+// What goes into epoll_event.data: the slot and its generation, so that an
+// event queued for an fd that was removed since is told apart from one for
+// whatever took the slot afterwards
+static uint64_t reactor_event_data(const Reactor *r, const ReactorHandler *h) {
+  return (uint64_t)h->gen << 32 | (uint64_t)(h - r->handlers);
+}
+
+static int reactor_register(Reactor *r, int fd, uint32_t events,
+                            ReactorCallback cb, void *userdata, bool owned) {
+  if (fd < 0 || cb == NULL) {
+    LOG_ERROR("Invalid arguments to reactor_register");
+    return -1;
+  }
+
+  if (reactor_find(r, fd) != NULL) {
+    LOG_ERROR("fd %d is already registered in the reactor", fd);
+    return -1;
+  }
+
+  ReactorHandler *h = reactor_find(r, -1);
+  if (h == NULL) {
+    LOG_ERROR("Reactor handler table is full (%d slots)",
+              REACTOR_MAX_HANDLERS);
+    return -1;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.u64 = reactor_event_data(r, h);
+
+  if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    LOG_SYS_ERROR("Failed to add fd %d to epoll", fd);
+    return -1;
+  }
+
+  h->fd = fd;
+  h->owned = owned;
+  h->cb = cb;
+  h->userdata = userdata;
+  return 0;
+}
+
+int reactor_init(Reactor *r) {
+  if (r == NULL) {
+    LOG_ERROR("Invalid argument to reactor_init");
+    return -1;
+  }
+
+  memset(r, 0, sizeof(Reactor));
+  for (size_t i = 0; i < REACTOR_MAX_HANDLERS; i++) {
+    r->handlers[i].fd = -1;
+  }
+
+  r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epoll_fd == -1) {
+    LOG_SYS_ERROR("Failed to create epoll instance");
+    return -1;
+  }
+
+  return 0;
+}
+
+int reactor_add_fd(Reactor *r, int fd, uint32_t events, ReactorCallback cb,
+                   void *userdata) {
+  return reactor_register(r, fd, events, cb, userdata, false);
+}
+
+int reactor_mod_fd(Reactor *r, int fd, uint32_t events) {
+  ReactorHandler *h = reactor_find(r, fd);
+  if (fd < 0 || h == NULL) {
+    LOG_ERROR("fd %d is not registered in the reactor", fd);
+    return -1;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.u64 = reactor_event_data(r, h);
+
+  if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+    LOG_SYS_ERROR("Failed to modify fd %d in epoll", fd);
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_del_fd(Reactor *r, int fd) {
+  ReactorHandler *h = reactor_find(r, fd);
+  if (fd < 0 || h == NULL) {
+    LOG_ERROR("fd %d is not registered in the reactor", fd);
+    return -1;
+  }
+
+  if (epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+    LOG_SYS_ERROR("Failed to remove fd %d from epoll", fd);
+  }
+
+  if (h->owned) {
+    close(fd);
+  }
+
+  // Events for this slot that are still pending in the current dispatch
+  // round are skipped because the generation no longer matches, even if
+  // a later callback in the round registers another fd into the slot.
+  h->gen++;
+  h->fd = -1;
+  h->cb = NULL;
+  h->userdata = NULL;
+  return 0;
+}
+
+int reactor_timer_set(int timer_fd, uint32_t interval_ms) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+  its.it_value = its.it_interval;
+
+  if (timerfd_settime(timer_fd, 0, &its, NULL) == -1) {
+    LOG_SYS_ERROR("Failed to arm timer fd %d", timer_fd);
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_add_timer(Reactor *r, uint32_t interval_ms, ReactorCallback cb,
+                      void *userdata) {
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (tfd == -1) {
+    LOG_SYS_ERROR("Failed to create timer fd");
+    return -1;
+  }
+
+  if (reactor_timer_set(tfd, interval_ms) != 0 ||
+      reactor_register(r, tfd, EPOLLIN, cb, userdata, true) != 0) {
+    close(tfd);
+    return -1;
+  }
+
+  return tfd;
+}
+
+uint64_t reactor_timer_ack(int timer_fd) {
+  uint64_t expirations = 0;
+  if (read(timer_fd, &expirations, sizeof(expirations)) !=
+      sizeof(expirations)) {
+    return 0;
+  }
+  return expirations;
+}
+
+int reactor_add_signals(Reactor *r, const int *signals, size_t count,
+                        ReactorCallback cb, void *userdata) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  for (size_t i = 0; i < count; i++) {
+    sigaddset(&mask, signals[i]);
+  }
+
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+    LOG_SYS_ERROR("Failed to block signals");
+    return -1;
+  }
+
+  int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sfd == -1) {
+    LOG_SYS_ERROR("Failed to create signal fd");
+    return -1;
+  }
+
+  if (reactor_register(r, sfd, EPOLLIN, cb, userdata, true) != 0) {
+    close(sfd);
+    return -1;
+  }
+
+  return sfd;
+}
+
+int reactor_signal_read(int signal_fd) {
+  struct signalfd_siginfo info;
+  if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+    return 0;
+  }
+  return (int)info.ssi_signo;
+}
+
+int reactor_run_once(Reactor *r, int timeout_ms) {
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, timeout_ms);
+  if (n == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    LOG_SYS_ERROR("epoll_wait failed");
+    return -1;
+  }
+
+  r->wakeups++;
+
+  int dispatched = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t data = events[i].data.u64;
+    ReactorHandler *h = &r->handlers[(uint32_t)data];
+    if (h->fd < 0 || h->gen != (uint32_t)(data >> 32)) {
+      continue; // removed (and maybe reused) by an earlier callback
+    }
+    h->cb(r, h->fd, events[i].events, h->userdata);
+    dispatched++;
+  }
+
+  r->dispatched += (uint64_t)dispatched;
+  return dispatched;
+}
+
+int reactor_run(Reactor *r) {
+  r->running = true;
+
+  while (r->running) {
+    if (reactor_run_once(r, -1) < 0) {
+      r->running = false;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void reactor_close(Reactor *r) {
+  for (size_t i = 0; i < REACTOR_MAX_HANDLERS; i++) {
+    if (r->handlers[i].fd >= 0 && r->handlers[i].owned) {
+      close(r->handlers[i].fd);
+    }
+    r->handlers[i].gen++;
+    r->handlers[i].fd = -1;
+  }
+
+  if (r->epoll_fd >= 0) {
+    close(r->epoll_fd);
+    r->epoll_fd = -1;
+  }
+}
+#endif
@@ -0,0 +1,363 @@
+#ifndef RECORDS_H
+#define RECORDS_H
+
+/* ==========================================================================
+ *  Orange Sentry - Uplink records
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Compact binary encoding of what the board publishes about itself: IDS
+ *  alerts, heartbeats and telemetry. Each record is one CBOR map with small
+ *  integer keys; key 0 is the record type, the others come from a schema
+ *  table per type, so the encoder and the decoder can't drift apart. Zero
+ *  fields are left out and read back as zero.
+ *
+ *  An alert is ~46 bytes this way, against ~110 as JSON.
+ *
+ *  Schemas (key: field):
+ *  RECORD_ALERT (PayloadIDSAlert)
+ *    1: event_ms  2: signature_id  3: severity  4: proto
+ *    5: src_ip (4 or 16 bytes)  6: src_port  7: dst_ip  8: dst_port
+ *  RECORD_HEARTBEAT (RecordHeartbeat)
+ *    1: ts_ms  2: module  3: uptime_s  4: seq
+ *  RECORD_TELEMETRY (RecordTelemetry)
+ *    1: ts_ms  2: module  3: values (array of uints)
+ *  RECORD_PROBE (PayloadProbe)
+ *    1: event_ms  2: proto  3: src_ip  4: src_port  5: dst_ip  6: dst_port
+ *    7: ttl  8: tcp_flags  9: tcp_window  10: ip_len  11: packets
+ *    12: bytes  13: duration_ms  14: end
+ *
+ *  New keys can be added to a schema at any time: decoders skip keys they
+ *  don't know. Keys must never be reused for something else.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  Define RECORDS_IMPLEMENTATION in exactly one .c file before including.
+ *
+ * ========================================================================== */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sockclient.h"
+
+#define RECORD_TELEMETRY_MAX 16
+
+typedef enum {
+  RECORD_ALERT = 1,
+  RECORD_HEARTBEAT = 2,
+  RECORD_TELEMETRY = 3,
+  RECORD_PROBE = 4,
+  RECORD_TYPE_COUNT
+} RecordType;
+
+typedef struct {
+  uint64_t ts_ms; // ms since the epoch (UTC)
+  uint8_t module; // ModuleID
+  uint32_t uptime_s;
+  uint32_t seq;
+} RecordHeartbeat;
+
+// The meaning of each value is defined by the module that sends it
+typedef struct {
+  uint64_t ts_ms;
+  uint8_t module;
+  uint8_t count;
+  uint64_t values[RECORD_TELEMETRY_MAX];
+} RecordTelemetry;
+
+/* *
+ * Encodes rec, a struct of the type's schema, into buf.
+ * * Returns:
+ * Bytes written, or 0 if the type is unknown or buf is too small.
+ */
+size_t record_encode(RecordType type, const void *rec, void *buf,
+                     size_t size);
+
+/* *
+ * Decodes one record into out, which must be the struct of the type the
+ * caller expects (out_size bytes). out is zeroed first.
+ * * Returns:
+ * The record type, or -1 if buf is malformed, is not a record, or its type
+ * doesn't fit in out_size.
+ */
+int record_decode(const void *buf, size_t len, void *out, size_t out_size);
+
+#endif // RECORDS_H
+
+#ifdef RECORDS_IMPLEMENTATION
+
+#include <string.h>
+
+#include "cbor.h"
+
+typedef enum {
+  FIELD_U8,
+  FIELD_U16,
+  FIELD_U32,
+  FIELD_U64,
+  FIELD_ADDR,     // uint8_t[16]; aux is the offset of its uint8_t ip_version
+  FIELD_U64_LIST, // uint64_t[RECORD_TELEMETRY_MAX]; aux: its uint8_t count
+} RecordFieldType;
+
+typedef struct {
+  uint8_t key;
+  uint8_t type; // RecordFieldType
+  uint16_t offset;
+  uint16_t aux;
+} RecordField;
+
+typedef struct {
+  const RecordField *fields;
+  size_t field_count;
+  size_t size; // of the struct
+} RecordSchema;
+
+#define RECORD_FIELD(k, t, S, m) {k, t, offsetof(S, m), 0}
+#define RECORD_FIELD_AUX(k, t, S, m, a) {k, t, offsetof(S, m), offsetof(S, a)}
+
+static const RecordField record_alert_fields[] = {
+    RECORD_FIELD(1, FIELD_U64, PayloadIDSAlert, event_ms),
+    RECORD_FIELD(2, FIELD_U32, PayloadIDSAlert, signature_id),
+    RECORD_FIELD(3, FIELD_U8, PayloadIDSAlert, severity),
+    RECORD_FIELD(4, FIELD_U8, PayloadIDSAlert, proto),
+    RECORD_FIELD_AUX(5, FIELD_ADDR, PayloadIDSAlert, src_ip, ip_version),
+    RECORD_FIELD(6, FIELD_U16, PayloadIDSAlert, src_port),
+    RECORD_FIELD_AUX(7, FIELD_ADDR, PayloadIDSAlert, dst_ip, ip_version),
+    RECORD_FIELD(8, FIELD_U16, PayloadIDSAlert, dst_port),
+};
+
+static const RecordField record_heartbeat_fields[] = {
+    RECORD_FIELD(1, FIELD_U64, RecordHeartbeat, ts_ms),
+    RECORD_FIELD(2, FIELD_U8, RecordHeartbeat, module),
+    RECORD_FIELD(3, FIELD_U32, RecordHeartbeat, uptime_s),
+    RECORD_FIELD(4, FIELD_U32, RecordHeartbeat, seq),
+};
+
+static const RecordField record_telemetry_fields[] = {
+    RECORD_FIELD(1, FIELD_U64, RecordTelemetry, ts_ms),
+    RECORD_FIELD(2, FIELD_U8, RecordTelemetry, module),
+    RECORD_FIELD_AUX(3, FIELD_U64_LIST, RecordTelemetry, values, count),
+};
+
+static const RecordField record_probe_fields[] = {
+    RECORD_FIELD(1, FIELD_U64, PayloadProbe, event_ms),
+    RECORD_FIELD(2, FIELD_U8, PayloadProbe, proto),
+    RECORD_FIELD_AUX(3, FIELD_ADDR, PayloadProbe, src_ip, ip_version),
+    RECORD_FIELD(4, FIELD_U16, PayloadProbe, src_port),
+    RECORD_FIELD_AUX(5, FIELD_ADDR, PayloadProbe, dst_ip, ip_version),
+    RECORD_FIELD(6, FIELD_U16, PayloadProbe, dst_port),
+    RECORD_FIELD(7, FIELD_U8, PayloadProbe, ttl),
+    RECORD_FIELD(8, FIELD_U8, PayloadProbe, tcp_flags),
+    RECORD_FIELD(9, FIELD_U16, PayloadProbe, tcp_window),
+    RECORD_FIELD(10, FIELD_U16, PayloadProbe, ip_len),
+    RECORD_FIELD(11, FIELD_U32, PayloadProbe, packets),
+    RECORD_FIELD(12, FIELD_U32, PayloadProbe, bytes),
+    RECORD_FIELD(13, FIELD_U32, PayloadProbe, duration_ms),
+    RECORD_FIELD(14, FIELD_U8, PayloadProbe, end),
+};
+
+#define RECORD_SCHEMA(f, S) {f, sizeof(f) / sizeof(f[0]), sizeof(S)}
+
+static const RecordSchema record_schemas[RECORD_TYPE_COUNT] = {
+    [RECORD_ALERT] = RECORD_SCHEMA(record_alert_fields, PayloadIDSAlert),
+    [RECORD_HEARTBEAT] =
+        RECORD_SCHEMA(record_heartbeat_fields, RecordHeartbeat),
+    [RECORD_TELEMETRY] =
+        RECORD_SCHEMA(record_telemetry_fields, RecordTelemetry),
+    [RECORD_PROBE] = RECORD_SCHEMA(record_probe_fields, PayloadProbe),
+};
+
+static uint64_t record_get_uint(const uint8_t *p, uint8_t type) {
+  switch (type) {
+  case FIELD_U8:
+    return *p;
+  case FIELD_U16: {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  case FIELD_U32: {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  default: {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  }
+}
+
+// Returns false if v doesn't fit the field
+static bool record_set_uint(uint8_t *p, uint8_t type, uint64_t v) {
+  switch (type) {
+  case FIELD_U8:
+    if (v > UINT8_MAX) {
+      return false;
+    }
+    *p = (uint8_t)v;
+    return true;
+  case FIELD_U16: {
+    if (v > UINT16_MAX) {
+      return false;
+    }
+    uint16_t x = (uint16_t)v;
+    memcpy(p, &x, sizeof(x));
+    return true;
+  }
+  case FIELD_U32: {
+    if (v > UINT32_MAX) {
+      return false;
+    }
+    uint32_t x = (uint32_t)v;
+    memcpy(p, &x, sizeof(x));
+    return true;
+  }
+  default:
+    memcpy(p, &v, sizeof(v));
+    return true;
+  }
+}
+
+// Bytes the address takes on the wire, 0 if it is left out
+static size_t record_addr_len(const uint8_t *rec, const RecordField *f) {
+  uint8_t version = rec[f->aux];
+  return version == 4 ? 4 : version == 6 ? 16 : 0;
+}
+
+static bool record_field_present(const uint8_t *rec, const RecordField *f) {
+  switch (f->type) {
+  case FIELD_ADDR:
+    return record_addr_len(rec, f) > 0;
+  case FIELD_U64_LIST:
+    return rec[f->aux] > 0;
+  default:
+    return record_get_uint(rec + f->offset, f->type) != 0;
+  }
+}
+
+size_t record_encode(RecordType type, const void *rec, void *buf,
+                     size_t size) {
+  if (type <= 0 || type >= RECORD_TYPE_COUNT || rec == NULL || buf == NULL) {
+    return 0;
+  }
+  const RecordSchema *schema = &record_schemas[type];
+  const uint8_t *r = (const uint8_t *)rec;
+
+  size_t pairs = 1;
+  for (size_t i = 0; i < schema->field_count; i++) {
+    pairs += record_field_present(r, &schema->fields[i]);
+  }
+
+  CborWriter w;
+  cbor_writer_init(&w, buf, size);
+  cbor_put_map(&w, pairs);
+  cbor_put_uint(&w, 0);
+  cbor_put_uint(&w, (uint64_t)type);
+
+  for (size_t i = 0; i < schema->field_count; i++) {
+    const RecordField *f = &schema->fields[i];
+    if (!record_field_present(r, f)) {
+      continue;
+    }
+    cbor_put_uint(&w, f->key);
+
+    switch (f->type) {
+    case FIELD_ADDR:
+      cbor_put_bytes(&w, r + f->offset, record_addr_len(r, f));
+      break;
+    case FIELD_U64_LIST: {
+      size_t count = r[f->aux];
+      if (count > RECORD_TELEMETRY_MAX) {
+        count = RECORD_TELEMETRY_MAX;
+      }
+      cbor_put_array(&w, count);
+      for (size_t j = 0; j < count; j++) {
+        cbor_put_uint(&w, record_get_uint(r + f->offset + j * 8, FIELD_U64));
+      }
+      break;
+    }
+    default:
+      cbor_put_uint(&w, record_get_uint(r + f->offset, f->type));
+      break;
+    }
+  }
+
+  return w.overflow ? 0 : w.len;
+}
+
+static bool record_decode_field(CborReader *cr, const RecordField *f,
+                                uint8_t *out) {
+  switch (f->type) {
+  case FIELD_ADDR: {
+    const uint8_t *addr;
+    size_t len;
+    if (!cbor_get_bytes(cr, &addr, &len) || (len != 4 && len != 16)) {
+      return false;
+    }
+    memcpy(out + f->offset, addr, len);
+    out[f->aux] = len == 4 ? 4 : 6;
+    return true;
+  }
+  case FIELD_U64_LIST: {
+    uint64_t count;
+    if (!cbor_get_array(cr, &count) || count > RECORD_TELEMETRY_MAX) {
+      return false;
+    }
+    for (uint64_t j = 0; j < count; j++) {
+      uint64_t v;
+      if (!cbor_get_uint(cr, &v)) {
+        return false;
+      }
+      record_set_uint(out + f->offset + j * 8, FIELD_U64, v);
+    }
+    out[f->aux] = (uint8_t)count;
+    return true;
+  }
+  default: {
+    uint64_t v;
+    return cbor_get_uint(cr, &v) && record_set_uint(out + f->offset, f->type, v);
+  }
+  }
+}
+
+int record_decode(const void *buf, size_t len, void *out, size_t out_size) {
+  if (buf == NULL || out == NULL) {
+    return -1;
+  }
+
+  CborReader cr = {(const uint8_t *)buf, (const uint8_t *)buf + len};
+  uint64_t pairs, key, type;
+  if (!cbor_get_map(&cr, &pairs) || pairs == 0 || !cbor_get_uint(&cr, &key) ||
+      key != 0 || !cbor_get_uint(&cr, &type) || type == 0 ||
+      type >= RECORD_TYPE_COUNT || record_schemas[type].size > out_size) {
+    return -1;
+  }
+
+  const RecordSchema *schema = &record_schemas[type];
+  uint8_t *o = (uint8_t *)out;
+  memset(o, 0, schema->size);
+
+  for (uint64_t i = 1; i < pairs; i++) {
+    if (!cbor_get_uint(&cr, &key)) {
+      return -1;
+    }
+
+    const RecordField *f = NULL;
+    for (size_t j = 0; j < schema->field_count; j++) {
+      if (schema->fields[j].key == key) {
+        f = &schema->fields[j];
+        break;
+      }
+    }
+
+    if (f == NULL ? !cbor_skip(&cr) : !record_decode_field(&cr, f, o)) {
+      return -1;
+    }
+  }
+
+  return cr.p == cr.end ? (int)type : -1;
+}
+
+#endif // RECORDS_IMPLEMENTATION
@@ -0,0 +1,196 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/* ==========================================================================
+ *  Orange Sentry - Size-class slab allocator
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Segregated fit on top of arena.h's Slab and SlabStack. Every request
+ *  is rounded up to a power of two from SLAB_MIN_SIZE to SLAB_MAX_SIZE,
+ *  and each of those size classes recycles its own slabs through its own
+ *  SlabStack, so a slab is only ever reused for a request it can hold.
+ *
+ *  Acquire and release are O(1): finding the class is one count of leading
+ *  zeros, then a pop or a push. A class creates new slabs from the parent
+ *  Arena only while its stack is empty, and never more than its max_slabs.
+ *  Its stack is sized for all of them, so a release always finds room and
+ *  no slab is ever abandoned inside the parent.
+ *
+ *  Each class counts its live slabs, free slabs and the most ever live at
+ *  once; slab_class_stats() reads them at any time.
+ *
+ *  Not thread-safe: one allocator per thread.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. slab_alloc_init() with a parent Arena and a limit per class.
+ *  2. slab_acquire() a slab of at least the size needed, allocate from its
+ *     sArena, slab_release() it when done.
+ *
+ * ========================================================================== */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define SLAB_MIN_SHIFT 6  // 64 bytes
+#define SLAB_MAX_SHIFT 16 // 64 KiB
+#define SLAB_MIN_SIZE ((size_t)1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE ((size_t)1 << SLAB_MAX_SHIFT)
+#define SLAB_CLASS_COUNT (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+typedef struct {
+  size_t size;       // bytes every slab of the class holds
+  size_t max_slabs;  // 0: the class isn't used
+  SlabStack *free;   // released slabs, max_slabs deep
+  size_t live;       // handed out right now
+  size_t created;    // taken from the parent so far, live or free
+  size_t high_water; // most live at once
+
+  uint64_t acquired;
+  uint64_t failed; // at max_slabs, or the parent arena is full
+} SlabClass;
+
+typedef struct {
+  Arena *parent;
+  SlabClass classes[SLAB_CLASS_COUNT];
+} SlabAllocator;
+
+// A snapshot of one class, for monitoring
+typedef struct {
+  size_t size;
+  size_t live;
+  size_t free;
+  size_t high_water;
+  uint64_t acquired;
+  uint64_t failed;
+} SlabClassStats;
+
+/**
+ * The class that holds size bytes.
+ * Returns SLAB_CLASS_COUNT if size is over SLAB_MAX_SIZE.
+ */
+static inline size_t slab_class_of(size_t size) {
+  if (size <= SLAB_MIN_SIZE) {
+    return 0;
+  }
+  if (size > SLAB_MAX_SIZE) {
+    return SLAB_CLASS_COUNT;
+  }
+  // ceil(log2(size)), size >= 2 here
+  size_t shift = 8 * sizeof(unsigned long long) -
+                 (size_t)__builtin_clzll((unsigned long long)(size - 1));
+  return shift - SLAB_MIN_SHIFT;
+}
+
+/**
+ * Sets the allocator up to take its slabs from parent, at most
+ * max_slabs[c] of class c (SLAB_MIN_SIZE << c bytes). Only the stacks are
+ * allocated now.
+ * * Returns:
+ * 0: Success.
+ * -1: The parent arena can't hold the stacks.
+ */
+static inline int slab_alloc_init(SlabAllocator *sa, Arena *parent,
+                                  const size_t max_slabs[SLAB_CLASS_COUNT]) {
+  memset(sa, 0, sizeof(*sa));
+  sa->parent = parent;
+  for (size_t c = 0; c < SLAB_CLASS_COUNT; c++) {
+    SlabClass *cl = &sa->classes[c];
+    cl->size = SLAB_MIN_SIZE << c;
+    cl->max_slabs = max_slabs[c];
+    if (cl->max_slabs > 0) {
+      cl->free = arena_slab_stack_create(parent, cl->max_slabs);
+      if (cl->free == NULL) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * A slab whose sArena holds at least size bytes, empty, tagged with id.
+ * Returns:
+ * Slab*: A recycled or new slab.
+ * NULL:  size is too big, or the class is at its limit or out of memory.
+ */
+static inline Slab *slab_acquire(SlabAllocator *sa, size_t size, int id) {
+  size_t c = slab_class_of(size);
+  if (c >= SLAB_CLASS_COUNT || sa->classes[c].max_slabs == 0) {
+    LOG_ERROR("No slab class for %zu bytes", size);
+    return NULL;
+  }
+  SlabClass *cl = &sa->classes[c];
+
+  Slab *s;
+  if (cl->free->count > 0) {
+    s = cl->free->slabs[--cl->free->count];
+  } else if (cl->created < cl->max_slabs) {
+    // The payload is padded so that alignment never eats into the class size
+    s = arena_create_slab(sa->parent, cl->size + DEFAULT_ALIGNMENT, id);
+    if (s == NULL) {
+      cl->failed++;
+      return NULL;
+    }
+    s->size_class = (int)c;
+    cl->created++;
+  } else {
+    cl->failed++;
+    return NULL;
+  }
+
+  s->id = id;
+  cl->acquired++;
+  if (++cl->live > cl->high_water) {
+    cl->high_water = cl->live;
+  }
+  return s;
+}
+
+/**
+ * Gives a slab from slab_acquire() back to its class; everything allocated
+ * from it is freed. There is always room for it.
+ */
+static inline void slab_release(SlabAllocator *sa, Slab *s) {
+  SlabClass *cl = &sa->classes[s->size_class];
+  assert(s->size_class >= 0 && cl->free->count < cl->max_slabs);
+  arena_reset(&s->sArena);
+  cl->free->slabs[cl->free->count++] = s;
+  cl->live--;
+}
+
+/**
+ * Reads the counters of class c.
+ */
+static inline void slab_class_stats(const SlabAllocator *sa, size_t c,
+                                    SlabClassStats *out) {
+  const SlabClass *cl = &sa->classes[c];
+  out->size = cl->size;
+  out->live = cl->live;
+  out->free = cl->free != NULL ? cl->free->count : 0;
+  out->high_water = cl->high_water;
+  out->acquired = cl->acquired;
+  out->failed = cl->failed;
+}
+
+/**
+ * Logs the counters of every class in use.
+ */
+static inline void slab_log_stats(const SlabAllocator *sa) {
+  for (size_t c = 0; c < SLAB_CLASS_COUNT; c++) {
+    SlabClassStats st;
+    slab_class_stats(sa, c, &st);
+    if (sa->classes[c].max_slabs == 0 || st.acquired == 0) {
+      continue;
+    }
+    LOG_INFO("slabs of %zu: live=%zu free=%zu high_water=%zu/%zu "
+             "acquired=%llu failed=%llu",
+             st.size, st.live, st.free, st.high_water,
+             sa->classes[c].max_slabs, (unsigned long long)st.acquired,
+             (unsigned long long)st.failed);
+  }
+}
+
+#endif // SLAB_H
@@ -0,0 +1,211 @@
+#ifndef SLABPOOL_H
+#define SLABPOOL_H
+
+/* ==========================================================================
+ *  Orange Sentry - Thread-safe slab pool and per-thread arenas
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Arena, SlabStack and slab.h are single-threaded. The mqtt-client is not:
+ *  Paho calls back on its own threads while the main loop runs. This gives
+ *  those threads two things that are safe to use concurrently.
+ *
+ *  SlabPool: a fixed set of equal-sized slabs that any thread can acquire
+ *  and release, lock-free. The free slabs form a Treiber stack linked by
+ *  slot index. The head packs the top slot with a tag that every successful
+ *  pop or push bumps, so a thread that read the head, was preempted while
+ *  the same slot was popped and pushed back, and then tries its CAS, fails
+ *  instead of installing a stale next link (the ABA problem). Slots and
+ *  tags are 32 bits each, so one 64-bit CAS does it on x86 and aarch64
+ *  alike, without a double-width CAS. A slab released by one thread and
+ *  acquired by another carries everything written to it (release/acquire).
+ *  All slabs are carved from the parent arena up front; the pool never
+ *  grows, and an empty pool returns NULL.
+ *
+ *  arena_thread(): each thread's own reserved scratch Arena, reserved on
+ *  first use and released when the thread exits. Nothing in it is shared,
+ *  so it needs no synchronization at all.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. Define SLABPOOL_IMPLEMENTATION in exactly one .c file before including.
+ *  2. slab_pool_init() from one thread before the others start; then
+ *     slab_pool_acquire() and slab_pool_release() from any thread.
+ *  3. arena_thread() from any thread, for scratch that thread owns.
+ *
+ * ========================================================================== */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// What arena_thread() reserves per thread; only what is used is committed
+#ifndef ARENA_THREAD_RESERVE
+#define ARENA_THREAD_RESERVE (4 * 1024 * 1024)
+#endif
+
+#define SLAB_POOL_NIL UINT32_MAX // the empty stack
+#define SLAB_POOL_CACHE_LINE 64
+
+typedef struct {
+  // tag << 32 | top slot; alone on its line, every acquire and release
+  // writes it
+  uint64_t head __attribute__((aligned(SLAB_POOL_CACHE_LINE)));
+
+  uint8_t *base __attribute__((aligned(SLAB_POOL_CACHE_LINE)));
+  size_t stride; // bytes from one slab to the next
+  uint32_t *next; // per slot: the slot under it on the stack
+  uint32_t capacity;
+  size_t slab_size; // what every slab's sArena holds
+
+  // counters, only touched on the slow paths
+  uint64_t exhausted; // acquires that found the pool empty
+  uint64_t contended; // CAS retries, acquire and release
+} SlabPool;
+
+/**
+ * Carves count slabs of at least size bytes from parent. Not thread-safe:
+ * call it before the pool is shared.
+ * Returns 0 on success, -1 if the parent arena can't hold them.
+ */
+int slab_pool_init(SlabPool *p, Arena *parent, uint32_t count, size_t size);
+
+/**
+ * Any thread: an empty slab tagged with id, or NULL if all of them are in
+ * use.
+ */
+Slab *slab_pool_acquire(SlabPool *p, int id);
+
+/**
+ * Any thread: gives back a slab from slab_pool_acquire(); everything
+ * allocated from it is freed.
+ */
+void slab_pool_release(SlabPool *p, Slab *s);
+
+/**
+ * The calling thread's scratch arena. Reset or save/restore it like any
+ * other; it is released when the thread exits (not the main thread's: that
+ * one lasts until the process does).
+ * Returns NULL if the address space couldn't be reserved.
+ */
+Arena *arena_thread(void);
+
+#endif // SLABPOOL_H
+
+// implementation (compile only once per program)
+#ifdef SLABPOOL_IMPLEMENTATION
+#include <pthread.h>
+
+static inline uint32_t slab_pool_slot(uint64_t head) { return (uint32_t)head; }
+
+static inline uint64_t slab_pool_head(uint32_t slot, uint64_t old) {
+  return (((old >> 32) + 1) << 32) | slot;
+}
+
+int slab_pool_init(SlabPool *p, Arena *parent, uint32_t count, size_t size) {
+  memset(p, 0, sizeof(*p));
+  if (count == 0 || count == SLAB_POOL_NIL) {
+    LOG_ERROR("A slab pool takes 1 to %u slabs, not %u", SLAB_POOL_NIL - 1,
+              count);
+    return -1;
+  }
+  // Every slab gets its own cache lines, so two threads working on
+  // neighbours don't share one
+  size_t header = align_forward(sizeof(Slab), SLAB_POOL_CACHE_LINE);
+  p->slab_size = align_forward(size, SLAB_POOL_CACHE_LINE);
+  p->stride = header + p->slab_size;
+  p->base = arena_alloc_align(parent, (size_t)count * p->stride,
+                              SLAB_POOL_CACHE_LINE);
+  p->next = ARENA_NEW_ARRAY(parent, uint32_t, count);
+  if (p->base == NULL || p->next == NULL) {
+    LOG_ERROR("Not enough memory for %u slabs of %zu bytes", count, size);
+    return -1;
+  }
+  p->capacity = count;
+
+  for (uint32_t i = 0; i < count; i++) {
+    Slab *s = (Slab *)(p->base + (size_t)i * p->stride);
+    uint8_t *buf = (uint8_t *)s + header;
+    s->parent_arena = parent;
+    s->id = -1;
+    s->size_class = -1;
+    arena_init(&s->sArena, buf, p->slab_size);
+    p->next[i] = i + 1 < count ? i + 1 : SLAB_POOL_NIL;
+  }
+  p->head = 0; // slot 0 on top, tag 0
+  return 0;
+}
+
+Slab *slab_pool_acquire(SlabPool *p, int id) {
+  uint64_t old = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t slot = slab_pool_slot(old);
+    if (slot == SLAB_POOL_NIL) {
+      __atomic_fetch_add(&p->exhausted, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    // May be stale if another thread takes slot first; the tag then fails
+    // the CAS below
+    uint32_t next = __atomic_load_n(&p->next[slot], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&p->head, &old,
+                                    slab_pool_head(next, old), true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      Slab *s = (Slab *)(p->base + (size_t)slot * p->stride);
+      s->id = id;
+      return s;
+    }
+    __atomic_fetch_add(&p->contended, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void slab_pool_release(SlabPool *p, Slab *s) {
+  size_t offset = (size_t)((uint8_t *)s - p->base);
+  assert(offset % p->stride == 0 && offset / p->stride < p->capacity);
+  uint32_t slot = (uint32_t)(offset / p->stride);
+  arena_reset(&s->sArena);
+
+  uint64_t old = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+  for (;;) {
+    __atomic_store_n(&p->next[slot], slab_pool_slot(old), __ATOMIC_RELAXED);
+    // Publishes the slab's contents and its next link with it
+    if (__atomic_compare_exchange_n(&p->head, &old,
+                                    slab_pool_head(slot, old), true,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return;
+    }
+    __atomic_fetch_add(&p->contended, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static pthread_key_t arena_thread_key;
+static pthread_once_t arena_thread_once = PTHREAD_ONCE_INIT;
+static bool arena_thread_keyed;
+static __thread Arena arena_thread_arena;
+static __thread bool arena_thread_ready;
+
+static void arena_thread_exit(void *a) { arena_release((Arena *)a); }
+
+static void arena_thread_key_create(void) {
+  arena_thread_keyed =
+      pthread_key_create(&arena_thread_key, arena_thread_exit) == 0;
+  if (!arena_thread_keyed) {
+    LOG_WARN("Thread arenas won't be released when their thread exits");
+  }
+}
+
+Arena *arena_thread(void) {
+  if (arena_thread_ready) {
+    return &arena_thread_arena;
+  }
+  if (arena_reserve(&arena_thread_arena, ARENA_THREAD_RESERVE) != 0) {
+    return NULL;
+  }
+  pthread_once(&arena_thread_once, arena_thread_key_create);
+  if (arena_thread_keyed) {
+    pthread_setspecific(arena_thread_key, &arena_thread_arena);
+  }
+  arena_thread_ready = true;
+  return &arena_thread_arena;
+}
+
+#endif // SLABPOOL_IMPLEMENTATION
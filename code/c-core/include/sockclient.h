@@ -2,11 +2,13 @@
 #define SOCK_IPC_H
 // header
 #include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
@@ -14,46 +16,196 @@
 #include "logging.h"
 
 // enums
-typedef enum { MOD_CORE = 0, MOD_MQTT, MOD_DISPLAY, MOD_HWINPUT } ModuleID;
+typedef enum {
+  MOD_CORE = 0,
+  MOD_MQTT,
+  MOD_DISPLAY,
+  MOD_HWINPUT,
+  MOD_SURICATA,
+  MOD_COWRIE,
+  MOD_LISTENER, // passive listener (packet capture)
+  MOD_FIREWALL,
+  MOD_SYSSTATS,
+
+  MOD_COUNT // keep last
+} ModuleID;
 
 typedef enum {
   // system / lifecycle
   MSG_SYS_ACK = 0,
   MSG_SYS_PING,
   MSG_SYS_PONG,
+  MSG_SYS_SHM_OFFER, // client -> server, carries the shared ring fds
+  MSG_SYS_HELLO,     // module -> controller, first message, names the module
 
   // commands (controller -> module)
   // gen
   MSG_CMD_START,
   MSG_CMD_STOP,
   MSG_CMD_REQ_DATA,
+  MSG_CMD_SET_STATE, // the system enters PayloadState.state
+  MSG_CMD_BAN,       // drop everything from PayloadBan.ip for a while
+  MSG_CMD_SHED,      // the controller is shedding load, see PayloadShed
   // mqtt
   MSG_CMD_MQTT_PUB,
 
   // event (module -> controller)
   // gen
   MSG_EVT_LOG,
+  MSG_EVT_STATE_DONE, // reply to MSG_CMD_SET_STATE
   // mqtt
   MSG_EVT_MQTT_SUB_MSG,
+  MSG_EVT_MQTT_PUB_RESULT,
+  // ids
+  MSG_EVT_IDS_ALERT,
+  // passive listener
+  MSG_EVT_PROBE,
+  // system stats
+  MSG_EVT_SYSSTATS,
 
   // errors
-  MSG_ERR
+  MSG_ERR,
+
+  MSG_TYPE_COUNT // keep last
 } MSGType;
 
+// The controller's finite state machine
+typedef enum {
+  STATE_CLOSED = 0,
+  STATE_PASSIVE_LISTEN,
+  STATE_HONEYPOT,
+  STATE_DEVELOPMENT,
+
+  STATE_COUNT // keep last
+} SystemState;
+
 // structs
+#define IPC_PROTOCOL_VERSION 1
+
+typedef struct {
+  uint16_t version; // IPC_PROTOCOL_VERSION of the sender
+  uint32_t pid;
+} PayloadHello;
+
+typedef struct {
+  uint8_t state; // SystemState
+} PayloadState;
+
+typedef struct {
+  uint8_t state;       // SystemState
+  int32_t status;      // 0 = applied, otherwise a negative errno
+  uint32_t elapsed_us; // time the module took to apply it
+} PayloadStateDone;
+
+typedef struct {
+  uint8_t ip_version; // 4 or 6
+  uint8_t reserved[3];
+  uint32_t reason; // signature id of the alert that earned it, 0 if none
+  uint8_t ip[16];  // network order, IPv4 uses the first 4 bytes
+} PayloadBan;
+
+// How much work a module should give up while the board is overloaded
+typedef struct {
+  uint8_t level; // the controller's ShedLevel, 0 = none
+  uint8_t reserved;
+  uint16_t sample_rate; // track 1 source address in this many, 1 = all
+} PayloadShed;
+
+// PayloadMQTTPubCMD.flags
+#define MQTT_PUB_URGENT 0x01 // publish right away, even when batching
+
 typedef struct {
   char topic[64];
   uint8_t qos;
+  uint8_t flags; // MQTT_PUB_*
   uint16_t data_len;
+  uint32_t msg_id; // echoed back in MSG_EVT_MQTT_PUB_RESULT. 0 = no report
   uint8_t data[256];
 } PayloadMQTTPubCMD;
 
+// Failure codes for PayloadMQTTPubResult.status that don't come from Paho
+#define MQTT_PUB_ERR_TIMEOUT -1000
+#define MQTT_PUB_ERR_CONN_LOST -1001
+#define MQTT_PUB_ERR_SPOOL_EVICTED -1002 // dropped from a full offline spool
+#define MQTT_PUB_ERR_TOO_LARGE -1003
+
+typedef struct {
+  uint32_t msg_id;
+  int32_t status; // 0 = delivered, otherwise Paho RC or MQTT_PUB_ERR_*
+} PayloadMQTTPubResult;
+
 typedef struct {
   char topic[64];
   uint16_t data_len;
   uint8_t data[256];
 } PayloadMQTTSubEVT;
 
+// One IDS alert, reduced to the fields that leave the box
+typedef struct {
+  uint64_t event_ms; // when the sensor saw it, ms since the epoch (UTC)
+  uint32_t signature_id;
+  uint8_t severity;   // 1 = most severe
+  uint8_t proto;      // IP protocol number, 0 if unknown
+  uint8_t ip_version; // 4 or 6, 0 if the addresses are missing
+  uint8_t reserved;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t src_ip[16]; // network order, IPv4 uses the first 4 bytes
+  uint8_t dst_ip[16];
+} PayloadIDSAlert;
+
+// Why the passive listener reported a flow (PayloadProbe.end)
+#define PROBE_END_IDLE 1    // nothing new for the idle timeout
+#define PROBE_END_ACTIVE 2  // open for the active timeout, or counters full
+#define PROBE_END_EVICTED 3 // made room for a new flow in a full table
+#define PROBE_END_STOPPED 4 // capture paused or the module stopped
+
+// Inbound connection attempts (TCP SYNs or UDP datagrams) seen on the wire,
+// folded per 5-tuple. A single decoded packet has packets = 1.
+typedef struct {
+  uint64_t event_ms;  // capture time of the first packet, ms since the epoch
+  uint8_t proto;      // IPPROTO_TCP or IPPROTO_UDP
+  uint8_t ip_version; // 4 or 6
+  uint8_t ttl;        // of the first packet, hop limit on IPv6
+  uint8_t tcp_flags;  // of every packet ORed together, 0 for UDP
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint16_t tcp_window; // of the first packet, 0 for UDP
+  uint16_t ip_len;     // IP length of the first packet as sent
+  uint8_t src_ip[16];  // network order, IPv4 uses the first 4 bytes
+  uint8_t dst_ip[16];
+  uint32_t packets;
+  uint32_t bytes;       // IP lengths summed
+  uint32_t duration_ms; // first packet to last
+  uint8_t end;          // PROBE_END_*, 0 for a single packet
+} PayloadProbe;
+
+// The board's health over the last sampling interval. Shares are in
+// permille of the CPU time of the cores concerned, rates are per second.
+#define SYSSTATS_MAX_CPUS 8
+#define SYSSTATS_TEMP_UNKNOWN INT32_MIN
+
+typedef struct {
+  uint32_t interval_ms; // since the previous sample
+  uint8_t cpu_count;    // cores in core_busy[]
+  uint8_t reserved[3];
+  uint16_t cpu_busy; // every core, all but idle and iowait
+  uint16_t cpu_iowait;
+  uint16_t cpu_softirq;
+  uint16_t core_busy[SYSSTATS_MAX_CPUS];
+  int32_t temp_mc; // millidegrees C, SYSSTATS_TEMP_UNKNOWN if there's no sensor
+  uint32_t mem_total_kb;
+  uint32_t mem_available_kb;
+  uint16_t load_x100[3]; // 1, 5 and 15 minute load averages, times 100
+  uint32_t net_rx_bytes; // every interface but loopback
+  uint32_t net_tx_bytes;
+  uint32_t net_rx_packets;
+  uint32_t net_rx_drops;
+  uint32_t softirq_net_rx; // NET_RX softirqs, every core
+  uint32_t softirq_net_tx;
+  uint32_t self_ppm; // the sampler's own CPU, millionths of one core
+} PayloadSysStats;
+
 typedef struct {
   int32_t system_errno; // if 0 it's not a system error
   int32_t module_errno; // if 0 it's not a module error
@@ -64,29 +216,715 @@ typedef struct {
 
 typedef struct {
   ModuleID origin;
+  ModuleID dest; // MOD_CORE: the controller handles or routes it by type
   MSGType msgtype;
   uint64_t timestamp_ms;
-  size_t payload_len;
+  size_t payload_len; // bytes of payload actually used, set on receive
   union {
     PayloadMQTTPubCMD mqtt_pub_cmd;
     PayloadMQTTSubEVT mqtt_sub_evt;
+    PayloadMQTTPubResult mqtt_pub_result;
+    PayloadIDSAlert ids_alert;
+    PayloadProbe probe;
+    PayloadHello hello;
+    PayloadState state;
+    PayloadStateDone state_done;
+    PayloadBan ban;
+    PayloadShed shed;
+    PayloadSysStats sysstats;
     PayloadError rror;
     // add more payload types here
   } payload;
 } IPCMessage;
 
+/*
+ * Wire format: one SOCK_SEQPACKET datagram per message, made of this header
+ * followed by exactly payload_len bytes of the payload union. Variable-size
+ * payloads keep their variable part (data[] / message[]) last, so only the
+ * used prefix of the struct goes on the wire (see ipc_payload_size()).
+ */
+typedef struct {
+  uint8_t origin;   // ModuleID
+  uint8_t msgtype;  // MSGType
+  uint16_t payload_len;
+  uint8_t dest;        // ModuleID
+  uint8_t reserved[3]; // must be 0
+  uint64_t timestamp_ms;
+} IPCWireHeader;
+
+#define IPC_MAX_PAYLOAD sizeof(((IPCMessage *)0)->payload)
+#define IPC_MAX_DATAGRAM (sizeof(IPCWireHeader) + IPC_MAX_PAYLOAD)
+
+// Where the controller listens for modules
+#define IPC_CONTROLLER_SOCK_PATH "/tmp/orange-sentry.sock"
+
 // prototypes
 
 int ipc_client_connect(const char *socket_path);
 int ipc_client_send(int fd, const IPCMessage *msg);
 int ipc_client_receive(int fd, IPCMessage *msg);
 int ipc_client_disconnect(int *pfd);
-static inline void safe_usleep(uint32_t usec);
+
+/**
+ * Identifies this process to the controller as module self. Must be the
+ * first message a module sends after ipc_client_connect(); the controller
+ * drops connections that don't say hello within a few seconds.
+ * Returns bytes sent on success, -1 on error.
+ */
+int ipc_client_hello(int fd, ModuleID self);
+
+// Max messages moved per sendmmsg()/recvmmsg() call
+#define IPC_BATCH_MAX 32
+
+/**
+ * Sends count messages, up to IPC_BATCH_MAX per syscall (sendmmsg).
+ * Blocks like ipc_client_send() if the socket buffer is full.
+ * Returns:
+ * >= 0: Number of messages sent (count on success).
+ * -1: Error before anything was sent.
+ */
+int ipc_client_send_batch(int fd, const IPCMessage *msgs, size_t count);
+
+/**
+ * Receives up to max messages that are already queued, without blocking,
+ * using one recvmmsg() call per IPC_BATCH_MAX messages.
+ * Malformed datagrams are dropped and not counted.
+ * Returns:
+ * > 0: Number of messages stored in msgs[0..n).
+ *   0: Nothing available at the moment.
+ *  -1: Error or connection closed.
+ */
+int ipc_client_receive_batch(int fd, IPCMessage *msgs, size_t max);
+
+/*
+ * Transports
+ * ----------
+ * By default every message is a SOCK_SEQPACKET datagram. Setting the
+ * environment variable OS_IPC_TRANSPORT=shm before a module starts makes
+ * ipc_client_connect() offer a shared-memory transport instead: a memfd with
+ * one single-producer/single-consumer ring per direction plus one eventfd per
+ * direction for wakeups, handed to the server over the socket (SCM_RIGHTS).
+ * The server side accepts the offer transparently inside its receive calls.
+ * Once set up, send/receive on that fd go through the rings and never enter
+ * the kernel while the peer keeps up; the socket stays open for hangups.
+ *
+ * Event loops must wait on ipc_client_poll_fd(fd) in addition to fd, and
+ * re-check it after receiving, because the server only learns about the
+ * switch when it reads the offer. On an O_NONBLOCK socket a full ring makes
+ * sends fail with EAGAIN right away, and the poll fd also becomes readable
+ * once the peer has made room again. Servers must not send before the client's
+ * first message has been read (the offer is always the first message).
+ */
+#define IPC_TRANSPORT_ENV "OS_IPC_TRANSPORT"
+
+/**
+ * The fd that becomes readable when messages for fd are waiting.
+ * Returns the ring eventfd for shared-memory channels, fd itself otherwise.
+ */
+int ipc_client_poll_fd(int fd);
+
+/**
+ * Number of payload bytes a message needs on the wire, derived from its type
+ * and its own length fields (data_len, message string...).
+ */
+static inline size_t ipc_payload_size(const IPCMessage *msg) {
+  switch (msg->msgtype) {
+  case MSG_SYS_ACK:
+  case MSG_SYS_PING:
+  case MSG_SYS_PONG:
+  case MSG_SYS_SHM_OFFER:
+  case MSG_CMD_START:
+  case MSG_CMD_STOP:
+  case MSG_CMD_REQ_DATA:
+    return 0;
+  case MSG_CMD_MQTT_PUB: {
+    size_t len = msg->payload.mqtt_pub_cmd.data_len;
+    if (len > sizeof(msg->payload.mqtt_pub_cmd.data)) {
+      len = sizeof(msg->payload.mqtt_pub_cmd.data);
+    }
+    return offsetof(PayloadMQTTPubCMD, data) + len;
+  }
+  case MSG_EVT_MQTT_SUB_MSG: {
+    size_t len = msg->payload.mqtt_sub_evt.data_len;
+    if (len > sizeof(msg->payload.mqtt_sub_evt.data)) {
+      len = sizeof(msg->payload.mqtt_sub_evt.data);
+    }
+    return offsetof(PayloadMQTTSubEVT, data) + len;
+  }
+  case MSG_EVT_MQTT_PUB_RESULT:
+    return sizeof(PayloadMQTTPubResult);
+  case MSG_SYS_HELLO:
+    return sizeof(PayloadHello);
+  case MSG_CMD_SET_STATE:
+    return sizeof(PayloadState);
+  case MSG_EVT_STATE_DONE:
+    return sizeof(PayloadStateDone);
+  case MSG_CMD_BAN:
+    return sizeof(PayloadBan);
+  case MSG_CMD_SHED:
+    return sizeof(PayloadShed);
+  case MSG_EVT_IDS_ALERT:
+    return sizeof(PayloadIDSAlert);
+  case MSG_EVT_PROBE:
+    return sizeof(PayloadProbe);
+  case MSG_EVT_SYSSTATS:
+    return sizeof(PayloadSysStats);
+  case MSG_ERR: {
+    size_t len = strnlen(msg->payload.rror.message,
+                         sizeof(msg->payload.rror.message) - 1);
+    return offsetof(PayloadError, message) + len + 1; // keep the '\0'
+  }
+  default:
+    return msg->payload_len < IPC_MAX_PAYLOAD ? msg->payload_len
+                                              : IPC_MAX_PAYLOAD;
+  }
+}
+
+/**
+ * Checks that a received payload of payload_len bytes is consistent with
+ * its message type. Terminates strings that arrived unterminated.
+ * Returns 0 if valid, -1 otherwise.
+ */
+static inline int ipc_payload_validate(IPCMessage *msg) {
+  size_t len = msg->payload_len;
+
+  switch (msg->msgtype) {
+  case MSG_CMD_MQTT_PUB: {
+    PayloadMQTTPubCMD *p = &msg->payload.mqtt_pub_cmd;
+    if (len < offsetof(PayloadMQTTPubCMD, data) ||
+        p->data_len != len - offsetof(PayloadMQTTPubCMD, data)) {
+      return -1;
+    }
+    p->topic[sizeof(p->topic) - 1] = '\0';
+    return 0;
+  }
+  case MSG_EVT_MQTT_SUB_MSG: {
+    PayloadMQTTSubEVT *p = &msg->payload.mqtt_sub_evt;
+    if (len < offsetof(PayloadMQTTSubEVT, data) ||
+        p->data_len != len - offsetof(PayloadMQTTSubEVT, data)) {
+      return -1;
+    }
+    p->topic[sizeof(p->topic) - 1] = '\0';
+    return 0;
+  }
+  case MSG_EVT_MQTT_PUB_RESULT:
+    return len == sizeof(PayloadMQTTPubResult) ? 0 : -1;
+  case MSG_ERR:
+    if (len <= offsetof(PayloadError, message)) {
+      return -1;
+    }
+    ((uint8_t *)&msg->payload)[len - 1] = '\0';
+    return 0;
+  default:
+    return ipc_payload_size(msg) == len ? 0 : -1;
+  }
+}
+
+static inline void safe_usleep(uint32_t usec) {
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
 
 #endif
 
 // implementation (compile only once per program)
 #ifdef SOCK_IPC_IMPLEMENTATION
+#ifndef _GNU_SOURCE
+#error "sockclient.h needs _GNU_SOURCE for sendmmsg/recvmmsg (add -D_GNU_SOURCE)"
+#endif
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Fills the wire header for msg and returns its payload length
+static size_t ipc_encode_header(const IPCMessage *msg, IPCWireHeader *hdr) {
+  size_t payload_len = ipc_payload_size(msg);
+  hdr->origin = (uint8_t)msg->origin;
+  hdr->msgtype = (uint8_t)msg->msgtype;
+  hdr->payload_len = (uint16_t)payload_len;
+  hdr->dest = (uint8_t)msg->dest;
+  memset(hdr->reserved, 0, sizeof(hdr->reserved));
+  hdr->timestamp_ms = msg->timestamp_ms;
+  return payload_len;
+}
+
+// Points iov[0..2) at the header and at the used part of the payload.
+// Returns the iovec count to use.
+static int ipc_fill_send_iov(const IPCMessage *msg, IPCWireHeader *hdr,
+                             struct iovec iov[2]) {
+  size_t payload_len = ipc_encode_header(msg, hdr);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(*hdr);
+  iov[1].iov_base = (void *)&msg->payload;
+  iov[1].iov_len = payload_len;
+  return payload_len > 0 ? 2 : 1;
+}
+
+static void ipc_fill_recv_iov(IPCMessage *msg, IPCWireHeader *hdr,
+                              struct iovec iov[2]) {
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(*hdr);
+  iov[1].iov_base = &msg->payload;
+  iov[1].iov_len = IPC_MAX_PAYLOAD;
+}
+
+// Validates a received datagram and moves the header fields into msg.
+// Returns 0 if the message is usable, -1 if it must be dropped.
+static int ipc_decode_message(const IPCWireHeader *hdr, size_t bytes_read,
+                              int msg_flags, IPCMessage *msg) {
+  if (bytes_read < sizeof(*hdr) || (msg_flags & MSG_TRUNC) ||
+      hdr->payload_len != bytes_read - sizeof(*hdr) ||
+      hdr->msgtype >= MSG_TYPE_COUNT || hdr->origin >= MOD_COUNT ||
+      hdr->dest >= MOD_COUNT) {
+    LOG_ERROR("Dropping malformed message: %zu bytes, payload_len %u, "
+              "type %u",
+              bytes_read, (unsigned)hdr->payload_len, (unsigned)hdr->msgtype);
+    return -1;
+  }
+
+  msg->origin = (ModuleID)hdr->origin;
+  msg->dest = (ModuleID)hdr->dest;
+  msg->msgtype = (MSGType)hdr->msgtype;
+  msg->timestamp_ms = hdr->timestamp_ms;
+  msg->payload_len = hdr->payload_len;
+
+  if (ipc_payload_validate(msg) != 0) {
+    LOG_ERROR("Dropping message of type %d: payload_len %zu does not match "
+              "its contents",
+              msg->msgtype, msg->payload_len);
+    return -1;
+  }
+  return 0;
+}
+
+static void ipc_log_send_error(void) {
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    // Only non-blocking fds get here; the caller decides whether to queue
+    LOG_DEBUG("Peer is not reading, send would block");
+  } else if (errno == EPIPE || errno == ECONNRESET) {
+    LOG_ERROR("Connection to server lost while sending message: %s",
+              strerror(errno));
+  } else {
+    LOG_ERROR("Failed to send message to server: %s", strerror(errno));
+  }
+}
+
+// ---- shared-memory transport ----
+
+#define IPC_SHM_SLOTS 256 // power of two
+#define IPC_SHM_SLOT_SIZE 384
+#define IPC_SHM_MAX_CHANNELS 16
+#define IPC_SHM_HANDSHAKE_MS 5000
+#define IPC_SHM_SEND_TIMEOUT_MS 1000
+
+// Each slot holds a uint32 length followed by header + payload, exactly as
+// they would go on the socket.
+typedef char ipc_shm_slot_fits[(sizeof(uint32_t) + IPC_MAX_DATAGRAM <=
+                                IPC_SHM_SLOT_SIZE)
+                                   ? 1
+                                   : -1];
+
+// Head and tail are free-running counters on separate cache lines so the
+// producer and the consumer never write the same line.
+typedef struct {
+  uint32_t head __attribute__((aligned(64))); // written by the producer
+  uint32_t tail __attribute__((aligned(64))); // written by the consumer
+  uint32_t closed __attribute__((aligned(64))); // producer hung up
+  uint32_t want_space; // non-blocking producer found the ring full
+  uint8_t slots[IPC_SHM_SLOTS][IPC_SHM_SLOT_SIZE] __attribute__((aligned(64)));
+} IPCShmRing;
+
+// ring 0 carries client -> server, ring 1 server -> client
+#define IPC_SHM_MAP_SIZE (2 * sizeof(IPCShmRing))
+
+typedef struct {
+  bool in_use;
+  int sock_fd;
+  IPCShmRing *tx;
+  IPCShmRing *rx;
+  int tx_efd; // poked when tx goes from empty to non-empty
+  int rx_efd; // our wakeup, returned by ipc_client_poll_fd()
+  void *map;
+  int tx_lock;   // serializes threads sending on this end
+  bool nonblock; // socket is O_NONBLOCK: fail with EAGAIN instead of waiting
+} IPCShmChannel;
+
+static IPCShmChannel ipc_shm_channels[IPC_SHM_MAX_CHANNELS];
+static int ipc_shm_table_lock; // only taken to claim a slot
+
+static IPCShmChannel *ipc_shm_find(int fd) {
+  for (size_t i = 0; i < IPC_SHM_MAX_CHANNELS; i++) {
+    if (__atomic_load_n(&ipc_shm_channels[i].in_use, __ATOMIC_ACQUIRE) &&
+        ipc_shm_channels[i].sock_fd == fd) {
+      return &ipc_shm_channels[i];
+    }
+  }
+  return NULL;
+}
+
+static IPCShmChannel *ipc_shm_register(int sock_fd, void *map, bool is_client,
+                                       int efd_c2s, int efd_s2c) {
+  while (__atomic_test_and_set(&ipc_shm_table_lock, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+
+  IPCShmChannel *found = NULL;
+  for (size_t i = 0; i < IPC_SHM_MAX_CHANNELS && found == NULL; i++) {
+    IPCShmChannel *ch = &ipc_shm_channels[i];
+    if (!ch->in_use) {
+      IPCShmRing *rings = (IPCShmRing *)map;
+      ch->sock_fd = sock_fd;
+      ch->map = map;
+      ch->tx = is_client ? &rings[0] : &rings[1];
+      ch->rx = is_client ? &rings[1] : &rings[0];
+      ch->tx_efd = is_client ? efd_c2s : efd_s2c;
+      ch->rx_efd = is_client ? efd_s2c : efd_c2s;
+      ch->tx_lock = 0;
+      ch->nonblock = (fcntl(sock_fd, F_GETFL) & O_NONBLOCK) != 0;
+      __atomic_store_n(&ch->in_use, true, __ATOMIC_RELEASE);
+      found = ch;
+    }
+  }
+
+  __atomic_clear(&ipc_shm_table_lock, __ATOMIC_RELEASE);
+  return found;
+}
+
+static void ipc_shm_release(IPCShmChannel *ch) {
+  // Let the peer see the hangup even if it only watches its eventfd
+  __atomic_store_n(&ch->tx->closed, 1, __ATOMIC_SEQ_CST);
+  uint64_t one = 1;
+  if (write(ch->tx_efd, &one, sizeof(one)) == -1) {
+    LOG_DEBUG("Could not poke peer on shm close: %s", strerror(errno));
+  }
+
+  munmap(ch->map, IPC_SHM_MAP_SIZE);
+  close(ch->tx_efd);
+  close(ch->rx_efd);
+  __atomic_store_n(&ch->in_use, false, __ATOMIC_RELEASE);
+}
+
+static int ipc_shm_push(IPCShmChannel *ch, const IPCMessage *msg) {
+  IPCShmRing *ring = ch->tx;
+
+  while (__atomic_test_and_set(&ch->tx_lock, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+
+  uint32_t head = ring->head;
+  uint32_t spins = 0;
+  // Ring full: the consumer is behind. Back off instead of failing at once,
+  // like a blocking send() would, unless the socket is non-blocking.
+  while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+         IPC_SHM_SLOTS) {
+    if (ch->nonblock) {
+      // Ask the consumer to poke our eventfd once it frees a slot, then
+      // look once more in case it already did before seeing the flag.
+      __atomic_store_n(&ring->want_space, 1, __ATOMIC_SEQ_CST);
+      if (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) <
+          IPC_SHM_SLOTS) {
+        continue;
+      }
+    }
+    if (ch->nonblock || __atomic_load_n(&ch->rx->closed, __ATOMIC_RELAXED) ||
+        ++spins > IPC_SHM_SEND_TIMEOUT_MS * 10) {
+      __atomic_clear(&ch->tx_lock, __ATOMIC_RELEASE);
+      errno = EAGAIN;
+      return -1;
+    }
+    if (spins < 64) {
+      sched_yield();
+    } else {
+      safe_usleep(100);
+    }
+  }
+
+  uint8_t *slot = ring->slots[head & (IPC_SHM_SLOTS - 1)];
+  IPCWireHeader hdr;
+  size_t payload_len = ipc_encode_header(msg, &hdr);
+  uint32_t len = (uint32_t)(sizeof(hdr) + payload_len);
+  memcpy(slot, &len, sizeof(len));
+  memcpy(slot + sizeof(len), &hdr, sizeof(hdr));
+  memcpy(slot + sizeof(len) + sizeof(hdr), &msg->payload, payload_len);
+
+  // Publish, then check whether the consumer had already drained everything
+  // before this slot: if so it may be asleep and needs a poke. Both sides use
+  // seq_cst on head/tail so at least one of them sees the other's update.
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+  bool was_empty = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head;
+
+  __atomic_clear(&ch->tx_lock, __ATOMIC_RELEASE);
+
+  if (was_empty) {
+    uint64_t one = 1;
+    if (write(ch->tx_efd, &one, sizeof(one)) == -1) {
+      LOG_ERROR("Failed to wake shm peer: %s", strerror(errno));
+    }
+  }
+  return (int)len;
+}
+
+// Returns bytes read (> 0), 0 if the ring is empty, -1 if the peer hung up.
+static int ipc_shm_pop(IPCShmChannel *ch, IPCMessage *msg) {
+  IPCShmRing *ring = ch->rx;
+
+  while (1) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+    if (head == tail) {
+      // Clear the wakeup, then look again so a push that raced with the
+      // clear is not left sitting in the ring without a pending wakeup.
+      uint64_t ignored;
+      if (read(ch->rx_efd, &ignored, sizeof(ignored)) == -1 &&
+          errno != EAGAIN) {
+        LOG_ERROR("Failed to read shm eventfd: %s", strerror(errno));
+      }
+      head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+      if (head == tail) {
+        return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) ? -1 : 0;
+      }
+    }
+
+    const uint8_t *slot = ring->slots[tail & (IPC_SHM_SLOTS - 1)];
+    uint32_t len;
+    IPCWireHeader hdr;
+    memcpy(&len, slot, sizeof(len));
+    if (len > IPC_MAX_DATAGRAM || len < sizeof(hdr)) {
+      len = 0; // corrupt slot: ipc_decode_message() rejects it below
+    }
+    memcpy(&hdr, slot + sizeof(uint32_t), sizeof(hdr));
+    if (len > sizeof(hdr)) {
+      memcpy(&msg->payload, slot + sizeof(uint32_t) + sizeof(hdr),
+             len - sizeof(hdr));
+    }
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->want_space, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&ring->want_space, 0, __ATOMIC_SEQ_CST)) {
+      uint64_t one = 1;
+      if (write(ch->tx_efd, &one, sizeof(one)) == -1) {
+        LOG_DEBUG("Could not tell shm peer about free space");
+      }
+    }
+
+    if (ipc_decode_message(&hdr, len, 0, msg) == 0) {
+      return (int)len;
+    }
+  }
+}
+
+// Ring receive with the socket as a liveness check: a peer that crashed
+// never sets the closed flag, but its end of the socket goes away.
+static int ipc_shm_receive(IPCShmChannel *ch, IPCMessage *msg) {
+  int rc = ipc_shm_pop(ch, msg);
+  if (rc != 0) {
+    return rc;
+  }
+
+  char probe;
+  if (recv(ch->sock_fd, &probe, sizeof(probe), MSG_DONTWAIT | MSG_PEEK) == 0) {
+    LOG_ERROR("Server closed the connection");
+    return -1;
+  }
+  return 0;
+}
+
+static int ipc_sock_send(int fd, const IPCMessage *msg);
+
+// Server side: map the rings offered by a client and acknowledge.
+static void ipc_shm_accept(int fd, const int *fds, size_t nfds) {
+  IPCMessage reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.origin = MOD_CORE;
+
+  void *map = MAP_FAILED;
+  struct stat st;
+  if (nfds == 3 && fstat(fds[0], &st) == 0 &&
+      (size_t)st.st_size == IPC_SHM_MAP_SIZE) {
+    map = mmap(NULL, IPC_SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fds[0], 0);
+  }
+  if (nfds > 0) {
+    close(fds[0]); // the mapping keeps the memfd alive
+  }
+
+  if (map == MAP_FAILED || ipc_shm_find(fd) != NULL) {
+    LOG_ERROR("Rejecting shared-memory offer on fd %d", fd);
+    for (size_t i = 1; i < nfds; i++) {
+      close(fds[i]);
+    }
+    if (map != MAP_FAILED) {
+      munmap(map, IPC_SHM_MAP_SIZE);
+    }
+    reply.msgtype = MSG_ERR;
+    strcpy(reply.payload.rror.message, "shm transport rejected");
+    ipc_sock_send(fd, &reply);
+    return;
+  }
+
+  // Register before acknowledging: the client starts using the rings as soon
+  // as it reads the ACK. The ACK itself still goes over the socket.
+  IPCShmChannel *ch = ipc_shm_register(fd, map, false, fds[1], fds[2]);
+  reply.msgtype = MSG_SYS_ACK;
+  if (ch == NULL || ipc_sock_send(fd, &reply) < 0) {
+    LOG_ERROR("Failed to set up shared-memory channel on fd %d", fd);
+    if (ch != NULL) {
+      ch->in_use = false;
+    }
+    munmap(map, IPC_SHM_MAP_SIZE);
+    close(fds[1]);
+    close(fds[2]);
+    return;
+  }
+
+  LOG_INFO("fd %d switched to the shared-memory transport", fd);
+}
+
+// Control buffer big enough for the fds of a shared-memory offer
+typedef union {
+  struct cmsghdr align;
+  char buf[CMSG_SPACE(3 * sizeof(int))];
+} IPCCmsgBuf;
+
+// Extracts SCM_RIGHTS fds from a received message. Returns how many.
+static size_t ipc_take_fds(struct msghdr *mh, int *fds, size_t max) {
+  size_t n = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(mh); c != NULL;
+       c = CMSG_NXTHDR(mh, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *passed = (int *)CMSG_DATA(c);
+    for (size_t i = 0; i < count; i++) {
+      if (n < max) {
+        fds[n++] = passed[i];
+      } else {
+        close(passed[i]);
+      }
+    }
+  }
+  return n;
+}
+
+// Handles transport control messages inside the receive path; msg is NULL
+// for dropped datagrams. Returns true if msg was consumed and must not reach
+// the caller.
+static bool ipc_handle_control(int fd, struct msghdr *mh,
+                               const IPCMessage *msg) {
+  int fds[3];
+  size_t nfds = ipc_take_fds(mh, fds, 3);
+
+  if (msg != NULL && msg->msgtype == MSG_SYS_SHM_OFFER) {
+    ipc_shm_accept(fd, fds, nfds);
+    return true;
+  }
+
+  // Nobody else passes fds; don't leak them
+  for (size_t i = 0; i < nfds; i++) {
+    close(fds[i]);
+  }
+  return false;
+}
+
+// Client side: offer a shared-memory channel and wait for the verdict.
+// On any failure the connection simply stays on the socket transport.
+static void ipc_shm_offer(int fd) {
+  int memfd = memfd_create("orange-sentry-ipc", MFD_CLOEXEC);
+  int efd_c2s = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int efd_s2c = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  void *map = MAP_FAILED;
+
+  if (memfd == -1 || efd_c2s == -1 || efd_s2c == -1 ||
+      ftruncate(memfd, IPC_SHM_MAP_SIZE) == -1 ||
+      (map = mmap(NULL, IPC_SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  memfd, 0)) == MAP_FAILED) {
+    LOG_ERROR("Failed to create shared-memory rings: %s", strerror(errno));
+    goto fallback;
+  }
+
+  IPCMessage offer;
+  memset(&offer, 0, sizeof(offer));
+  offer.origin = MOD_CORE;
+  offer.msgtype = MSG_SYS_SHM_OFFER;
+
+  IPCWireHeader hdr;
+  ipc_encode_header(&offer, &hdr);
+  struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+
+  IPCCmsgBuf ctrl;
+  memset(&ctrl, 0, sizeof(ctrl));
+
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctrl.buf;
+  mh.msg_controllen = sizeof(ctrl.buf);
+
+  struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  int fds[3] = {memfd, efd_c2s, efd_s2c};
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+  if (sendmsg(fd, &mh, MSG_NOSIGNAL) == -1) {
+    LOG_ERROR("Failed to send shared-memory offer: %s", strerror(errno));
+    goto fallback;
+  }
+
+  IPCMessage reply;
+  int waited_ms = 0;
+  int rc;
+  while ((rc = ipc_client_receive(fd, &reply)) == 0 &&
+         waited_ms < IPC_SHM_HANDSHAKE_MS) {
+    safe_usleep(1000);
+    waited_ms++;
+  }
+
+  if (rc > 0 && reply.msgtype == MSG_SYS_ACK &&
+      ipc_shm_register(fd, map, true, efd_c2s, efd_s2c) != NULL) {
+    close(memfd);
+    LOG_INFO("Using the shared-memory transport on fd %d", fd);
+    return;
+  }
+
+  if (rc > 0 && reply.msgtype != MSG_SYS_ACK && reply.msgtype != MSG_ERR) {
+    LOG_ERROR("Unexpected message type %d during shm handshake, dropped",
+              reply.msgtype);
+  }
+  LOG_WARN("Server did not accept the shared-memory transport, using the "
+           "socket");
+
+fallback:
+  if (map != MAP_FAILED) {
+    munmap(map, IPC_SHM_MAP_SIZE);
+  }
+  if (memfd != -1) {
+    close(memfd);
+  }
+  if (efd_c2s != -1) {
+    close(efd_c2s);
+  }
+  if (efd_s2c != -1) {
+    close(efd_s2c);
+  }
+}
+
+int ipc_client_poll_fd(int fd) {
+  IPCShmChannel *ch = ipc_shm_find(fd);
+  return ch != NULL ? ch->rx_efd : fd;
+}
+
+// ---- socket transport ----
+
 // definitions
 int ipc_client_connect(const char *socket_path) {
   int client_fd;
@@ -110,6 +948,11 @@ int ipc_client_connect(const char *socket_path) {
                 sizeof(struct sockaddr_un)) == 0) {
       LOG_INFO("Connected successfully to server at %s. fd: %d", socket_path,
                client_fd);
+
+      const char *transport = getenv(IPC_TRANSPORT_ENV);
+      if (transport != NULL && strcmp(transport, "shm") == 0) {
+        ipc_shm_offer(client_fd);
+      }
       return client_fd;
     }
 
@@ -123,26 +966,44 @@ int ipc_client_connect(const char *socket_path) {
   return -1;
 }
 
+static int ipc_sock_send(int fd, const IPCMessage *msg) {
+  // Header and payload go out as one datagram straight from where they live
+  IPCWireHeader hdr;
+  struct iovec iov[2];
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = ipc_fill_send_iov(msg, &hdr, iov);
+
+  ssize_t bytes_sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+  if (bytes_sent == -1) {
+    ipc_log_send_error();
+    return -1;
+  }
+
+  LOG_DEBUG("Successfully sent message to server. Origin: %d, Type: %d, "
+            "Size: %zd",
+            msg->origin, msg->msgtype, bytes_sent);
+  return (int)bytes_sent;
+}
+
 int ipc_client_send(int fd, const IPCMessage *msg) {
   if (fd < 0 || msg == NULL) {
     LOG_ERROR("Invalid arguments to ipc_client_send");
     return -1;
   }
 
-  ssize_t bytes_sent = send(fd, msg, sizeof(IPCMessage), MSG_NOSIGNAL);
-  if (bytes_sent == -1) {
-    if (errno == EPIPE || errno == ECONNRESET) {
-      LOG_ERROR("Connection to server lost while sending message: %s",
-                strerror(errno));
-    } else {
-      LOG_ERROR("Failed to send message to server: %s", strerror(errno));
+  IPCShmChannel *ch = ipc_shm_find(fd);
+  if (ch != NULL) {
+    int rc = ipc_shm_push(ch, msg);
+    if (rc < 0 && !ch->nonblock) {
+      LOG_ERROR("Failed to queue message on shared-memory ring: peer %s",
+                errno == EAGAIN ? "not draining" : "gone");
     }
-    return -1;
+    return rc;
   }
 
-  LOG_DEBUG("Successfully sent message to server. Origin: %d, Type: %d",
-            msg->origin, msg->msgtype);
-  return (int)bytes_sent;
+  return ipc_sock_send(fd, msg);
 }
 
 int ipc_client_receive(int fd, IPCMessage *msg) {
@@ -151,7 +1012,24 @@ int ipc_client_receive(int fd, IPCMessage *msg) {
     return -1;
   }
 
-  ssize_t bytes_read = recv(fd, msg, sizeof(IPCMessage), MSG_DONTWAIT);
+  IPCShmChannel *ch = ipc_shm_find(fd);
+  if (ch != NULL) {
+    return ipc_shm_receive(ch, msg);
+  }
+
+  IPCWireHeader hdr;
+  struct iovec iov[2];
+  ipc_fill_recv_iov(msg, &hdr, iov);
+
+  IPCCmsgBuf ctrl;
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 2;
+  mh.msg_control = ctrl.buf;
+  mh.msg_controllen = sizeof(ctrl.buf);
+
+  ssize_t bytes_read = recvmsg(fd, &mh, MSG_DONTWAIT);
   if (bytes_read == -1) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
       // No data available, not an error
@@ -165,11 +1043,178 @@ int ipc_client_receive(int fd, IPCMessage *msg) {
     return -1;
   }
 
+  // A malformed datagram is dropped, the connection itself is still fine
+  if (ipc_decode_message(&hdr, (size_t)bytes_read, mh.msg_flags, msg) != 0) {
+    ipc_handle_control(fd, &mh, NULL);
+    return 0;
+  }
+
+  if (ipc_handle_control(fd, &mh, msg)) {
+    return 0;
+  }
+
   LOG_DEBUG("Successfully received message from server. Origin: %d, Type: %d",
             msg->origin, msg->msgtype);
   return (int)bytes_read;
 }
 
+int ipc_client_send_batch(int fd, const IPCMessage *msgs, size_t count) {
+  if (fd < 0 || msgs == NULL) {
+    LOG_ERROR("Invalid arguments to ipc_client_send_batch");
+    return -1;
+  }
+
+  IPCShmChannel *ch = ipc_shm_find(fd);
+  if (ch != NULL) {
+    size_t queued = 0;
+    while (queued < count && ipc_shm_push(ch, &msgs[queued]) > 0) {
+      queued++;
+    }
+    if (queued < count) {
+      LOG_ERROR("Shared-memory ring stalled after %zu of %zu messages",
+                queued, count);
+      return queued > 0 ? (int)queued : -1;
+    }
+    return (int)queued;
+  }
+
+  IPCWireHeader hdrs[IPC_BATCH_MAX];
+  struct iovec iovs[IPC_BATCH_MAX][2];
+  struct mmsghdr mmsg[IPC_BATCH_MAX];
+  size_t sent = 0;
+
+  while (sent < count) {
+    size_t chunk = count - sent;
+    if (chunk > IPC_BATCH_MAX) {
+      chunk = IPC_BATCH_MAX;
+    }
+
+    memset(mmsg, 0, chunk * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < chunk; i++) {
+      mmsg[i].msg_hdr.msg_iov = iovs[i];
+      mmsg[i].msg_hdr.msg_iovlen =
+          ipc_fill_send_iov(&msgs[sent + i], &hdrs[i], iovs[i]);
+    }
+
+    // sendmmsg() can stop early (e.g. buffer full after some datagrams);
+    // the next round simply restarts from the first unsent message.
+    int n = sendmmsg(fd, mmsg, (unsigned int)chunk, MSG_NOSIGNAL);
+    if (n == -1) {
+      ipc_log_send_error();
+      return sent > 0 ? (int)sent : -1;
+    }
+    sent += (size_t)n;
+  }
+
+  LOG_DEBUG("Successfully sent a batch of %zu messages to server", sent);
+  return (int)sent;
+}
+
+int ipc_client_receive_batch(int fd, IPCMessage *msgs, size_t max) {
+  if (fd < 0 || msgs == NULL) {
+    LOG_ERROR("Invalid arguments to ipc_client_receive_batch");
+    return -1;
+  }
+
+  IPCShmChannel *ch = ipc_shm_find(fd);
+  if (ch != NULL) {
+    size_t got = 0;
+    while (got < max) {
+      int rc = ipc_shm_receive(ch, &msgs[got]);
+      if (rc < 0) {
+        return got > 0 ? (int)got : -1; // report the close on the next call
+      }
+      if (rc == 0) {
+        break;
+      }
+      got++;
+    }
+    return (int)got;
+  }
+
+  IPCWireHeader hdrs[IPC_BATCH_MAX];
+  struct iovec iovs[IPC_BATCH_MAX][2];
+  struct mmsghdr mmsg[IPC_BATCH_MAX];
+  IPCCmsgBuf ctrls[IPC_BATCH_MAX];
+  size_t stored = 0;
+
+  while (stored < max) {
+    size_t chunk = max - stored;
+    if (chunk > IPC_BATCH_MAX) {
+      chunk = IPC_BATCH_MAX;
+    }
+
+    memset(mmsg, 0, chunk * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < chunk; i++) {
+      ipc_fill_recv_iov(&msgs[stored + i], &hdrs[i], iovs[i]);
+      mmsg[i].msg_hdr.msg_iov = iovs[i];
+      mmsg[i].msg_hdr.msg_iovlen = 2;
+      mmsg[i].msg_hdr.msg_control = ctrls[i].buf;
+      mmsg[i].msg_hdr.msg_controllen = sizeof(ctrls[i].buf);
+    }
+
+    int n = recvmmsg(fd, mmsg, (unsigned int)chunk, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      LOG_ERROR("Failed to receive message batch from server: %s",
+                strerror(errno));
+      return stored > 0 ? (int)stored : -1;
+    }
+
+    // Payloads were received in place; compact the survivors if a
+    // malformed datagram left a hole, and stop at end-of-stream.
+    size_t base = stored;
+    bool closed = false;
+    for (int i = 0; i < n; i++) {
+      if (mmsg[i].msg_len == 0) {
+        closed = true;
+        break;
+      }
+      IPCMessage *slot = &msgs[base + (size_t)i];
+      if (ipc_decode_message(&hdrs[i], mmsg[i].msg_len,
+                             mmsg[i].msg_hdr.msg_flags, slot) != 0) {
+        ipc_handle_control(fd, &mmsg[i].msg_hdr, NULL);
+        continue;
+      }
+      if (ipc_handle_control(fd, &mmsg[i].msg_hdr, slot)) {
+        continue;
+      }
+      if (slot != &msgs[stored]) {
+        msgs[stored] = *slot;
+      }
+      stored++;
+    }
+
+    if (closed) {
+      if (stored > 0) {
+        return (int)stored; // report the close on the next call
+      }
+      LOG_ERROR("Server closed the connection");
+      return -1;
+    }
+
+    if ((size_t)n < chunk) {
+      break; // queue drained
+    }
+  }
+
+  LOG_DEBUG("Received a batch of %zu messages from server", stored);
+  return (int)stored;
+}
+
+int ipc_client_hello(int fd, ModuleID self) {
+  IPCMessage msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.origin = self;
+  msg.dest = MOD_CORE;
+  msg.msgtype = MSG_SYS_HELLO;
+  msg.payload.hello.version = IPC_PROTOCOL_VERSION;
+  msg.payload.hello.pid = (uint32_t)getpid();
+  return ipc_client_send(fd, &msg);
+}
+
 int ipc_client_disconnect(int *pfd) {
   if (pfd == NULL) {
     LOG_ERROR("Invalid argument to ipc_client_disconnect");
@@ -177,6 +1222,11 @@ int ipc_client_disconnect(int *pfd) {
   }
 
   if (*pfd >= 0) {
+    IPCShmChannel *ch = ipc_shm_find(*pfd);
+    if (ch != NULL) {
+      ipc_shm_release(ch);
+    }
+
     if (close(*pfd) == -1) {
       LOG_ERROR("Failed to close client socket fd: %s", strerror(errno));
       return -1;
@@ -190,11 +1240,4 @@ int ipc_client_disconnect(int *pfd) {
   }
   return 0;
 }
-
-static inline void safe_usleep(uint32_t usec) {
-  struct timespec ts;
-  ts.tv_sec = usec / 1000000;
-  ts.tv_nsec = (usec % 1000000) * 1000;
-  nanosleep(&ts, NULL);
-}
 #endif
@@ -0,0 +1,131 @@
+// Benchmark: Suricata eve.json ingestion rate.
+//
+// 1. parse: eve_parse_alert() over an in-memory mix of realistic records
+//    (ALERT_PERCENT alerts, the rest flow/dns/http records).
+// 2. tail: the same mix written to a file and consumed through FileTail,
+//    i.e. read() + line splitting + parsing, as the module does it.
+//
+// The ingester has to stay ahead of Suricata: tens of thousands of events
+// per second on the target.
+//
+// Usage: bench_eve_ingest [records]
+
+#define MODULE_NAME "BENCH"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../suricata-ingester/eve.h"
+
+#define FILETAIL_IMPLEMENTATION
+#include "filetail.h"
+
+#define ALERT_PERCENT 10
+#define BENCH_FILE "/tmp/bench_eve.json"
+
+static const char *alert_fmt =
+    "{\"timestamp\":\"2024-05-14T12:%02d:%02d.%06d+0000\",\"flow_id\":"
+    "1290483726150592,\"in_iface\":\"eth0\",\"event_type\":\"alert\","
+    "\"src_ip\":\"192.168.1.%d\",\"src_port\":%d,\"dest_ip\":\"10.0.0.5\","
+    "\"dest_port\":22,\"proto\":\"TCP\",\"pkt_src\":\"wire/pcap\",\"alert\":{"
+    "\"action\":\"allowed\",\"gid\":1,\"signature_id\":%d,\"rev\":3,"
+    "\"signature\":\"ET SCAN Potential SSH Scan \\\"OUTBOUND\\\"\","
+    "\"category\":\"Attempted Information Leak\",\"severity\":2,\"metadata\":{"
+    "\"created_at\":[\"2010_07_30\"],\"updated_at\":[\"2019_07_26\"]}},"
+    "\"flow\":{\"pkts_toserver\":3,\"pkts_toclient\":1,\"bytes_toserver\":206,"
+    "\"bytes_toclient\":74,\"start\":\"2024-05-14T12:00:01.000000+0000\"}}\n";
+
+static const char *flow_fmt =
+    "{\"timestamp\":\"2024-05-14T12:%02d:%02d.%06d+0000\",\"flow_id\":"
+    "2110483726150592,\"in_iface\":\"eth0\",\"event_type\":\"flow\","
+    "\"src_ip\":\"192.168.1.%d\",\"src_port\":%d,\"dest_ip\":\"1.1.1.1\","
+    "\"dest_port\":53,\"proto\":\"UDP\",\"app_proto\":\"dns\",\"flow\":{"
+    "\"pkts_toserver\":1,\"pkts_toclient\":1,\"bytes_toserver\":74,"
+    "\"bytes_toclient\":90,\"start\":\"2024-05-14T12:00:01.000000+0000\","
+    "\"end\":\"2024-05-14T12:00:01.020000+0000\",\"age\":0,\"state\":\"new\","
+    "\"reason\":\"timeout\",\"alerted\":false}}\n";
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t build_mix(char *buf, size_t cap, size_t records) {
+  size_t used = 0;
+  for (size_t i = 0; i < records; i++) {
+    const char *fmt = (i % 100) < ALERT_PERCENT ? alert_fmt : flow_fmt;
+    int n = snprintf(buf + used, cap - used, fmt, (int)(i / 60) % 60,
+                     (int)i % 60, (int)(i * 37) % 1000000, (int)i % 250 + 1,
+                     (int)(1024 + i % 60000), (int)(2001219 + i % 50));
+    used += (size_t)n;
+  }
+  return used;
+}
+
+static uint64_t seen_alerts;
+static void count_alert(void *userdata, const char *line, size_t len) {
+  PayloadIDSAlert alert;
+  seen_alerts += eve_parse_alert(line, len, &alert) == 1;
+}
+
+int main(int argc, char **argv) {
+  size_t records = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  size_t cap = records * 1024;
+  char *mix = malloc(cap);
+  if (mix == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  size_t len = build_mix(mix, cap, records);
+
+  // 1. parse only
+  uint64_t alerts = 0, malformed = 0;
+  PayloadIDSAlert out;
+  uint64_t t0 = now_ns();
+  for (char *p = mix, *end = mix + len; p < end;) {
+    char *nl = memchr(p, '\n', (size_t)(end - p));
+    int rc = eve_parse_alert(p, (size_t)(nl - p), &out);
+    alerts += rc == 1;
+    malformed += rc < 0;
+    p = nl + 1;
+  }
+  double secs = (double)(now_ns() - t0) / 1e9;
+  printf("parse: %zu records (%llu alerts, %llu malformed) in %.3f s: "
+         "%.0f records/s, %.0f MB/s\n",
+         records, (unsigned long long)alerts, (unsigned long long)malformed,
+         secs, records / secs, len / secs / 1e6);
+
+  // 2. through the file follower
+  FILE *f = fopen(BENCH_FILE, "w");
+  if (f == NULL || fwrite(mix, 1, len, f) != len) {
+    perror("write " BENCH_FILE);
+    return 1;
+  }
+  fclose(f);
+
+  static uint8_t memory[EVE_READ_BUF_SIZE + 4096];
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+  FileTail tail;
+  if (filetail_open(&tail, BENCH_FILE, &arena, EVE_READ_BUF_SIZE, true,
+                    count_alert, NULL) != 0) {
+    return 1;
+  }
+
+  t0 = now_ns();
+  filetail_check(&tail);
+  secs = (double)(now_ns() - t0) / 1e9;
+  printf("tail:  %llu records (%llu alerts) in %.3f s: %.0f records/s, "
+         "%.0f MB/s\n",
+         (unsigned long long)tail.lines, (unsigned long long)seen_alerts, secs,
+         tail.lines / secs, tail.bytes / secs / 1e6);
+
+  filetail_close(&tail);
+  unlink(BENCH_FILE);
+  free(mix);
+  return 0;
+}
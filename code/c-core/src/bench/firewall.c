@@ -0,0 +1,185 @@
+// Benchmark: firewall state transitions, in a network namespace of its own.
+//
+// The rule set of every state is compiled once, then the states are cycled
+// (closed -> passive listen -> honeypot -> development -> closed ...):
+// 1. batch:    each transition is the state's whole batch, one transaction
+// 2. per-rule: each transition sends the same messages as one transaction
+//              apiece, the way a script running `nft add rule` per line
+//              does (less the cost of starting nft, measured separately)
+// 3. exec:     what starting a process costs, per rule, for that script
+//
+// After every transition of the first cycle the rules are listed back from
+// the kernel and counted against what the batch holds.
+//
+// Needs root (CAP_SYS_ADMIN for the namespace). The host's rules are never
+// touched.
+//
+// Usage: bench_firewall [transitions]
+
+#define MODULE_NAME "BENCH"
+
+#include <sched.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "../firewall/nft.h"
+#include "../firewall/rulesets.h"
+
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+
+extern char **environ;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void report(const char *phase, uint64_t *us, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += us[i];
+  }
+  qsort(us, n, sizeof(uint64_t), cmp_u64);
+  printf("%-9s %zu transitions: mean %.0f us, p50 %llu us, p99 %llu us, "
+         "max %llu us\n",
+         phase, n, (double)sum / n, (unsigned long long)us[n / 2],
+         (unsigned long long)us[n * 99 / 100], (unsigned long long)us[n - 1]);
+}
+
+// Commits every message between BEGIN and END of the batch in a transaction
+// of its own; the first and last messages of a built batch are BEGIN and END
+static int commit_per_message(int fd, const NftBatch *b, NftBatch *one) {
+  const struct nlmsghdr *begin = (const struct nlmsghdr *)b->buf;
+  const struct nlmsghdr *end = NULL;
+  size_t left = b->len;
+  for (const struct nlmsghdr *m = begin; NLMSG_OK(m, left);
+       m = NLMSG_NEXT(m, left)) {
+    end = m;
+  }
+
+  left = b->len - begin->nlmsg_len;
+  for (const struct nlmsghdr *m = NLMSG_NEXT(begin, left); m != end;
+       m = NLMSG_NEXT(m, left)) {
+    nft_batch_reset(one);
+    memcpy(one->buf, begin, begin->nlmsg_len);
+    memcpy(one->buf + begin->nlmsg_len, m, m->nlmsg_len);
+    memcpy(one->buf + begin->nlmsg_len + m->nlmsg_len, end, end->nlmsg_len);
+    one->len = begin->nlmsg_len + m->nlmsg_len + end->nlmsg_len;
+    one->acks = 1;
+    int rc = nft_commit(fd, one);
+    if (rc != 0) {
+      return rc;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+  if (n < STATE_COUNT) {
+    fprintf(stderr, "at least %d transitions\n", STATE_COUNT);
+    return 1;
+  }
+
+  if (unshare(CLONE_NEWNET) != 0) {
+    perror("unshare(CLONE_NEWNET) (run as root)");
+    return 1;
+  }
+
+  static uint8_t memory[(STATE_COUNT + 1) * FW_BATCH_SIZE + 256];
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+  NftBatch sets[STATE_COUNT], one;
+  for (int s = 0; s < STATE_COUNT; s++) {
+    if (nft_batch_init(&sets[s], &arena, FW_BATCH_SIZE) != 0 ||
+        ruleset_build(&sets[s], (SystemState)s) != 0) {
+      return 1;
+    }
+    printf("%-15s %2u rules, %4zu bytes, %2u messages\n",
+           ruleset_state_name((SystemState)s), sets[s].rules, sets[s].len,
+           sets[s].acks);
+  }
+  if (nft_batch_init(&one, &arena, FW_BATCH_SIZE) != 0) {
+    return 1;
+  }
+
+  int fd = nft_open();
+  if (fd < 0) {
+    return 1;
+  }
+
+  uint64_t *us = malloc(n * sizeof(uint64_t));
+  if (us == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    NftBatch *b = &sets[i % STATE_COUNT];
+    uint64_t t0 = now_us();
+    int rc = nft_commit(fd, b);
+    us[i] = now_us() - t0;
+    if (rc != 0) {
+      fprintf(stderr, "transition %zu failed: %s\n", i, strerror(-rc));
+      return 1;
+    }
+
+    if (i < STATE_COUNT) {
+      int rules = nft_count_rules(fd, FW_FAMILY, FW_TABLE);
+      if (rules != (int)b->rules) {
+        fprintf(stderr, "%s: the kernel holds %d rules, the batch %u\n",
+                ruleset_state_name((SystemState)i), rules, b->rules);
+        return 1;
+      }
+    }
+  }
+  report("batch", us, n);
+
+  for (size_t i = 0; i < n; i++) {
+    uint64_t t0 = now_us();
+    int rc = commit_per_message(fd, &sets[i % STATE_COUNT], &one);
+    us[i] = now_us() - t0;
+    if (rc != 0) {
+      fprintf(stderr, "transition %zu failed: %s\n", i, strerror(-rc));
+      return 1;
+    }
+  }
+  report("per-rule", us, n);
+
+  // Starting nft once per rule: a process spawn is the least it costs
+  size_t spawns = n < 200 ? n : 200;
+  char *args[] = {"/bin/true", NULL};
+  uint64_t t0 = now_us();
+  for (size_t i = 0; i < spawns; i++) {
+    pid_t pid;
+    if (posix_spawn(&pid, args[0], NULL, NULL, args, environ) != 0 ||
+        waitpid(pid, NULL, 0) != pid) {
+      perror("posix_spawn");
+      return 1;
+    }
+  }
+  double spawn_us = (double)(now_us() - t0) / spawns;
+  double per_state = 0;
+  for (int s = 0; s < STATE_COUNT; s++) {
+    per_state += sets[s].acks;
+  }
+  per_state /= STATE_COUNT;
+  printf("exec      %.0f us per process start: %.1f ms more per transition "
+         "for a script running nft per rule\n",
+         spawn_us, spawn_us * per_state / 1000);
+
+  free(us);
+  nft_close(&fd);
+  return 0;
+}
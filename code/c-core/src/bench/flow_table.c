@@ -0,0 +1,183 @@
+// Benchmark: passive listener flow table at scale.
+//
+// A table for N flows (default 1M) is filled and then exercised:
+// 1. insert: N new 5-tuples into the empty table
+// 2. update: a packet for every flow, in scattered order (the hot path)
+// 3. batch:  the same through flow_update_batch(), FLOW_BATCH at a time
+// 4. lookup: every flow, scattered; then N absent keys
+// 5. churn:  N more new 5-tuples into the full table, each one evicting
+// 6. age:    one full sweep of the clock hand, every flow idle
+//
+// Every flow the table exports is checked to account for its packets.
+//
+// Usage: bench_flow_table [flows]
+
+#define MODULE_NAME "BENCH"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../passive-listener/flows.h"
+
+#define STEP 999983 // prime: i * STEP mod n visits every index once
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Flow i: a distinct IPv4 source per i (the multiply is a bijection on 32
+// bits), a scanner-like spread of source and destination ports
+static void make_probe(PayloadProbe *p, uint64_t i, uint64_t ms) {
+  memset(p, 0, sizeof(PayloadProbe));
+  uint32_t src = (uint32_t)i * 2654435761u;
+  memcpy(p->src_ip, &src, 4);
+  p->dst_ip[0] = 10;
+  p->dst_ip[3] = 5;
+  p->src_port = (uint16_t)(1024 + (i * 7919) % 60000);
+  p->dst_port = (uint16_t)(1 + i % 1024);
+  p->proto = 6;
+  p->ip_version = 4;
+  p->ttl = 64;
+  p->tcp_flags = 0x02;
+  p->ip_len = 60;
+  p->packets = 1;
+  p->bytes = 60;
+  p->event_ms = ms;
+}
+
+static void make_key(FlowKey *k, uint64_t i) {
+  PayloadProbe p;
+  make_probe(&p, i, 0);
+  memset(k, 0, sizeof(FlowKey));
+  memcpy(k->src_ip, p.src_ip, 16);
+  memcpy(k->dst_ip, p.dst_ip, 16);
+  k->src_port = p.src_port;
+  k->dst_port = p.dst_port;
+  k->proto = p.proto;
+  k->ip_version = p.ip_version;
+}
+
+static uint64_t exported, exported_packets;
+static void on_export(void *userdata, const PayloadProbe *p) {
+  exported++;
+  exported_packets += p->packets;
+}
+
+static void report(const char *phase, size_t ops, uint64_t t0) {
+  double secs = (double)(now_ns() - t0) / 1e9;
+  printf("%-7s %zu in %.3f s: %.2f M/s, %.0f ns each\n", phase, ops, secs,
+         ops / secs / 1e6, secs * 1e9 / ops);
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  if (n < 2 || n % STEP == 0) {
+    fprintf(stderr, "flows must be at least 2 and not a multiple of %d\n",
+            STEP);
+    return 1;
+  }
+
+  size_t mem = flow_table_mem(n);
+  void *buffer = malloc(mem);
+  if (buffer == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  Arena arena;
+  arena_init(&arena, buffer, mem);
+
+  const FlowConfig cfg = {.max_flows = n, .idle_ms = 10000, .active_ms = 60000};
+  FlowTable t;
+  if (flow_init(&t, &arena, &cfg, on_export, NULL) != 0) {
+    return 1;
+  }
+  printf("table: %zu flows, %zu slots, %.1f MiB\n", n, t.capacity,
+         (double)mem / (1 << 20));
+
+  PayloadProbe p;
+  FlowKey key;
+  uint64_t ms = 1000;
+
+  uint64_t t0 = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    make_probe(&p, i, ms);
+    flow_update(&t, &p);
+  }
+  report("insert", n, t0);
+
+  ms++;
+  t0 = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    make_probe(&p, (i * STEP) % n, ms);
+    flow_update(&t, &p);
+  }
+  report("update", n, t0);
+
+  PayloadProbe batch[FLOW_BATCH];
+  ms++;
+  t0 = now_ns();
+  for (size_t i = 0; i < n;) {
+    size_t m = 0;
+    for (; m < FLOW_BATCH && i < n; m++, i++) {
+      make_probe(&batch[m], (i * STEP) % n, ms);
+    }
+    flow_update_batch(&t, batch, m);
+  }
+  report("batch", n, t0);
+
+  size_t found = 0;
+  t0 = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    make_key(&key, (i * STEP) % n);
+    const FlowEntry *f = flow_lookup(&t, &key);
+    found += f != NULL && f->packets == 3;
+  }
+  report("hit", n, t0);
+
+  t0 = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    make_key(&key, n + i);
+    found += flow_lookup(&t, &key) != NULL;
+  }
+  report("miss", n, t0);
+
+  if (found != n || t.count != n || exported != 0) {
+    fprintf(stderr, "lookups found %zu of %zu flows\n", found, n);
+    return 1;
+  }
+
+  ms++;
+  t0 = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    make_probe(&p, n + i, ms);
+    flow_update(&t, &p);
+  }
+  report("churn", n, t0);
+
+  // Everything idle: the first call only starts the clock
+  flow_age(&t, ms);
+  t0 = now_ns();
+  size_t aged = flow_age(&t, ms + cfg.idle_ms);
+  report("age", t.capacity, t0);
+
+  // Every packet is in exactly one exported flow
+  if (t.count != 0 || aged + t.ended[PROBE_END_EVICTED] != exported ||
+      exported_packets != 4 * (uint64_t)n) {
+    fprintf(stderr,
+            "lost flows: %zu live, %llu exported holding %llu packets\n",
+            t.count, (unsigned long long)exported,
+            (unsigned long long)exported_packets);
+    return 1;
+  }
+  printf("exported %llu flows (%llu evicted), %llu packets accounted for\n",
+         (unsigned long long)exported,
+         (unsigned long long)t.ended[PROBE_END_EVICTED],
+         (unsigned long long)exported_packets);
+
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Benchmark: IPC throughput per batch size.
+//
+// A producer thread pushes alert-sized MSG_CMD_MQTT_PUB messages over a
+// SOCK_SEQPACKET socketpair and a consumer drains them, both moving
+// batch_size messages per syscall. batch size 1 uses the single-message
+// ipc_client_send/ipc_client_receive path as the baseline.
+//
+// Usage: bench_ipc_batch [messages]
+
+#define MODULE_NAME "BENCH"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "sockclient.h"
+
+#define ALERT_DATA_LEN 160
+
+typedef struct {
+  int fd;
+  size_t total;
+  size_t batch;
+} Side;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void *producer_main(void *arg) {
+  Side *p = (Side *)arg;
+  static IPCMessage msgs[IPC_BATCH_MAX];
+  memset(msgs, 0, sizeof(msgs));
+  for (size_t i = 0; i < IPC_BATCH_MAX; i++) {
+    msgs[i].origin = MOD_CORE;
+    msgs[i].msgtype = MSG_CMD_MQTT_PUB;
+    strcpy(msgs[i].payload.mqtt_pub_cmd.topic, "sentry/alerts");
+    msgs[i].payload.mqtt_pub_cmd.data_len = ALERT_DATA_LEN;
+  }
+
+  size_t sent = 0;
+  while (sent < p->total) {
+    size_t n = p->total - sent < p->batch ? p->total - sent : p->batch;
+    int rc = p->batch == 1 ? (ipc_client_send(p->fd, &msgs[0]) > 0 ? 1 : -1)
+                           : ipc_client_send_batch(p->fd, msgs, n);
+    if (rc <= 0) {
+      fprintf(stderr, "send failed\n");
+      break;
+    }
+    sent += (size_t)rc;
+  }
+  return NULL;
+}
+
+static size_t consume(Side *c, uint64_t *syscalls) {
+  static IPCMessage msgs[IPC_BATCH_MAX];
+  struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+  size_t received = 0;
+
+  while (received < c->total) {
+    int rc = c->batch == 1 ? ipc_client_receive(c->fd, &msgs[0]) > 0
+                           : ipc_client_receive_batch(c->fd, msgs, c->batch);
+    (*syscalls)++;
+    if (rc < 0) {
+      break;
+    }
+    if (rc == 0) {
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    received += (size_t)rc;
+  }
+  return received;
+}
+
+int main(int argc, char **argv) {
+  size_t total = argc > 1 ? (size_t)atol(argv[1]) : 500000;
+  const size_t batches[] = {1, 2, 4, 8, 16, 32};
+
+  IPCMessage probe;
+  memset(&probe, 0, sizeof(probe));
+  probe.msgtype = MSG_CMD_MQTT_PUB;
+  probe.payload.mqtt_pub_cmd.data_len = ALERT_DATA_LEN;
+
+  printf("IPC throughput, %zu messages of %zu bytes on the wire\n", total,
+         sizeof(IPCWireHeader) + ipc_payload_size(&probe));
+  printf("%6s  %12s  %10s  %14s\n", "batch", "msgs/s", "MB/s", "recv calls");
+
+  for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+      perror("socketpair");
+      return 1;
+    }
+
+    Side producer = {.fd = sv[0], .total = total, .batch = batches[b]};
+    Side consumer = {.fd = sv[1], .total = total, .batch = batches[b]};
+    uint64_t syscalls = 0;
+
+    uint64_t start = now_ns();
+    pthread_t tid;
+    pthread_create(&tid, NULL, producer_main, &producer);
+    size_t received = consume(&consumer, &syscalls);
+    pthread_join(tid, NULL);
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    double wire = (double)(sizeof(IPCWireHeader) + ipc_payload_size(&probe));
+    printf("%6zu  %12.0f  %10.1f  %14llu\n", batches[b], received / secs,
+           received * wire / secs / 1e6, (unsigned long long)syscalls);
+
+    close(sv[0]);
+    close(sv[1]);
+  }
+  return 0;
+}
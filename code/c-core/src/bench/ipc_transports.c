@@ -0,0 +1,303 @@
+// Benchmark: IPC transports side by side.
+//
+// The same alert-sized MSG_CMD_MQTT_PUB message is moved between two threads
+// over
+//   - seqpacket: the default SOCK_SEQPACKET socket path of sockclient.h
+//   - fifo:      a pair of named pipes through fifo-ipc.c
+//   - shm:       the shared-memory rings of sockclient.h (OS_IPC_TRANSPORT=shm)
+// and measured two ways: ping-pong round trips (latency, every message needs
+// a wakeup) and a one-way stream (throughput, the consumer drains whatever is
+// queued per wakeup). All waits are blocking poll()s, no busy-polling.
+//
+// Usage: bench_ipc_transports [round_trips] [stream_messages]
+
+#define MODULE_NAME "BENCH"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "fifo-ipc.h"
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "sockclient.h"
+
+#define ALERT_DATA_LEN 160
+#define FIFO_PATH_A "/tmp/os_bench_fifo_a"
+#define FIFO_PATH_B "/tmp/os_bench_fifo_b"
+
+typedef struct Endpoint Endpoint;
+
+struct Endpoint {
+  int fd;          // socket transports
+  IPC_Channel rx;  // fifo transport
+  IPC_Channel tx;
+  int (*send)(Endpoint *ep, const IPCMessage *msg);
+  int (*recv)(Endpoint *ep, IPCMessage *msg); // >0 got one, 0 none, -1 closed
+  void (*wait)(Endpoint *ep);
+};
+
+typedef struct {
+  Endpoint *ep;
+  size_t count;
+  bool echo; // ping-pong peer instead of stream consumer
+  size_t received;
+  uint64_t wakeups;
+} Peer;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// ---- socket based (seqpacket and shm) ----
+
+static int sock_send(Endpoint *ep, const IPCMessage *msg) {
+  return ipc_client_send(ep->fd, msg);
+}
+
+static int sock_recv(Endpoint *ep, IPCMessage *msg) {
+  return ipc_client_receive(ep->fd, msg);
+}
+
+static void sock_wait(Endpoint *ep) {
+  // The poll fd changes once the shm offer has been accepted
+  struct pollfd pfd[2] = {
+      {.fd = ipc_client_poll_fd(ep->fd), .events = POLLIN},
+      {.fd = ep->fd, .events = POLLIN},
+  };
+  poll(pfd, pfd[0].fd == ep->fd ? 1 : 2, -1);
+}
+
+// ---- named pipes ----
+
+static int fifo_send(Endpoint *ep, const IPCMessage *msg) {
+  uint8_t buf[IPC_MAX_DATAGRAM];
+  IPCWireHeader hdr;
+  size_t len = ipc_encode_header(msg, &hdr);
+  memcpy(buf, &hdr, sizeof(hdr));
+  memcpy(buf + sizeof(hdr), &msg->payload, len);
+  len += sizeof(hdr);
+
+  // Writes up to PIPE_BUF are atomic, so each message stays in one piece;
+  // wait for room instead of letting the non-blocking write fail.
+  struct pollfd pfd = {.fd = ep->tx.fd, .events = POLLOUT};
+  poll(&pfd, 1, -1);
+  return (int)ipc_write_nonblocking(&ep->tx, (char *)buf, len);
+}
+
+static int fifo_recv(Endpoint *ep, IPCMessage *msg) {
+  // Read exactly one message worth of bytes (the channel keeps one for '\0')
+  char buf[IPC_MAX_DATAGRAM + 1];
+  IPCMessage probe;
+  probe.msgtype = MSG_CMD_MQTT_PUB;
+  probe.payload.mqtt_pub_cmd.data_len = ALERT_DATA_LEN;
+  size_t want = sizeof(IPCWireHeader) + ipc_payload_size(&probe);
+
+  size_t n = ipc_read_nonblocking(&ep->rx, buf, want + 1);
+  if (n < sizeof(IPCWireHeader)) {
+    return 0;
+  }
+  IPCWireHeader hdr;
+  memcpy(&hdr, buf, sizeof(hdr));
+  memcpy(&msg->payload, buf + sizeof(hdr), n - sizeof(hdr));
+  return ipc_decode_message(&hdr, n, 0, msg) == 0 ? (int)n : 0;
+}
+
+static void fifo_wait(Endpoint *ep) {
+  struct pollfd pfd = {.fd = ep->rx.fd, .events = POLLIN};
+  poll(&pfd, 1, -1);
+}
+
+// ---- workloads ----
+
+static void init_message(IPCMessage *msg) {
+  memset(msg, 0, sizeof(*msg));
+  msg->origin = MOD_CORE;
+  msg->msgtype = MSG_CMD_MQTT_PUB;
+  strcpy(msg->payload.mqtt_pub_cmd.topic, "sentry/alerts");
+  msg->payload.mqtt_pub_cmd.data_len = ALERT_DATA_LEN;
+}
+
+static void *peer_main(void *arg) {
+  Peer *p = (Peer *)arg;
+  IPCMessage msg;
+
+  while (p->received < p->count) {
+    int rc = p->ep->recv(p->ep, &msg);
+    if (rc < 0) {
+      break;
+    }
+    if (rc == 0) {
+      p->ep->wait(p->ep);
+      p->wakeups++;
+      continue;
+    }
+    p->received++;
+    if (p->echo) {
+      p->ep->send(p->ep, &msg);
+    }
+  }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void run_ping_pong(const char *name, Endpoint *a, Endpoint *b,
+                          size_t rounds) {
+  Peer echo = {.ep = b, .count = rounds, .echo = true};
+  pthread_t tid;
+  pthread_create(&tid, NULL, peer_main, &echo);
+
+  uint64_t *rtt = calloc(rounds, sizeof(uint64_t));
+  IPCMessage msg;
+  init_message(&msg);
+
+  for (size_t i = 0; i < rounds; i++) {
+    uint64_t start = now_ns();
+    a->send(a, &msg);
+    int rc;
+    while ((rc = a->recv(a, &msg)) == 0) {
+      a->wait(a);
+    }
+    if (rc < 0) {
+      fprintf(stderr, "%s: peer closed\n", name);
+      break;
+    }
+    rtt[i] = now_ns() - start;
+  }
+  pthread_join(tid, NULL);
+
+  qsort(rtt, rounds, sizeof(uint64_t), cmp_u64);
+  uint64_t sum = 0;
+  for (size_t i = 0; i < rounds; i++) {
+    sum += rtt[i];
+  }
+  printf("%-10s  rtt mean=%7.2fus  p50=%7.2fus  p99=%7.2fus\n", name,
+         (double)sum / rounds / 1000.0, rtt[rounds / 2] / 1000.0,
+         rtt[(rounds * 99) / 100] / 1000.0);
+  free(rtt);
+}
+
+static void run_stream(const char *name, Endpoint *a, Endpoint *b,
+                       size_t total) {
+  Peer consumer = {.ep = b, .count = total, .echo = false};
+  IPCMessage msg;
+  init_message(&msg);
+
+  uint64_t start = now_ns();
+  pthread_t tid;
+  pthread_create(&tid, NULL, peer_main, &consumer);
+  for (size_t i = 0; i < total; i++) {
+    if (a->send(a, &msg) <= 0) {
+      fprintf(stderr, "%s: send failed\n", name);
+      break;
+    }
+  }
+  pthread_join(tid, NULL);
+  double secs = (double)(now_ns() - start) / 1e9;
+
+  printf("%-10s  stream %10.0f msgs/s  consumer wakeups=%llu\n", name,
+         consumer.received / secs, (unsigned long long)consumer.wakeups);
+}
+
+// Server side of the shm handshake: receive until the offer is taken
+static void *accept_main(void *arg) {
+  Endpoint *ep = (Endpoint *)arg;
+  IPCMessage msg;
+  while (ep->recv(ep, &msg) >= 0 && ipc_client_poll_fd(ep->fd) == ep->fd) {
+    ep->wait(ep);
+  }
+  return NULL;
+}
+
+static void setup_socket_pair(Endpoint *a, Endpoint *b, bool shm) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+  *a = (Endpoint){.fd = sv[0], .send = sock_send, .recv = sock_recv,
+                  .wait = sock_wait};
+  *b = (Endpoint){.fd = sv[1], .send = sock_send, .recv = sock_recv,
+                  .wait = sock_wait};
+
+  if (shm) {
+    // Same handshake ipc_client_connect() runs under OS_IPC_TRANSPORT=shm;
+    // the server side answers it from its receive call.
+    pthread_t tid;
+    pthread_create(&tid, NULL, accept_main, b);
+    ipc_shm_offer(sv[0]);
+    pthread_join(tid, NULL);
+    if (ipc_client_poll_fd(sv[0]) == sv[0]) {
+      fprintf(stderr, "shm handshake failed\n");
+      exit(1);
+    }
+  }
+}
+
+static void teardown_socket_pair(Endpoint *a, Endpoint *b) {
+  ipc_client_disconnect(&a->fd);
+  ipc_client_disconnect(&b->fd);
+}
+
+static void setup_fifo_pair(Endpoint *a, Endpoint *b) {
+  unlink(FIFO_PATH_A);
+  unlink(FIFO_PATH_B);
+  *a = (Endpoint){.send = fifo_send, .recv = fifo_recv, .wait = fifo_wait};
+  *b = (Endpoint){.send = fifo_send, .recv = fifo_recv, .wait = fifo_wait};
+  if (ipc_open_channel(&a->tx, FIFO_PATH_A) != 0 ||
+      ipc_open_channel(&b->rx, FIFO_PATH_A) != 0 ||
+      ipc_open_channel(&b->tx, FIFO_PATH_B) != 0 ||
+      ipc_open_channel(&a->rx, FIFO_PATH_B) != 0) {
+    exit(1);
+  }
+}
+
+static void teardown_fifo_pair(Endpoint *a, Endpoint *b) {
+  ipc_close_channel(&a->tx);
+  ipc_close_channel(&a->rx);
+  ipc_close_channel(&b->tx);
+  ipc_close_channel(&b->rx);
+  unlink(FIFO_PATH_A);
+  unlink(FIFO_PATH_B);
+}
+
+int main(int argc, char **argv) {
+  size_t rounds = argc > 1 ? (size_t)atol(argv[1]) : 50000;
+  size_t stream = argc > 2 ? (size_t)atol(argv[2]) : 500000;
+  if (rounds == 0 || stream == 0) {
+    fprintf(stderr, "usage: %s [round_trips] [stream_messages]\n", argv[0]);
+    return 1;
+  }
+
+  printf("IPC transports, %zu round trips, %zu streamed messages\n", rounds,
+         stream);
+
+  Endpoint a, b;
+  for (int pass = 0; pass < 2; pass++) {
+    setup_socket_pair(&a, &b, false);
+    pass == 0 ? run_ping_pong("seqpacket", &a, &b, rounds)
+              : run_stream("seqpacket", &a, &b, stream);
+    teardown_socket_pair(&a, &b);
+
+    setup_fifo_pair(&a, &b);
+    pass == 0 ? run_ping_pong("fifo", &a, &b, rounds)
+              : run_stream("fifo", &a, &b, stream);
+    teardown_fifo_pair(&a, &b);
+
+    setup_socket_pair(&a, &b, true);
+    pass == 0 ? run_ping_pong("shm", &a, &b, rounds)
+              : run_stream("shm", &a, &b, stream);
+    teardown_socket_pair(&a, &b);
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+// Benchmark: what a log call costs its caller when the log sink is slow,
+// with the synchronous macros and with the LOG_ASYNC backend.
+//
+// stdout is a pipe read by a thread that keeps up, except that it stalls
+// for 100 ms after every 256 KiB: a journal on an SD card. The same lines
+// are logged, one every 50 us,
+// 1. sync:  fprintf(stdout), what LOG_INFO is without LOG_ASYNC
+// 2. async: LOG_INFO with LOG_ASYNC, into the thread's ring
+// and the latency of every call is recorded. Records the ring can't take
+// are dropped and counted, never waited for.
+//
+// Usage: bench_logging [lines]
+
+#define MODULE_NAME "BENCH"
+#define LOG_ASYNC
+#define LOG_SITE_RATE 1000000000 // no rate limit: every line is measured
+#define LOGGING_IMPLEMENTATION
+#include "../../include/logging.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_CHUNK 4096
+#define STALL_EVERY (256 * 1024)
+#define STALL_NS 100000000
+#define PACE_NS 50000 // between two lines: a busy module, not a flood
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void *slow_reader(void *arg) {
+  int fd = *(int *)arg;
+  char buf[READ_CHUNK];
+  struct timespec stall = {0, STALL_NS};
+  size_t since_stall = 0;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    since_stall += (size_t)n;
+    if (since_stall >= STALL_EVERY) {
+      nanosleep(&stall, NULL);
+      since_stall = 0;
+    }
+  }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void pace(uint64_t since) {
+  while (now_ns() - since < PACE_NS) {
+  }
+}
+
+static void report(const char *name, uint64_t *ns, int n, uint64_t total) {
+  qsort(ns, (size_t)n, sizeof(ns[0]), cmp_u64);
+  fprintf(stderr,
+          "%-6s %d lines in %.1f ms: p50 %llu ns, p99 %llu ns, max %.2f ms\n",
+          name, n, total / 1e6, (unsigned long long)ns[n / 2],
+          (unsigned long long)ns[(size_t)n * 99 / 100], ns[n - 1] / 1e6);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 20000;
+  if (n <= 0) {
+    fprintf(stderr, "at least one line\n");
+    return 1;
+  }
+  uint64_t *ns = malloc((size_t)n * sizeof(uint64_t));
+  int fds[2];
+  if (ns == NULL || pipe(fds) != 0 || dup2(fds[1], STDOUT_FILENO) < 0) {
+    perror("setup");
+    return 1;
+  }
+  close(fds[1]);
+  pthread_t reader;
+  pthread_create(&reader, NULL, slow_reader, &fds[0]);
+
+  const char *peer = "192.0.2.17";
+
+  // 1. sync
+  uint64_t t0 = now_ns();
+  for (int i = 0; i < n; i++) {
+    uint64_t t = now_ns();
+    fprintf(stdout,
+            LOG_LVL_INFO "[%s] Probe %d from %s to port %u, %zu bytes\n",
+            MODULE_NAME, i, peer, 22u, (size_t)60);
+    ns[i] = now_ns() - t;
+    pace(t);
+  }
+  fflush(stdout);
+  report("sync", ns, n, now_ns() - t0);
+
+  // 2. async
+  t0 = now_ns();
+  for (int i = 0; i < n; i++) {
+    uint64_t t = now_ns();
+    LOG_INFO("Probe %d from %s to port %u, %zu bytes", i, peer, 22u,
+             (size_t)60);
+    ns[i] = now_ns() - t;
+    pace(t);
+  }
+  uint64_t total = now_ns() - t0;
+  report("async", ns, n, total);
+
+  log_async_stop();
+  uint64_t dropped, suppressed;
+  log_async_stats(&dropped, &suppressed);
+  fprintf(stderr, "async: %llu dropped (ring of %d records), %llu suppressed\n",
+          (unsigned long long)dropped, LOG_RING_RECORDS,
+          (unsigned long long)suppressed);
+
+  fclose(stdout);
+  pthread_join(reader, NULL);
+  free(ns);
+  return 0;
+}
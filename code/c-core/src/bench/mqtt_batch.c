@@ -0,0 +1,277 @@
+// Benchmark: MQTT publish batching (mqtt-client/batch.c) under a scan flood.
+//
+// A scanner trips alerts from a handful of sources at flood rate. Every
+// alert is a CBOR record, as the controller publishes it, and goes through:
+// 1. no batching: one PUBLISH per alert (the old behaviour).
+// 2. batch: the Batcher with the mqtt-client's limits, raw frames.
+// 3. batch+lz: the same with LZ compression.
+// For each: messages, bytes on the wire (MQTT framing and PUBACKs included)
+// and batcher throughput. Every batch is unpacked again and its records
+// compared with what went in. The LZ codec is also checked on its own, with
+// edge cases and corrupted input.
+//
+// Usage: bench_mqtt_batch [alerts] [alerts/s]
+
+#define MODULE_NAME "BENCH"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mqtt-client/batch.h"
+#include "lz.h"
+
+#define RECORDS_IMPLEMENTATION
+#include "records.h"
+
+#define TOPIC "/ids/alert"
+#define MAX_DELAY_MS 250
+#define SCAN_SOURCES 4
+
+static uint8_t memory[1024 * 1024];
+
+typedef struct {
+  uint64_t messages;
+  uint64_t wire_bytes;
+  uint64_t next; // index of the alert the next record should be
+  uint64_t bad;
+  uint8_t raw[BATCH_MAX_BYTES];
+} Sink;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// A QoS 1 PUBLISH and its PUBACK
+static size_t mqtt_wire_size(size_t topic_len, size_t payload_len) {
+  size_t remaining = 2 + topic_len + 2 + payload_len;
+  size_t len_bytes = remaining < 128 ? 1 : remaining < 16384 ? 2 : 3;
+  return 1 + len_bytes + remaining + 4;
+}
+
+static void make_alert(PayloadIDSAlert *a, size_t i) {
+  memset(a, 0, sizeof(*a));
+  a->event_ms = 1715688000000ULL + i / 5;
+  a->signature_id = 2001219 + (uint32_t)(i % 3);
+  a->severity = 2;
+  a->proto = 6;
+  a->ip_version = 4;
+  inet_pton(AF_INET, "203.0.113.7", a->src_ip);
+  a->src_ip[3] += (uint8_t)(i % SCAN_SOURCES);
+  inet_pton(AF_INET, "10.0.0.5", a->dst_ip);
+  a->src_port = (uint16_t)(40000 + i % 20000);
+  a->dst_port = (uint16_t)(1 + i % 1024);
+}
+
+static uint64_t get_uvarint(const uint8_t **p, const uint8_t *end) {
+  uint64_t v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t b = *(*p)++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return v;
+    }
+  }
+  *p = end + 1; // marks the error
+  return 0;
+}
+
+// Unpacks a batch like a consumer would and checks every record in it
+static int on_batch(void *userdata, const char *topic, const void *data,
+                    size_t len) {
+  Sink *s = (Sink *)userdata;
+  const uint8_t *p = (const uint8_t *)data;
+  const uint8_t *end = p + len;
+  s->messages++;
+  s->wire_bytes += mqtt_wire_size(strlen(topic), len);
+
+  if (len < 4 || p[0] != 'O' || p[1] != 'B' ||
+      strcmp(topic, TOPIC BATCH_TOPIC_SUFFIX) != 0) {
+    s->bad++;
+    return 0;
+  }
+  uint8_t flags = p[2];
+  p += 3;
+  uint64_t count = get_uvarint(&p, end);
+
+  if (flags & BATCH_FLAG_LZ) {
+    uint64_t raw_len = get_uvarint(&p, end);
+    size_t out_len;
+    if (p > end || raw_len > sizeof(s->raw) ||
+        lz_decompress(p, (size_t)(end - p), s->raw, sizeof(s->raw),
+                      &out_len) != 0 ||
+        out_len != raw_len) {
+      s->bad++;
+      return 0;
+    }
+    p = s->raw;
+    end = s->raw + out_len;
+  }
+
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t n = get_uvarint(&p, end);
+    PayloadIDSAlert got, want;
+    make_alert(&want, s->next++);
+    if (p > end || n > (uint64_t)(end - p) ||
+        record_decode(p, (size_t)n, &got, sizeof(got)) != RECORD_ALERT ||
+        memcmp(&got, &want, sizeof(got)) != 0) {
+      s->bad++;
+      return 0;
+    }
+    p += n;
+  }
+  if (p != end) {
+    s->bad++;
+  }
+  return 0;
+}
+
+static int run(const char *name, bool compress, const uint8_t *records,
+               const uint16_t *lens, size_t count, double rate,
+               uint64_t baseline_msgs, uint64_t baseline_bytes) {
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+
+  static Sink sink;
+  memset(&sink, 0, sizeof(sink));
+
+  Batcher b;
+  BatchConfig cfg = {BATCH_MAX_BYTES, MAX_DELAY_MS, compress};
+  if (batch_init(&b, &arena, &cfg, on_batch, &sink) != 0) {
+    return -1;
+  }
+
+  // Time moves with the flood rate, so deadline flushes happen as they would
+  uint64_t t0 = now_ns();
+  for (size_t i = 0; i < count; i++) {
+    uint64_t now_ms = (uint64_t)(i * 1000.0 / rate);
+    batch_flush(&b, now_ms);
+    if (batch_add(&b, TOPIC, records + i * 64, lens[i], now_ms) != 0) {
+      printf("%s: record %zu refused\n", name, i);
+      return -1;
+    }
+  }
+  batch_flush(&b, UINT64_MAX);
+  double secs = (double)(now_ns() - t0) / 1e9;
+
+  printf("%-9s %8llu msgs  %10llu bytes  (%5.1fx fewer msgs, %4.1f%% of the "
+         "bytes)  size=%llu deadline=%llu lz=%llu  %.1fM records/s\n",
+         name, (unsigned long long)sink.messages,
+         (unsigned long long)sink.wire_bytes,
+         (double)baseline_msgs / sink.messages,
+         100.0 * sink.wire_bytes / baseline_bytes,
+         (unsigned long long)b.size_flushes,
+         (unsigned long long)b.deadline_flushes,
+         (unsigned long long)b.compressed, count / secs / 1e6);
+
+  if (sink.bad > 0 || sink.next != count) {
+    printf("%s: %llu bad batches, %llu/%zu records came back\n", name,
+           (unsigned long long)sink.bad, (unsigned long long)sink.next,
+           count);
+    return -1;
+  }
+  return 0;
+}
+
+static int check_lz_case(const char *name, const uint8_t *src, size_t len,
+                         uint8_t *buf, size_t cap, uint32_t *table) {
+  static uint8_t back[BATCH_MAX_BYTES];
+  size_t n = lz_compress(src, len, buf, cap, table);
+  size_t out_len;
+  if (n == 0 || lz_decompress(buf, n, back, sizeof(back), &out_len) != 0 ||
+      out_len != len || memcmp(src, back, len) != 0) {
+    printf("lz roundtrip FAILED: %s\n", name);
+    return -1;
+  }
+
+  // Truncated or corrupted blocks must fail cleanly, never overrun
+  for (size_t cut = 0; cut < n; cut += 1 + n / 64) {
+    if (lz_decompress(buf, cut, back, sizeof(back), &out_len) == 0 &&
+        out_len == len) {
+      printf("lz truncation not detected: %s\n", name);
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < n; i += 1 + n / 64) {
+    buf[i] ^= 0x5a;
+    lz_decompress(buf, n, back, len, &out_len);
+    buf[i] ^= 0x5a;
+  }
+  return 0;
+}
+
+static int check_lz(void) {
+  static uint8_t src[BATCH_MAX_BYTES], buf[BATCH_MAX_BYTES + 1024];
+  static uint32_t table[LZ_TABLE_SIZE];
+  unsigned int seed = 42;
+
+  memset(src, 'a', sizeof(src));
+  if (check_lz_case("empty", src, 0, buf, sizeof(buf), table) != 0 ||
+      check_lz_case("short", src, 7, buf, sizeof(buf), table) != 0 ||
+      check_lz_case("run", src, sizeof(src), buf, sizeof(buf), table) != 0) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = (uint8_t)rand_r(&seed);
+  }
+  if (check_lz_case("random", src, sizeof(src), buf, sizeof(buf), table) !=
+      0) {
+    return -1;
+  }
+  // Random data doesn't shrink: it must not fit a smaller buffer
+  if (lz_compress(src, sizeof(src), buf, sizeof(src) - 1, table) != 0) {
+    printf("lz overflow not detected\n");
+    return -1;
+  }
+
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = (uint8_t)("0123456789abcdef"[rand_r(&seed) % 16]);
+  }
+  if (check_lz_case("text", src, sizeof(src), buf, sizeof(buf), table) != 0) {
+    return -1;
+  }
+
+  printf("lz: roundtrips and corruption checks passed\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  double rate = argc > 2 ? strtod(argv[2], NULL) : 20000;
+  if (count == 0 || rate <= 0 || check_lz() != 0) {
+    return 1;
+  }
+
+  uint8_t *records = malloc(count * 64);
+  uint16_t *lens = malloc(count * sizeof(uint16_t));
+  if (records == NULL || lens == NULL) {
+    return 1;
+  }
+
+  uint64_t base_bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    PayloadIDSAlert a;
+    make_alert(&a, i);
+    lens[i] = (uint16_t)record_encode(RECORD_ALERT, &a, records + i * 64, 64);
+    base_bytes += mqtt_wire_size(strlen(TOPIC), lens[i]);
+  }
+
+  printf("%zu alerts at %.0f/s, %d ms / %d byte batches\n", count, rate,
+         MAX_DELAY_MS, BATCH_MAX_BYTES);
+  printf("%-9s %8zu msgs  %10llu bytes\n", "single", count,
+         (unsigned long long)base_bytes);
+
+  int rc = run("batch", false, records, lens, count, rate, count, base_bytes);
+  if (rc == 0) {
+    rc = run("batch+lz", true, records, lens, count, rate, count, base_bytes);
+  }
+
+  free(records);
+  free(lens);
+  return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+// Benchmark: how long Paho's receive thread spends in the message callback
+// when the controller can't keep up, the old way and through the inbox.
+//
+// A "paho" thread delivers messages in bursts of BURST with a short pause
+// in between, faster than a "controller" thread reads them (it sleeps a
+// little per message). Per message the callback:
+// 1. direct: builds the IPCMessage and ipc_client_send()s it, blocking once
+//    the socket buffer is full, as mqtt_on_message_arrived() used to
+// 2. inbox: builds it in a SlabPool slab and mpsc_push()es it, waking a
+//    "main" thread through an eventfd; main forwards IPC_BATCH_MAX per
+//    sendmmsg(). A full inbox drops the message.
+// The callback's latency percentiles are reported with what got through.
+//
+// Usage: bench_mqtt_inbox [messages] [controller us per message]
+
+#define MODULE_NAME "BENCH"
+#define SLABPOOL_IMPLEMENTATION
+#define SOCK_IPC_IMPLEMENTATION
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpsc.h"
+#include "slabpool.h"
+#include "sockclient.h"
+
+#define INBOX_SLOTS 64 // MQTT_INBOX_SLOTS
+#define BURST 16
+#define BURST_GAP_NS 100000
+
+typedef struct {
+  int fd; // to the controller
+  int event_fd;
+  SlabPool pool;
+  MpscQueue queue;
+  bool use_inbox;
+  bool done; // paho has delivered everything
+
+  size_t total;
+  uint64_t *latency_ns;
+  uint64_t dropped;
+  uint64_t batches;
+} Bench;
+
+typedef struct {
+  int fd;
+  int delay_us;
+  size_t received;
+} Controller;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void fill(IPCMessage *msg, size_t i) {
+  msg->origin = MOD_MQTT;
+  msg->msgtype = MSG_EVT_MQTT_SUB_MSG;
+  msg->timestamp_ms = i;
+  strcpy(msg->payload.mqtt_sub_evt.topic, "sentry/cmd/state");
+  memcpy(msg->payload.mqtt_sub_evt.data, "{\"state\":\"HP\"}", 14);
+  msg->payload.mqtt_sub_evt.data_len = 14;
+  msg->payload_len = sizeof(msg->payload.mqtt_sub_evt);
+}
+
+static void on_message(Bench *b, size_t i) {
+  if (!b->use_inbox) {
+    IPCMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    fill(&msg, i);
+    ipc_client_send(b->fd, &msg);
+    return;
+  }
+  Slab *s = slab_pool_acquire(&b->pool, 0);
+  IPCMessage *msg = s != NULL ? ARENA_NEW(&s->sArena, IPCMessage) : NULL;
+  if (msg == NULL) {
+    b->dropped++;
+    return;
+  }
+  fill(msg, i);
+  if (mpsc_push(&b->queue, s) != 0) {
+    slab_pool_release(&b->pool, s);
+    b->dropped++;
+  } else if (mpsc_wake_needed(&b->queue)) {
+    uint64_t one = 1;
+    if (write(b->event_fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("eventfd");
+    }
+  }
+}
+
+static void *paho_main(void *arg) {
+  Bench *b = arg;
+  struct timespec gap = {.tv_nsec = BURST_GAP_NS};
+  for (size_t i = 0; i < b->total; i++) {
+    uint64_t t0 = now_ns();
+    on_message(b, i);
+    b->latency_ns[i] = now_ns() - t0;
+    if (i % BURST == BURST - 1) {
+      nanosleep(&gap, NULL);
+    }
+  }
+  __atomic_store_n(&b->done, true, __ATOMIC_RELEASE);
+  if (b->use_inbox) {
+    uint64_t one = 1;
+    if (write(b->event_fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("eventfd");
+    }
+  }
+  return NULL;
+}
+
+// What mqtt_forward_inbox() does on every wake-up
+static void main_loop(Bench *b) {
+  struct pollfd pfd = {.fd = b->event_fd, .events = POLLIN};
+  IPCMessage batch[IPC_BATCH_MAX];
+  for (;;) {
+    bool done = __atomic_load_n(&b->done, __ATOMIC_ACQUIRE);
+    size_t count;
+    do {
+      Slab *s;
+      count = 0;
+      while (count < IPC_BATCH_MAX && (s = mpsc_pop(&b->queue)) != NULL) {
+        memcpy(&batch[count++], s->sArena.buffer, sizeof(IPCMessage));
+        slab_pool_release(&b->pool, s);
+      }
+      if (count > 0) {
+        ipc_client_send_batch(b->fd, batch, count);
+        b->batches++;
+      }
+    } while (count == IPC_BATCH_MAX);
+    if (done) {
+      return;
+    }
+    poll(&pfd, 1, -1);
+    uint64_t ignored;
+    if (read(b->event_fd, &ignored, sizeof(ignored)) == -1) {
+      perror("eventfd");
+    }
+  }
+}
+
+static void *controller_main(void *arg) {
+  Controller *c = arg;
+  IPCMessage msg;
+  struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+  for (;;) {
+    int rc = ipc_client_receive(c->fd, &msg);
+    if (rc < 0) {
+      break; // the sender shut down
+    }
+    if (rc == 0) {
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    c->received++;
+    if (c->delay_us > 0) {
+      usleep((useconds_t)c->delay_us);
+    }
+  }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int run(bool use_inbox, size_t total, int delay_us) {
+  Bench b = {.use_inbox = use_inbox, .total = total};
+  static uint8_t memory[256 * 1024];
+  Arena arena;
+  arena_init(&arena, memory, sizeof(memory));
+  b.latency_ns = calloc(total, sizeof(uint64_t));
+  b.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int sv[2];
+  if (b.latency_ns == NULL || b.event_fd == -1 ||
+      socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1 ||
+      slab_pool_init(&b.pool, &arena, INBOX_SLOTS, sizeof(IPCMessage)) != 0 ||
+      mpsc_init(&b.queue, &arena, INBOX_SLOTS) != 0) {
+    perror("setup");
+    return -1;
+  }
+  b.fd = sv[0];
+  Controller c = {.fd = sv[1], .delay_us = delay_us};
+
+  pthread_t paho, controller;
+  uint64_t t0 = now_ns();
+  pthread_create(&controller, NULL, controller_main, &c);
+  pthread_create(&paho, NULL, paho_main, &b);
+  if (use_inbox) {
+    main_loop(&b);
+  }
+  pthread_join(paho, NULL);
+  uint64_t paho_ns = now_ns() - t0;
+  shutdown(sv[0], SHUT_WR);
+  pthread_join(controller, NULL);
+
+  qsort(b.latency_ns, total, sizeof(uint64_t), cmp_u64);
+  fprintf(stderr,
+          "%-6s callback p50 %6.2f us, p99 %8.2f us, max %8.1f us; paho "
+          "done in %5.0f ms; %zu delivered, %llu dropped, %llu batches\n",
+          use_inbox ? "inbox" : "direct", b.latency_ns[total / 2] / 1e3,
+          b.latency_ns[total * 99 / 100] / 1e3, b.latency_ns[total - 1] / 1e3,
+          paho_ns / 1e6, c.received, (unsigned long long)b.dropped,
+          (unsigned long long)b.batches);
+
+  close(sv[0]);
+  close(sv[1]);
+  close(b.event_fd);
+  free(b.latency_ns);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t total = argc > 1 ? (size_t)atol(argv[1]) : 20000;
+  int delay_us = argc > 2 ? atoi(argv[2]) : 20;
+  if (total == 0 || delay_us < 0) {
+    fprintf(stderr, "at least one message\n");
+    return 1;
+  }
+  if (run(false, total, delay_us) != 0 || run(true, total, delay_us) != 0) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,195 @@
+// Benchmark: 10 ms sleep-poll loop vs epoll reactor on the IPC socket.
+//
+// A producer thread sends IPCMessages over a SOCK_SEQPACKET socketpair with a
+// send timestamp in the payload, spaced out like sporadic alerts. The consumer
+// runs either the old mqtt-client loop (recv MSG_DONTWAIT + 10 ms sleep) or the
+// reactor, and records delivery latency. Afterwards both loops are left idle
+// for a while to count how many times they wake up with nothing to do.
+//
+// Usage: bench_reactor [messages] [idle_seconds]
+
+#define MODULE_NAME "BENCH"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "sockclient.h"
+
+#define REACTOR_IMPLEMENTATION
+#include "reactor.h"
+
+#define SEND_SPACING_US 10000
+
+typedef struct {
+  int fd;
+  int count;
+} Producer;
+
+typedef struct {
+  uint64_t *latencies_ns;
+  int received;
+  int expected;
+  uint64_t idle_until_ns;
+  uint64_t loop_iterations;
+} Consumer;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void *producer_main(void *arg) {
+  Producer *p = (Producer *)arg;
+  IPCMessage msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.origin = MOD_CORE;
+  msg.msgtype = MSG_CMD_MQTT_PUB;
+  msg.payload_len = sizeof(PayloadMQTTPubCMD);
+  msg.payload.mqtt_pub_cmd.data_len = sizeof(uint64_t);
+
+  for (int i = 0; i < p->count; i++) {
+    // Jitter the spacing so sends don't phase-lock with the 10 ms sleep
+    safe_usleep(SEND_SPACING_US + (uint32_t)(rand() % SEND_SPACING_US));
+    uint64_t t = now_ns();
+    memcpy(msg.payload.mqtt_pub_cmd.data, &t, sizeof(t));
+    ipc_client_send(p->fd, &msg);
+  }
+  return NULL;
+}
+
+static void consume_one(Consumer *c, const IPCMessage *msg) {
+  uint64_t sent;
+  memcpy(&sent, msg->payload.mqtt_pub_cmd.data, sizeof(sent));
+  if (c->received < c->expected) {
+    c->latencies_ns[c->received++] = now_ns() - sent;
+  }
+}
+
+static void run_sleep_poll(int fd, Consumer *c) {
+  IPCMessage msg;
+  while (c->received < c->expected) {
+    if (ipc_client_receive(fd, &msg) > 0) {
+      consume_one(c, &msg);
+    }
+    safe_usleep(10000);
+  }
+
+  // Idle phase: count wakeups of the unchanged loop
+  uint64_t start = now_ns();
+  c->loop_iterations = 0;
+  while (now_ns() < c->idle_until_ns) {
+    ipc_client_receive(fd, &msg);
+    safe_usleep(10000);
+    c->loop_iterations++;
+  }
+  c->idle_until_ns = now_ns() - start;
+}
+
+static void on_bench_ipc(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Consumer *c = (Consumer *)userdata;
+  IPCMessage msg;
+  while (ipc_client_receive(fd, &msg) > 0) {
+    consume_one(c, &msg);
+  }
+  if (c->received >= c->expected) {
+    reactor_stop(r);
+  }
+}
+
+static void on_bench_idle_end(Reactor *r, int fd, uint32_t events,
+                              void *userdata) {
+  reactor_timer_ack(fd);
+  reactor_stop(r);
+}
+
+static void run_reactor(int fd, Consumer *c) {
+  Reactor r;
+  reactor_init(&r);
+  reactor_add_fd(&r, fd, EPOLLIN, on_bench_ipc, c);
+  reactor_run(&r);
+
+  // Idle phase: the only thing left to wake us is the end-of-idle timer
+  uint64_t start = now_ns();
+  uint32_t idle_ms = 1000;
+  if (c->idle_until_ns > start + 1000000ULL) {
+    idle_ms = (uint32_t)((c->idle_until_ns - start) / 1000000ULL);
+  }
+  reactor_add_timer(&r, idle_ms, on_bench_idle_end, NULL);
+  uint64_t wakeups_before = r.wakeups;
+  reactor_run(&r);
+  c->loop_iterations = r.wakeups - wakeups_before;
+  c->idle_until_ns = now_ns() - start;
+  reactor_close(&r);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char *name, Consumer *c) {
+  qsort(c->latencies_ns, c->received, sizeof(uint64_t), cmp_u64);
+  uint64_t sum = 0;
+  for (int i = 0; i < c->received; i++) {
+    sum += c->latencies_ns[i];
+  }
+  double idle_s = (double)c->idle_until_ns / 1e9;
+  printf("%-11s  n=%-5d mean=%8.1fus  p50=%8.1fus  p99=%8.1fus  "
+         "max=%8.1fus  idle_wakeups/s=%.1f\n",
+         name, c->received, (double)sum / c->received / 1000.0,
+         c->latencies_ns[c->received / 2] / 1000.0,
+         c->latencies_ns[(c->received * 99) / 100] / 1000.0,
+         c->latencies_ns[c->received - 1] / 1000.0,
+         (double)c->loop_iterations / idle_s);
+}
+
+static void run_case(const char *name, int messages, int idle_seconds,
+                     void (*loop)(int, Consumer *)) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+
+  Consumer c;
+  memset(&c, 0, sizeof(c));
+  c.expected = messages;
+  c.latencies_ns = calloc((size_t)messages, sizeof(uint64_t));
+
+  Producer p = {.fd = sv[0], .count = messages};
+  pthread_t tid;
+  pthread_create(&tid, NULL, producer_main, &p);
+
+  // The idle window starts after the last message is expected to arrive
+  c.idle_until_ns = now_ns() +
+                    (uint64_t)messages * (SEND_SPACING_US * 2) * 1000ULL +
+                    (uint64_t)idle_seconds * 1000000000ULL;
+  loop(sv[1], &c);
+  pthread_join(tid, NULL);
+
+  report(name, &c);
+  free(c.latencies_ns);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(int argc, char **argv) {
+  int messages = argc > 1 ? atoi(argv[1]) : 200;
+  int idle_seconds = argc > 2 ? atoi(argv[2]) : 3;
+  if (messages <= 0 || idle_seconds <= 0) {
+    fprintf(stderr, "usage: %s [messages] [idle_seconds]\n", argv[0]);
+    return 1;
+  }
+
+  printf("IPC delivery latency, %d messages, %d s idle window\n", messages,
+         idle_seconds);
+  run_case("sleep-poll", messages, idle_seconds, run_sleep_poll);
+  run_case("reactor", messages, idle_seconds, run_reactor);
+  return 0;
+}
@@ -0,0 +1,302 @@
+// Benchmark and stress test: the lock-free SlabPool shared between threads,
+// the way the mqtt-client's main loop and Paho's callback thread share it.
+//
+// 1. Stress: every thread acquires a slab, claims it, stamps it, and swaps
+//    it into a random mailbox for whichever thread comes by next; the slab
+//    it gets back out is checked and released. So slabs are mostly released
+//    by a thread other than the one that acquired them, and the pool is
+//    small enough to run empty. Any slab handed to two threads at once, any
+//    stamp that doesn't survive the handoff, or any slab missing from the
+//    pool at the end is a failure (exit status 1). Each thread also works
+//    in its arena_thread(), which must be its own.
+// 2. Contention: acquire + release pairs per thread, from 1 to N threads
+//    at once, for the Treiber pool against a SlabStack behind a mutex.
+//
+// Usage: bench_slab_pool [operations per thread] [threads] [pool slabs]
+
+#define MODULE_NAME "BENCH"
+#define SLABPOOL_IMPLEMENTATION
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../include/slabpool.h"
+#include "../../include/sockclient.h"
+
+#define MAILBOXES 16
+#define MAX_THREADS 16
+
+// What a thread writes into a slab it holds
+typedef struct {
+  uint32_t claimed; // 1 while some thread holds the slab
+  uint32_t owner;
+  uint64_t seq;
+  uint64_t check; // derived from the two above
+} Stamp;
+
+typedef struct {
+  SlabPool *pool;
+  Slab **mailboxes;
+  int index;
+  int ops;
+  pthread_barrier_t *start;
+
+  // results
+  uint64_t failures;
+  uint64_t empty; // acquires that had to wait for a slab
+  Arena *arena;
+} Worker;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t stamp_check(uint32_t owner, uint64_t seq) {
+  return (seq * 0x9E3779B97F4A7C15ull) ^ owner;
+}
+
+static bool check_and_unclaim(Slab *s) {
+  Stamp *st = (Stamp *)s->sArena.buffer;
+  bool ok = st->check == stamp_check(st->owner, st->seq) &&
+            s->id == (int)st->owner;
+  // Released as claimed: anyone else claiming it meanwhile shows up here
+  ok &= __atomic_exchange_n(&st->claimed, 0, __ATOMIC_RELAXED) == 1;
+  return ok;
+}
+
+// With the pool empty, the slabs are all in mailboxes or on their way
+static void drain_one(Worker *w, uint32_t from) {
+  for (uint32_t b = 0; b < MAILBOXES; b++) {
+    Slab **box = &w->mailboxes[(from + b) % MAILBOXES];
+    Slab *got = __atomic_exchange_n(box, NULL, __ATOMIC_ACQ_REL);
+    if (got != NULL) {
+      if (!check_and_unclaim(got)) {
+        w->failures++;
+      }
+      slab_pool_release(w->pool, got);
+      return;
+    }
+  }
+}
+
+static void *stress(void *arg) {
+  Worker *w = arg;
+  uint32_t seed = (uint32_t)w->index * 2654435761u + 1;
+  w->arena = arena_thread();
+  pthread_barrier_wait(w->start);
+
+  for (int i = 0; i < w->ops; i++) {
+    Slab *s;
+    while ((s = slab_pool_acquire(w->pool, w->index)) == NULL) {
+      w->empty++;
+      drain_one(w, seed);
+    }
+    // Not zeroed: the claim of whoever held it last has to show
+    Stamp *st = arena_alloc_nozero(&s->sArena, sizeof(Stamp));
+    if (st != (Stamp *)s->sArena.buffer ||
+        __atomic_exchange_n(&st->claimed, 1, __ATOMIC_RELAXED) != 0) {
+      w->failures++; // not reset, or someone else holds it
+    }
+    st->owner = (uint32_t)w->index;
+    st->seq = (uint64_t)i;
+    st->check = stamp_check(st->owner, st->seq);
+
+    // Scratch that only this thread touches
+    ArenaMark m = arena_save(w->arena);
+    uint32_t *scratch = arena_alloc_nozero(w->arena, 64 * sizeof(uint32_t));
+    for (int k = 0; k < 64; k++) {
+      scratch[k] = (uint32_t)(w->index + k);
+    }
+    if (scratch[63] != (uint32_t)(w->index + 63)) {
+      w->failures++;
+    }
+    arena_restore(m);
+
+    seed = seed * 1103515245u + 12345u;
+    Slab **box = &w->mailboxes[(seed >> 16) % MAILBOXES];
+    Slab *got = __atomic_exchange_n(box, s, __ATOMIC_ACQ_REL);
+    if (got != NULL) {
+      if (!check_and_unclaim(got)) {
+        w->failures++;
+      }
+      slab_pool_release(w->pool, got);
+    }
+  }
+  return NULL;
+}
+
+// 2. contention
+
+typedef struct {
+  SlabStack *stack;
+  pthread_mutex_t lock;
+} LockedStack;
+
+typedef struct {
+  SlabPool *pool;
+  LockedStack *locked; // NULL: the pool
+  int ops;
+  pthread_barrier_t *start;
+  uint64_t ns;
+} Hammer;
+
+static void *hammer(void *arg) {
+  Hammer *h = arg;
+  pthread_barrier_wait(h->start);
+  uint64_t t0 = now_ns();
+  for (int i = 0; i < h->ops; i++) {
+    Slab *s;
+    if (h->locked == NULL) {
+      while ((s = slab_pool_acquire(h->pool, i)) == NULL) {
+      }
+      ((volatile uint8_t *)s->sArena.buffer)[0] = (uint8_t)i;
+      slab_pool_release(h->pool, s);
+    } else {
+      for (;;) {
+        pthread_mutex_lock(&h->locked->lock);
+        s = h->locked->stack->count > 0
+                ? arena_slab_stack_pop(h->locked->stack)
+                : NULL;
+        pthread_mutex_unlock(&h->locked->lock);
+        if (s != NULL) {
+          break;
+        }
+      }
+      ((volatile uint8_t *)s->sArena.buffer)[0] = (uint8_t)i;
+      pthread_mutex_lock(&h->locked->lock);
+      arena_slab_stack_push(h->locked->stack, s);
+      pthread_mutex_unlock(&h->locked->lock);
+    }
+  }
+  h->ns = now_ns() - t0;
+  return NULL;
+}
+
+static double run_hammer(SlabPool *pool, LockedStack *locked, int threads,
+                         int ops) {
+  pthread_t tids[MAX_THREADS];
+  Hammer hs[MAX_THREADS];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, (unsigned)threads);
+  for (int t = 0; t < threads; t++) {
+    hs[t] = (Hammer){.pool = pool, .locked = locked, .ops = ops,
+                     .start = &start};
+    pthread_create(&tids[t], NULL, hammer, &hs[t]);
+  }
+  uint64_t ns = 0;
+  for (int t = 0; t < threads; t++) {
+    pthread_join(tids[t], NULL);
+    ns += hs[t].ns;
+  }
+  pthread_barrier_destroy(&start);
+  return (double)ns / ((double)ops * threads);
+}
+
+int main(int argc, char **argv) {
+  int ops = argc > 1 ? atoi(argv[1]) : 1000000;
+  int threads = argc > 2 ? atoi(argv[2]) : 2; // the main loop and Paho
+  int slabs = argc > 3 ? atoi(argv[3]) : 8;
+  if (ops <= 0 || threads < 1 || threads > MAX_THREADS || slabs < 1) {
+    fprintf(stderr, "at least one operation, 1 to %d threads, one slab\n",
+            MAX_THREADS);
+    return 1;
+  }
+
+  static uint8_t memory[4 * 1024 * 1024];
+  Arena parent;
+  arena_init(&parent, memory, sizeof(memory));
+  SlabPool pool;
+  if (slab_pool_init(&pool, &parent, (uint32_t)slabs, sizeof(IPCMessage)) !=
+      0) {
+    return 1;
+  }
+
+  // 1. stress
+  Slab *mailboxes[MAILBOXES] = {0};
+  pthread_t tids[MAX_THREADS];
+  Worker ws[MAX_THREADS];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, (unsigned)threads);
+  uint64_t t0 = now_ns();
+  for (int t = 0; t < threads; t++) {
+    ws[t] = (Worker){.pool = &pool, .mailboxes = mailboxes, .index = t,
+                     .ops = ops, .start = &start};
+    pthread_create(&tids[t], NULL, stress, &ws[t]);
+  }
+  uint64_t failures = 0, empty = 0;
+  for (int t = 0; t < threads; t++) {
+    pthread_join(tids[t], NULL);
+    failures += ws[t].failures;
+    empty += ws[t].empty;
+    for (int u = 0; u < t; u++) {
+      if (ws[t].arena == NULL || ws[t].arena == ws[u].arena) {
+        fprintf(stderr, "threads %d and %d share an arena\n", u, t);
+        failures++;
+      }
+    }
+  }
+  double stress_ns = (double)(now_ns() - t0) / ops;
+  pthread_barrier_destroy(&start);
+  for (int b = 0; b < MAILBOXES; b++) {
+    if (mailboxes[b] != NULL) {
+      failures += !check_and_unclaim(mailboxes[b]);
+      slab_pool_release(&pool, mailboxes[b]);
+    }
+  }
+
+  // Everything is back, exactly once
+  uint8_t *seen = calloc((size_t)slabs, 1);
+  int back = 0;
+  Slab *s;
+  while ((s = slab_pool_acquire(&pool, 0)) != NULL) {
+    size_t slot = (size_t)((uint8_t *)s - pool.base) / pool.stride;
+    failures += seen[slot]++ != 0;
+    back++;
+  }
+  failures += back != slabs;
+  free(seen);
+  fprintf(stderr,
+          "stress: %d threads x %d ops, %d slabs: %.1f ns per round, "
+          "%llu CAS retries, %llu empty, %d/%d slabs back, %llu failures\n",
+          threads, ops, slabs, stress_ns,
+          (unsigned long long)pool.contended, (unsigned long long)empty, back,
+          slabs, (unsigned long long)failures);
+  if (failures > 0) {
+    return 1;
+  }
+
+  // 2. contention, on a fresh pool
+  arena_reset(&parent);
+  if (slab_pool_init(&pool, &parent, (uint32_t)slabs, sizeof(IPCMessage)) !=
+      0) {
+    return 1;
+  }
+  LockedStack locked = {.stack = arena_slab_stack_create(&parent, slabs)};
+  pthread_mutex_init(&locked.lock, NULL);
+  for (int i = 0; i < slabs; i++) {
+    Slab *ls = arena_create_slab(&parent, sizeof(IPCMessage), i);
+    if (ls == NULL) {
+      return 1;
+    }
+    arena_slab_stack_push(locked.stack, ls);
+  }
+  // 1, 2, 4... threads, ending on the count asked for
+  for (int t = 1;; t = t * 2 < threads ? t * 2 : threads) {
+    double treiber = run_hammer(&pool, NULL, t, ops);
+    double mutex = run_hammer(NULL, &locked, t, ops);
+    fprintf(stderr,
+            "%2d threads: treiber %6.1f ns, mutex %6.1f ns per acquire + "
+            "release\n",
+            t, treiber, mutex);
+    if (t == threads) {
+      break;
+    }
+  }
+  pthread_mutex_destroy(&locked.lock);
+  return 0;
+}
@@ -0,0 +1,205 @@
+// Benchmark: state transitions run as a dependency graph by the controller's
+// transition engine, with sleeps standing in for the services.
+//
+// The services: ids (0.20 s to start), sensor (0.10 s, after ids), honeypot
+// (0.15 s) and listener (a module), 0.05 s each to stop. The firewall is
+// answered at once by a stub. Closed <-> Honeypot is cycled, and for every
+// transition the wall time is printed with
+// - sequential: the sum of the steps, what one after the other would cost
+// - critical:   the longest chain of dependent steps, the least it can cost
+//
+// The same cycle again in hot standby: the services stay up in every
+// state, so only the listener and the firewall change.
+//
+// Then two transitions that must fail and roll back:
+// - broken:  a start command exits 1
+// - timeout: a start command outlives its timeout and is killed
+// Both must end back in Closed with nothing up.
+//
+// Usage: bench_transition [cycles]
+
+#define MODULE_NAME "BENCH"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../controller/transition.h"
+
+// transition.h already pulled in the declarations; this emits the definitions
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
+enum { IDS, SENSOR, HONEYPOT, LISTENER };
+#define BIT(i) (1u << (i))
+
+static const char *const ids_start[] = {"sleep", "0.2", NULL};
+static const char *const sensor_start[] = {"sleep", "0.1", NULL};
+static const char *const honeypot_start[] = {"sleep", "0.15", NULL};
+static const char *const stop[] = {"sleep", "0.05", NULL};
+static const char *const broken_start[] = {"sh", "-c", "sleep 0.05; exit 1",
+                                           NULL};
+static const char *const hung_start[] = {"sleep", "10", NULL};
+
+static const ServiceDef services[] = {
+    [IDS] = {"ids", SVC_EXEC, ids_start, stop, 0, 0, 0, 2000},
+    [SENSOR] = {"sensor", SVC_EXEC, sensor_start, stop, 0, 0, BIT(IDS), 2000},
+    [HONEYPOT] = {"honeypot", SVC_EXEC, honeypot_start, stop, 0, 0, 0, 2000},
+    [LISTENER] = {"listener", SVC_MODULE, NULL, NULL, 0, MOD_LISTENER, 0,
+                  1000},
+};
+
+static const uint32_t wanted[STATE_COUNT] = {
+    [STATE_CLOSED] = 0,
+    [STATE_PASSIVE_LISTEN] = BIT(IDS) | BIT(SENSOR) | BIT(LISTENER),
+    [STATE_HONEYPOT] = BIT(IDS) | BIT(SENSOR) | BIT(HONEYPOT) | BIT(LISTENER),
+    [STATE_DEVELOPMENT] = 0,
+};
+
+typedef struct {
+  Transition *t;
+  Reactor *reactor;
+  int failures; // transitions that failed, rollbacks aside
+  uint64_t total_us, critical_us, sum_us;
+} Bench;
+
+// The firewall answers at once; the engine takes replies from inside sends
+static int stub_send(void *userdata, ModuleID dest, const IPCMessage *msg) {
+  Bench *b = (Bench *)userdata;
+  if (msg->msgtype == MSG_CMD_SET_STATE) {
+    IPCMessage reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.origin = MOD_FIREWALL;
+    reply.msgtype = MSG_EVT_STATE_DONE;
+    reply.payload.state_done.state = msg->payload.state.state;
+    transition_on_message(b->t, &reply);
+  }
+  return 0;
+}
+
+static void on_done(void *userdata, const Transition *t) {
+  Bench *b = (Bench *)userdata;
+  b->total_us = t->ended_us - t->started_us;
+  b->critical_us = transition_critical_us(t);
+  b->sum_us = 0;
+  for (size_t i = 0; i < t->step_count; i++) {
+    b->sum_us += transition_step_us(&t->steps[i]);
+  }
+  if (t->status != 0 && !t->rollback) {
+    b->failures++;
+    printf("  %u -> %u failed at %s (%s), rolling back\n", t->from, t->to,
+           transition_step_name(t, &t->steps[t->failed_step]),
+           strerror(-t->status));
+    return; // the rollback starts next
+  }
+  reactor_stop(b->reactor);
+}
+
+static int run(Bench *b, SystemState to) {
+  if (transition_start(b->t, to) != 0) {
+    fprintf(stderr, "transition to %d refused\n", to);
+    return -1;
+  }
+  // Nothing to wait for when every step was done at once
+  if (b->t->active) {
+    reactor_run(b->reactor);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int cycles = argc > 1 ? atoi(argv[1]) : 5;
+
+  Reactor reactor;
+  static Transition t;
+  Bench b = {.t = &t, .reactor = &reactor};
+  if (reactor_init(&reactor) != 0 ||
+      transition_init(&t, &reactor, services,
+                      sizeof(services) / sizeof(services[0]), wanted,
+                      stub_send, on_done, &b) != 0) {
+    return 1;
+  }
+
+  uint64_t wall[2] = {0}, seq[2] = {0}, crit[2] = {0};
+  for (int c = 0; c < cycles; c++) {
+    for (int up = 1; up >= 0; up--) {
+      if (run(&b, up ? STATE_HONEYPOT : STATE_CLOSED) != 0 || t.status != 0) {
+        return 1;
+      }
+      wall[up] += b.total_us;
+      seq[up] += b.sum_us;
+      crit[up] += b.critical_us;
+    }
+  }
+  static const char *const names[] = {"honeypot -> closed",
+                                      "closed -> honeypot"};
+  for (int up = 1; up >= 0; up--) {
+    printf("%s: %.1f ms (sequential %.1f ms, critical path %.1f ms), "
+           "average of %d\n",
+           names[up], wall[up] / 1e3 / cycles, seq[up] / 1e3 / cycles,
+           crit[up] / 1e3 / cycles, cycles);
+  }
+
+  // Hot standby: warm up with Closed -> Closed, cycle, then back to cold
+  for (int s = 0; s < STATE_COUNT; s++) {
+    t.wanted[s] |= BIT(IDS) | BIT(SENSOR) | BIT(HONEYPOT);
+  }
+  if (run(&b, STATE_CLOSED) != 0 || t.status != 0) {
+    return 1;
+  }
+  printf("standby warm-up: %.1f ms\n", b.total_us / 1e3);
+  memset(wall, 0, sizeof(wall));
+  for (int c = 0; c < cycles; c++) {
+    for (int up = 1; up >= 0; up--) {
+      if (run(&b, up ? STATE_HONEYPOT : STATE_CLOSED) != 0 || t.status != 0) {
+        return 1;
+      }
+      wall[up] += b.total_us;
+    }
+  }
+  for (int up = 1; up >= 0; up--) {
+    printf("%s in standby: %.3f ms, average of %d\n", names[up],
+           wall[up] / 1e3 / cycles, cycles);
+  }
+  memcpy(t.wanted, wanted, sizeof(wanted));
+  if (run(&b, STATE_CLOSED) != 0 || t.status != 0 || t.up != 0) {
+    return 1;
+  }
+
+  // Failures: the honeypot won't come up, the rest must go back down
+  static ServiceDef faulty[sizeof(services) / sizeof(services[0])];
+  memcpy(faulty, services, sizeof(services));
+  t.services = faulty;
+
+  faulty[HONEYPOT].start_argv = broken_start;
+  printf("broken:\n");
+  if (run(&b, STATE_HONEYPOT) != 0) {
+    return 1;
+  }
+  printf("  back in %u after %.1f ms, %s, services up: 0x%x\n", t.state,
+         (t.ended_us - t.started_us) / 1e3, t.status == 0 ? "ok" : "failed",
+         t.up);
+  if (b.failures != 1 || t.state != STATE_CLOSED || t.up != 0) {
+    return 1;
+  }
+
+  faulty[HONEYPOT].start_argv = hung_start;
+  faulty[HONEYPOT].timeout_ms = 300;
+  printf("timeout:\n");
+  if (run(&b, STATE_HONEYPOT) != 0) {
+    return 1;
+  }
+  printf("  back in %u after %.1f ms, %s, services up: 0x%x\n", t.state,
+         (t.ended_us - t.started_us) / 1e3, t.status == 0 ? "ok" : "failed",
+         t.up);
+  if (b.failures != 2 || t.state != STATE_CLOSED || t.up != 0) {
+    return 1;
+  }
+
+  printf("%llu transitions, %llu failed, %llu rolled back\n",
+         (unsigned long long)t.transitions, (unsigned long long)t.failures,
+         (unsigned long long)t.rollbacks);
+  transition_close(&t);
+  reactor_close(&reactor);
+  return 0;
+}
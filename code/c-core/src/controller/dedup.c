@@ -0,0 +1,303 @@
+#define MODULE_NAME "DEDUP"
+
+#include <string.h>
+
+#include "dedup.h"
+#include "openaddr.h"
+
+#define DEDUP_TOKEN 1000 // one alert, in bucket units
+
+// ---- hash table ----
+
+static uint32_t dedup_hash(const uint8_t ip[16], uint32_t sig) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < 16; i++) {
+    h = (h ^ ip[i]) * 16777619u;
+  }
+  for (size_t i = 0; i < 4; i++) {
+    h = (h ^ ((sig >> (i * 8)) & 0xff)) * 16777619u;
+  }
+  return h;
+}
+
+static bool dedup_match(const DedupEntry *e, const uint8_t ip[16],
+                        uint8_t ip_version, uint32_t sig) {
+  return e->signature_id == sig && e->ip_version == ip_version &&
+         memcmp(e->src_ip, ip, 16) == 0;
+}
+
+// ---- LRU list ----
+
+static void dedup_unlink(DedupTable *t, uint32_t i) {
+  DedupEntry *e = &t->slots[i];
+  if (e->prev != DEDUP_NIL) {
+    t->slots[e->prev].next = e->next;
+  } else {
+    t->lru_head = e->next;
+  }
+  if (e->next != DEDUP_NIL) {
+    t->slots[e->next].prev = e->prev;
+  } else {
+    t->lru_tail = e->prev;
+  }
+}
+
+static void dedup_push_front(DedupTable *t, uint32_t i) {
+  DedupEntry *e = &t->slots[i];
+  e->prev = DEDUP_NIL;
+  e->next = t->lru_head;
+  if (t->lru_head != DEDUP_NIL) {
+    t->slots[t->lru_head].prev = i;
+  } else {
+    t->lru_tail = i;
+  }
+  t->lru_head = i;
+}
+
+// Points the neighbours of the entry now stored in slot i back at it
+static void dedup_relink(DedupTable *t, uint32_t i) {
+  DedupEntry *e = &t->slots[i];
+  if (e->prev != DEDUP_NIL) {
+    t->slots[e->prev].next = i;
+  } else {
+    t->lru_head = i;
+  }
+  if (e->next != DEDUP_NIL) {
+    t->slots[e->next].prev = i;
+  } else {
+    t->lru_tail = i;
+  }
+}
+
+typedef struct {
+  uint32_t hash;
+  const uint8_t *ip;
+  uint8_t ip_version;
+  uint32_t sig;
+} DedupKey;
+
+static bool dedup_slot_used(const void *e) {
+  return ((const DedupEntry *)e)->used;
+}
+
+static bool dedup_slot_match(const void *e, const void *key) {
+  const DedupEntry *d = e;
+  const DedupKey *k = key;
+  return d->hash == k->hash && dedup_match(d, k->ip, k->ip_version, k->sig);
+}
+
+static uint64_t dedup_slot_hash(const void *t, const void *e) {
+  return ((const DedupEntry *)e)->hash;
+}
+
+static void dedup_slot_moved(void *t, size_t to) {
+  dedup_relink(t, (uint32_t)to);
+}
+
+static const OpenAddrOps dedup_ops = {
+    .entry_size = sizeof(DedupEntry),
+    .used = dedup_slot_used,
+    .match = dedup_slot_match,
+    .hash = dedup_slot_hash,
+    .moved = dedup_slot_moved,
+};
+
+// Returns the slot holding the key, or the empty slot ending its probe chain
+static size_t dedup_probe(const DedupTable *t, uint32_t hash,
+                          const uint8_t ip[16], uint8_t ip_version,
+                          uint32_t sig) {
+  DedupKey key = {hash, ip, ip_version, sig};
+  return openaddr_probe(&dedup_ops, t->slots, t->capacity, hash, &key);
+}
+
+// The entries shifted back into the hole keep their place in the LRU list
+static void dedup_remove(DedupTable *t, size_t i) {
+  dedup_unlink(t, (uint32_t)i);
+  openaddr_remove(&dedup_ops, t, t->slots, t->capacity, i);
+  t->count--;
+}
+
+static void dedup_report(DedupTable *t, DedupEntry *e) {
+  if (t->summary != NULL) {
+    t->summary(t->userdata, e);
+  }
+  t->summaries++;
+  e->suppressed = 0;
+}
+
+static void dedup_evict(DedupTable *t) {
+  DedupEntry *e = &t->slots[t->lru_tail];
+  if (e->suppressed > 0) {
+    // Its count would be lost with it: report what we have now
+    dedup_report(t, e);
+    t->evicted_pending++;
+  }
+  t->evictions++;
+  dedup_remove(t, t->lru_tail);
+}
+
+// Finds or creates the entry for a key and marks it most recently used
+static size_t dedup_touch(DedupTable *t, const uint8_t ip[16],
+                          uint8_t ip_version, uint32_t sig, uint32_t burst,
+                          uint64_t now_ms) {
+  uint32_t hash = dedup_hash(ip, sig);
+  size_t i = dedup_probe(t, hash, ip, ip_version, sig);
+
+  if (!t->slots[i].used) {
+    if (t->count == t->cfg.max_entries) {
+      dedup_evict(t);
+      // The shift may have moved the end of our probe chain
+      i = dedup_probe(t, hash, ip, ip_version, sig);
+    }
+
+    DedupEntry *e = &t->slots[i];
+    memcpy(e->src_ip, ip, 16);
+    e->signature_id = sig;
+    e->hash = hash;
+    e->used = 1;
+    e->ip_version = ip_version;
+    e->tokens = burst * DEDUP_TOKEN;
+    e->refill_ms = now_ms;
+    t->count++;
+  } else {
+    dedup_unlink(t, (uint32_t)i);
+  }
+
+  t->slots[i].seen_ms = now_ms;
+  dedup_push_front(t, (uint32_t)i);
+  return i;
+}
+
+// ---- token buckets ----
+
+static bool dedup_take(DedupEntry *e, uint32_t rate, uint32_t burst,
+                       uint64_t now_ms) {
+  // rate is per minute, so this is thousandths of an alert gained per ms.
+  // The clock only moves on once something was gained, so slow rates still
+  // add up between closely spaced alerts.
+  uint64_t gained = (now_ms - e->refill_ms) * rate / 60;
+  if (gained > 0) {
+    uint64_t tokens = e->tokens + gained;
+    uint64_t cap = (uint64_t)burst * DEDUP_TOKEN;
+    e->tokens = (uint32_t)(tokens < cap ? tokens : cap);
+    e->refill_ms = now_ms;
+  }
+
+  if (e->tokens < DEDUP_TOKEN) {
+    return false;
+  }
+  e->tokens -= DEDUP_TOKEN;
+  return true;
+}
+
+static void dedup_suppress(DedupEntry *e, const PayloadIDSAlert *alert) {
+  if (e->suppressed == 0) {
+    e->first_ms = alert->event_ms;
+  }
+  e->last_ms = alert->event_ms;
+  e->severity = alert->severity;
+  e->suppressed++;
+}
+
+// ---- public API ----
+
+int dedup_init(DedupTable *t, Arena *a, const DedupConfig *cfg,
+               DedupSummaryFn summary, void *userdata) {
+  if (t == NULL || a == NULL || cfg == NULL || cfg->max_entries < 2 ||
+      cfg->max_entries >= DEDUP_NIL / 2 || cfg->pair_burst == 0 ||
+      (cfg->src_rate > 0 && cfg->src_burst == 0)) {
+    LOG_ERROR("Invalid arguments to dedup_init");
+    return -1;
+  }
+
+  memset(t, 0, sizeof(DedupTable));
+  t->cfg = *cfg;
+  t->summary = summary;
+  t->userdata = userdata;
+  t->lru_head = DEDUP_NIL;
+  t->lru_tail = DEDUP_NIL;
+
+  t->capacity = openaddr_capacity(cfg->max_entries);
+  t->slots = ARENA_NEW_ARRAY(a, DedupEntry, t->capacity);
+  if (t->slots == NULL) {
+    LOG_ERROR("Not enough memory for %zu dedup entries", cfg->max_entries);
+    return -1;
+  }
+  return 0;
+}
+
+bool dedup_check(DedupTable *t, const PayloadIDSAlert *alert, uint64_t now_ms) {
+  const DedupConfig *cfg = &t->cfg;
+  t->seen++;
+
+  size_t i = dedup_touch(t, alert->src_ip, alert->ip_version,
+                         alert->signature_id, cfg->pair_burst, now_ms);
+  if (t->summary_only && alert->severity != 1) {
+    dedup_suppress(&t->slots[i], alert);
+    t->shed_suppressed++;
+    return false;
+  }
+  if (!dedup_take(&t->slots[i], cfg->pair_rate, cfg->pair_burst, now_ms)) {
+    dedup_suppress(&t->slots[i], alert);
+    t->dup_suppressed++;
+    return false;
+  }
+
+  if (cfg->src_rate > 0 && alert->signature_id != 0) {
+    size_t s = dedup_touch(t, alert->src_ip, alert->ip_version, 0,
+                           cfg->src_burst, now_ms);
+    if (!dedup_take(&t->slots[s], cfg->src_rate, cfg->src_burst, now_ms)) {
+      // Creating the source entry may have shifted the pair: look it up again
+      i = dedup_probe(t, dedup_hash(alert->src_ip, alert->signature_id),
+                      alert->src_ip, alert->ip_version, alert->signature_id);
+      dedup_suppress(&t->slots[i], alert);
+      t->rate_suppressed++;
+      return false;
+    }
+  }
+
+  t->passed++;
+  return true;
+}
+
+size_t dedup_flush(DedupTable *t, uint64_t now_ms) {
+  size_t reported = 0;
+
+  for (size_t i = 0; i < t->capacity;) {
+    DedupEntry *e = &t->slots[i];
+    if (!e->used) {
+      i++;
+      continue;
+    }
+
+    if (e->suppressed > 0) {
+      dedup_report(t, e);
+      reported++;
+    }
+
+    if (now_ms - e->seen_ms >= t->cfg.idle_ms) {
+      dedup_remove(t, i);
+      t->expired++;
+      continue; // another entry may have shifted into slot i
+    }
+    i++;
+  }
+  return reported;
+}
+
+void dedup_log_stats(const DedupTable *t) {
+  LOG_INFO("alerts seen=%llu passed=%llu suppressed=%llu (repeats=%llu "
+           "rate=%llu shed=%llu) summaries=%llu",
+           (unsigned long long)t->seen, (unsigned long long)t->passed,
+           (unsigned long long)(t->dup_suppressed + t->rate_suppressed +
+                                t->shed_suppressed),
+           (unsigned long long)t->dup_suppressed,
+           (unsigned long long)t->rate_suppressed,
+           (unsigned long long)t->shed_suppressed,
+           (unsigned long long)t->summaries);
+  LOG_INFO("entries=%zu/%zu evictions=%llu (%llu with pending summaries) "
+           "expired=%llu",
+           t->count, t->cfg.max_entries, (unsigned long long)t->evictions,
+           (unsigned long long)t->evicted_pending,
+           (unsigned long long)t->expired);
+}
@@ -0,0 +1,129 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+/* ==========================================================================
+ *  Orange Sentry - IDS Alert Deduplication
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Sits between the IDS modules and MQTT. A scanner can fire the same
+ *  signature thousands of times a minute; only the first few of those are
+ *  worth a publish, the rest are counted and reported later as one
+ *  "N repeats suppressed" summary.
+ *
+ *  Every (source address, signature) pair has a token bucket: a burst of
+ *  alerts goes through, then at most rate per minute. On top of that, each
+ *  source address has its own bucket across all signatures, so a host
+ *  tripping many different rules is limited too. Alerts refused by either
+ *  bucket are added to the pair's suppression counter.
+ *
+ *  Memory is fixed: one open-addressing table (linear probing, backward
+ *  shift deletion) allocated from an Arena at init. Entries are kept on an
+ *  LRU list; when the table is full the least recently seen entry is evicted,
+ *  after its pending summary is published. Source buckets are stored in the
+ *  same table, with signature id 0 (Suricata never uses it).
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. dedup_init() with the limits and a summary callback.
+ *  2. dedup_check() for every alert; forward it only if it returns true.
+ *  3. dedup_flush() on a timer to publish summaries and drop idle entries.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "sockclient.h"
+
+#define DEDUP_NIL UINT32_MAX
+
+typedef struct {
+  uint8_t src_ip[16];
+  uint32_t signature_id; // 0: the bucket shared by every signature
+  uint32_t hash;
+  uint8_t used;
+  uint8_t ip_version;
+  uint8_t severity;
+  uint8_t reserved;
+
+  uint32_t tokens;     // thousandths of an alert
+  uint32_t suppressed; // since the last summary
+  uint32_t prev;       // LRU list, most recent first
+  uint32_t next;
+
+  uint64_t refill_ms; // monotonic
+  uint64_t seen_ms;   // monotonic, last alert
+  uint64_t first_ms;  // event time of the first suppressed alert
+  uint64_t last_ms;   // event time of the last suppressed alert
+} DedupEntry;
+
+typedef struct {
+  size_t max_entries; // pairs and sources together, at least 2
+  uint32_t pair_rate; // alerts per minute per (source, signature)
+  uint32_t pair_burst;
+  uint32_t src_rate; // alerts per minute per source, 0 for no limit
+  uint32_t src_burst;
+  uint64_t idle_ms; // entries with nothing pending are dropped after this
+} DedupConfig;
+
+/* *
+ * Called with an entry whose suppressed alerts should be reported.
+ */
+typedef void (*DedupSummaryFn)(void *userdata, const DedupEntry *e);
+
+typedef struct {
+  DedupEntry *slots;
+  size_t capacity; // power of two, at least twice max_entries
+  size_t count;
+  uint32_t lru_head;
+  uint32_t lru_tail;
+  DedupConfig cfg;
+
+  DedupSummaryFn summary;
+  void *userdata;
+  // Load shedding: every alert but severity 1 goes to the summaries
+  bool summary_only;
+
+  // counters
+  uint64_t seen;
+  uint64_t passed;
+  uint64_t dup_suppressed;  // refused by the pair bucket
+  uint64_t rate_suppressed; // refused by the source bucket
+  uint64_t shed_suppressed; // held back by summary_only
+  uint64_t summaries;
+  uint64_t evictions;
+  uint64_t evicted_pending; // evictions that forced an early summary
+  uint64_t expired;
+} DedupTable;
+
+/* *
+ * Allocates the table from a.
+ * * Returns:
+ * 0 on success, -1 on invalid limits or if the arena is too small.
+ */
+int dedup_init(DedupTable *t, Arena *a, const DedupConfig *cfg,
+               DedupSummaryFn summary, void *userdata);
+
+/* *
+ * Accounts for one alert. now_ms is a monotonic clock.
+ * * Returns:
+ * true if the alert should be forwarded, false if it was suppressed.
+ */
+bool dedup_check(DedupTable *t, const PayloadIDSAlert *alert, uint64_t now_ms);
+
+/* *
+ * Reports every pending suppression and drops entries idle for longer than
+ * the configured idle time.
+ * * Returns:
+ * Number of summaries reported.
+ */
+size_t dedup_flush(DedupTable *t, uint64_t now_ms);
+
+/* *
+ * Logs the counters.
+ */
+void dedup_log_stats(const DedupTable *t);
+
+#endif // DEDUP_H
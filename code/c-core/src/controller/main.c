@@ -1,148 +1,762 @@
-#include <stdio.h>
+// Global defines
+#define MODULE_NAME "CONTROLLER"
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include "../../include-shr/arena.h"
-#include "../../include-shr/exit-codes.h"
+#include <time.h>
+#include <unistd.h>
+
+#include "../../include/arena.h"
+#include "../../include/exit-codes.h"
+#include "../../include/logging.h"
+
+#include "dedup.h"
+#include "router.h"
+#include "shed.h"
+#include "standby.h"
+#include "transition.h"
+
+// Before the IPC definitions: records.h includes sockclient.h for the types
+#define RECORDS_IMPLEMENTATION
+#include "../../include/records.h"
+
+// router.h already pulled in the declarations; this emits the definitions
+#define SOCK_IPC_IMPLEMENTATION
+#include "../../include/sockclient.h"
+
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
+#define BUF_SIZE 64
+#define ARENA_SIZE (768 * 1024) // router backlogs (~46 KiB a module), dedup
+static uint8_t controller_memory[ARENA_SIZE];
 
-#define BUF_SIZE 64 
+// IDS alerts leaving the box: the first few of each kind as RECORD_ALERT,
+// then JSON summaries of the rest
+#define TOPIC_IDS_ALERT "/ids/alert"
+#define TOPIC_IDS_SUPPRESSED "/ids/suppressed"
+// Connection attempts seen by the passive listener, one RECORD_PROBE per
+// 5-tuple flow
+#define TOPIC_PROBE "/listen/probe"
+// The sysstats module's samples, one RECORD_TELEMETRY each. values[]:
+//   0 cpu busy, 1-2 busy of cores 0-3 and 4-7 (16 bits each, core 0 lowest),
+//   3 iowait, 4 softirq (all permille), 5 temperature in millikelvin (0: no
+//   sensor), 6 MemTotal, 7 MemAvailable (kB), 8 load 1/5/15 min x100 (16
+//   bits each), 9 rx bytes/s, 10 tx bytes/s, 11 rx packets/s, 12 rx drops/s,
+//   13 NET_RX softirqs/s, 14 NET_TX softirqs/s, 15 the sampler's own CPU
+//   (millionths of a core)
+#define TOPIC_SYSSTATS "/system/stats"
 
-typedef enum {
-    STATE_CLOSED = 0,
-    STATE_PASSIVE_LISTEN,
-    STATE_HONEYPOT,
-    STATE_DEVELOPMENT
-} SystemState;
+// Load shedding, decided on every system stats sample; see shed.h for the
+// levels. The H616 throttles from about 80 C. The queue is the fullest
+// outbound backlog, a module's or MQTT's, in permille of ROUTER_QUEUE_LEN.
+// Every decision is published on /system/shed; probes held back at
+// SHED_SUMMARY are counted on /listen/summary with the alert summaries.
+#define TOPIC_SHED "/system/shed"
+#define TOPIC_PROBE_SUMMARY "/listen/summary"
+#define SHED_SAMPLE_RATE 8 // sources per source tracked at SHED_SAMPLE
+static const ShedConfig shed_config = {
+    .metrics =
+        {
+            [SHED_TEMP] = {.enter = {0, 70000, 75000, 80000},
+                           .exit = {0, 65000, 70000, 75000}},
+            [SHED_CPU] = {.enter = {0, 850, 920, 970},
+                          .exit = {0, 700, 800, 900}},
+            [SHED_QUEUE] = {.enter = {0, 250, 500, 750},
+                            .exit = {0, 100, 250, 500}},
+        },
+    .rise_samples = 2,
+    .hold_ms = 30 * 1000,
+};
+static ShedPolicy shed;
+static uint64_t probes_shed; // held back since the last summary
+#define DEDUP_SUMMARY_MS (60 * 1000)
+// Sources of alerts this severe or worse get banned by the firewall
+#define BAN_MAX_SEVERITY 2
+
+static const DedupConfig dedup_config = {
+    .max_entries = 1024,
+    .pair_rate = 6, // per minute, after a burst of
+    .pair_burst = 3,
+    .src_rate = 60,
+    .src_burst = 20,
+    .idle_ms = 10 * 60 * 1000,
+};
 
 SystemState current_state, next_state;
 
+// The transition engine starts and stops modules through it
+static Router router;
+static Transition transition;
+
+// Services the states run; a transition starts what the new state wants and
+// stops the rest, in parallel where the dependencies allow.
+// TODO read the services and their commands from a config file
+#define TOPIC_STATE_TRANSITION "/state/transition"
+#define COWRIE_SSH_PORT 2222
+enum { SERVICE_SURICATA, SERVICE_COWRIE, SERVICE_LISTENER };
+#define SERVICE(i) (1u << (i))
+
+static const char *const suricata_start[] = {"systemctl", "start", "suricata",
+                                             NULL};
+static const char *const suricata_stop[] = {"systemctl", "stop", "suricata",
+                                            NULL};
+static const char *const cowrie_start[] = {"systemctl", "start", "cowrie",
+                                           NULL};
+static const char *const cowrie_stop[] = {"systemctl", "stop", "cowrie", NULL};
+
+static const ServiceDef services[] = {
+    [SERVICE_SURICATA] = {.name = "suricata",
+                          .kind = SVC_EXEC,
+                          .start_argv = suricata_start,
+                          .stop_argv = suricata_stop,
+                          .timeout_ms = 30000},
+    // ready once its SSH port answers, not when systemctl returns
+    [SERVICE_COWRIE] = {.name = "cowrie",
+                        .kind = SVC_EXEC,
+                        .start_argv = cowrie_start,
+                        .stop_argv = cowrie_stop,
+                        .ready_port = COWRIE_SSH_PORT,
+                        .timeout_ms = 30000},
+    // Queued by the router until the listener connects, if it hasn't yet
+    [SERVICE_LISTENER] = {.name = "listener",
+                          .kind = SVC_MODULE,
+                          .module = MOD_LISTENER,
+                          .timeout_ms = 1000},
+};
+
+static const uint32_t state_services[STATE_COUNT] = {
+    [STATE_CLOSED] = 0,
+    [STATE_PASSIVE_LISTEN] = SERVICE(SERVICE_SURICATA) |
+                             SERVICE(SERVICE_LISTENER),
+    // Who knocks on ports the honeypot doesn't answer is worth knowing too
+    [STATE_HONEYPOT] = SERVICE(SERVICE_SURICATA) | SERVICE(SERVICE_COWRIE) |
+                       SERVICE(SERVICE_LISTENER),
+    [STATE_DEVELOPMENT] = 0,
+};
+
+// Hot standby (OS_STANDBY=1): these stay up in every state, closed off by
+// the firewall outside Honeypot, so entering and leaving it only swaps rule
+// sets. What they cost is published on /state/standby, standby or not.
+#define STANDBY_ENV "OS_STANDBY"
+#define STANDBY_SERVICES (SERVICE(SERVICE_SURICATA) | SERVICE(SERVICE_COWRIE))
+#define TOPIC_STATE_STANDBY "/state/standby"
+#define STANDBY_REPORT_MS (10 * 60 * 1000)
+
+static const char *const service_units[] = {
+    [SERVICE_SURICATA] = "suricata.service",
+    [SERVICE_COWRIE] = "cowrie.service",
+    [SERVICE_LISTENER] = NULL,
+};
+static StandbyReport standby;
+
+// Where each message type goes, by sending module. Anything not listed is
+// handled by the controller itself (on_local_message).
+static const RouteRule route_rules[] = {
+    // alerts raised by any module leave the box over MQTT
+    {ROUTE_ANY_ORIGIN, MSG_CMD_MQTT_PUB, MOD_MQTT},
+    // the MQTT module can't command itself
+    {MOD_MQTT, MSG_CMD_MQTT_PUB, ROUTE_DROP},
+};
 
 int change_state();
-int deactivate_state(uint8_t state);
-int activate_state(uint8_t state);
 
-int d_state_closed();
-int d_state_dev();
-int d_state_honey();
-int d_state_pl();
+static uint64_t now_ms(void);
+static void publish_ids_alert(Router *rt, const PayloadIDSAlert *alert);
+static void publish_probe(Router *rt, const PayloadProbe *probe);
+static int send_to_module(void *userdata, ModuleID dest,
+                          const IPCMessage *msg);
+static void on_transition_done(void *userdata, const Transition *t);
+static void send_ban(const PayloadIDSAlert *alert);
+static void report_standby(Router *rt);
+static void on_standby_timer(Reactor *r, int fd, uint32_t events,
+                             void *userdata);
+static void on_dedup_summary(void *userdata, const DedupEntry *e);
+static void on_sysstats(Router *rt, DedupTable *dedup,
+                        const PayloadSysStats *st);
+static void send_listener_shed(Router *rt);
+static void on_local_message(Router *rt, const IPCMessage *msg,
+                             void *userdata);
+static void on_dedup_timer(Reactor *r, int fd, uint32_t events,
+                           void *userdata);
+static void on_stdin(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata);
 
-int a_state_closed();
-int a_state_dev();
-int a_state_honey();
-int a_state_pl();
+/* The controller owns the system state and is the hub every module connects
+ * to. Everything runs on one reactor: module IPC (through the router), state
+ * change requests typed on stdin, and SIGINT/SIGTERM.
+ * */
+int main() {
+  Reactor reactor;
+  if (reactor_init(&reactor) != 0) {
+    LOG_ERROR("Failed to initialize reactor");
+    return OS_EXIT_GEN_FAILURE;
+  }
 
+  const int signals[] = {SIGINT, SIGTERM};
+  if (reactor_add_signals(&reactor, signals, 2, on_signal, NULL) < 0) {
+    LOG_ERROR("Failed to register signal handlers");
+    return OS_EXIT_GEN_FAILURE;
+  }
 
-int main(){
-  next_state = STATE_CLOSED;
-  change_state();
-  int user_input;
+  Arena arena;
+  arena_init(&arena, controller_memory, ARENA_SIZE);
 
-  while(1){
-    if(scanf("%d", &user_input) == 1){
-      next_state = (uint8_t)user_input;
-      change_state();
-    }
-    else{
-      while(getchar() != '\n');
-    }
+  static DedupTable dedup;
+  if (dedup_init(&dedup, &arena, &dedup_config, on_dedup_summary, &router) !=
+      0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
 
+  if (shed_init(&shed, &shed_config) != 0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (router_init(&router, &reactor, &arena, IPC_CONTROLLER_SOCK_PATH,
+                  route_rules, sizeof(route_rules) / sizeof(route_rules[0]),
+                  on_local_message, &dedup) != 0) {
+    LOG_ERROR("Failed to start the IPC router");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (reactor_add_timer(&reactor, DEDUP_SUMMARY_MS, on_dedup_timer, &dedup) <
+      0) {
+    LOG_ERROR("Failed to create the alert summary timer");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  const char *standby_mode = getenv(STANDBY_ENV);
+  bool standby_on = standby_mode != NULL && strcmp(standby_mode, "1") == 0;
+  uint32_t wanted[STATE_COUNT];
+  for (int s = 0; s < STATE_COUNT; s++) {
+    wanted[s] = state_services[s] | (standby_on ? STANDBY_SERVICES : 0);
+  }
+  if (standby_init(&standby, standby_on, service_units,
+                   sizeof(service_units) / sizeof(service_units[0])) != 0 ||
+      transition_init(&transition, &reactor, services,
+                      sizeof(services) / sizeof(services[0]), wanted,
+                      send_to_module, on_transition_done, &router) != 0) {
+    LOG_ERROR("Failed to start the state transition engine");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  if (reactor_add_timer(&reactor, STANDBY_REPORT_MS, on_standby_timer,
+                        &router) < 0) {
+    LOG_ERROR("Failed to create the standby report timer");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  // stdin may be /dev/null when running as a service; that's fine
+  if (reactor_add_fd(&reactor, STDIN_FILENO, EPOLLIN, on_stdin, NULL) != 0) {
+    LOG_WARN("stdin can't be watched, state changes only via IPC");
   }
-  return 0;
-}
 
-int change_state(){
-  
-  if (next_state == current_state) return OS_EXIT_SUCCESS;
-  
-  deactivate_state(current_state);
-  activate_state(next_state);
+  // The firewall comes up closed by itself, and nothing else runs yet
+  current_state = next_state = transition.state;
+  if (standby_on) {
+    // Closed to Closed: only brings the standby services up
+    LOG_INFO("Hot standby: starting the honeypot services now");
+    transition_start(&transition, STATE_CLOSED);
+  }
 
-  current_state = next_state;
+  LOG_INFO("Entering main controller loop");
+  reactor_run(&reactor);
 
+  // Best effort: whatever the MQTT module takes before we close goes out
+  dedup_flush(&dedup, UINT64_MAX);
+  dedup_log_stats(&dedup);
+  LOG_INFO("shedding: level %s, raised %llu times, lowered %llu times",
+           shed_level_name(shed.level), (unsigned long long)shed.raised,
+           (unsigned long long)shed.lowered);
+  router_log_stats(&router);
+  transition_close(&transition);
+  router_close(&router);
+  reactor_close(&reactor);
+  LOG_INFO("Controller stopped");
   return OS_EXIT_SUCCESS;
 }
 
-int deactivate_state(uint8_t state){
-  switch (state) {
-    case STATE_CLOSED:
-      d_state_closed();
-      break;
-    case STATE_DEVELOPMENT:
-      d_state_dev();
-      break;
-    case STATE_HONEYPOT:
-      d_state_honey();
-      break;
-    case STATE_PASSIVE_LISTEN:
-      d_state_pl();
-      break;
-    default:
-      printf("Invalid State for Activating\n");
-      return OS_EXIT_GEN_FAILURE
-  } 
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-  return OS_EXIT_SUCCESS;
+static const char *ip_to_str(const uint8_t ip[16], uint8_t ip_version,
+                             char *buf, size_t size) {
+  int family = ip_version == 6 ? AF_INET6 : AF_INET;
+  if (ip_version == 0 || inet_ntop(family, ip, buf, (socklen_t)size) == NULL) {
+    buf[0] = '\0';
+  }
+  return buf;
 }
 
-int d_state_closed(){
-  printf("Deactivating the Closed State\n");
-  return OS_EXIT_SUCCESS;
+static void publish_init(IPCMessage *msg, const char *topic) {
+  memset(msg, 0, sizeof(IPCMessage));
+  msg->msgtype = MSG_CMD_MQTT_PUB;
+
+  PayloadMQTTPubCMD *pub = &msg->payload.mqtt_pub_cmd;
+  snprintf(pub->topic, sizeof(pub->topic), "%s", topic);
+  pub->qos = 1;
 }
 
-int d_state_dev(){
-  printf("Deactivating the Development State\n");
-  return OS_EXIT_SUCCESS;
+static void publish_json(Router *rt, const char *topic, const char *fmt, ...) {
+  IPCMessage msg;
+  publish_init(&msg, topic);
+  PayloadMQTTPubCMD *pub = &msg.payload.mqtt_pub_cmd;
+
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf((char *)pub->data, sizeof(pub->data), fmt, args);
+  va_end(args);
+  if (n < 0 || (size_t)n >= sizeof(pub->data)) {
+    LOG_WARN("Dropping oversized publish on %s", topic);
+    return;
+  }
+  pub->data_len = (uint16_t)n;
+
+  router_send(rt, MOD_MQTT, &msg);
 }
 
-int d_state_honey(){
-  printf("Deactivating the Honeypot State\n");
-  return OS_EXIT_SUCCESS;
+static void publish_ids_alert(Router *rt, const PayloadIDSAlert *alert) {
+  IPCMessage msg;
+  publish_init(&msg, TOPIC_IDS_ALERT);
+  PayloadMQTTPubCMD *pub = &msg.payload.mqtt_pub_cmd;
+
+  size_t len =
+      record_encode(RECORD_ALERT, alert, pub->data, sizeof(pub->data));
+  if (len == 0) {
+    LOG_ERROR("Failed to encode alert sid %u", alert->signature_id);
+    return;
+  }
+  pub->data_len = (uint16_t)len;
+  // Suricata's most severe class shouldn't wait for a batch to fill
+  if (alert->severity == 1) {
+    pub->flags |= MQTT_PUB_URGENT;
+  }
+
+  router_send(rt, MOD_MQTT, &msg);
 }
 
-int d_state_pl(){
-  printf("Deactivating the Passive Listen State\n");
-  return OS_EXIT_SUCCESS;
+static void publish_probe(Router *rt, const PayloadProbe *probe) {
+  IPCMessage msg;
+  publish_init(&msg, TOPIC_PROBE);
+  PayloadMQTTPubCMD *pub = &msg.payload.mqtt_pub_cmd;
+
+  size_t len =
+      record_encode(RECORD_PROBE, probe, pub->data, sizeof(pub->data));
+  if (len == 0) {
+    LOG_ERROR("Failed to encode probe on port %u", probe->dst_port);
+    return;
+  }
+  pub->data_len = (uint16_t)len;
+
+  router_send(rt, MOD_MQTT, &msg);
 }
 
-int activate_state(uint8_t state){
-  switch (state) {
-    case STATE_CLOSED:
-      a_state_closed();
-      break;
-    case STATE_DEVELOPMENT:
-      a_state_dev();
-      break;
-    case STATE_HONEYPOT:
-      a_state_honey();
-      break;
-    case STATE_PASSIVE_LISTEN:
-      a_state_pl();
-      break;
-    default: 
-      printf("Invalid State for Deactivating\n");
-      break;
+static uint64_t pack_u16(const uint16_t *v, size_t count) {
+  uint64_t packed = 0;
+  for (size_t i = 0; i < count; i++) {
+    packed |= (uint64_t)v[i] << (16 * i);
   }
+  return packed;
+}
 
-  return OS_EXIT_SUCCESS;
+static void publish_sysstats(Router *rt, const PayloadSysStats *st) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  RecordTelemetry tm = {
+      .ts_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000,
+      .module = MOD_SYSSTATS,
+      .count = RECORD_TELEMETRY_MAX,
+      .values =
+          {
+              st->cpu_busy,
+              pack_u16(&st->core_busy[0], 4),
+              pack_u16(&st->core_busy[4], 4),
+              st->cpu_iowait,
+              st->cpu_softirq,
+              st->temp_mc == SYSSTATS_TEMP_UNKNOWN
+                  ? 0
+                  : (uint64_t)((int64_t)st->temp_mc + 273150),
+              st->mem_total_kb,
+              st->mem_available_kb,
+              pack_u16(st->load_x100, 3),
+              st->net_rx_bytes,
+              st->net_tx_bytes,
+              st->net_rx_packets,
+              st->net_rx_drops,
+              st->softirq_net_rx,
+              st->softirq_net_tx,
+              st->self_ppm,
+          },
+  };
+
+  IPCMessage msg;
+  publish_init(&msg, TOPIC_SYSSTATS);
+  PayloadMQTTPubCMD *pub = &msg.payload.mqtt_pub_cmd;
+  size_t len =
+      record_encode(RECORD_TELEMETRY, &tm, pub->data, sizeof(pub->data));
+  if (len == 0) {
+    LOG_ERROR("Failed to encode system stats");
+    return;
+  }
+  pub->data_len = (uint16_t)len;
+
+  router_send(rt, MOD_MQTT, &msg);
 }
 
-int a_state_closed(){
-  printf("Activating the Closed State\n");
-  return OS_EXIT_SUCCESS;
+static int send_to_module(void *userdata, ModuleID dest,
+                          const IPCMessage *msg) {
+  Router *rt = (Router *)userdata;
+  int rc = router_send(rt, dest, msg);
+  // A listener started while shedding samples from its first packet
+  if (rc == 0 && dest == MOD_LISTENER && msg->msgtype == MSG_CMD_START &&
+      shed.level != SHED_NONE) {
+    send_listener_shed(rt);
+  }
+  return rc;
 }
 
-int a_state_dev(){
-  printf("Activating the Development State\n");
-  return OS_EXIT_SUCCESS;
+static void report_standby(Router *rt) {
+  char report[sizeof(((PayloadMQTTPubCMD *)0)->data)];
+  standby_measure(&standby, transition.up);
+  if (standby_format(&standby, report, sizeof(report)) < 0) {
+    LOG_WARN("Standby report doesn't fit a publish");
+    return;
+  }
+  LOG_INFO("Standby cost: %s", report);
+  publish_json(rt, TOPIC_STATE_STANDBY, "%s", report);
 }
 
-int a_state_honey(){
-  printf("Activating the Honeypot State\n");
-  return OS_EXIT_SUCCESS;
+static void on_standby_timer(Reactor *r, int fd, uint32_t events,
+                             void *userdata) {
+  reactor_timer_ack(fd);
+  if (shed.level < SHED_TELEMETRY) {
+    report_standby((Router *)userdata);
+  }
+}
+
+static void send_ban(const PayloadIDSAlert *alert) {
+  IPCMessage msg;
+  memset(&msg, 0, sizeof(IPCMessage));
+  msg.msgtype = MSG_CMD_BAN;
+  msg.payload_len = sizeof(PayloadBan);
+  msg.payload.ban.ip_version = alert->ip_version;
+  msg.payload.ban.reason = alert->signature_id;
+  memcpy(msg.payload.ban.ip, alert->src_ip, 16);
+  router_send(&router, MOD_FIREWALL, &msg);
+}
+
+static void on_dedup_summary(void *userdata, const DedupEntry *e) {
+  Router *rt = (Router *)userdata;
+  char src[INET6_ADDRSTRLEN];
+  publish_json(rt, TOPIC_IDS_SUPPRESSED,
+               "{\"sid\":%u,\"sev\":%u,\"src\":\"%s\",\"n\":%u,\"t0\":%llu,"
+               "\"t1\":%llu}",
+               e->signature_id, e->severity,
+               ip_to_str(e->src_ip, e->ip_version, src, sizeof(src)),
+               e->suppressed, (unsigned long long)e->first_ms,
+               (unsigned long long)e->last_ms);
+}
+
+static void on_dedup_timer(Reactor *r, int fd, uint32_t events,
+                           void *userdata) {
+  DedupTable *dedup = (DedupTable *)userdata;
+  reactor_timer_ack(fd);
+
+  size_t reported = dedup_flush(dedup, now_ms());
+  if (reported > 0) {
+    LOG_INFO("Reported repeats of %zu alerts (%llu suppressed so far)",
+             reported,
+             (unsigned long long)(dedup->dup_suppressed +
+                                  dedup->rate_suppressed +
+                                  dedup->shed_suppressed));
+  }
+  if (probes_shed > 0) {
+    publish_json(&router, TOPIC_PROBE_SUMMARY, "{\"probes\":%llu}",
+                 (unsigned long long)probes_shed);
+    probes_shed = 0;
+  }
+}
+
+// The fullest outbound backlog, in permille
+static int32_t queue_fill(const Router *rt) {
+  size_t fullest = 0;
+  for (int i = 0; i < MOD_COUNT; i++) {
+    if (rt->modules[i].q_count > fullest) {
+      fullest = rt->modules[i].q_count;
+    }
+  }
+  return (int32_t)(fullest * 1000 / ROUTER_QUEUE_LEN);
+}
+
+static void apply_shed(Router *rt, DedupTable *dedup, ShedLevel was) {
+  const int32_t *v = shed.values;
+  if (shed.level > was) {
+    LOG_WARN("Shedding load: %s -> %s on %s (temp %d mC, cpu %d, queue %d "
+             "permille)",
+             shed_level_name(was), shed_level_name(shed.level),
+             shed_metric_name(shed.cause), v[SHED_TEMP], v[SHED_CPU],
+             v[SHED_QUEUE]);
+  } else {
+    LOG_INFO("Shedding eased: %s -> %s", shed_level_name(was),
+             shed_level_name(shed.level));
+  }
+
+  dedup->summary_only = shed.level >= SHED_SUMMARY;
+  send_listener_shed(rt);
+
+  char temp[16] = "null";
+  if (v[SHED_TEMP] != SHED_UNKNOWN) {
+    snprintf(temp, sizeof(temp), "%d", v[SHED_TEMP]);
+  }
+  publish_json(rt, TOPIC_SHED,
+               "{\"level\":\"%s\",\"from\":\"%s\",\"cause\":\"%s\","
+               "\"temp_mc\":%s,\"cpu\":%d,\"queue\":%d}",
+               shed_level_name(shed.level), shed_level_name(was),
+               shed_metric_name(shed.cause), temp, v[SHED_CPU], v[SHED_QUEUE]);
+}
+
+// Tells the listener how much of its traffic to track at the current level
+static void send_listener_shed(Router *rt) {
+  IPCMessage msg;
+  memset(&msg, 0, sizeof(IPCMessage));
+  msg.msgtype = MSG_CMD_SHED;
+  msg.payload_len = sizeof(PayloadShed);
+  msg.payload.shed.level = (uint8_t)shed.level;
+  msg.payload.shed.sample_rate =
+      shed.level >= SHED_SAMPLE ? SHED_SAMPLE_RATE : 1;
+  router_send(rt, MOD_LISTENER, &msg);
+}
+
+static void on_sysstats(Router *rt, DedupTable *dedup,
+                        const PayloadSysStats *st) {
+  const int32_t values[SHED_METRIC_COUNT] = {
+      [SHED_TEMP] =
+          st->temp_mc == SYSSTATS_TEMP_UNKNOWN ? SHED_UNKNOWN : st->temp_mc,
+      [SHED_CPU] = st->cpu_busy,
+      [SHED_QUEUE] = queue_fill(rt),
+  };
+  ShedLevel was = shed.level;
+  if (shed_update(&shed, values, now_ms())) {
+    apply_shed(rt, dedup, was);
+  }
+  // Low priority: the first thing to go
+  if (shed.level < SHED_TELEMETRY) {
+    publish_sysstats(rt, st);
+  }
+}
+
+static void on_local_message(Router *rt, const IPCMessage *msg,
+                             void *userdata) {
+  DedupTable *dedup = (DedupTable *)userdata;
+
+  switch (msg->msgtype) {
+  case MSG_SYS_HELLO:
+    // A new listener process starts at full rate, whatever the level
+    if (msg->origin == MOD_LISTENER && shed.level != SHED_NONE) {
+      send_listener_shed(rt);
+    }
+    break;
+  case MSG_EVT_MQTT_PUB_RESULT:
+    if (msg->payload.mqtt_pub_result.status != 0) {
+      LOG_WARN("Publish %u failed with status %d",
+               msg->payload.mqtt_pub_result.msg_id,
+               msg->payload.mqtt_pub_result.status);
+    }
+    break;
+  case MSG_EVT_MQTT_SUB_MSG:
+    LOG_INFO("Remote message on %s (%u bytes)",
+             msg->payload.mqtt_sub_evt.topic,
+             msg->payload.mqtt_sub_evt.data_len);
+    break;
+  case MSG_EVT_IDS_ALERT:
+    LOG_DEBUG("IDS alert sid %u severity %u",
+              msg->payload.ids_alert.signature_id,
+              msg->payload.ids_alert.severity);
+    if (dedup_check(dedup, &msg->payload.ids_alert, now_ms())) {
+      publish_ids_alert(rt, &msg->payload.ids_alert);
+      // The honeypot wants attackers in; repeats are coalesced by the
+      // firewall, and by dedup before it
+      if (current_state != STATE_HONEYPOT &&
+          msg->payload.ids_alert.severity != 0 &&
+          msg->payload.ids_alert.severity <= BAN_MAX_SEVERITY &&
+          msg->payload.ids_alert.ip_version != 0) {
+        send_ban(&msg->payload.ids_alert);
+      }
+    }
+    break;
+  case MSG_EVT_PROBE:
+    if (shed.level >= SHED_SUMMARY) {
+      probes_shed++;
+    } else {
+      publish_probe(rt, &msg->payload.probe);
+    }
+    break;
+  case MSG_EVT_SYSSTATS:
+    on_sysstats(rt, dedup, &msg->payload.sysstats);
+    break;
+  case MSG_EVT_STATE_DONE:
+    if (msg->payload.state_done.status == 0) {
+      LOG_INFO("Firewall rules of state %u in place after %u us",
+               msg->payload.state_done.state,
+               msg->payload.state_done.elapsed_us);
+    } else {
+      LOG_ERROR("Firewall failed to enter state %u (%s), previous rules kept",
+                msg->payload.state_done.state,
+                strerror(-msg->payload.state_done.status));
+    }
+    transition_on_message(&transition, msg);
+    break;
+  case MSG_ERR:
+    LOG_ERROR("Module %d reported: %s", msg->origin,
+              msg->payload.rror.message);
+    break;
+  default:
+    LOG_DEBUG("Unhandled message type %d from module %d", msg->msgtype,
+              msg->origin);
+    break;
+  }
 }
 
-int a_state_pl(){
-  printf("Activating the Passive Listen State\n");
+static void on_stdin(Reactor *r, int fd, uint32_t events, void *userdata) {
+  char buf[BUF_SIZE];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  if (n <= 0) {
+    // EOF: keep running, just stop listening to the terminal
+    reactor_del_fd(r, fd);
+    return;
+  }
+  buf[n] = '\0';
+
+  char *end;
+  long value = strtol(buf, &end, 10);
+  if (end == buf) {
+    LOG_WARN("Expected a state number");
+    return;
+  }
+  next_state = (SystemState)value;
+  change_state();
+}
+
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata) {
+  int signo = reactor_signal_read(fd);
+  LOG_INFO("Received signal %d. Shutting down", signo);
+  reactor_stop(r);
+}
+
+int change_state() {
+  if ((unsigned)next_state >= STATE_COUNT) {
+    LOG_WARN("No such state: %d", next_state);
+    next_state = current_state;
+    return OS_EXIT_GEN_FAILURE;
+  }
+  // One at a time: the latest request starts when the running one ends
+  if (transition.active || next_state == current_state)
+    return OS_EXIT_SUCCESS;
+
+  if (transition_start(&transition, next_state) != 0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
   return OS_EXIT_SUCCESS;
 }
 
+// The sampler follows the state; queued by the router until it connects
+static void tell_sysstats(Router *rt, SystemState state) {
+  IPCMessage msg;
+  memset(&msg, 0, sizeof(IPCMessage));
+  msg.msgtype = MSG_CMD_SET_STATE;
+  msg.payload_len = sizeof(PayloadState);
+  msg.payload.state.state = (uint8_t)state;
+  router_send(rt, MOD_SYSSTATS, &msg);
+}
+
+// The transition report; steps is filled to what the publish has room for
+#define TRANSITION_JSON                                                        \
+  "{\"from\":%u,\"to\":%u,\"ok\":%s,\"rollback\":%s,\"us\":%llu,"           \
+  "\"crit_us\":%llu,\"sum_us\":%llu,\"steps\":\"%s\",\"more\":%zu}"
+
+// Reports how the transition went and what it cost, on the log and over MQTT
+static void on_transition_done(void *userdata, const Transition *t) {
+  Router *rt = (Router *)userdata;
+  current_state = t->state;
+
+  uint64_t sum_us = 0;
+  bool started = false; // a cold start worth reporting against standby
+  for (size_t i = 0; i < t->step_count; i++) {
+    const Step *s = &t->steps[i];
+    uint64_t us = transition_step_us(s);
+    sum_us += us;
+    if (s->service != STEP_FIREWALL && s->start && s->status == STEP_DONE &&
+        service_units[s->service] != NULL) {
+      standby_record_start(&standby, s->service, us);
+      started = true;
+    }
+  }
+  uint64_t total_us = t->ended_us - t->started_us;
+  uint64_t crit_us = transition_critical_us(t);
+
+  // "name+:us" per start, "name-:us" per stop, a trailing ! if it failed;
+  // whole steps only, as many as fit in the publish, "more" counts the rest
+  char steps[sizeof(((PayloadMQTTPubCMD *)0)->data)];
+  int base = snprintf(NULL, 0, TRANSITION_JSON, t->from, t->to, "false",
+                      "false", (unsigned long long)total_us,
+                      (unsigned long long)crit_us, (unsigned long long)sum_us,
+                      "", t->step_count);
+  size_t room = base > 0 && (size_t)base < sizeof(steps)
+                    ? sizeof(steps) - (size_t)base
+                    : 1;
+  size_t len = 0, shown = 0;
+  steps[0] = '\0';
+  for (; shown < t->step_count; shown++) {
+    const Step *s = &t->steps[shown];
+    int n = snprintf(steps + len, room - len, "%s%s%s:%llu%s",
+                     shown > 0 ? "," : "", transition_step_name(t, s),
+                     s->service == STEP_FIREWALL ? "" : s->start ? "+" : "-",
+                     (unsigned long long)transition_step_us(s),
+                     s->status == STEP_FAILED ? "!" : "");
+    if (n < 0 || (size_t)n >= room - len) {
+      steps[len] = '\0';
+      break;
+    }
+    len += (size_t)n;
+  }
 
+  if (t->status == 0) {
+    LOG_INFO("%s %u -> %u in %llu us (critical path %llu us, steps %llu us)",
+             t->rollback ? "Rolled back" : "State", t->from, t->to,
+             (unsigned long long)total_us, (unsigned long long)crit_us,
+             (unsigned long long)sum_us);
+  } else {
+    LOG_ERROR("%s %u -> %u failed at %s: %s", t->rollback ? "Rollback" : "State",
+              t->from, t->to,
+              t->failed_step >= 0
+                  ? transition_step_name(t, &t->steps[t->failed_step])
+                  : "?",
+              strerror(-t->status));
+  }
+  publish_json(rt, TOPIC_STATE_TRANSITION, TRANSITION_JSON, t->from, t->to,
+               t->status == 0 ? "true" : "false",
+               t->rollback ? "true" : "false", (unsigned long long)total_us,
+               (unsigned long long)crit_us, (unsigned long long)sum_us, steps,
+               t->step_count - shown);
+  if (started) {
+    report_standby(rt);
+  }
+  if (t->status == 0 && !t->rollback && t->from != t->to) {
+    tell_sysstats(rt, t->to);
+  }
+
+  // A failure rolls back first; whatever was asked for meanwhile waits for it
+  if (t->status != 0 && !t->rollback) {
+    return;
+  }
+  if (t->status != 0) {
+    next_state = current_state;
+  }
+  change_state();
+}
@@ -0,0 +1,520 @@
+#define MODULE_NAME "ROUTER"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "router.h"
+
+static const char *module_names[MOD_COUNT] = {
+    "core",     "mqtt",     "display",  "hwinput", "suricata",
+    "cowrie",   "listener", "firewall", "sysstats"};
+
+static uint64_t router_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void on_accept(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_pending(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_module(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_retry(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_housekeeping(Reactor *r, int fd, uint32_t events,
+                            void *userdata);
+
+// ---- backlog ----
+
+static bool router_backlog_push(RouterModule *m, const IPCMessage *msg) {
+  if (m->q_count == ROUTER_QUEUE_LEN) {
+    m->dropped++;
+    if (!m->drop_logged) {
+      LOG_WARN("Backlog for module %s is full, dropping messages",
+               module_names[m->id]);
+      m->drop_logged = true;
+    }
+    return false;
+  }
+
+  m->queue[(m->q_head + m->q_count) % ROUTER_QUEUE_LEN] = *msg;
+  m->q_count++;
+  m->queued++;
+  return true;
+}
+
+static void router_arm_retry(Router *rt) {
+  if (!rt->retry_armed &&
+      reactor_timer_set(rt->retry_timer_fd, ROUTER_RETRY_MS) == 0) {
+    rt->retry_armed = true;
+  }
+}
+
+// Sends as much of the backlog as the module accepts right now.
+// Returns true if the backlog is empty afterwards.
+static bool router_flush(RouterModule *m) {
+  while (m->q_count > 0 && m->fd >= 0) {
+    if (ipc_client_send(m->fd, &m->queue[m->q_head]) < 0) {
+      // EAGAIN: still busy. Anything else: the hangup handler cleans up.
+      return false;
+    }
+    m->q_head = (m->q_head + 1) % ROUTER_QUEUE_LEN;
+    m->q_count--;
+    m->tx++;
+  }
+
+  if (m->q_count == 0) {
+    m->drop_logged = false;
+  }
+  return m->q_count == 0;
+}
+
+static int router_deliver(Router *rt, ModuleID dest, const IPCMessage *msg) {
+  RouterModule *m = &rt->modules[dest];
+
+  // Keep order: once something waits in the backlog, everything queues up
+  // behind it.
+  if (m->fd >= 0 && m->q_count == 0) {
+    if (ipc_client_send(m->fd, msg) > 0) {
+      m->tx++;
+      return 0;
+    }
+  }
+
+  if (!router_backlog_push(m, msg)) {
+    return -1;
+  }
+  if (m->fd >= 0) {
+    router_arm_retry(rt);
+  }
+  return 0;
+}
+
+// ---- routing ----
+
+static void router_route(Router *rt, ModuleID origin, IPCMessage *msg) {
+  // The handshake, not the header, says who sent it
+  msg->origin = origin;
+
+  switch (msg->msgtype) {
+  case MSG_SYS_PING: {
+    IPCMessage pong;
+    memset(&pong, 0, sizeof(pong));
+    pong.origin = MOD_CORE;
+    pong.dest = origin;
+    pong.msgtype = MSG_SYS_PONG;
+    pong.timestamp_ms = msg->timestamp_ms;
+    router_deliver(rt, origin, &pong);
+    return;
+  }
+  case MSG_SYS_HELLO:
+    LOG_WARN("Module %s said hello twice, ignoring", module_names[origin]);
+    return;
+  default:
+    break;
+  }
+
+  int dest = rt->routes[origin][msg->msgtype];
+  if (dest == ROUTE_DIRECT) {
+    dest = (int)msg->dest;
+  } else if (msg->dest != MOD_CORE) {
+    // The table decides: a module can't send around it
+    uint64_t n = ++rt->dest_ignored;
+    if ((n & (n - 1)) == 0) {
+      LOG_WARN("Ignoring dest %d of message type %d from %s (%llu so far)",
+               msg->dest, msg->msgtype, module_names[origin],
+               (unsigned long long)n);
+    }
+  }
+
+  if (dest == ROUTE_DROP || dest == (int)origin) {
+    rt->unroutable++;
+    LOG_DEBUG("Dropping message type %d from %s", msg->msgtype,
+              module_names[origin]);
+    return;
+  }
+
+  if (dest == ROUTE_LOCAL) {
+    if (rt->local != NULL) {
+      rt->local(rt, msg, rt->local_userdata);
+    }
+    return;
+  }
+
+  router_deliver(rt, (ModuleID)dest, msg);
+}
+
+// ---- connections ----
+
+static void router_unwatch(Router *rt, int fd, int poll_fd) {
+  if (poll_fd != fd) {
+    reactor_del_fd(rt->reactor, poll_fd);
+  }
+  reactor_del_fd(rt->reactor, fd);
+}
+
+// Registers fd and, on shm channels, its eventfd. The socket itself is then
+// only watched for hangups.
+static int router_watch(Router *rt, int fd, ReactorCallback cb,
+                        void *userdata, int *poll_fd) {
+  *poll_fd = ipc_client_poll_fd(fd);
+  if (reactor_add_fd(rt->reactor, *poll_fd, EPOLLIN, cb, userdata) != 0) {
+    return -1;
+  }
+  if (*poll_fd != fd &&
+      reactor_add_fd(rt->reactor, fd, 0, cb, userdata) != 0) {
+    reactor_del_fd(rt->reactor, *poll_fd);
+    return -1;
+  }
+  return 0;
+}
+
+static void router_drop_pending(RouterPending *p) {
+  router_unwatch(p->router, p->fd, p->poll_fd);
+  ipc_client_disconnect(&p->fd);
+  p->fd = -1;
+}
+
+static void router_detach(RouterModule *m) {
+  if (m->fd < 0) {
+    return;
+  }
+  router_unwatch(m->router, m->fd, m->poll_fd);
+  ipc_client_disconnect(&m->fd);
+  m->fd = -1;
+  LOG_WARN("Module %s disconnected (%zu messages kept in its backlog)",
+           module_names[m->id], m->q_count);
+}
+
+// Promotes a pending connection to module id after a valid hello
+static int router_attach(Router *rt, RouterPending *p,
+                         const IPCMessage *hello) {
+  ModuleID id = hello->origin;
+  RouterModule *m = &rt->modules[id];
+  if (m->fd >= 0) {
+    // The old process is gone or stuck; the newest connection wins
+    LOG_WARN("Module %s reconnected, replacing its old connection",
+             module_names[id]);
+    router_detach(m);
+  }
+
+  int fd = p->fd;
+  router_unwatch(rt, p->fd, p->poll_fd);
+  p->fd = -1;
+
+  if (router_watch(rt, fd, on_module, m, &m->poll_fd) != 0) {
+    LOG_ERROR("Failed to watch module %s", module_names[id]);
+    ipc_client_disconnect(&fd);
+    return -1;
+  }
+  m->fd = fd;
+  m->connects++;
+
+  IPCMessage ack;
+  memset(&ack, 0, sizeof(ack));
+  ack.origin = MOD_CORE;
+  ack.dest = id;
+  ack.msgtype = MSG_SYS_ACK;
+  if (ipc_client_send(fd, &ack) < 0) {
+    LOG_WARN("Could not acknowledge hello from %s", module_names[id]);
+  }
+
+  LOG_INFO("Module %s connected (fd %d, %zu messages waiting)",
+           module_names[id], fd, m->q_count);
+  if (!router_flush(m)) {
+    router_arm_retry(rt);
+  }
+  if (rt->local != NULL) {
+    rt->local(rt, hello, rt->local_userdata);
+  }
+  return 0;
+}
+
+static void on_accept(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Router *rt = (Router *)userdata;
+
+  while (1) {
+    int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_SYS_ERROR("Failed to accept module connection");
+      }
+      return;
+    }
+
+    RouterPending *slot = NULL;
+    for (size_t i = 0; i < ROUTER_MAX_PENDING; i++) {
+      if (rt->pending[i].fd < 0) {
+        slot = &rt->pending[i];
+        break;
+      }
+    }
+
+    if (slot == NULL ||
+        router_watch(rt, client_fd, on_pending, slot, &slot->poll_fd) != 0) {
+      LOG_ERROR("Too many connections waiting for hello, refusing fd %d",
+                client_fd);
+      close(client_fd);
+      continue;
+    }
+    slot->fd = client_fd;
+    slot->since_ms = router_now_ms();
+  }
+}
+
+static bool router_valid_hello(const IPCMessage *msg) {
+  if (msg->msgtype != MSG_SYS_HELLO) {
+    LOG_ERROR("First message was type %d instead of hello", msg->msgtype);
+    return false;
+  }
+  if (msg->origin == MOD_CORE || msg->origin >= MOD_COUNT) {
+    LOG_ERROR("Hello from invalid module id %d", msg->origin);
+    return false;
+  }
+  if (msg->payload.hello.version != IPC_PROTOCOL_VERSION) {
+    LOG_ERROR("Module %s speaks IPC version %u, expected %u",
+              module_names[msg->origin], msg->payload.hello.version,
+              IPC_PROTOCOL_VERSION);
+    return false;
+  }
+  return true;
+}
+
+static void on_pending(Reactor *r, int fd, uint32_t events, void *userdata) {
+  RouterPending *p = (RouterPending *)userdata;
+  Router *rt = p->router;
+
+  int count = ipc_client_receive_batch(p->fd, rt->rx_batch, IPC_BATCH_MAX);
+  if (count < 0 || (count == 0 && (events & (EPOLLHUP | EPOLLERR)))) {
+    router_drop_pending(p);
+    return;
+  }
+
+  // A shared-memory offer was consumed: wait on the ring eventfd from now on
+  if (ipc_client_poll_fd(p->fd) != p->poll_fd) {
+    int sock_fd = p->fd;
+    router_unwatch(rt, sock_fd, p->poll_fd);
+    if (router_watch(rt, sock_fd, on_pending, p, &p->poll_fd) != 0) {
+      LOG_ERROR("Failed to watch shared-memory channel on fd %d", sock_fd);
+      ipc_client_disconnect(&p->fd);
+      p->fd = -1;
+      return;
+    }
+  }
+
+  if (count == 0) {
+    return;
+  }
+
+  if (!router_valid_hello(&rt->rx_batch[0])) {
+    router_drop_pending(p);
+    return;
+  }
+
+  ModuleID id = rt->rx_batch[0].origin;
+  if (router_attach(rt, p, &rt->rx_batch[0]) != 0) {
+    return;
+  }
+
+  // Whatever arrived right behind the hello is already ours to route
+  RouterModule *m = &rt->modules[id];
+  for (int i = 1; i < count; i++) {
+    m->rx++;
+    router_route(rt, id, &rt->rx_batch[i]);
+  }
+}
+
+static void on_module(Reactor *r, int fd, uint32_t events, void *userdata) {
+  RouterModule *m = (RouterModule *)userdata;
+  Router *rt = m->router;
+
+  // One batch per wakeup: a chatty module can't starve the others, the
+  // level-triggered fd brings us back for the rest.
+  int count = ipc_client_receive_batch(m->fd, rt->rx_batch, IPC_BATCH_MAX);
+  if (count < 0 || (count == 0 && (events & (EPOLLHUP | EPOLLERR)))) {
+    router_detach(m);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    m->rx++;
+    router_route(rt, m->id, &rt->rx_batch[i]);
+  }
+
+  // On shm channels this wakeup can also mean the module made room
+  if (m->q_count > 0) {
+    router_flush(m);
+  }
+}
+
+static void on_retry(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Router *rt = (Router *)userdata;
+  reactor_timer_ack(fd);
+
+  bool pending = false;
+  for (size_t i = 0; i < MOD_COUNT; i++) {
+    RouterModule *m = &rt->modules[i];
+    if (m->fd >= 0 && !router_flush(m)) {
+      pending = true;
+    }
+  }
+
+  if (!pending && reactor_timer_set(fd, 0) == 0) {
+    rt->retry_armed = false;
+  }
+}
+
+static void on_housekeeping(Reactor *r, int fd, uint32_t events,
+                            void *userdata) {
+  Router *rt = (Router *)userdata;
+  reactor_timer_ack(fd);
+
+  uint64_t now = router_now_ms();
+  for (size_t i = 0; i < ROUTER_MAX_PENDING; i++) {
+    RouterPending *p = &rt->pending[i];
+    if (p->fd >= 0 && now - p->since_ms > ROUTER_HELLO_TIMEOUT_MS) {
+      LOG_WARN("fd %d never said hello, dropping it", p->fd);
+      router_drop_pending(p);
+    }
+  }
+}
+
+// ---- public API ----
+
+int router_init(Router *rt, Reactor *r, Arena *arena, const char *path,
+                const RouteRule *rules, size_t rule_count,
+                RouterLocalHandler local, void *userdata) {
+  if (rt == NULL || r == NULL || arena == NULL || path == NULL) {
+    LOG_ERROR("Invalid arguments to router_init");
+    return -1;
+  }
+
+  memset(rt, 0, sizeof(Router));
+  rt->reactor = r;
+  rt->path = path;
+  rt->local = local;
+  rt->local_userdata = userdata;
+  rt->listen_fd = -1;
+
+  memset(rt->routes, ROUTE_LOCAL, sizeof(rt->routes));
+  for (size_t i = 0; i < rule_count; i++) {
+    const RouteRule *rule = &rules[i];
+    if (rule->msgtype >= MSG_TYPE_COUNT || rule->dest < 0 ||
+        rule->dest > ROUTE_DIRECT || rule->origin < ROUTE_ANY_ORIGIN ||
+        rule->origin >= MOD_COUNT) {
+      LOG_ERROR("Ignoring invalid route rule %zu", i);
+      continue;
+    }
+    for (int o = 0; o < MOD_COUNT; o++) {
+      if (rule->origin == ROUTE_ANY_ORIGIN || rule->origin == o) {
+        rt->routes[o][rule->msgtype] = (uint8_t)rule->dest;
+      }
+    }
+  }
+
+  for (int i = 0; i < MOD_COUNT; i++) {
+    RouterModule *m = &rt->modules[i];
+    m->router = rt;
+    m->id = (ModuleID)i;
+    m->fd = -1;
+    m->poll_fd = -1;
+    if (i == MOD_CORE) {
+      continue; // that's us
+    }
+    m->queue = arena_alloc(arena, ROUTER_QUEUE_LEN * sizeof(IPCMessage));
+    if (m->queue == NULL) {
+      LOG_ERROR("Failed to allocate backlog for module %s", module_names[i]);
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < ROUTER_MAX_PENDING; i++) {
+    rt->pending[i].router = rt;
+    rt->pending[i].fd = -1;
+  }
+
+  rt->listen_fd =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (rt->listen_fd == -1) {
+    LOG_SYS_ERROR("Failed to create controller socket");
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+
+  if (bind(rt->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(rt->listen_fd, ROUTER_MAX_PENDING) == -1) {
+    LOG_SYS_ERROR("Failed to listen on %s", path);
+    close(rt->listen_fd);
+    rt->listen_fd = -1;
+    return -1;
+  }
+
+  if (reactor_add_fd(r, rt->listen_fd, EPOLLIN, on_accept, rt) != 0) {
+    LOG_ERROR("Failed to watch controller socket");
+    return -1;
+  }
+
+  rt->retry_timer_fd = reactor_add_timer(r, ROUTER_RETRY_MS, on_retry, rt);
+  if (rt->retry_timer_fd < 0 || reactor_timer_set(rt->retry_timer_fd, 0) != 0) {
+    LOG_ERROR("Failed to create backlog retry timer");
+    return -1;
+  }
+
+  if (reactor_add_timer(r, ROUTER_HOUSEKEEPING_MS, on_housekeeping, rt) < 0) {
+    LOG_ERROR("Failed to create router housekeeping timer");
+    return -1;
+  }
+
+  LOG_INFO("Listening for modules on %s", path);
+  return 0;
+}
+
+int router_send(Router *rt, ModuleID dest, const IPCMessage *msg) {
+  if (rt == NULL || msg == NULL || dest == MOD_CORE || dest >= MOD_COUNT) {
+    LOG_ERROR("Invalid arguments to router_send");
+    return -1;
+  }
+
+  IPCMessage out = *msg;
+  out.origin = MOD_CORE;
+  out.dest = dest;
+  return router_deliver(rt, dest, &out);
+}
+
+void router_log_stats(const Router *rt) {
+  for (int i = 1; i < MOD_COUNT; i++) {
+    const RouterModule *m = &rt->modules[i];
+    LOG_INFO("%-8s %-12s rx=%llu tx=%llu queued=%llu dropped=%llu "
+             "backlog=%zu connects=%llu",
+             module_names[i], m->fd >= 0 ? "connected" : "disconnected",
+             (unsigned long long)m->rx, (unsigned long long)m->tx,
+             (unsigned long long)m->queued, (unsigned long long)m->dropped,
+             m->q_count, (unsigned long long)m->connects);
+  }
+  LOG_INFO("unroutable=%llu dest_ignored=%llu",
+           (unsigned long long)rt->unroutable,
+           (unsigned long long)rt->dest_ignored);
+}
+
+void router_close(Router *rt) {
+  for (size_t i = 0; i < ROUTER_MAX_PENDING; i++) {
+    if (rt->pending[i].fd >= 0) {
+      router_drop_pending(&rt->pending[i]);
+    }
+  }
+  for (int i = 0; i < MOD_COUNT; i++) {
+    router_detach(&rt->modules[i]);
+  }
+  if (rt->listen_fd >= 0) {
+    reactor_del_fd(rt->reactor, rt->listen_fd);
+    close(rt->listen_fd);
+    rt->listen_fd = -1;
+    unlink(rt->path);
+  }
+}
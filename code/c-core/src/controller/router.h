@@ -0,0 +1,141 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+/* ==========================================================================
+ *  Orange Sentry - Controller IPC Router
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  The controller side of sockclient.h. One listening socket accepts every
+ *  module; each connection must identify itself with MSG_SYS_HELLO before
+ *  anything else is accepted from it. After that, each message is routed
+ *  through the routing table, indexed by [origin module][message type]. A
+ *  table entry of ROUTE_LOCAL hands the message to the controller's own
+ *  handler, ROUTE_DROP discards it, and ROUTE_DIRECT sends it to the module
+ *  the sender named in msg.dest. Anywhere else, the dest a module sets is
+ *  ignored: it can't skip a route, or the controller's checks on what it
+ *  handles itself (alert dedup and rate limits before anything is
+ *  published).
+ *
+ *  Sends to modules never block: every module has its own outbound backlog,
+ *  so a module that stops reading (or is restarting) only delays its own
+ *  messages. The backlog survives reconnects and is flushed, in order, after
+ *  the module says hello again. The hello itself then goes to the local
+ *  handler, so the controller can bring a (re)started module up to date.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. router_init() on an initialized Reactor, with the routing rules.
+ *  2. Run the reactor; the local handler is called from the loop thread.
+ *  3. router_send() to talk to a module from controller code.
+ *
+ * ========================================================================== */
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "reactor.h"
+#include "sockclient.h"
+
+#define ROUTER_MAX_PENDING 8         // connections that have not said hello
+#define ROUTER_QUEUE_LEN 128         // per-module outbound backlog
+#define ROUTER_HELLO_TIMEOUT_MS 5000 // pending connections are dropped after
+#define ROUTER_RETRY_MS 5            // backlog flush period while one exists
+#define ROUTER_HOUSEKEEPING_MS 1000
+
+// Routing table destinations besides real modules
+#define ROUTE_LOCAL MOD_CORE
+#define ROUTE_DROP MOD_COUNT
+#define ROUTE_DIRECT (MOD_COUNT + 1) // msg.dest, ROUTE_LOCAL if it's MOD_CORE
+#define ROUTE_ANY_ORIGIN -1
+
+/**
+ * One routing table rule: messages of msgtype coming from origin (a
+ * ModuleID or ROUTE_ANY_ORIGIN) go to dest (a ModuleID, ROUTE_LOCAL,
+ * ROUTE_DROP or ROUTE_DIRECT). Later rules override earlier ones; unmatched
+ * entries are ROUTE_LOCAL.
+ */
+typedef struct {
+  int origin;
+  MSGType msgtype;
+  int dest;
+} RouteRule;
+
+struct Router;
+
+typedef void (*RouterLocalHandler)(struct Router *rt, const IPCMessage *msg,
+                                   void *userdata);
+
+typedef struct {
+  struct Router *router;
+  ModuleID id;
+  int fd;      // -1 while disconnected
+  int poll_fd; // where incoming messages are signalled (eventfd on shm)
+
+  // outbound backlog, ring of ROUTER_QUEUE_LEN messages
+  IPCMessage *queue;
+  size_t q_head;
+  size_t q_count;
+  bool drop_logged;
+
+  uint64_t rx;
+  uint64_t tx;
+  uint64_t queued;  // messages that had to wait in the backlog
+  uint64_t dropped; // backlog full
+  uint64_t connects;
+} RouterModule;
+
+typedef struct {
+  struct Router *router;
+  int fd; // -1 when the slot is free
+  int poll_fd;
+  uint64_t since_ms;
+} RouterPending;
+
+typedef struct Router {
+  Reactor *reactor;
+  int listen_fd;
+  int retry_timer_fd;
+  bool retry_armed;
+  const char *path;
+
+  uint8_t routes[MOD_COUNT][MSG_TYPE_COUNT];
+  RouterModule modules[MOD_COUNT];
+  RouterPending pending[ROUTER_MAX_PENDING];
+
+  RouterLocalHandler local;
+  void *local_userdata;
+
+  IPCMessage rx_batch[IPC_BATCH_MAX];
+  uint64_t unroutable;
+  uint64_t dest_ignored; // msg.dest set where the table doesn't allow it
+} Router;
+
+/**
+ * Builds the routing table, allocates the per-module backlogs from arena and
+ * starts listening on path (an existing socket file is replaced).
+ * Returns 0 on success, -1 on error.
+ */
+int router_init(Router *rt, Reactor *r, Arena *arena, const char *path,
+                const RouteRule *rules, size_t rule_count,
+                RouterLocalHandler local, void *userdata);
+
+/**
+ * Sends msg from the controller to module dest without blocking. If the
+ * module is disconnected or not keeping up, msg waits in its backlog.
+ * Returns:
+ *  0: Sent or queued.
+ * -1: Dropped (invalid destination or backlog full).
+ */
+int router_send(Router *rt, ModuleID dest, const IPCMessage *msg);
+
+/**
+ * Logs per-module traffic counters.
+ */
+void router_log_stats(const Router *rt);
+
+/**
+ * Disconnects every module, stops listening and removes the socket file.
+ */
+void router_close(Router *rt);
+
+#endif // ROUTER_H
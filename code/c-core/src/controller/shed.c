@@ -0,0 +1,115 @@
+#define MODULE_NAME "SHED"
+
+#include <string.h>
+
+#include "logging.h"
+#include "shed.h"
+
+static const char *const level_names[SHED_LEVEL_COUNT] = {
+    [SHED_NONE] = "none",
+    [SHED_TELEMETRY] = "telemetry",
+    [SHED_SAMPLE] = "sample",
+    [SHED_SUMMARY] = "summary",
+};
+
+static const char *const metric_names[SHED_METRIC_COUNT] = {
+    [SHED_TEMP] = "temp",
+    [SHED_CPU] = "cpu",
+    [SHED_QUEUE] = "queue",
+};
+
+// The highest level some metric is at or over the entry threshold of
+static ShedLevel pressure(const ShedPolicy *p, const int32_t *values,
+                          ShedMetric *cause) {
+  ShedLevel top = SHED_NONE;
+  for (int m = 0; m < SHED_METRIC_COUNT; m++) {
+    if (values[m] == SHED_UNKNOWN) {
+      continue;
+    }
+    for (int l = SHED_LEVEL_COUNT - 1; l > (int)top; l--) {
+      if (values[m] >= p->cfg.metrics[m].enter[l]) {
+        top = (ShedLevel)l;
+        *cause = (ShedMetric)m;
+        break;
+      }
+    }
+  }
+  return top;
+}
+
+// Whether every metric is under the exit thresholds of level
+static bool calm(const ShedPolicy *p, const int32_t *values, ShedLevel level) {
+  for (int m = 0; m < SHED_METRIC_COUNT; m++) {
+    if (values[m] != SHED_UNKNOWN &&
+        values[m] >= p->cfg.metrics[m].exit[level]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int shed_init(ShedPolicy *p, const ShedConfig *cfg) {
+  for (int m = 0; m < SHED_METRIC_COUNT; m++) {
+    for (int l = SHED_NONE + 1; l < SHED_LEVEL_COUNT; l++) {
+      if (cfg->metrics[m].exit[l] >= cfg->metrics[m].enter[l]) {
+        LOG_ERROR("The %s exit threshold of level %s isn't under its entry",
+                  metric_names[m], level_names[l]);
+        return -1;
+      }
+    }
+  }
+  memset(p, 0, sizeof(*p));
+  p->cfg = *cfg;
+  if (p->cfg.rise_samples == 0) {
+    p->cfg.rise_samples = 1;
+  }
+  for (int m = 0; m < SHED_METRIC_COUNT; m++) {
+    p->values[m] = SHED_UNKNOWN;
+  }
+  return 0;
+}
+
+bool shed_update(ShedPolicy *p, const int32_t values[SHED_METRIC_COUNT],
+                 uint64_t now_ms) {
+  memcpy(p->values, values, sizeof(p->values));
+
+  ShedMetric cause = p->cause;
+  ShedLevel top = pressure(p, values, &cause);
+  if (top > p->level) {
+    p->calm_since_ms = 0;
+    if (++p->above < p->cfg.rise_samples) {
+      return false;
+    }
+    p->level = top;
+    p->cause = cause;
+    p->above = 0;
+    p->raised++;
+    return true;
+  }
+  p->above = 0;
+
+  if (p->level == SHED_NONE || !calm(p, values, p->level)) {
+    p->calm_since_ms = 0;
+    return false;
+  }
+  if (p->calm_since_ms == 0) {
+    p->calm_since_ms = now_ms > 0 ? now_ms : 1;
+    return false;
+  }
+  if (now_ms - p->calm_since_ms < p->cfg.hold_ms) {
+    return false;
+  }
+  // The next level down has to hold on its own
+  p->level = (ShedLevel)(p->level - 1);
+  p->calm_since_ms = p->level > SHED_NONE ? now_ms : 0;
+  p->lowered++;
+  return true;
+}
+
+const char *shed_level_name(ShedLevel level) {
+  return level < SHED_LEVEL_COUNT ? level_names[level] : "?";
+}
+
+const char *shed_metric_name(ShedMetric metric) {
+  return metric < SHED_METRIC_COUNT ? metric_names[metric] : "?";
+}
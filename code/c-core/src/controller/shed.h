@@ -0,0 +1,100 @@
+#ifndef SHED_H
+#define SHED_H
+
+/* ==========================================================================
+ *  Orange Sentry - Load shedding policy
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Under a sustained flood the board can overheat, throttle and stall the
+ *  control plane. This decides how much work to give up, in grades:
+ *    SHED_TELEMETRY  low-priority telemetry (system stats) is paused
+ *    SHED_SAMPLE     and the passive listener tracks 1 source in N
+ *    SHED_SUMMARY    and MQTT only gets summaries: alerts and probes are
+ *                    counted, not published one by one
+ *  Each level includes the ones below it.
+ *
+ *  The inputs are metrics where higher is worse: CPU temperature, CPU
+ *  busy and the fill of the fullest outbound queue. Each metric has an
+ *  entry and a lower exit threshold per level. The level is raised once
+ *  the metrics have been at or over a higher level's entry threshold for
+ *  rise_samples samples in a row, straight to the level the last of them
+ *  reached. It is lowered one level at a time, once every metric has
+ *  stayed under the current level's exit thresholds for hold_ms. The gap
+ *  between the thresholds and the hold keep it from flapping.
+ *
+ *  The policy only decides: what each level means is up to the caller.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. shed_init() with the thresholds.
+ *  2. shed_update() with every new set of metrics; act when it returns
+ *     true.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+  SHED_NONE = 0,
+  SHED_TELEMETRY,
+  SHED_SAMPLE,
+  SHED_SUMMARY,
+  SHED_LEVEL_COUNT // keep last
+} ShedLevel;
+
+typedef enum {
+  SHED_TEMP = 0, // millidegrees C
+  SHED_CPU,      // permille busy
+  SHED_QUEUE,    // permille full
+  SHED_METRIC_COUNT // keep last
+} ShedMetric;
+
+// Metrics that aren't known (no thermal sensor) never trigger anything
+#define SHED_UNKNOWN INT32_MIN
+
+typedef struct {
+  // index 0 (SHED_NONE) is unused
+  int32_t enter[SHED_LEVEL_COUNT];
+  int32_t exit[SHED_LEVEL_COUNT]; // below enter
+} ShedThresholds;
+
+typedef struct {
+  ShedThresholds metrics[SHED_METRIC_COUNT];
+  uint32_t rise_samples; // at least 1
+  uint64_t hold_ms;
+} ShedConfig;
+
+typedef struct {
+  ShedConfig cfg;
+  ShedLevel level;
+  ShedMetric cause; // the metric that raised or last held the level
+  int32_t values[SHED_METRIC_COUNT]; // as of the last update
+
+  uint32_t above;         // samples in a row over the level
+  uint64_t calm_since_ms; // every metric under the exit thresholds, 0: not
+
+  // counters
+  uint64_t raised;
+  uint64_t lowered;
+} ShedPolicy;
+
+/* *
+ * Starts at SHED_NONE.
+ * * Returns:
+ * 0 on success, -1 if an exit threshold isn't under its entry threshold.
+ */
+int shed_init(ShedPolicy *p, const ShedConfig *cfg);
+
+/* *
+ * Accounts for one set of metrics. now_ms is a monotonic clock.
+ * * Returns:
+ * true if the level changed; p->level is the new one.
+ */
+bool shed_update(ShedPolicy *p, const int32_t values[SHED_METRIC_COUNT],
+                 uint64_t now_ms);
+
+const char *shed_level_name(ShedLevel level);
+const char *shed_metric_name(ShedMetric metric);
+
+#endif // SHED_H
@@ -0,0 +1,123 @@
+#define MODULE_NAME "STANDBY"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "logging.h"
+#include "standby.h"
+
+#define CGROUP_V2_FMT "/sys/fs/cgroup/system.slice/%s/memory.current"
+#define CGROUP_V1_FMT                                                          \
+  "/sys/fs/cgroup/memory/system.slice/%s/memory.usage_in_bytes"
+
+// ---- reading ----
+
+static int64_t read_bytes(const char *fmt, const char *unit) {
+  char path[160];
+  int n = snprintf(path, sizeof(path), fmt, unit);
+  if (n < 0 || (size_t)n >= sizeof(path)) {
+    return -1;
+  }
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  int64_t bytes;
+  if (fscanf(f, "%" SCNd64, &bytes) != 1) {
+    bytes = -1;
+  }
+  fclose(f);
+  return bytes;
+}
+
+static int64_t unit_memory(const char *unit) {
+  int64_t bytes = read_bytes(CGROUP_V2_FMT, unit);
+  return bytes >= 0 ? bytes : read_bytes(CGROUP_V1_FMT, unit);
+}
+
+static int64_t mem_available(void) {
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  char line[128];
+  int64_t kb = -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "MemAvailable: %" SCNd64 " kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return kb >= 0 ? kb * 1024 : -1;
+}
+
+// ---- API ----
+
+int standby_init(StandbyReport *s, bool enabled, const char *const *units,
+                 size_t count) {
+  if (count > STANDBY_MAX_SERVICES) {
+    LOG_ERROR("Too many services (%zu, at most %d)", count,
+              STANDBY_MAX_SERVICES);
+    return -1;
+  }
+  memset(s, 0, sizeof(*s));
+  s->enabled = enabled;
+  s->count = count;
+  s->available_bytes = -1;
+  for (size_t i = 0; i < count; i++) {
+    s->services[i].unit = units[i];
+    s->services[i].mem_bytes = -1;
+  }
+  return 0;
+}
+
+void standby_record_start(StandbyReport *s, size_t service, uint64_t us) {
+  if (service < s->count && s->services[service].unit != NULL) {
+    s->services[service].start_us = us;
+  }
+}
+
+void standby_measure(StandbyReport *s, uint32_t up) {
+  for (size_t i = 0; i < s->count; i++) {
+    StandbyService *svc = &s->services[i];
+    svc->mem_bytes = svc->unit != NULL && (up & (1u << i))
+                         ? unit_memory(svc->unit)
+                         : -1;
+  }
+  s->available_bytes = mem_available();
+}
+
+int standby_format(const StandbyReport *s, char *buf, size_t size) {
+  // {"standby":true,"avail_kb":N,"services":{"unit":{"kb":N,"start_ms":N}}}
+  // with -1 for what isn't known
+  size_t len = 0;
+  int n = snprintf(buf, size, "{\"standby\":%s,\"avail_kb\":%" PRId64
+                              ",\"services\":{",
+                   s->enabled ? "true" : "false",
+                   s->available_bytes < 0 ? -1 : s->available_bytes / 1024);
+  bool first = true;
+  for (size_t i = 0; i < s->count && n >= 0 && (size_t)n < size - len; i++) {
+    len += (size_t)n;
+    n = 0;
+    const StandbyService *svc = &s->services[i];
+    if (svc->unit == NULL) {
+      continue;
+    }
+    n = snprintf(buf + len, size - len,
+                 "%s\"%s\":{\"kb\":%" PRId64 ",\"start_ms\":%" PRId64 "}",
+                 first ? "" : ",", svc->unit,
+                 svc->mem_bytes < 0 ? -1 : svc->mem_bytes / 1024,
+                 svc->start_us == 0 ? -1 : (int64_t)(svc->start_us / 1000));
+    first = false;
+  }
+  if (n < 0 || (size_t)n >= size - len) {
+    return -1;
+  }
+  len += (size_t)n;
+  n = snprintf(buf + len, size - len, "}}");
+  if (n < 0 || (size_t)n >= size - len) {
+    return -1;
+  }
+  return (int)(len + (size_t)n);
+}
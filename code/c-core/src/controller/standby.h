@@ -0,0 +1,69 @@
+#ifndef STANDBY_H
+#define STANDBY_H
+
+/* ==========================================================================
+ *  Orange Sentry - Hot standby cost
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  With hot standby the honeypot services (Cowrie, Suricata) stay up in
+ *  every state, unreachable from outside, so that entering or leaving
+ *  Honeypot only swaps firewall rules. That trades RAM for the seconds
+ *  they take to start. This reports both sides so each deployment can
+ *  decide:
+ *  - what each service holds, from the memory accounting of its systemd
+ *    unit's cgroup (v2 memory.current, else v1 memory.usage_in_bytes),
+ *    measured whenever it's up, standby or not;
+ *  - how long its last cold start took, as timed by a transition;
+ *  - how much memory the system still has available.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. standby_init() with the units of the services to report on.
+ *  2. standby_record_start() with every start a transition timed.
+ *  3. standby_measure() then standby_format() for a report.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STANDBY_MAX_SERVICES 8
+
+typedef struct {
+  const char *unit; // systemd unit, e.g. "cowrie.service"
+  int64_t mem_bytes; // as of standby_measure(), -1 if unknown or not up
+  uint64_t start_us; // last cold start, 0 if never timed
+} StandbyService;
+
+typedef struct {
+  bool enabled; // the policy is on: the services never stop
+  StandbyService services[STANDBY_MAX_SERVICES];
+  size_t count;
+  int64_t available_bytes; // MemAvailable, -1 if unknown
+} StandbyReport;
+
+/* *
+ * units[i] is the unit of service i, NULL for services not reported on.
+ * * Returns:
+ * 0 on success, -1 if there are too many services.
+ */
+int standby_init(StandbyReport *s, bool enabled, const char *const *units,
+                 size_t count);
+
+void standby_record_start(StandbyReport *s, size_t service, uint64_t us);
+
+/* *
+ * Reads the memory of every service in up (bit per index) and what the
+ * system has available; the others are reported unknown.
+ */
+void standby_measure(StandbyReport *s, uint32_t up);
+
+/* *
+ * Formats the report as JSON into buf.
+ * * Returns:
+ * The length, or -1 if it doesn't fit.
+ */
+int standby_format(const StandbyReport *s, char *buf, size_t size);
+
+#endif // STANDBY_H
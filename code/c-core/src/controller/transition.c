@@ -0,0 +1,527 @@
+#define MODULE_NAME "TRANSITION"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "transition.h"
+
+// Same number on every architecture
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+extern char **environ;
+
+static void transition_advance(Transition *t);
+
+static uint64_t transition_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static inline bool step_over(const Step *s) {
+  return s->status >= STEP_DONE;
+}
+
+static const ServiceDef *step_service(const Transition *t, const Step *s) {
+  return s->service == STEP_FIREWALL ? NULL : &t->services[s->service];
+}
+
+// ---- child processes ----
+
+static int pidfd_open(pid_t pid) {
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void step_kill(Step *s, int sig) {
+  if (s->pidfd >= 0) {
+    syscall(SYS_pidfd_send_signal, s->pidfd, sig, NULL, 0);
+  }
+}
+
+// The loop blocks SIGINT and SIGTERM for its signalfd; children must not
+// inherit that, or they couldn't be stopped
+static int spawn(const char *const *argv, pid_t *pid) {
+  posix_spawnattr_t attr;
+  sigset_t none, all;
+  sigemptyset(&none);
+  sigfillset(&all);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &all);
+  posix_spawnattr_setflags(&attr,
+                           POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  int rc = posix_spawnp(pid, argv[0], NULL, &attr, (char *const *)argv,
+                        environ);
+  posix_spawnattr_destroy(&attr);
+  return rc;
+}
+
+// Is something accepting connections on the loopback port?
+static bool probe_port(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  // Refused or accepted right away on loopback: this doesn't block
+  bool ready = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  close(fd);
+  return ready;
+}
+
+// ---- steps ----
+
+static void step_end(Transition *t, Step *s, StepStatus status) {
+  s->status = status;
+  s->ended_us = transition_now_us();
+  if (s->pidfd >= 0) {
+    reactor_del_fd(t->reactor, s->pidfd);
+    close(s->pidfd);
+    s->pidfd = -1;
+  }
+
+  if (s->service == STEP_FIREWALL) {
+    return;
+  }
+  uint32_t bit = 1u << s->service;
+  if (status == STEP_DONE) {
+    t->up = s->start ? t->up | bit : t->up & ~bit;
+  } else if (s->start && s->started_us != 0) {
+    // It may be half up: make sure the rollback stops it
+    t->up |= bit;
+  }
+}
+
+// Records the first failure, launches nothing more and stops what is still
+// running. Commands are reaped by on_child_exit() as they go.
+static void transition_abort(Transition *t, Step *failed, int err) {
+  if (t->status != 0) {
+    return;
+  }
+  t->status = err;
+  t->failed_step = (int)(failed - t->steps);
+  LOG_ERROR("%s %s failed: %s", failed->start ? "Starting" : "Stopping",
+            transition_step_name(t, failed), strerror(-err));
+
+  for (size_t i = 0; i < t->step_count; i++) {
+    Step *o = &t->steps[i];
+    if (o->status == STEP_PENDING) {
+      o->status = STEP_CANCELLED;
+    } else if (o->pidfd >= 0) {
+      // SIGKILL if it's still there after the grace period
+      step_kill(o, SIGTERM);
+      o->deadline_us = transition_now_us() + TRANSITION_KILL_GRACE_MS * 1000ULL;
+    } else if (!step_over(o)) {
+      step_end(t, o, o == failed ? STEP_FAILED : STEP_CANCELLED);
+    }
+  }
+}
+
+// For a step with no process left
+static void step_fail(Transition *t, Step *s, int err) {
+  if (t->status != 0) {
+    step_end(t, s, STEP_CANCELLED);
+    return;
+  }
+  transition_abort(t, s, err);
+}
+
+static void on_child_exit(Reactor *r, int fd, uint32_t events,
+                          void *userdata) {
+  Transition *t = (Transition *)userdata;
+  Step *s = NULL;
+  for (size_t i = 0; i < t->step_count; i++) {
+    if (t->steps[i].pidfd == fd) {
+      s = &t->steps[i];
+    }
+  }
+  if (s == NULL) {
+    return;
+  }
+
+  int wstatus = 0;
+  if (waitpid(s->pid, &wstatus, WNOHANG) == 0) {
+    return; // not yet
+  }
+  reactor_del_fd(r, fd);
+  close(fd);
+  s->pidfd = -1;
+
+  const ServiceDef *svc = step_service(t, s);
+  if (t->status != 0) {
+    bool failed = t->failed_step == (int)(s - t->steps);
+    step_end(t, s, failed ? STEP_FAILED : STEP_CANCELLED);
+  } else if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+    LOG_WARN("%s exited with status %d", svc->name,
+             WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -WTERMSIG(wstatus));
+    step_fail(t, s, -EIO); // what went wrong is the command's to log
+  } else if (s->start && svc->ready_port != 0 &&
+             !probe_port(svc->ready_port)) {
+    s->status = STEP_PROBING; // the tick probes again until the deadline
+  } else {
+    step_end(t, s, STEP_DONE);
+  }
+  transition_advance(t);
+}
+
+static void step_launch(Transition *t, Step *s) {
+  s->status = STEP_RUNNING;
+  s->started_us = transition_now_us();
+
+  IPCMessage msg;
+  memset(&msg, 0, sizeof(IPCMessage));
+
+  if (s->service == STEP_FIREWALL) {
+    s->deadline_us = s->started_us + TRANSITION_FIREWALL_TIMEOUT_MS * 1000ULL;
+    msg.msgtype = MSG_CMD_SET_STATE;
+    msg.payload_len = sizeof(PayloadState);
+    msg.payload.state.state = (uint8_t)t->to;
+    if (t->send_fn(t->userdata, MOD_FIREWALL, &msg) != 0) {
+      step_fail(t, s, -EPIPE);
+    }
+    return; // done when the firewall answers
+  }
+
+  const ServiceDef *svc = step_service(t, s);
+  s->deadline_us = s->started_us + svc->timeout_ms * 1000ULL;
+
+  if (svc->kind == SVC_MODULE) {
+    msg.msgtype = s->start ? MSG_CMD_START : MSG_CMD_STOP;
+    if (t->send_fn(t->userdata, svc->module, &msg) != 0) {
+      step_fail(t, s, -EPIPE);
+    } else {
+      step_end(t, s, STEP_DONE);
+    }
+    return;
+  }
+
+  const char *const *argv = s->start ? svc->start_argv : svc->stop_argv;
+  if (argv == NULL) {
+    step_end(t, s, STEP_DONE);
+    return;
+  }
+  int rc = spawn(argv, &s->pid);
+  if (rc != 0) {
+    LOG_ERROR("Failed to run %s: %s", argv[0], strerror(rc));
+    step_fail(t, s, -rc);
+    return;
+  }
+  s->pidfd = pidfd_open(s->pid);
+  if (s->pidfd < 0 ||
+      reactor_add_fd(t->reactor, s->pidfd, EPOLLIN, on_child_exit, t) != 0) {
+    // Can't be watched: don't leave it running unsupervised
+    int err = s->pidfd < 0 ? -errno : -EMFILE;
+    kill(s->pid, SIGKILL);
+    waitpid(s->pid, NULL, 0);
+    if (s->pidfd >= 0) {
+      close(s->pidfd);
+      s->pidfd = -1;
+    }
+    step_fail(t, s, err);
+  }
+}
+
+static void on_tick(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Transition *t = (Transition *)userdata;
+  reactor_timer_ack(fd);
+
+  uint64_t now = transition_now_us();
+  for (size_t i = 0; i < t->step_count; i++) {
+    Step *s = &t->steps[i];
+    if (s->status == STEP_PROBING &&
+        probe_port(step_service(t, s)->ready_port)) {
+      step_end(t, s, STEP_DONE);
+    } else if ((s->status == STEP_RUNNING || s->status == STEP_PROBING) &&
+               now >= s->deadline_us) {
+      if (t->status == 0) {
+        // A command still running is killed, and fails once reaped
+        transition_abort(t, s, -ETIMEDOUT);
+      } else {
+        step_kill(s, SIGKILL);
+      }
+    }
+  }
+  transition_advance(t);
+}
+
+// ---- planning ----
+
+static size_t add_step(Transition *t, uint8_t service, bool start,
+                       uint32_t deps) {
+  Step *s = &t->steps[t->step_count];
+  memset(s, 0, sizeof(Step));
+  s->service = service;
+  s->start = start;
+  s->deps = deps;
+  s->pidfd = -1;
+  return t->step_count++;
+}
+
+// Steps are added dependencies first, so every dep has a lower index
+static void plan(Transition *t) {
+  uint32_t starting = t->wanted[t->to] & ~t->up;
+  uint32_t stopping = t->up & ~t->wanted[t->to];
+  size_t step_of[TRANSITION_MAX_SERVICES];
+
+  uint32_t starts = 0; // steps
+  uint32_t added = 0;  // services
+  for (bool progress = true; progress;) {
+    progress = false;
+    for (size_t i = 0; i < t->service_count; i++) {
+      uint32_t bit = 1u << i;
+      uint32_t waits = t->services[i].after & starting & ~added;
+      if (!(starting & bit) || (added & bit) || waits != 0) {
+        continue;
+      }
+      uint32_t deps = 0;
+      for (size_t j = 0; j < t->service_count; j++) {
+        if (t->services[i].after & starting & (1u << j)) {
+          deps |= 1u << step_of[j];
+        }
+      }
+      step_of[i] = add_step(t, (uint8_t)i, true, deps);
+      starts |= 1u << step_of[i];
+      added |= bit;
+      progress = true;
+    }
+  }
+
+  if (added != starting) {
+    LOG_ERROR("Services 0x%x depend on each other, not starting them",
+              starting & ~added);
+  }
+
+  // The firewall opens once everything behind it is up... unless the rules
+  // stay the same. A rollback has from == to too, but the failed transition
+  // may have swapped them.
+  uint32_t fw_dep = 0;
+  if (t->from != t->to || t->rollback) {
+    fw_dep = 1u << add_step(t, STEP_FIREWALL, true, starts);
+  }
+
+  // ...and closes before anything behind it goes. A service stops after
+  // the ones started after it.
+  added = 0;
+  for (bool progress = true; progress;) {
+    progress = false;
+    for (size_t i = 0; i < t->service_count; i++) {
+      uint32_t bit = 1u << i;
+      if (!(stopping & bit) || (added & bit)) {
+        continue;
+      }
+      uint32_t deps = fw_dep;
+      bool ready = true;
+      for (size_t j = 0; j < t->service_count; j++) {
+        if ((stopping & (1u << j)) && (t->services[j].after & bit)) {
+          ready = ready && (added & (1u << j));
+          deps |= 1u << step_of[j];
+        }
+      }
+      if (!ready) {
+        continue;
+      }
+      step_of[i] = add_step(t, (uint8_t)i, false, deps);
+      added |= bit;
+      progress = true;
+    }
+  }
+  if (added != stopping) {
+    LOG_ERROR("Services 0x%x depend on each other, not stopping them",
+              stopping & ~added);
+  }
+}
+
+static int transition_begin(Transition *t, SystemState to, bool rollback) {
+  t->active = true;
+  t->rollback = rollback;
+  t->from = t->state;
+  t->to = to;
+  t->step_count = 0;
+  t->status = 0;
+  t->failed_step = -1;
+  t->started_us = transition_now_us();
+  t->ended_us = 0;
+  t->transitions++;
+
+  plan(t);
+  reactor_timer_set(t->timer_fd, TRANSITION_TICK_MS);
+  transition_advance(t);
+  return 0;
+}
+
+static void transition_finish(Transition *t) {
+  t->active = false;
+  t->ended_us = transition_now_us();
+  reactor_timer_set(t->timer_fd, 0);
+
+  bool roll_back = t->status != 0 && !t->rollback;
+  if (t->status == 0 || t->rollback) {
+    // A failed rollback leaves us nowhere better than where we meant to be
+    t->state = t->to;
+  }
+  if (t->status != 0) {
+    t->failures++;
+  }
+  if (t->done_fn != NULL) {
+    t->done_fn(t->userdata, t);
+  }
+  if (roll_back) {
+    t->rollbacks++;
+    transition_begin(t, t->from, true);
+  }
+}
+
+static void transition_advance(Transition *t) {
+  if (t->advancing) {
+    t->again = true;
+    return;
+  }
+  t->advancing = true;
+  do {
+    t->again = false;
+    bool over = true;
+    for (size_t i = 0; i < t->step_count && t->active; i++) {
+      Step *s = &t->steps[i];
+      if (s->status == STEP_PENDING && t->status == 0) {
+        bool ready = true;
+        for (size_t j = 0; j < t->step_count; j++) {
+          if ((s->deps & (1u << j)) && t->steps[j].status != STEP_DONE) {
+            ready = false;
+          }
+        }
+        if (ready) {
+          step_launch(t, s);
+        }
+      }
+      over = over && step_over(s);
+    }
+    if (over && t->active) {
+      t->advancing = false;
+      transition_finish(t); // may begin the rollback, which advances
+      return;
+    }
+  } while (t->again);
+  t->advancing = false;
+}
+
+// ---- public API ----
+
+int transition_init(Transition *t, Reactor *r, const ServiceDef *services,
+                    size_t service_count,
+                    const uint32_t wanted[STATE_COUNT],
+                    TransitionSendFn send_fn, TransitionDoneFn done_fn,
+                    void *userdata) {
+  if (t == NULL || r == NULL || service_count > TRANSITION_MAX_SERVICES ||
+      (services == NULL && service_count > 0) || send_fn == NULL) {
+    LOG_ERROR("Invalid arguments to transition_init");
+    return -1;
+  }
+
+  memset(t, 0, sizeof(Transition));
+  t->reactor = r;
+  t->services = services;
+  t->service_count = service_count;
+  memcpy(t->wanted, wanted, sizeof(t->wanted));
+  t->send_fn = send_fn;
+  t->done_fn = done_fn;
+  t->userdata = userdata;
+  t->state = STATE_CLOSED;
+  t->failed_step = -1;
+
+  t->timer_fd = reactor_add_timer(r, TRANSITION_TICK_MS, on_tick, t);
+  if (t->timer_fd < 0) {
+    return -1;
+  }
+  reactor_timer_set(t->timer_fd, 0);
+  return 0;
+}
+
+int transition_start(Transition *t, SystemState to) {
+  if (t->active || (unsigned)to >= STATE_COUNT) {
+    return -1;
+  }
+  return transition_begin(t, to, false);
+}
+
+bool transition_on_message(Transition *t, const IPCMessage *msg) {
+  if (msg->msgtype != MSG_EVT_STATE_DONE || !t->active) {
+    return false;
+  }
+  for (size_t i = 0; i < t->step_count; i++) {
+    Step *s = &t->steps[i];
+    if (s->service != STEP_FIREWALL || s->status != STEP_RUNNING ||
+        msg->payload.state_done.state != t->to) {
+      continue;
+    }
+    if (msg->payload.state_done.status == 0) {
+      step_end(t, s, STEP_DONE);
+    } else {
+      step_fail(t, s, msg->payload.state_done.status);
+    }
+    transition_advance(t);
+    return true;
+  }
+  return false;
+}
+
+uint64_t transition_step_us(const Step *s) {
+  return s->started_us != 0 && s->ended_us >= s->started_us
+             ? s->ended_us - s->started_us
+             : 0;
+}
+
+uint64_t transition_critical_us(const Transition *t) {
+  // Deps have lower indexes: one pass in order finds every chain's length
+  uint64_t chain[TRANSITION_MAX_STEPS];
+  uint64_t longest = 0;
+  for (size_t i = 0; i < t->step_count; i++) {
+    uint64_t before = 0;
+    for (size_t j = 0; j < i; j++) {
+      if ((t->steps[i].deps & (1u << j)) && chain[j] > before) {
+        before = chain[j];
+      }
+    }
+    chain[i] = before + transition_step_us(&t->steps[i]);
+    longest = chain[i] > longest ? chain[i] : longest;
+  }
+  return longest;
+}
+
+const char *transition_step_name(const Transition *t, const Step *s) {
+  return s->service == STEP_FIREWALL ? "firewall"
+                                     : t->services[s->service].name;
+}
+
+void transition_close(Transition *t) {
+  for (size_t i = 0; i < t->step_count; i++) {
+    Step *s = &t->steps[i];
+    if (s->pidfd >= 0) {
+      step_kill(s, SIGKILL);
+      waitpid(s->pid, NULL, 0);
+      reactor_del_fd(t->reactor, s->pidfd);
+      close(s->pidfd);
+      s->pidfd = -1;
+    }
+  }
+  t->active = false;
+  if (t->timer_fd >= 0) {
+    reactor_del_fd(t->reactor, t->timer_fd);
+    t->timer_fd = -1;
+  }
+}
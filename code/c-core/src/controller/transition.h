@@ -0,0 +1,192 @@
+#ifndef TRANSITION_H
+#define TRANSITION_H
+
+/* ==========================================================================
+ *  Orange Sentry - State transition engine
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Takes the system from one SystemState to another by starting the
+ *  services the new state needs and stopping the ones it doesn't, as a
+ *  dependency graph instead of a list: every step starts as soon as the
+ *  steps it depends on are done, so independent services come up in
+ *  parallel and a transition takes as long as its slowest chain of
+ *  dependencies, not the sum of its steps.
+ *
+ *  A service is one of:
+ *  - SVC_EXEC:     a command (e.g. systemctl start cowrie), spawned without
+ *                  blocking the loop and watched through a pidfd; done when
+ *                  it exits 0 and, if ready_port is set, something accepts
+ *                  connections on that loopback port;
+ *  - SVC_MODULE:   a module sent MSG_CMD_START / MSG_CMD_STOP, done once the
+ *                  command is handed to the router.
+ *  The firewall is a step of every transition between two states:
+ *  MSG_CMD_SET_STATE, done when it answers MSG_EVT_STATE_DONE. It opens
+ *  the door last: it waits for every service being started, and every
+ *  service being stopped waits for it. A transition to the state the
+ *  system is already in only brings the services in line (e.g. warming
+ *  up standby services) and leaves the rules alone.
+ *
+ *  Every step has a timeout. When one fails, nothing new is launched, the
+ *  commands still running are sent SIGTERM, and once they are gone the
+ *  engine rolls back: a transition to the state it came from, from the
+ *  services actually up. If the rollback fails too, the state is left as
+ *  it is and reported.
+ *
+ *  The time of every step and of the whole transition is recorded and
+ *  handed to a callback when it ends, with the critical path: the longest
+ *  chain of dependent steps, which is what the transition cost.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. transition_init() with the services, the services each state wants
+ *     and the callbacks.
+ *  2. transition_start() on a state change; one transition at a time.
+ *  3. transition_on_message() with every MSG_EVT_STATE_DONE.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "reactor.h"
+#include "sockclient.h"
+
+#define TRANSITION_MAX_SERVICES 8
+#define TRANSITION_MAX_STEPS (2 * TRANSITION_MAX_SERVICES + 1)
+#define TRANSITION_TICK_MS 20 // deadlines and readiness probes, while active
+#define TRANSITION_FIREWALL_TIMEOUT_MS 3000
+#define TRANSITION_KILL_GRACE_MS 2000 // SIGTERM to SIGKILL, after a failure
+
+typedef enum { SVC_EXEC, SVC_MODULE } ServiceKind;
+
+typedef struct {
+  const char *name;
+  ServiceKind kind;
+  const char *const *start_argv; // SVC_EXEC, NULL-terminated
+  const char *const *stop_argv;
+  uint16_t ready_port; // SVC_EXEC: also wait for a listener here, 0: none
+  ModuleID module;     // SVC_MODULE
+  uint32_t after;      // services (bit per index) that start before this one
+  uint32_t timeout_ms; // per start or stop
+} ServiceDef;
+
+typedef enum {
+  STEP_PENDING = 0,
+  STEP_RUNNING, // spawned, or waiting for a reply
+  STEP_PROBING, // command done, waiting for ready_port
+  STEP_DONE,
+  STEP_FAILED,
+  STEP_CANCELLED, // never started, or stopped by a failure elsewhere
+} StepStatus;
+
+#define STEP_FIREWALL 0xff // Step.service of the firewall step
+
+typedef struct {
+  uint8_t service; // index into the services, or STEP_FIREWALL
+  bool start;
+  StepStatus status;
+  uint32_t deps; // steps (bit per index) that must be done first
+  pid_t pid;
+  int pidfd;
+  uint64_t started_us;
+  uint64_t ended_us;
+  uint64_t deadline_us;
+} Step;
+
+struct Transition;
+
+/* *
+ * Sends a message to a module (a Router in the controller).
+ * * Returns:
+ * 0 if it was sent or queued, -1 otherwise.
+ */
+typedef int (*TransitionSendFn)(void *userdata, ModuleID dest,
+                                const IPCMessage *msg);
+
+/* *
+ * Called when a transition ends, with t->status 0 or the first failed
+ * step's error, t->state the state the system is in now, and the steps
+ * still holding their timings. After a failure (t->status != 0 and not
+ * t->rollback) the rollback starts as soon as the callback returns: don't
+ * start another transition from it.
+ */
+typedef void (*TransitionDoneFn)(void *userdata, const struct Transition *t);
+
+typedef struct Transition {
+  Reactor *reactor;
+  const ServiceDef *services;
+  size_t service_count;
+  uint32_t wanted[STATE_COUNT]; // services each state runs
+  uint32_t up;                  // services running now
+  TransitionSendFn send_fn;
+  TransitionDoneFn done_fn;
+  void *userdata;
+
+  SystemState state; // the system's, as of the last transition that ended
+  bool active;
+  bool rollback; // this transition undoes a failed one
+  SystemState from;
+  SystemState to;
+  Step steps[TRANSITION_MAX_STEPS];
+  size_t step_count;
+  int status;      // 0, or the negative errno of the first failure
+  int failed_step; // -1 if none
+  uint64_t started_us;
+  uint64_t ended_us;
+  int timer_fd;
+  bool advancing; // re-entrancy guard for transition_advance()
+  bool again;
+
+  // counters
+  uint64_t transitions;
+  uint64_t failures;
+  uint64_t rollbacks;
+} Transition;
+
+/* *
+ * wanted[s] is the set of services (bit per index) state s runs. The system
+ * is assumed to be in STATE_CLOSED with nothing up.
+ * * Returns:
+ * 0 on success, -1 on invalid arguments or if the timer can't be created.
+ */
+int transition_init(Transition *t, Reactor *r, const ServiceDef *services,
+                    size_t service_count,
+                    const uint32_t wanted[STATE_COUNT],
+                    TransitionSendFn send_fn, TransitionDoneFn done_fn,
+                    void *userdata);
+
+/* *
+ * Starts taking the system from t->state to state to.
+ * * Returns:
+ * 0 if started, -1 if a transition is already running or to is invalid.
+ */
+int transition_start(Transition *t, SystemState to);
+
+/* *
+ * Feeds a message the engine may be waiting for.
+ * * Returns:
+ * true if it was the firewall's answer to the running transition.
+ */
+bool transition_on_message(Transition *t, const IPCMessage *msg);
+
+/* *
+ * Microseconds the step took; 0 if it never ran.
+ */
+uint64_t transition_step_us(const Step *s);
+
+/* *
+ * The longest chain of dependent steps of the last transition: the time
+ * the transition had to take, however many steps ran in parallel.
+ */
+uint64_t transition_critical_us(const Transition *t);
+
+const char *transition_step_name(const Transition *t, const Step *s);
+
+/* *
+ * Kills whatever is still running, without rolling back, and frees the
+ * timer.
+ */
+void transition_close(Transition *t);
+
+#endif // TRANSITION_H
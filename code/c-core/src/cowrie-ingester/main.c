@@ -0,0 +1,246 @@
+// Global defines
+#define MODULE_NAME "COWRIE"
+
+// standard includes
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+// shared includes
+#include "../../include/arena.h"
+#include "../../include/exit-codes.h"
+#include "../../include/logging.h"
+
+// local includes
+#include "sessions.h"
+
+#define FILETAIL_IMPLEMENTATION
+#include "../../include/filetail.h"
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "../../include/sockclient.h"
+
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
+// TODO make the program configurable via config file
+#define COWRIE_LOG_PATH "/home/cowrie/cowrie/var/log/cowrie/cowrie.json"
+#define READ_BUF_SIZE (64 * 1024)
+#define MAX_SESSIONS 512
+#define SESSION_IDLE_MS (5 * 60 * 1000) // Cowrie itself drops idle ones at 3
+#define CHECK_INTERVAL_MS 1000
+#define EXPIRE_INTERVAL_MS 10000
+#define SOCK_PATH IPC_CONTROLLER_SOCK_PATH
+
+#define ARENA_SIZE                                                             \
+  (READ_BUF_SIZE + MAX_SESSIONS * 2 * sizeof(CowrieSession) + 4096)
+static uint8_t ingester_memory[ARENA_SIZE];
+
+// State shared by the reactor callbacks
+typedef struct {
+  FileTail tail;
+  CowrieTable table;
+  int sock_fd;
+  int ipc_fd;
+
+  // publishes waiting to go out, flushed in one sendmmsg() per batch
+  IPCMessage batch[IPC_BATCH_MAX];
+  size_t batch_count;
+  uint64_t sent;
+  uint64_t send_failed;
+
+  IPCMessage rcv_msgs[IPC_BATCH_MAX];
+} Ingester;
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void flush_publishes(Ingester *in);
+static void on_publish(void *userdata, const char *topic, const char *json,
+                       size_t len);
+static void on_cowrie_line(void *userdata, const char *line, size_t len);
+static void on_log_event(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_check(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_expire(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata);
+
+/* Follows Cowrie's JSON log and turns each attacker session into one summary
+ * publish (plus immediate alerts for logins that worked and file transfers),
+ * sent to the MQTT module through the controller. The log path can be given
+ * as the only argument.
+ * */
+int main(int argc, char **argv) {
+  const char *log_path = argc > 1 ? argv[1] : COWRIE_LOG_PATH;
+
+  Reactor reactor;
+  if (reactor_init(&reactor) != 0) {
+    LOG_ERROR("Failed to initialize reactor");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  const int signals[] = {SIGINT, SIGTERM};
+  if (reactor_add_signals(&reactor, signals, 2, on_signal, NULL) < 0) {
+    LOG_ERROR("Failed to register signal handlers");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  Arena arena;
+  arena_init(&arena, ingester_memory, ARENA_SIZE);
+
+  static Ingester in;
+  if (cowrie_table_init(&in.table, &arena, MAX_SESSIONS, on_publish, &in) !=
+      0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  in.sock_fd = ipc_client_connect(SOCK_PATH);
+  if (in.sock_fd < 1) {
+    LOG_ERROR("Could not connect to the controller. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  if (ipc_client_hello(in.sock_fd, MOD_COWRIE) < 0) {
+    LOG_ERROR("Failed to identify to the controller");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  in.ipc_fd = ipc_client_poll_fd(in.sock_fd);
+
+  if (filetail_open(&in.tail, log_path, &arena, READ_BUF_SIZE, false,
+                    on_cowrie_line, &in) != 0) {
+    LOG_ERROR("Failed to follow %s", log_path);
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (reactor_add_fd(&reactor, filetail_fd(&in.tail), EPOLLIN, on_log_event,
+                     &in) != 0 ||
+      reactor_add_timer(&reactor, CHECK_INTERVAL_MS, on_check, &in) < 0 ||
+      reactor_add_timer(&reactor, EXPIRE_INTERVAL_MS, on_expire, &in) < 0) {
+    LOG_ERROR("Failed to watch %s", log_path);
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (reactor_add_fd(&reactor, in.ipc_fd, EPOLLIN, on_ipc_ready, &in) != 0 ||
+      (in.ipc_fd != in.sock_fd &&
+       reactor_add_fd(&reactor, in.sock_fd, 0, on_ipc_ready, &in) != 0)) {
+    LOG_ERROR("Failed to watch IPC socket");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  LOG_INFO("Following %s", log_path);
+  reactor_run(&reactor);
+
+  cowrie_flush_all(&in.table);
+  flush_publishes(&in);
+  LOG_INFO("%llu events (%llu malformed) from %llu sessions -> %llu "
+           "summaries + %llu alerts; %llu timed out, %llu evicted; %llu "
+           "publishes sent, %llu failed",
+           (unsigned long long)in.table.events,
+           (unsigned long long)in.table.malformed,
+           (unsigned long long)in.table.sessions,
+           (unsigned long long)in.table.summaries,
+           (unsigned long long)in.table.alerts,
+           (unsigned long long)in.table.timeouts,
+           (unsigned long long)in.table.evicted, (unsigned long long)in.sent,
+           (unsigned long long)in.send_failed);
+
+  filetail_close(&in.tail);
+  ipc_client_disconnect(&in.sock_fd);
+  reactor_close(&reactor);
+  LOG_INFO("Cowrie ingester stopped");
+  return OS_EXIT_SUCCESS;
+}
+
+static void flush_publishes(Ingester *in) {
+  if (in->batch_count == 0) {
+    return;
+  }
+
+  int sent = ipc_client_send_batch(in->sock_fd, in->batch, in->batch_count);
+  if (sent < 0) {
+    sent = 0;
+  }
+  in->sent += (uint64_t)sent;
+  if ((size_t)sent < in->batch_count) {
+    in->send_failed += in->batch_count - (size_t)sent;
+    LOG_ERROR("Failed to forward %zu publishes",
+              in->batch_count - (size_t)sent);
+  }
+  in->batch_count = 0;
+}
+
+static void on_publish(void *userdata, const char *topic, const char *json,
+                       size_t len) {
+  Ingester *in = (Ingester *)userdata;
+
+  IPCMessage *msg = &in->batch[in->batch_count++];
+  memset(msg, 0, offsetof(IPCMessage, payload));
+  msg->origin = MOD_COWRIE;
+  msg->msgtype = MSG_CMD_MQTT_PUB;
+
+  PayloadMQTTPubCMD *pub = &msg->payload.mqtt_pub_cmd;
+  snprintf(pub->topic, sizeof(pub->topic), "%s", topic);
+  pub->qos = 1;
+  // Logins and file transfers are what an operator wants to see now
+  pub->flags = strcmp(topic, COWRIE_TOPIC_ALERT) == 0 ? MQTT_PUB_URGENT : 0;
+  pub->msg_id = 0;
+  pub->data_len = len < sizeof(pub->data) ? (uint16_t)len : sizeof(pub->data);
+  memcpy(pub->data, json, pub->data_len);
+  msg->payload_len = ipc_payload_size(msg);
+
+  if (in->batch_count == IPC_BATCH_MAX) {
+    flush_publishes(in);
+  }
+}
+
+static void on_cowrie_line(void *userdata, const char *line, size_t len) {
+  Ingester *in = (Ingester *)userdata;
+  cowrie_handle_line(&in->table, line, len, now_ms());
+}
+
+static void on_log_event(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Ingester *in = (Ingester *)userdata;
+  if (filetail_process(&in->tail) < 0) {
+    reactor_stop(r);
+  }
+  flush_publishes(in);
+}
+
+static void on_check(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Ingester *in = (Ingester *)userdata;
+  reactor_timer_ack(fd);
+  filetail_check(&in->tail);
+  flush_publishes(in);
+}
+
+static void on_expire(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Ingester *in = (Ingester *)userdata;
+  reactor_timer_ack(fd);
+  cowrie_expire(&in->table, now_ms(), SESSION_IDLE_MS);
+  flush_publishes(in);
+}
+
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Ingester *in = (Ingester *)userdata;
+
+  // Nothing is addressed to us yet; just notice when the controller goes away
+  int n;
+  while ((n = ipc_client_receive_batch(in->sock_fd, in->rcv_msgs,
+                                       IPC_BATCH_MAX)) > 0) {
+  }
+  if (n < 0 || (events & (EPOLLHUP | EPOLLERR))) {
+    LOG_ERROR("IPC connection lost. Exiting loop");
+    reactor_stop(r);
+  }
+}
+
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata) {
+  int signo = reactor_signal_read(fd);
+  LOG_INFO("Received signal %d. Shutting down", signo);
+  reactor_stop(r);
+}
@@ -0,0 +1,538 @@
+#define MODULE_NAME "COWRIE"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sessions.h"
+
+#include "../../include/jsonscan.h"
+#include "../../include/logging.h"
+#include "../../include/openaddr.h"
+
+// The fields of one cowrie.json record we look at, as raw slices
+typedef struct {
+  const char *eventid, *session, *timestamp, *src_ip, *protocol;
+  const char *username, *password, *input, *url, *shasum, *filename;
+  const char *version;
+  size_t eventid_len, session_len, timestamp_len, src_ip_len, protocol_len;
+  size_t username_len, password_len, input_len, url_len, shasum_len;
+  size_t filename_len, version_len;
+  uint64_t src_port, dst_port;
+} CowrieEvent;
+
+// ---- JSON output ----
+
+// Longest prefix of the JSON string contents s that is at most max bytes
+// and doesn't split an escape sequence or a UTF-8 character
+static size_t cowrie_safe_prefix(const char *s, size_t len, size_t max) {
+  size_t i = 0;
+  while (i < len) {
+    size_t step = 1;
+    unsigned char c = (unsigned char)s[i];
+    if (c == '\\') {
+      step = i + 1 < len && s[i + 1] == 'u' ? 6 : 2;
+    } else if (c >= 0xF0) {
+      step = 4;
+    } else if (c >= 0xE0) {
+      step = 3;
+    } else if (c >= 0xC0) {
+      step = 2;
+    }
+    if (i + step > max || i + step > len) {
+      break;
+    }
+    i += step;
+  }
+  return i;
+}
+
+// Copies as much of the raw string as fits, NUL-terminated.
+// Returns true if all of it fit.
+static bool cowrie_store(char *dst, size_t cap, const char *src, size_t len) {
+  size_t n = cowrie_safe_prefix(src, len, cap - 1);
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+  return n == len;
+}
+
+typedef struct {
+  char buf[COWRIE_SUMMARY_MAX];
+  size_t len;
+  size_t reserve; // kept free for what has to go last
+} JsonOut;
+
+static size_t json_out_room(const JsonOut *o) {
+  size_t used = o->len + o->reserve + 1; // '}'
+  return used < sizeof(o->buf) ? sizeof(o->buf) - used : 0;
+}
+
+// Appends a formatted fragment if it fits entirely (keeping room for '}')
+static bool json_out_fmt(JsonOut *o, const char *fmt, ...) {
+  size_t room = json_out_room(o);
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(o->buf + o->len, room + 1, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n > room) {
+    o->buf[o->len] = '\0';
+    return false;
+  }
+  o->len += (size_t)n;
+  return true;
+}
+
+// Appends ,"key":"value", cutting value to what's left. Skipped if empty.
+static void json_out_str(JsonOut *o, const char *key, const char *value,
+                         size_t value_len) {
+  if (value_len == 0) {
+    return;
+  }
+  size_t overhead = strlen(key) + 6; // ,"":"" around key and value
+  size_t room = json_out_room(o);
+  if (room <= overhead) {
+    return;
+  }
+  size_t n = cowrie_safe_prefix(value, value_len, room - overhead);
+  if (n == 0) {
+    return;
+  }
+  json_out_fmt(o, ",\"%s\":\"%.*s\"", key, (int)n, value);
+}
+
+static void json_out_uint(JsonOut *o, const char *key, unsigned v) {
+  if (v > 0) {
+    json_out_fmt(o, ",\"%s\":%u", key, v);
+  }
+}
+
+// Appends ,"key":[...] with as many whole values of l as fit.
+// Returns false if some were left out.
+static bool json_out_sample(JsonOut *o, const char *key,
+                            const CowrieSample *l) {
+  if (l->count == 0) {
+    return true;
+  }
+  size_t overhead = strlen(key) + 6; // ,"":[] around key and values
+  size_t room = json_out_room(o);
+  uint8_t shown = 0;
+  while (shown < l->count && overhead + l->ends[shown] <= room) {
+    shown++;
+  }
+  if (shown > 0) {
+    json_out_fmt(o, ",\"%s\":[%.*s]", key, (int)l->ends[shown - 1], l->buf);
+  }
+  return shown == l->count;
+}
+
+static void cowrie_emit(CowrieTable *t, const char *topic, JsonOut *o) {
+  o->buf[o->len++] = '}';
+  t->publish(t->userdata, topic, o->buf, o->len);
+}
+
+// ---- credential and command samples ----
+
+static size_t cowrie_sample_len(const CowrieSample *l) {
+  return l->count > 0 ? l->ends[l->count - 1] : 0;
+}
+
+// Appends one JSON value, or marks l cut if it doesn't fit
+static void cowrie_sample_push(CowrieSample *l, const char *v, size_t len) {
+  size_t start = cowrie_sample_len(l) + (l->count > 0 ? 1 : 0); // ','
+  if (l->count == COWRIE_SAMPLE_ITEMS || start + len > sizeof(l->buf)) {
+    l->cut = true;
+    return;
+  }
+  if (start > 0) {
+    l->buf[start - 1] = ',';
+  }
+  memcpy(l->buf + start, v, len);
+  l->ends[l->count++] = (uint8_t)(start + len);
+}
+
+// Adds a command, cut short if it is the one that fills the sample
+static void cowrie_sample_cmd(CowrieSample *l, const char *cmd, size_t len) {
+  size_t start = cowrie_sample_len(l) + (l->count > 0 ? 1 : 0);
+  size_t room = start < sizeof(l->buf) ? sizeof(l->buf) - start : 0;
+  size_t n = room > 2 ? cowrie_safe_prefix(cmd, len, room - 2) : 0;
+  if (n < len) {
+    l->cut = true;
+    if (n == 0) {
+      return;
+    }
+  }
+  char v[COWRIE_SAMPLE_MAX];
+  v[0] = '"';
+  memcpy(v + 1, cmd, n);
+  v[n + 1] = '"';
+  cowrie_sample_push(l, v, n + 2);
+}
+
+// Adds a failed login's credentials, unless they are already in l
+static void cowrie_sample_cred(CowrieSample *l, const char *user,
+                               size_t user_len, const char *pass,
+                               size_t pass_len) {
+  // As long as the summary's u/p can be
+  size_t max = sizeof(((CowrieSession *)0)->username) - 1;
+  size_t u = cowrie_safe_prefix(user, user_len, max);
+  size_t p = cowrie_safe_prefix(pass, pass_len, max);
+  if (u < user_len || p < pass_len) {
+    l->cut = true;
+  }
+
+  char v[COWRIE_SAMPLE_MAX];
+  int n = snprintf(v, sizeof(v), "[\"%.*s\",\"%.*s\"]", (int)u, user, (int)p,
+                   pass);
+  size_t start = 0;
+  for (uint8_t i = 0; i < l->count; i++) {
+    if (l->ends[i] - start == (size_t)n &&
+        memcmp(l->buf + start, v, (size_t)n) == 0) {
+      return;
+    }
+    start = l->ends[i] + 1;
+  }
+  cowrie_sample_push(l, v, (size_t)n);
+}
+
+// ---- hash table ----
+
+static uint32_t cowrie_hash(const char *id, size_t len) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)id[i]) * 16777619u;
+  }
+  return h;
+}
+
+// A session id as it appears in the event, not NUL-terminated
+typedef struct {
+  const char *id;
+  size_t len;
+} CowrieKey;
+
+static bool cowrie_slot_used(const void *e) {
+  return ((const CowrieSession *)e)->id[0] != '\0';
+}
+
+static bool cowrie_slot_match(const void *e, const void *key) {
+  const CowrieSession *s = e;
+  const CowrieKey *k = key;
+  return strncmp(s->id, k->id, k->len) == 0 && s->id[k->len] == '\0';
+}
+
+static uint64_t cowrie_slot_hash(const void *t, const void *e) {
+  const char *id = ((const CowrieSession *)e)->id;
+  return cowrie_hash(id, strlen(id));
+}
+
+static const OpenAddrOps cowrie_ops = {
+    .entry_size = sizeof(CowrieSession),
+    .used = cowrie_slot_used,
+    .match = cowrie_slot_match,
+    .hash = cowrie_slot_hash,
+};
+
+static CowrieSession *cowrie_find(CowrieTable *t, const char *id, size_t len,
+                                  size_t *slot) {
+  CowrieKey key = {id, len};
+  *slot = openaddr_probe(&cowrie_ops, t->slots, t->capacity,
+                         cowrie_hash(id, len), &key);
+  CowrieSession *s = &t->slots[*slot];
+  return cowrie_slot_used(s) ? s : NULL;
+}
+
+static void cowrie_remove(CowrieTable *t, size_t i) {
+  openaddr_remove(&cowrie_ops, t, t->slots, t->capacity, i);
+  t->count--;
+}
+
+// ---- summaries and alerts ----
+
+// What a summary ends with when cr or c leave something out
+#define COWRIE_CUT_FLAGS ",\"crc\":1,\"cc\":1"
+
+static void cowrie_summarize(CowrieTable *t, const CowrieSession *s,
+                             const char *end) {
+  JsonOut o;
+  o.len = 0;
+  o.reserve = sizeof(COWRIE_CUT_FLAGS) - 1;
+  uint64_t dur = s->last_ms > s->start_ms ? s->last_ms - s->start_ms : 0;
+
+  json_out_fmt(&o,
+               "{\"id\":\"%s\",\"src\":\"%s\",\"sp\":%u,\"dp\":%u,"
+               "\"proto\":\"%s\",\"t0\":%llu,\"dur\":%llu,\"end\":\"%s\","
+               "\"ev\":%u",
+               s->id, s->src_ip, s->src_port, s->dst_port, s->protocol,
+               (unsigned long long)(s->start_ms / 1000),
+               (unsigned long long)(dur / 1000), end, s->events);
+  json_out_uint(&o, "lf", s->login_failed);
+  json_out_uint(&o, "lo", s->login_ok);
+  json_out_uint(&o, "nc", s->commands);
+  json_out_uint(&o, "ncf", s->commands_failed);
+  json_out_uint(&o, "dl", s->downloads);
+  json_out_uint(&o, "ul", s->uploads);
+  json_out_uint(&o, "fwd", s->tcpip_requests);
+  json_out_str(&o, "u", s->username, strlen(s->username));
+  json_out_str(&o, "p", s->password, strlen(s->password));
+  json_out_str(&o, "cl", s->client, strlen(s->client));
+  // Credentials get at most half of what's left when there are commands
+  size_t flags = o.reserve;
+  if (s->cmds.count > 0) {
+    o.reserve += json_out_room(&o) / 2;
+  }
+  bool creds_cut = !json_out_sample(&o, "cr", &s->creds) || s->creds.cut;
+  o.reserve = flags;
+  bool cmds_cut = !json_out_sample(&o, "c", &s->cmds) || s->cmds.cut;
+
+  o.reserve = 0;
+  if (creds_cut) {
+    json_out_fmt(&o, ",\"crc\":1");
+  }
+  if (cmds_cut) {
+    json_out_fmt(&o, ",\"cc\":1");
+  }
+
+  cowrie_emit(t, COWRIE_TOPIC_SESSION, &o);
+  t->summaries++;
+}
+
+static void cowrie_alert(CowrieTable *t, const CowrieSession *s,
+                         const char *what, const char *k1, const char *v1,
+                         size_t l1, const char *k2, const char *v2,
+                         size_t l2) {
+  JsonOut o;
+  o.len = 0;
+  o.reserve = 0;
+  json_out_fmt(&o, "{\"id\":\"%s\",\"src\":\"%s\",\"ev\":\"%s\"", s->id,
+               s->src_ip, what);
+  json_out_str(&o, k1, v1, l1);
+  json_out_str(&o, k2, v2, l2);
+  cowrie_emit(t, COWRIE_TOPIC_ALERT, &o);
+  t->alerts++;
+}
+
+// ---- event parsing ----
+
+static bool cowrie_field(JsonScan *s, const char **val, size_t *len) {
+  json_skip_ws(s);
+  if (s->p < s->end && *s->p == '"') {
+    return json_scan_string(s, val, len);
+  }
+  return json_skip_value(s); // null or an unexpected type: ignore it
+}
+
+static int cowrie_parse(const char *line, size_t len, CowrieEvent *ev) {
+  JsonScan s = {line, line + len};
+  memset(ev, 0, sizeof(CowrieEvent));
+  if (!json_expect(&s, '{')) {
+    return -1;
+  }
+
+  bool ok = true;
+  do {
+    const char *key;
+    size_t klen;
+    if (!json_scan_string(&s, &key, &klen) || !json_expect(&s, ':')) {
+      return -1;
+    }
+
+#define COWRIE_STR_FIELD(name)                                                 \
+  if (JSON_KEY_IS(key, klen, #name)) {                                         \
+    if (!cowrie_field(&s, &ev->name, &ev->name##_len)) {                       \
+      return -1;                                                               \
+    }                                                                          \
+    continue;                                                                  \
+  }
+    COWRIE_STR_FIELD(eventid)
+    COWRIE_STR_FIELD(session)
+    COWRIE_STR_FIELD(timestamp)
+    COWRIE_STR_FIELD(src_ip)
+    COWRIE_STR_FIELD(protocol)
+    COWRIE_STR_FIELD(username)
+    COWRIE_STR_FIELD(password)
+    COWRIE_STR_FIELD(input)
+    COWRIE_STR_FIELD(url)
+    COWRIE_STR_FIELD(shasum)
+    COWRIE_STR_FIELD(filename)
+    COWRIE_STR_FIELD(version)
+#undef COWRIE_STR_FIELD
+
+    if (JSON_KEY_IS(key, klen, "src_port")) {
+      if (!json_scan_uint(&s, &ev->src_port)) {
+        return -1;
+      }
+    } else if (JSON_KEY_IS(key, klen, "dst_port")) {
+      if (!json_scan_uint(&s, &ev->dst_port)) {
+        return -1;
+      }
+    } else if (!json_skip_value(&s)) {
+      return -1;
+    }
+  } while (json_next_member(&s, &ok));
+
+  return ok ? 0 : -1;
+}
+
+// ---- public API ----
+
+int cowrie_table_init(CowrieTable *t, Arena *a, size_t max_sessions,
+                      CowriePublish publish, void *userdata) {
+  memset(t, 0, sizeof(CowrieTable));
+
+  size_t capacity = openaddr_capacity(max_sessions);
+  t->slots = ARENA_NEW_ARRAY(a, CowrieSession, capacity);
+  if (t->slots == NULL) {
+    LOG_ERROR("Failed to allocate the session table (%zu sessions)",
+              max_sessions);
+    return -1;
+  }
+  t->capacity = capacity;
+  t->max_sessions = max_sessions;
+  t->publish = publish;
+  t->userdata = userdata;
+  return 0;
+}
+
+// Makes room by closing the session that has been quiet the longest
+static void cowrie_evict_oldest(CowrieTable *t) {
+  size_t oldest = t->capacity;
+  for (size_t i = 0; i < t->capacity; i++) {
+    if (t->slots[i].id[0] != '\0' &&
+        (oldest == t->capacity ||
+         t->slots[i].seen_ms < t->slots[oldest].seen_ms)) {
+      oldest = i;
+    }
+  }
+  if (oldest < t->capacity) {
+    cowrie_summarize(t, &t->slots[oldest], "evicted");
+    cowrie_remove(t, oldest);
+    t->evicted++;
+  }
+}
+
+int cowrie_handle_line(CowrieTable *t, const char *line, size_t len,
+                       uint64_t now_ms) {
+  CowrieEvent ev;
+  if (cowrie_parse(line, len, &ev) != 0 || ev.session_len == 0 ||
+      ev.session_len >= COWRIE_SESSION_ID_MAX || ev.eventid_len == 0) {
+    t->malformed++;
+    return -1;
+  }
+  t->events++;
+
+  size_t slot;
+  CowrieSession *s = cowrie_find(t, ev.session, ev.session_len, &slot);
+  if (s == NULL) {
+    if (t->count >= t->max_sessions) {
+      cowrie_evict_oldest(t);
+      cowrie_find(t, ev.session, ev.session_len, &slot);
+    }
+    s = &t->slots[slot];
+    memcpy(s->id, ev.session, ev.session_len);
+    s->id[ev.session_len] = '\0';
+    t->count++;
+    t->sessions++;
+  }
+
+  uint64_t event_ms = json_parse_timestamp_ms(ev.timestamp, ev.timestamp_len);
+  if (s->start_ms == 0) {
+    s->start_ms = event_ms;
+  }
+  if (event_ms > s->last_ms) {
+    s->last_ms = event_ms;
+  }
+  s->seen_ms = now_ms;
+  if (s->events < UINT16_MAX) {
+    s->events++;
+  }
+
+  // Every record repeats the peer, pick it up from whichever comes first
+  if (s->src_ip[0] == '\0' && ev.src_ip_len > 0) {
+    cowrie_store(s->src_ip, sizeof(s->src_ip), ev.src_ip, ev.src_ip_len);
+  }
+  if (ev.src_port != 0) {
+    s->src_port = (uint16_t)ev.src_port;
+  }
+  if (ev.dst_port != 0 && s->dst_port == 0) {
+    s->dst_port = (uint16_t)ev.dst_port;
+  }
+  if (ev.protocol_len > 0) {
+    cowrie_store(s->protocol, sizeof(s->protocol), ev.protocol,
+                 ev.protocol_len);
+  }
+
+  const char *id = ev.eventid;
+  size_t id_len = ev.eventid_len;
+  if (id_len > 7 && memcmp(id, "cowrie.", 7) == 0) {
+    id += 7;
+    id_len -= 7;
+  }
+
+#define COUNT(field)                                                           \
+  if (s->field < UINT16_MAX) {                                                 \
+    s->field++;                                                                \
+  }
+
+  if (JSON_KEY_IS(id, id_len, "login.failed")) {
+    COUNT(login_failed);
+    cowrie_sample_cred(&s->creds, ev.username, ev.username_len, ev.password,
+                       ev.password_len);
+  } else if (JSON_KEY_IS(id, id_len, "login.success")) {
+    COUNT(login_ok);
+    cowrie_store(s->username, sizeof(s->username), ev.username,
+                 ev.username_len);
+    cowrie_store(s->password, sizeof(s->password), ev.password,
+                 ev.password_len);
+    cowrie_alert(t, s, "login", "u", ev.username, ev.username_len, "p",
+                 ev.password, ev.password_len);
+  } else if (JSON_KEY_IS(id, id_len, "command.input")) {
+    COUNT(commands);
+    cowrie_sample_cmd(&s->cmds, ev.input, ev.input_len);
+  } else if (JSON_KEY_IS(id, id_len, "command.failed")) {
+    COUNT(commands_failed);
+  } else if (JSON_KEY_IS(id, id_len, "session.file_download")) {
+    COUNT(downloads);
+    cowrie_alert(t, s, "download", "sha", ev.shasum, ev.shasum_len, "url",
+                 ev.url, ev.url_len);
+  } else if (JSON_KEY_IS(id, id_len, "session.file_upload")) {
+    COUNT(uploads);
+    cowrie_alert(t, s, "upload", "sha", ev.shasum, ev.shasum_len, "file",
+                 ev.filename, ev.filename_len);
+  } else if (JSON_KEY_IS(id, id_len, "direct-tcpip.request")) {
+    COUNT(tcpip_requests);
+  } else if (JSON_KEY_IS(id, id_len, "client.version")) {
+    cowrie_store(s->client, sizeof(s->client), ev.version, ev.version_len);
+  } else if (JSON_KEY_IS(id, id_len, "session.closed")) {
+    cowrie_summarize(t, s, "closed");
+    cowrie_remove(t, slot);
+  }
+#undef COUNT
+
+  return 0;
+}
+
+size_t cowrie_expire(CowrieTable *t, uint64_t now_ms, uint64_t idle_ms) {
+  size_t closed = 0;
+  for (size_t i = 0; i < t->capacity;) {
+    CowrieSession *s = &t->slots[i];
+    if (s->id[0] != '\0' && now_ms - s->seen_ms > idle_ms) {
+      cowrie_summarize(t, s, "timeout");
+      cowrie_remove(t, i);
+      t->timeouts++;
+      closed++;
+      continue; // another entry may have shifted into slot i
+    }
+    i++;
+  }
+  return closed;
+}
+
+void cowrie_flush_all(CowrieTable *t) {
+  for (size_t i = 0; i < t->capacity; i++) {
+    if (t->slots[i].id[0] != '\0') {
+      cowrie_summarize(t, &t->slots[i], "shutdown");
+    }
+  }
+  memset(t->slots, 0, t->capacity * sizeof(CowrieSession));
+  t->count = 0;
+}
@@ -0,0 +1,137 @@
+#ifndef COWRIE_SESSIONS_H
+#define COWRIE_SESSIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/arena.h"
+
+/* *
+ * Live Cowrie sessions, aggregated from cowrie.json events.
+ *
+ * A session produces dozens of small events (connect, every login attempt,
+ * every command...). Instead of forwarding each one, events are folded into
+ * the session's entry and one compact summary is published when the session
+ * closes, idles out, or has to make room for a new one. Only events worth
+ * acting on right away (successful logins, file transfers) are published
+ * immediately, in full.
+ *
+ * The table is a fixed-size open-addressing hash (linear probing, backward
+ * shift deletion) keyed by Cowrie's session id, allocated once from an Arena.
+ */
+
+#define COWRIE_SESSION_ID_MAX 24
+#define COWRIE_SAMPLE_MAX 112  // bytes of credentials or commands kept
+#define COWRIE_SAMPLE_ITEMS 8  // credentials or commands kept
+#define COWRIE_SUMMARY_MAX 256 // fits PayloadMQTTPubCMD.data
+
+/* *
+ * Summary keys (COWRIE_TOPIC_SESSION): id, src, sp/dp (ports), proto, t0
+ * (start, epoch s), dur (s), end (closed|timeout|evicted|shutdown), ev
+ * (events folded in), and only when non-zero / known: lf/lo (failed / good
+ * logins), nc/ncf (commands / failed commands), dl/ul (downloads /
+ * uploads), fwd (port forward requests), u/p (credentials that logged in),
+ * cl (client version), cr (first distinct failed credentials, as [u,p]
+ * pairs), c (first commands), crc / cc (cr / c leave some out, or cut one
+ * short).
+ *
+ * Alert keys (COWRIE_TOPIC_ALERT): id, src, ev (login|download|upload) and
+ * u/p, sha/url or sha/file respectively.
+ */
+#define COWRIE_TOPIC_SESSION "/cowrie/session"
+#define COWRIE_TOPIC_ALERT "/cowrie/alert"
+
+// The first values of a list, as JSON, ','-separated
+typedef struct {
+  char buf[COWRIE_SAMPLE_MAX];
+  uint8_t ends[COWRIE_SAMPLE_ITEMS]; // where each value ends in buf
+  uint8_t count;
+  bool cut; // values were left out or shortened
+} CowrieSample;
+
+_Static_assert(COWRIE_SAMPLE_MAX <= UINT8_MAX, "CowrieSample.ends overflow");
+
+typedef struct {
+  char id[COWRIE_SESSION_ID_MAX]; // "" = free slot
+  uint64_t seen_ms;               // local monotonic time of the last event
+  uint64_t start_ms;              // event time of the first event
+  uint64_t last_ms;               // event time of the last event
+
+  // strings are kept JSON-escaped, as Cowrie wrote them
+  char src_ip[40];
+  char protocol[8];
+  char client[48];
+  char username[32];
+  char password[32];
+  uint16_t src_port;
+  uint16_t dst_port;
+
+  uint16_t events;
+  uint16_t login_failed;
+  uint16_t login_ok;
+  uint16_t commands;
+  uint16_t commands_failed;
+  uint16_t downloads;
+  uint16_t uploads;
+  uint16_t tcpip_requests;
+
+  CowrieSample creds; // ["user","pass"] of failed logins
+  CowrieSample cmds;  // "command"
+} CowrieSession;
+
+/* *
+ * Called with a ready-to-send JSON document (not NUL-terminated).
+ */
+typedef void (*CowriePublish)(void *userdata, const char *topic,
+                              const char *json, size_t len);
+
+typedef struct {
+  CowrieSession *slots;
+  size_t capacity; // power of two, twice max_sessions
+  size_t max_sessions;
+  size_t count;
+
+  CowriePublish publish;
+  void *userdata;
+
+  // counters
+  uint64_t events;
+  uint64_t malformed;
+  uint64_t sessions;
+  uint64_t summaries;
+  uint64_t alerts;
+  uint64_t timeouts;
+  uint64_t evicted;
+} CowrieTable;
+
+/* *
+ * Allocates a table for max_sessions live sessions from a.
+ * * Returns:
+ * 0 on success, -1 if the arena is too small.
+ */
+int cowrie_table_init(CowrieTable *t, Arena *a, size_t max_sessions,
+                      CowriePublish publish, void *userdata);
+
+/* *
+ * Folds one cowrie.json line into its session. now_ms is a monotonic clock,
+ * used for idle timeouts.
+ * * Returns:
+ * 0 on success, -1 if the line is malformed or has no session id.
+ */
+int cowrie_handle_line(CowrieTable *t, const char *line, size_t len,
+                       uint64_t now_ms);
+
+/* *
+ * Closes (and summarizes) every session without events for idle_ms.
+ * * Returns:
+ * Number of sessions closed.
+ */
+size_t cowrie_expire(CowrieTable *t, uint64_t now_ms, uint64_t idle_ms);
+
+/* *
+ * Summarizes and drops every live session, e.g. on shutdown.
+ */
+void cowrie_flush_all(CowrieTable *t);
+
+#endif // COWRIE_SESSIONS_H
@@ -0,0 +1,296 @@
+#define MODULE_NAME "BANS"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/netfilter_ipv4.h>
+
+#include "bans.h"
+
+#include "../../include/openaddr.h"
+
+#define BAN_FAMILY NFPROTO_INET
+#define BAN_CHAIN "prerouting"
+#define BAN_SET4 "ban4"
+#define BAN_SET6 "ban6"
+#define BAN_SET4_ID 1
+#define BAN_SET6_ID 2
+
+// nft's own datatype numbers, so that `nft list ruleset` prints addresses
+#define BAN_TYPE_IPADDR 7
+#define BAN_TYPE_IP6ADDR 8
+
+// ---- userspace copy of the sets ----
+
+static inline uint64_t ban_hash(const BanList *l, const uint8_t *ip,
+                                uint8_t ip_version) {
+  uint64_t w[2];
+  memcpy(w, ip, sizeof(w));
+  uint64_t h = l->seed ^ ip_version;
+  for (size_t i = 0; i < 2; i++) {
+    h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 33);
+}
+
+static inline bool ban_used(const BanEntry *e) { return e->ip_version != 0; }
+
+static bool ban_slot_used(const void *e) {
+  return ban_used((const BanEntry *)e);
+}
+
+typedef struct {
+  const uint8_t *ip;
+  uint8_t ip_version;
+} BanKey;
+
+static bool ban_slot_match(const void *e, const void *key) {
+  const BanEntry *b = e;
+  const BanKey *k = key;
+  return b->ip_version == k->ip_version && memcmp(b->ip, k->ip, 16) == 0;
+}
+
+static uint64_t ban_slot_hash(const void *l, const void *e) {
+  const BanEntry *b = e;
+  return ban_hash((const BanList *)l, b->ip, b->ip_version);
+}
+
+static const OpenAddrOps ban_ops = {
+    .entry_size = sizeof(BanEntry),
+    .used = ban_slot_used,
+    .match = ban_slot_match,
+    .hash = ban_slot_hash,
+};
+
+// Returns the slot holding the address, or the empty slot ending its chain
+static size_t ban_probe(const BanList *l, const uint8_t *ip,
+                        uint8_t ip_version) {
+  BanKey key = {ip, ip_version};
+  return openaddr_probe(&ban_ops, l->slots, l->capacity,
+                        ban_hash(l, ip, ip_version), &key);
+}
+
+static void ban_remove(BanList *l, size_t i) {
+  openaddr_remove(&ban_ops, l, l->slots, l->capacity, i);
+  l->count--;
+}
+
+// Forgets the bans at the head of the FIFO whose time is up. An entry
+// whose address was banned again since (a later expiry, or queued) only
+// leaves the FIFO: the newer ban has its own entry.
+static void ban_expire(BanList *l, uint64_t now_ms) {
+  while (l->expiry_count > 0) {
+    const BanEntry *x = &l->expiry[l->expiry_head];
+    if (x->expires_ms > now_ms) {
+      break;
+    }
+    size_t slot = ban_probe(l, x->ip, x->ip_version);
+    if (ban_used(&l->slots[slot]) &&
+        l->slots[slot].expires_ms == x->expires_ms) {
+      ban_remove(l, slot);
+      l->expired++;
+    }
+    l->expiry_head = (l->expiry_head + 1) % l->cfg.max_bans;
+    l->expiry_count--;
+  }
+}
+
+static bool ban_allowed(const uint8_t *ip, uint8_t ip_version) {
+  static const uint8_t zero[16];
+  if (ip_version == 4) {
+    return ip[0] != 127 && memcmp(ip, zero, 4) != 0;
+  }
+  if (ip_version == 6) {
+    static const uint8_t loopback[16] = {[15] = 1};
+    return memcmp(ip, zero, 16) != 0 && memcmp(ip, loopback, 16) != 0;
+  }
+  return false;
+}
+
+// ---- public API ----
+
+size_t ban_mem(uint32_t max_bans) {
+  return (openaddr_capacity(max_bans) + max_bans) * sizeof(BanEntry) +
+         BAN_BATCH_SIZE + 128;
+}
+
+int ban_init(BanList *l, Arena *a, const BanConfig *cfg) {
+  if (l == NULL || a == NULL || cfg == NULL || cfg->max_bans == 0 ||
+      cfg->timeout_ms == 0) {
+    LOG_ERROR("Invalid arguments to ban_init");
+    return -1;
+  }
+
+  memset(l, 0, sizeof(BanList));
+  l->cfg = *cfg;
+  l->capacity = openaddr_capacity(cfg->max_bans);
+  l->slots = (BanEntry *)arena_alloc_align(
+      a, l->capacity * sizeof(BanEntry), _Alignof(BanEntry));
+  l->expiry = ARENA_NEW_ARRAY(a, BanEntry, cfg->max_bans);
+  if (l->slots == NULL || l->expiry == NULL ||
+      nft_batch_init(&l->batch, a, BAN_BATCH_SIZE) != 0) {
+    LOG_ERROR("Not enough memory for %u bans", cfg->max_bans);
+    return -1;
+  }
+
+  if (getrandom(&l->seed, sizeof(l->seed), GRND_NONBLOCK) !=
+      sizeof(l->seed)) {
+    l->seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  }
+  return 0;
+}
+
+int ban_table_build(NftBatch *b, const BanConfig *cfg) {
+  nft_batch_reset(b);
+  nft_batch_begin(b);
+  nft_table_add(b, BAN_FAMILY, BAN_TABLE);
+  nft_table_del(b, BAN_FAMILY, BAN_TABLE);
+  nft_table_add(b, BAN_FAMILY, BAN_TABLE);
+
+  nft_set_add(b, BAN_FAMILY, BAN_TABLE, BAN_SET4, BAN_SET4_ID,
+              BAN_TYPE_IPADDR, 4, NFT_SET_TIMEOUT, cfg->timeout_ms);
+  nft_set_add(b, BAN_FAMILY, BAN_TABLE, BAN_SET6, BAN_SET6_ID,
+              BAN_TYPE_IP6ADDR, 16, NFT_SET_TIMEOUT, cfg->timeout_ms);
+
+  // Ahead of connection tracking: a banned host costs no conntrack entry
+  const NftHook hook = {"filter", NF_INET_PRE_ROUTING, NF_IP_PRI_RAW,
+                        NF_ACCEPT};
+  nft_chain_add(b, BAN_FAMILY, BAN_TABLE, BAN_CHAIN, &hook);
+
+  // meta nfproto ipv4 ip saddr @ban4 counter drop, and the same for IPv6
+  const struct {
+    uint8_t nfproto;
+    uint32_t offset; // of the source address in the network header
+    uint32_t len;
+    const char *set;
+    uint32_t set_id;
+  } rules[] = {
+      {NFPROTO_IPV4, 12, 4, BAN_SET4, BAN_SET4_ID},
+      {NFPROTO_IPV6, 8, 16, BAN_SET6, BAN_SET6_ID},
+  };
+  for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+    nft_rule_begin(b, BAN_FAMILY, BAN_TABLE, BAN_CHAIN);
+    nft_expr_meta(b, NFT_META_NFPROTO, NFT_REG_1);
+    nft_expr_cmp_u8(b, NFT_REG_1, NFT_CMP_EQ, rules[i].nfproto);
+    nft_expr_payload(b, NFT_PAYLOAD_NETWORK_HEADER, rules[i].offset,
+                     rules[i].len, NFT_REG_1);
+    nft_expr_lookup(b, rules[i].set, rules[i].set_id, NFT_REG_1);
+    nft_expr_counter(b);
+    nft_expr_verdict(b, NF_DROP);
+    nft_rule_end(b);
+  }
+  nft_batch_end(b);
+
+  if (!nft_batch_ok(b)) {
+    LOG_ERROR("The ban table doesn't fit in %zu bytes", b->cap);
+    return -1;
+  }
+  return 0;
+}
+
+int ban_add(BanList *l, const uint8_t *ip, uint8_t ip_version,
+            uint64_t now_ms) {
+  if (!ban_allowed(ip, ip_version) || l->pending_count == BAN_PENDING_MAX) {
+    l->refused++;
+    return -1;
+  }
+
+  BanEntry *e = &l->slots[ban_probe(l, ip, ip_version)];
+  if (ban_used(e)) {
+    if (e->expires_ms > now_ms) {
+      l->repeated++;
+      return 0;
+    }
+    // Expired since the last flush: ban it again in the same slot
+  } else if (l->count == l->cfg.max_bans) {
+    l->refused++;
+    return -1;
+  } else {
+    memcpy(e->ip, ip, 16);
+    e->ip_version = ip_version;
+    l->count++;
+  }
+  e->expires_ms = BAN_QUEUED;
+  l->pending[l->pending_count++] = *e;
+  return 1;
+}
+
+// Every queued address of one family, in as many messages as needed
+static void ban_batch_family(BanList *l, uint8_t ip_version) {
+  const char *set = ip_version == 4 ? BAN_SET4 : BAN_SET6;
+  const size_t key_len = ip_version == 4 ? 4 : 16;
+  const size_t per_msg = NFT_SETELEM_MAX / NFT_SETELEM_SIZE(key_len);
+
+  size_t in_msg = 0;
+  for (size_t i = 0; i < l->pending_count; i++) {
+    if (l->pending[i].ip_version != ip_version) {
+      continue;
+    }
+    if (in_msg == per_msg) {
+      nft_setelem_end(&l->batch);
+      in_msg = 0;
+    }
+    if (in_msg == 0) {
+      nft_setelem_begin(&l->batch, BAN_FAMILY, BAN_TABLE, set);
+    }
+    // The set's timeout applies
+    nft_setelem(&l->batch, l->pending[i].ip, key_len, 0);
+    in_msg++;
+  }
+  if (in_msg > 0) {
+    nft_setelem_end(&l->batch);
+  }
+}
+
+int ban_flush(BanList *l, int fd, uint64_t now_ms) {
+  ban_expire(l, now_ms);
+  if (l->pending_count == 0) {
+    return 0;
+  }
+
+  nft_batch_reset(&l->batch);
+  nft_batch_begin(&l->batch);
+  ban_batch_family(l, 4);
+  ban_batch_family(l, 6);
+  nft_batch_end(&l->batch);
+  int rc = nft_commit(fd, &l->batch);
+
+  // The kernel's clock started after now_ms: ours never outlasts its own
+  int committed = (int)l->pending_count;
+  for (size_t i = 0; i < l->pending_count; i++) {
+    const BanEntry *p = &l->pending[i];
+    size_t slot = ban_probe(l, p->ip, p->ip_version);
+    if (rc == 0) {
+      BanEntry *e = &l->slots[slot];
+      e->expires_ms = now_ms + l->cfg.timeout_ms;
+      // Room for it: the FIFO holds only live bans now, at most max_bans
+      size_t tail = (l->expiry_head + l->expiry_count) % l->cfg.max_bans;
+      l->expiry[tail] = *e;
+      l->expiry_count++;
+    } else {
+      ban_remove(l, slot);
+    }
+  }
+  l->pending_count = 0;
+
+  if (rc != 0) {
+    l->failed += (uint64_t)committed;
+    return rc;
+  }
+  l->banned += (uint64_t)committed;
+  return committed;
+}
+
+void ban_log_stats(const BanList *l) {
+  LOG_INFO("bans: %zu/%u active; %llu banned, %llu repeated, %llu refused, "
+           "%llu failed, %llu expired",
+           l->count, l->cfg.max_bans, (unsigned long long)l->banned,
+           (unsigned long long)l->repeated, (unsigned long long)l->refused,
+           (unsigned long long)l->failed, (unsigned long long)l->expired);
+}
@@ -0,0 +1,132 @@
+#ifndef FIREWALL_BANS_H
+#define FIREWALL_BANS_H
+
+/* ==========================================================================
+ *  Orange Sentry - Address bans
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Drops all traffic from banned addresses in the kernel, for a limited
+ *  time. The addresses are elements of two nf_tables hash sets, ban4 and
+ *  ban6, in a table of their own (inet orange-sentry-ban) that the state
+ *  rule sets never touch. Two rules in a prerouting chain, ahead of
+ *  connection tracking, look every packet's source up in them: one hash
+ *  lookup per packet, whether ten or ten thousand addresses are banned,
+ *  and banning one more never changes the rules. The kernel removes every
+ *  element by itself when its timeout runs out.
+ *
+ *  Bans are not sent one by one. ban_add() queues them, and ban_flush()
+ *  adds everything queued since the last call in one transaction. A copy
+ *  of the set in userspace (open addressing, like the flow table) drops
+ *  repeats before they are queued, knows when each element expires, and
+ *  keeps the sets at max_bans: past that, new bans are refused until old
+ *  ones run out, so an address flood can't grow kernel memory. Every ban
+ *  has the same timeout, so they run out in the order they were committed:
+ *  a FIFO of committed bans tells ban_flush() which ones to forget,
+ *  without sweeping the table. The kernel enforces the timeouts anyway.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. ban_init() with the limits, ban_table_build() and commit it once: it
+ *     starts the table over, so bans don't outlive the module.
+ *  2. ban_add() for every address to ban.
+ *  3. ban_flush() on a timer, or as soon as ban_flush_due().
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/arena.h"
+#include "nft.h"
+
+#define BAN_TABLE "orange-sentry-ban"
+#define BAN_PENDING_MAX 1024 // bans queued between two flushes
+#define BAN_BATCH_SIZE (BAN_PENDING_MAX * NFT_SETELEM_SIZE(16) + 4096)
+
+typedef struct {
+  uint8_t ip[16];
+  uint8_t ip_version; // 0: free slot
+  uint64_t expires_ms; // BAN_QUEUED until committed
+} BanEntry;
+
+#define BAN_QUEUED UINT64_MAX
+
+typedef struct {
+  uint32_t max_bans;
+  uint32_t timeout_ms;
+} BanConfig;
+
+typedef struct {
+  BanEntry *slots;
+  size_t capacity; // power of two, at least twice max_bans
+  size_t count;
+  BanConfig cfg;
+  uint64_t seed;
+
+  // committed bans, oldest first: a ring of max_bans
+  BanEntry *expiry;
+  size_t expiry_head;
+  size_t expiry_count;
+
+  // queued since the last flush
+  BanEntry pending[BAN_PENDING_MAX];
+  size_t pending_count;
+  NftBatch batch;
+
+  // counters
+  uint64_t banned;   // committed
+  uint64_t repeated; // already banned or queued
+  uint64_t refused;  // set full or invalid address
+  uint64_t failed;   // lost with a failed transaction
+  uint64_t expired;
+} BanList;
+
+/* *
+ * Bytes ban_init() takes from its arena, batch buffer included.
+ */
+size_t ban_mem(uint32_t max_bans);
+
+/* *
+ * Allocates the userspace copy, the expiry FIFO and the batch buffer from a:
+ * ban_mem() bytes.
+ * * Returns:
+ * 0 on success, -1 on invalid limits or if the arena is too small.
+ */
+int ban_init(BanList *l, Arena *a, const BanConfig *cfg);
+
+/* *
+ * Builds the transaction that (re)creates the ban table, empty, into b.
+ * * Returns:
+ * 0 on success, -1 if it doesn't fit.
+ */
+int ban_table_build(NftBatch *b, const BanConfig *cfg);
+
+/* *
+ * Queues a ban of ip (network order, IPv4 in the first 4 bytes).
+ * * Returns:
+ * 1 if queued, 0 if the address is already banned or queued, -1 if it was
+ * refused: the sets are full, or the address is loopback or unspecified.
+ */
+int ban_add(BanList *l, const uint8_t *ip, uint8_t ip_version,
+            uint64_t now_ms);
+
+static inline bool ban_flush_due(const BanList *l) {
+  return l->pending_count == BAN_PENDING_MAX;
+}
+
+/* *
+ * Forgets the bans the kernel has expired by now, then commits everything
+ * queued in one transaction. now_ms is a monotonic clock, as for ban_add().
+ * * Returns:
+ * Number of bans committed, or a negative errno: the transaction failed
+ * and the queued bans were dropped (a later ban_add() queues them again).
+ */
+int ban_flush(BanList *l, int fd, uint64_t now_ms);
+
+/* *
+ * Logs the counters.
+ */
+void ban_log_stats(const BanList *l);
+
+#endif // FIREWALL_BANS_H
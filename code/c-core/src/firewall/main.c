@@ -1,19 +1,261 @@
-#include <stdio.h>
+// Global defines
+#define MODULE_NAME "FIREWALL"
+
+// standard includes
+#include <signal.h>
 #include <stdint.h>
-#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+// shared includes
+#include "../../include/arena.h"
+#include "../../include/exit-codes.h"
+#include "../../include/logging.h"
+
+// local includes
+#include "bans.h"
+#include "nft.h"
+#include "rulesets.h"
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "../../include/sockclient.h"
+
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
+#define SOCK_PATH IPC_CONTROLLER_SOCK_PATH
+
+#define BAN_FLUSH_INTERVAL_MS 1000
+#define MAX_BANS 16384 // a power of two, so the table is exactly 2x
+static const BanConfig ban_config = {
+    .max_bans = MAX_BANS,
+    .timeout_ms = 60 * 60 * 1000,
+};
+
+// Reserved at startup: ban_mem() is what ban_init() takes
+#define ARENA_SLACK 512
+
+// State shared by the reactor callbacks
+typedef struct {
+  NftBatch rulesets[STATE_COUNT]; // built once, committed on every change
+  BanList bans;
+  int nft_fd;
+  int sock_fd;
+  int ipc_fd;
 
-#include "../include/arena.h"
-#include "../include/exit-codes.h"
+  IPCMessage rcv_msgs[IPC_BATCH_MAX];
+} Firewall;
 
-/*   
- Objective: make a c program that can change firewall rules based on the nlibnftnl (interact with 
-the kernel module nftables) and the library libmnl (for making netlink sockets to interact programatically with the kernel)
+static uint64_t now_us(void);
+static int apply_state(Firewall *fw, SystemState state, uint32_t *elapsed_us);
+static void flush_bans(Firewall *fw);
+static void on_ban_timer(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata);
 
- */ 
+/* Puts the firewall rules of the controller's current state in place. The
+ * rule set of every state is compiled into an nf_tables batch at startup, so
+ * that a MSG_CMD_SET_STATE is answered with one netlink transaction: the old
+ * rules are swapped for the new ones atomically, in about a millisecond. The
+ * Closed rules go in before anything else, and the last rules stay in place
+ * when the module exits.
+ *
+ * Addresses the controller bans with MSG_CMD_BAN are dropped in the kernel
+ * for an hour, whatever the state: they are queued and added to the ban
+ * sets once a second, in one transaction.
+ *
+ * Usage: firewall
+ * */
+int main(int argc, char **argv) {
+  static Firewall fw;
+  fw.nft_fd = -1;
 
-int main{
+  Arena arena;
+  if (arena_reserve(&arena, STATE_COUNT * FW_BATCH_SIZE + ban_mem(MAX_BANS) +
+                                ARENA_SLACK) != 0) {
+    LOG_ERROR("Could not reserve the firewall's memory. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  for (int s = 0; s < STATE_COUNT; s++) {
+    if (nft_batch_init(&fw.rulesets[s], &arena, FW_BATCH_SIZE) != 0 ||
+        ruleset_build(&fw.rulesets[s], (SystemState)s) != 0) {
+      return OS_EXIT_GEN_FAILURE;
+    }
+  }
+  if (ban_init(&fw.bans, &arena, &ban_config) != 0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
 
+  fw.nft_fd = nft_open();
+  if (fw.nft_fd < 0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
 
+  // Fail closed: nothing gets in until the controller says otherwise
+  uint32_t elapsed_us;
+  if (apply_state(&fw, STATE_CLOSED, &elapsed_us) != 0) {
+    LOG_ERROR("Could not put the closed rule set in place. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  // The ban table's batch is built in the buffer later used for bans
+  if (ban_table_build(&fw.bans.batch, &ban_config) != 0 ||
+      nft_commit(fw.nft_fd, &fw.bans.batch) != 0) {
+    LOG_ERROR("Could not create the ban sets. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
 
+  Reactor reactor;
+  if (reactor_init(&reactor) != 0) {
+    LOG_ERROR("Failed to initialize reactor");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  const int signals[] = {SIGINT, SIGTERM};
+  if (reactor_add_signals(&reactor, signals, 2, on_signal, NULL) < 0) {
+    LOG_ERROR("Failed to register signal handlers");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  fw.sock_fd = ipc_client_connect(SOCK_PATH);
+  if (fw.sock_fd < 1) {
+    LOG_ERROR("Could not connect to the controller. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  if (ipc_client_hello(fw.sock_fd, MOD_FIREWALL) < 0) {
+    LOG_ERROR("Failed to identify to the controller");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  fw.ipc_fd = ipc_client_poll_fd(fw.sock_fd);
+
+  if (reactor_add_fd(&reactor, fw.ipc_fd, EPOLLIN, on_ipc_ready, &fw) != 0 ||
+      (fw.ipc_fd != fw.sock_fd &&
+       reactor_add_fd(&reactor, fw.sock_fd, 0, on_ipc_ready, &fw) != 0)) {
+    LOG_ERROR("Failed to watch IPC socket");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  if (reactor_add_timer(&reactor, BAN_FLUSH_INTERVAL_MS, on_ban_timer, &fw) <
+      0) {
+    LOG_ERROR("Failed to start the ban timer");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  LOG_INFO("Firewall closed, waiting for state changes");
+  reactor_run(&reactor);
+
+  flush_bans(&fw);
+  ban_log_stats(&fw.bans);
+  nft_close(&fw.nft_fd);
+  ipc_client_disconnect(&fw.sock_fd);
+  reactor_close(&reactor);
+  arena_release(&arena);
+  LOG_INFO("Firewall module stopped, rules left in place");
   return OS_EXIT_SUCCESS;
 }
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int apply_state(Firewall *fw, SystemState state, uint32_t *elapsed_us) {
+  uint64_t t0 = now_us();
+  int rc = nft_commit(fw->nft_fd, &fw->rulesets[state]);
+  *elapsed_us = (uint32_t)(now_us() - t0);
+
+  if (rc == 0) {
+    LOG_INFO("%s rule set applied in %u us (%u rules)",
+             ruleset_state_name(state), *elapsed_us,
+             fw->rulesets[state].rules);
+  } else {
+    LOG_ERROR("Failed to apply the %s rule set: %s, previous rules kept",
+              ruleset_state_name(state), strerror(-rc));
+  }
+  return rc;
+}
+
+static void on_set_state(Firewall *fw, const IPCMessage *msg) {
+  IPCMessage reply;
+  memset(&reply, 0, offsetof(IPCMessage, payload));
+  reply.origin = MOD_FIREWALL;
+  reply.msgtype = MSG_EVT_STATE_DONE;
+  reply.payload_len = sizeof(PayloadStateDone);
+
+  PayloadStateDone *done = &reply.payload.state_done;
+  done->state = msg->payload.state.state;
+  done->elapsed_us = 0;
+  if (done->state >= STATE_COUNT) {
+    LOG_WARN("Asked for unknown state %u", done->state);
+    done->status = -EINVAL;
+  } else {
+    done->status =
+        apply_state(fw, (SystemState)done->state, &done->elapsed_us);
+  }
+
+  if (ipc_client_send(fw->sock_fd, &reply) < 0) {
+    LOG_ERROR("Failed to report the state change");
+  }
+}
+
+static void flush_bans(Firewall *fw) {
+  uint64_t t0 = now_us();
+  int n = ban_flush(&fw->bans, fw->nft_fd, t0 / 1000);
+  if (n > 0) {
+    LOG_INFO("Banned %d addresses in %llu us (%zu active)", n,
+             (unsigned long long)(now_us() - t0), fw->bans.count);
+  } else if (n < 0) {
+    LOG_ERROR("Failed to add bans: %s", strerror(-n));
+  }
+}
+
+static void on_ban(Firewall *fw, const PayloadBan *ban) {
+  int rc = ban_add(&fw->bans, ban->ip, ban->ip_version, now_us() / 1000);
+  // A flood refuses thousands: log the 1st, 2nd, 4th, 8th...
+  uint64_t refused = fw->bans.refused;
+  if (rc < 0 && fw->bans.count == fw->bans.cfg.max_bans &&
+      (refused & (refused - 1)) == 0) {
+    LOG_WARN("Ban list full (%u), %llu bans refused so far (last for sid %u)",
+             fw->bans.cfg.max_bans, (unsigned long long)refused, ban->reason);
+  }
+  if (ban_flush_due(&fw->bans)) {
+    flush_bans(fw);
+  }
+}
+
+static void on_ban_timer(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Firewall *fw = (Firewall *)userdata;
+  reactor_timer_ack(fd);
+  flush_bans(fw);
+}
+
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Firewall *fw = (Firewall *)userdata;
+
+  int n;
+  while ((n = ipc_client_receive_batch(fw->sock_fd, fw->rcv_msgs,
+                                       IPC_BATCH_MAX)) > 0) {
+    for (int i = 0; i < n; i++) {
+      switch (fw->rcv_msgs[i].msgtype) {
+      case MSG_CMD_SET_STATE:
+        on_set_state(fw, &fw->rcv_msgs[i]);
+        break;
+      case MSG_CMD_BAN:
+        on_ban(fw, &fw->rcv_msgs[i].payload.ban);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+  if (n < 0 || (events & (EPOLLHUP | EPOLLERR))) {
+    LOG_ERROR("IPC connection lost. Exiting loop");
+    reactor_stop(r);
+  }
+}
+
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata) {
+  int signo = reactor_signal_read(fd);
+  LOG_INFO("Received signal %d. Shutting down", signo);
+  reactor_stop(r);
+}
@@ -0,0 +1,519 @@
+#define MODULE_NAME "NFT"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "nft.h"
+
+#define NFT_RECV_BUF 8192
+#define NFT_ACK_TIMEOUT_MS 1000
+
+// ---- raw encoding ----
+
+// Reserves len bytes, padded to 4 and zeroed; NULL once the buffer is full
+static void *nft_put(NftBatch *b, size_t len) {
+  size_t aligned = NLA_ALIGN(len);
+  if (b->overflow || aligned > b->cap - b->len) {
+    b->overflow = true;
+    return NULL;
+  }
+  uint8_t *p = b->buf + b->len;
+  memset(p, 0, aligned);
+  b->len += aligned;
+  return p;
+}
+
+static void nft_attr(NftBatch *b, uint16_t type, const void *data,
+                     size_t len) {
+  struct nlattr *a = nft_put(b, NLA_HDRLEN + len);
+  if (a == NULL) {
+    return;
+  }
+  a->nla_type = type;
+  a->nla_len = (uint16_t)(NLA_HDRLEN + len);
+  memcpy((uint8_t *)a + NLA_HDRLEN, data, len);
+}
+
+static void nft_attr_be32(NftBatch *b, uint16_t type, uint32_t v) {
+  uint32_t be = htonl(v);
+  nft_attr(b, type, &be, sizeof(be));
+}
+
+static void nft_attr_be64(NftBatch *b, uint16_t type, uint64_t v) {
+  uint64_t be = htobe64(v);
+  nft_attr(b, type, &be, sizeof(be));
+}
+
+static void nft_attr_str(NftBatch *b, uint16_t type, const char *s) {
+  nft_attr(b, type, s, strlen(s) + 1);
+}
+
+static void nft_nest_begin(NftBatch *b, uint16_t type) {
+  if (b->depth == NFT_NEST_MAX) {
+    b->overflow = true;
+    return;
+  }
+  b->nest[b->depth++] = b->len;
+  struct nlattr *a = nft_put(b, NLA_HDRLEN);
+  if (a != NULL) {
+    a->nla_type = NLA_F_NESTED | type;
+  }
+}
+
+static void nft_nest_end(NftBatch *b) {
+  if (b->depth == 0) {
+    b->overflow = true;
+    return;
+  }
+  size_t start = b->nest[--b->depth];
+  if (!b->overflow) {
+    ((struct nlattr *)(b->buf + start))->nla_len = (uint16_t)(b->len - start);
+  }
+}
+
+static void nft_msg_begin(NftBatch *b, uint16_t type, uint8_t family,
+                          uint16_t flags, uint16_t res_id) {
+  b->msg = b->len;
+  struct nlmsghdr *nlh = nft_put(b, NLMSG_HDRLEN);
+  struct nfgenmsg *nfg = nft_put(b, sizeof(struct nfgenmsg));
+  if (nlh == NULL || nfg == NULL) {
+    return;
+  }
+  nlh->nlmsg_type = type;
+  nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+  nlh->nlmsg_seq = b->seq++;
+  nfg->nfgen_family = family;
+  nfg->version = NFNETLINK_V0;
+  nfg->res_id = htons(res_id);
+  if (flags & NLM_F_ACK) {
+    b->acks++;
+  }
+}
+
+static void nft_msg_end(NftBatch *b) {
+  if (!b->overflow) {
+    ((struct nlmsghdr *)(b->buf + b->msg))->nlmsg_len =
+        (uint32_t)(b->len - b->msg);
+  }
+}
+
+static inline uint16_t nft_type(uint16_t msg) {
+  return (uint16_t)(NFNL_SUBSYS_NFTABLES << 8 | msg);
+}
+
+// ---- batches, tables, chains, rules ----
+
+int nft_batch_init(NftBatch *b, Arena *a, size_t cap) {
+  memset(b, 0, sizeof(NftBatch));
+  b->buf = arena_alloc_align(a, cap, NLMSG_ALIGNTO);
+  if (b->buf == NULL) {
+    LOG_ERROR("Not enough memory for a %zu byte nf_tables batch", cap);
+    return -1;
+  }
+  b->cap = cap;
+  b->seq = 1;
+  return 0;
+}
+
+void nft_batch_reset(NftBatch *b) {
+  b->len = 0;
+  b->acks = 0;
+  b->rules = 0;
+  b->overflow = false;
+  b->depth = 0;
+}
+
+void nft_batch_begin(NftBatch *b) {
+  nft_msg_begin(b, NFNL_MSG_BATCH_BEGIN, AF_UNSPEC, 0, NFNL_SUBSYS_NFTABLES);
+  nft_msg_end(b);
+}
+
+void nft_batch_end(NftBatch *b) {
+  nft_msg_begin(b, NFNL_MSG_BATCH_END, AF_UNSPEC, 0, NFNL_SUBSYS_NFTABLES);
+  nft_msg_end(b);
+}
+
+void nft_table_add(NftBatch *b, uint8_t family, const char *name) {
+  nft_msg_begin(b, nft_type(NFT_MSG_NEWTABLE), family,
+                NLM_F_CREATE | NLM_F_ACK, 0);
+  nft_attr_str(b, NFTA_TABLE_NAME, name);
+  nft_attr_be32(b, NFTA_TABLE_FLAGS, 0);
+  nft_msg_end(b);
+}
+
+void nft_table_del(NftBatch *b, uint8_t family, const char *name) {
+  nft_msg_begin(b, nft_type(NFT_MSG_DELTABLE), family, NLM_F_ACK, 0);
+  nft_attr_str(b, NFTA_TABLE_NAME, name);
+  nft_msg_end(b);
+}
+
+void nft_chain_add(NftBatch *b, uint8_t family, const char *table,
+                   const char *name, const NftHook *hook) {
+  nft_msg_begin(b, nft_type(NFT_MSG_NEWCHAIN), family,
+                NLM_F_CREATE | NLM_F_ACK, 0);
+  nft_attr_str(b, NFTA_CHAIN_TABLE, table);
+  nft_attr_str(b, NFTA_CHAIN_NAME, name);
+  if (hook != NULL) {
+    nft_nest_begin(b, NFTA_CHAIN_HOOK);
+    nft_attr_be32(b, NFTA_HOOK_HOOKNUM, hook->hooknum);
+    nft_attr_be32(b, NFTA_HOOK_PRIORITY, (uint32_t)hook->priority);
+    nft_nest_end(b);
+    nft_attr_be32(b, NFTA_CHAIN_POLICY, hook->policy);
+    nft_attr_str(b, NFTA_CHAIN_TYPE, hook->type);
+  }
+  nft_msg_end(b);
+}
+
+void nft_rule_begin(NftBatch *b, uint8_t family, const char *table,
+                    const char *chain) {
+  nft_msg_begin(b, nft_type(NFT_MSG_NEWRULE), family,
+                NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK, 0);
+  nft_attr_str(b, NFTA_RULE_TABLE, table);
+  nft_attr_str(b, NFTA_RULE_CHAIN, chain);
+  nft_nest_begin(b, NFTA_RULE_EXPRESSIONS);
+}
+
+void nft_rule_end(NftBatch *b) {
+  nft_nest_end(b);
+  nft_msg_end(b);
+  b->rules++;
+}
+
+// ---- expressions ----
+
+static void nft_expr_begin(NftBatch *b, const char *name) {
+  nft_nest_begin(b, NFTA_LIST_ELEM);
+  nft_attr_str(b, NFTA_EXPR_NAME, name);
+  nft_nest_begin(b, NFTA_EXPR_DATA);
+}
+
+static void nft_expr_end(NftBatch *b) {
+  nft_nest_end(b);
+  nft_nest_end(b);
+}
+
+static void nft_data_value(NftBatch *b, uint16_t type, const void *data,
+                           size_t len) {
+  nft_nest_begin(b, type);
+  nft_attr(b, NFTA_DATA_VALUE, data, len);
+  nft_nest_end(b);
+}
+
+void nft_expr_meta(NftBatch *b, uint32_t key, uint32_t dreg) {
+  nft_expr_begin(b, "meta");
+  nft_attr_be32(b, NFTA_META_KEY, key);
+  nft_attr_be32(b, NFTA_META_DREG, dreg);
+  nft_expr_end(b);
+}
+
+void nft_expr_ct(NftBatch *b, uint32_t key, uint32_t dreg) {
+  nft_expr_begin(b, "ct");
+  nft_attr_be32(b, NFTA_CT_KEY, key);
+  nft_attr_be32(b, NFTA_CT_DREG, dreg);
+  nft_expr_end(b);
+}
+
+void nft_expr_payload(NftBatch *b, uint32_t base, uint32_t offset,
+                      uint32_t len, uint32_t dreg) {
+  nft_expr_begin(b, "payload");
+  nft_attr_be32(b, NFTA_PAYLOAD_DREG, dreg);
+  nft_attr_be32(b, NFTA_PAYLOAD_BASE, base);
+  nft_attr_be32(b, NFTA_PAYLOAD_OFFSET, offset);
+  nft_attr_be32(b, NFTA_PAYLOAD_LEN, len);
+  nft_expr_end(b);
+}
+
+void nft_expr_cmp(NftBatch *b, uint32_t sreg, uint32_t op, const void *data,
+                  size_t len) {
+  nft_expr_begin(b, "cmp");
+  nft_attr_be32(b, NFTA_CMP_SREG, sreg);
+  nft_attr_be32(b, NFTA_CMP_OP, op);
+  nft_data_value(b, NFTA_CMP_DATA, data, len);
+  nft_expr_end(b);
+}
+
+void nft_expr_cmp_u8(NftBatch *b, uint32_t sreg, uint32_t op, uint8_t v) {
+  nft_expr_cmp(b, sreg, op, &v, sizeof(v));
+}
+
+void nft_expr_cmp_be16(NftBatch *b, uint32_t sreg, uint32_t op, uint16_t v) {
+  uint16_t be = htons(v);
+  nft_expr_cmp(b, sreg, op, &be, sizeof(be));
+}
+
+void nft_expr_bitwise(NftBatch *b, uint32_t sreg, uint32_t dreg,
+                      const void *mask, const void *xor, size_t len) {
+  nft_expr_begin(b, "bitwise");
+  nft_attr_be32(b, NFTA_BITWISE_SREG, sreg);
+  nft_attr_be32(b, NFTA_BITWISE_DREG, dreg);
+  nft_attr_be32(b, NFTA_BITWISE_LEN, (uint32_t)len);
+  nft_data_value(b, NFTA_BITWISE_MASK, mask, len);
+  nft_data_value(b, NFTA_BITWISE_XOR, xor, len);
+  nft_expr_end(b);
+}
+
+void nft_expr_immediate(NftBatch *b, uint32_t dreg, const void *data,
+                        size_t len) {
+  nft_expr_begin(b, "immediate");
+  nft_attr_be32(b, NFTA_IMMEDIATE_DREG, dreg);
+  nft_data_value(b, NFTA_IMMEDIATE_DATA, data, len);
+  nft_expr_end(b);
+}
+
+void nft_expr_verdict(NftBatch *b, int32_t verdict) {
+  nft_expr_begin(b, "immediate");
+  nft_attr_be32(b, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+  nft_nest_begin(b, NFTA_IMMEDIATE_DATA);
+  nft_nest_begin(b, NFTA_DATA_VERDICT);
+  nft_attr_be32(b, NFTA_VERDICT_CODE, (uint32_t)verdict);
+  nft_nest_end(b);
+  nft_nest_end(b);
+  nft_expr_end(b);
+}
+
+void nft_expr_counter(NftBatch *b) {
+  nft_expr_begin(b, "counter");
+  nft_expr_end(b);
+}
+
+void nft_expr_reject(NftBatch *b, uint32_t type, uint8_t icmp_code) {
+  nft_expr_begin(b, "reject");
+  nft_attr_be32(b, NFTA_REJECT_TYPE, type);
+  if (type != NFT_REJECT_TCP_RST) {
+    nft_attr(b, NFTA_REJECT_ICMP_CODE, &icmp_code, sizeof(icmp_code));
+  }
+  nft_expr_end(b);
+}
+
+void nft_expr_redir(NftBatch *b, uint32_t reg_proto_min) {
+  nft_expr_begin(b, "redir");
+  nft_attr_be32(b, NFTA_REDIR_REG_PROTO_MIN, reg_proto_min);
+  nft_expr_end(b);
+}
+
+void nft_expr_lookup(NftBatch *b, const char *set, uint32_t set_id,
+                     uint32_t sreg) {
+  nft_expr_begin(b, "lookup");
+  nft_attr_str(b, NFTA_LOOKUP_SET, set);
+  nft_attr_be32(b, NFTA_LOOKUP_SET_ID, set_id);
+  nft_attr_be32(b, NFTA_LOOKUP_SREG, sreg);
+  nft_expr_end(b);
+}
+
+// ---- sets ----
+
+void nft_set_add(NftBatch *b, uint8_t family, const char *table,
+                 const char *name, uint32_t id, uint32_t key_type,
+                 uint32_t key_len, uint32_t flags, uint64_t timeout_ms) {
+  nft_msg_begin(b, nft_type(NFT_MSG_NEWSET), family,
+                NLM_F_CREATE | NLM_F_ACK, 0);
+  nft_attr_str(b, NFTA_SET_TABLE, table);
+  nft_attr_str(b, NFTA_SET_NAME, name);
+  nft_attr_be32(b, NFTA_SET_ID, id);
+  nft_attr_be32(b, NFTA_SET_FLAGS, flags);
+  nft_attr_be32(b, NFTA_SET_KEY_TYPE, key_type);
+  nft_attr_be32(b, NFTA_SET_KEY_LEN, key_len);
+  if ((flags & NFT_SET_TIMEOUT) && timeout_ms != 0) {
+    nft_attr_be64(b, NFTA_SET_TIMEOUT, timeout_ms);
+  }
+  nft_msg_end(b);
+}
+
+void nft_setelem_begin(NftBatch *b, uint8_t family, const char *table,
+                       const char *set) {
+  nft_msg_begin(b, nft_type(NFT_MSG_NEWSETELEM), family,
+                NLM_F_CREATE | NLM_F_ACK, 0);
+  nft_attr_str(b, NFTA_SET_ELEM_LIST_TABLE, table);
+  nft_attr_str(b, NFTA_SET_ELEM_LIST_SET, set);
+  nft_nest_begin(b, NFTA_SET_ELEM_LIST_ELEMENTS);
+}
+
+void nft_setelem(NftBatch *b, const void *key, size_t key_len,
+                 uint64_t timeout_ms) {
+  nft_nest_begin(b, NFTA_LIST_ELEM);
+  nft_data_value(b, NFTA_SET_ELEM_KEY, key, key_len);
+  if (timeout_ms != 0) {
+    nft_attr_be64(b, NFTA_SET_ELEM_TIMEOUT, timeout_ms);
+  }
+  nft_nest_end(b);
+}
+
+void nft_setelem_end(NftBatch *b) {
+  nft_nest_end(b);
+  nft_msg_end(b);
+}
+
+// ---- socket ----
+
+int nft_open(void) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+  if (fd == -1) {
+    LOG_SYS_ERROR("Failed to open a netfilter netlink socket");
+    return -1;
+  }
+
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    LOG_SYS_ERROR("Failed to bind the netlink socket");
+    close(fd);
+    return -1;
+  }
+
+  // Errors don't need to carry a copy of the (possibly large) request
+  int one = 1;
+  setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+  return fd;
+}
+
+// Every request sent gets sequence numbers no earlier one used, so that
+// replies still queued from a batch that timed out or failed are told apart
+// from the replies to this one
+static uint32_t nft_next_seq = 1;
+
+// Renumbers the messages of b from nft_next_seq on. Returns the first one.
+static uint32_t nft_number(NftBatch *b) {
+  uint32_t first = nft_next_seq;
+  size_t left = b->len;
+  for (struct nlmsghdr *nlh = (struct nlmsghdr *)b->buf; NLMSG_OK(nlh, left);
+       nlh = NLMSG_NEXT(nlh, left)) {
+    nlh->nlmsg_seq = nft_next_seq++;
+  }
+  return first;
+}
+
+int nft_commit(int fd, NftBatch *b) {
+  if (!nft_batch_ok(b)) {
+    LOG_ERROR("Refusing to send an incomplete nf_tables batch");
+    return -EINVAL;
+  }
+  uint32_t first = nft_number(b);
+  uint32_t count = nft_next_seq - first;
+
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  if (sendto(fd, b->buf, b->len, 0, (struct sockaddr *)&kernel,
+             sizeof(kernel)) == -1) {
+    int err = errno;
+    LOG_SYS_ERROR("Failed to send the nf_tables batch");
+    return -err;
+  }
+
+  // The kernel acks every message that asked for it, or reports the first
+  // failure and rolls the whole batch back. After an error, only drain what
+  // is already queued.
+  uint8_t buf[NFT_RECV_BUF] __attribute__((aligned(NLMSG_ALIGNTO)));
+  uint32_t acked = 0;
+  int status = 0;
+  while (acked < b->acks) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int rc = poll(&pfd, 1, status == 0 ? NFT_ACK_TIMEOUT_MS : 0);
+    if (rc == 0) {
+      if (status == 0) {
+        LOG_ERROR("nf_tables acknowledged %u of %u messages", acked, b->acks);
+        status = -ETIMEDOUT;
+      }
+      break;
+    }
+    ssize_t n = rc > 0 ? recv(fd, buf, sizeof(buf), 0) : -1;
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      status = status != 0 ? status : -errno;
+      LOG_SYS_ERROR("Failed to read the nf_tables acknowledgements");
+      break;
+    }
+
+    size_t left = (size_t)n;
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, left);
+         nlh = NLMSG_NEXT(nlh, left)) {
+      if (nlh->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+      const struct nlmsgerr *e = NLMSG_DATA(nlh);
+      if (e->msg.nlmsg_seq - first >= count) {
+        LOG_DEBUG("Ignoring a stale nf_tables reply (message %u)",
+                  e->msg.nlmsg_seq);
+        continue;
+      }
+      acked++;
+      if (e->error != 0 && status == 0) {
+        status = e->error;
+        LOG_ERROR("nf_tables rejected the batch (message %u): %s",
+                  e->msg.nlmsg_seq, strerror(-e->error));
+      }
+    }
+  }
+  return status;
+}
+
+int nft_count_rules(int fd, uint8_t family, const char *table) {
+  uint8_t req[256] __attribute__((aligned(NLMSG_ALIGNTO)));
+  NftBatch b;
+  memset(&b, 0, sizeof(NftBatch));
+  b.buf = req;
+  b.cap = sizeof(req);
+  nft_msg_begin(&b, nft_type(NFT_MSG_GETRULE), family, NLM_F_DUMP, 0);
+  nft_attr_str(&b, NFTA_RULE_TABLE, table);
+  nft_msg_end(&b);
+  if (!nft_batch_ok(&b)) {
+    return -ENAMETOOLONG;
+  }
+  uint32_t seq = nft_number(&b);
+
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  if (sendto(fd, b.buf, b.len, 0, (struct sockaddr *)&kernel,
+             sizeof(kernel)) == -1) {
+    return -errno;
+  }
+
+  static uint8_t buf[4 * NFT_RECV_BUF] __attribute__((aligned(NLMSG_ALIGNTO)));
+  int rules = 0;
+  while (1) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, NFT_ACK_TIMEOUT_MS) <= 0) {
+      return -ETIMEDOUT;
+    }
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+
+    size_t left = (size_t)n;
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, left);
+         nlh = NLMSG_NEXT(nlh, left)) {
+      if (nlh->nlmsg_seq != seq) {
+        continue; // left over from an earlier request
+      }
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        return rules;
+      }
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr *e = NLMSG_DATA(nlh);
+        return e->error;
+      }
+      rules += nlh->nlmsg_type == nft_type(NFT_MSG_NEWRULE);
+    }
+  }
+}
+
+void nft_close(int *fd) {
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+}
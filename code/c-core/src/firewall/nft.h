@@ -0,0 +1,180 @@
+#ifndef FIREWALL_NFT_H
+#define FIREWALL_NFT_H
+
+/* ==========================================================================
+ *  Orange Sentry - nf_tables netlink batches
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Builds nf_tables transactions as raw netlink messages and commits them.
+ *  A transaction is a batch: NFNL_MSG_BATCH_BEGIN, any number of table,
+ *  chain, rule and set messages, NFNL_MSG_BATCH_END, all in one buffer
+ *  handed to the kernel with one sendto(). The kernel applies the whole
+ *  batch or none of it, and the ruleset switches over at once: there is no
+ *  moment where half the old rules and half the new ones are loaded.
+ *
+ *  This is the encoding libnftnl produces (and `nft -f` sends), written
+ *  directly against the kernel's uapi headers: the module needs a dozen
+ *  expressions, not the whole library. Rules are built expression by
+ *  expression, the way `nft --debug=netlink` prints them:
+ *
+ *      nft_rule_begin(b, NFPROTO_INET, "t", "input");
+ *      nft_expr_meta(b, NFT_META_L4PROTO, NFT_REG_1);
+ *      nft_expr_cmp_u8(b, NFT_REG_1, NFT_CMP_EQ, IPPROTO_TCP);
+ *      nft_expr_verdict(b, NF_ACCEPT);
+ *      nft_rule_end(b);
+ *
+ *  Builders never fail one by one: running out of room sets b->overflow
+ *  and everything after is ignored, so a whole batch is checked once with
+ *  nft_batch_ok() before it is used.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. nft_batch_init() with a buffer from an Arena.
+ *  2. nft_batch_begin(), table/chain/rule/set messages, nft_batch_end().
+ *  3. nft_open() once, then nft_commit() as many times as needed: a built
+ *     batch can be sent again unchanged.
+ *
+ * ========================================================================== */
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netlink.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/arena.h"
+
+#define NFT_NEST_MAX 8
+
+typedef struct {
+  uint8_t *buf;
+  size_t cap;
+  size_t len;
+  uint32_t seq;
+  uint32_t acks; // messages the kernel will acknowledge
+  uint32_t rules;
+  bool overflow;
+
+  // open message and nested attributes
+  size_t msg;
+  size_t nest[NFT_NEST_MAX];
+  int depth;
+} NftBatch;
+
+// Base chain settings
+typedef struct {
+  const char *type; // "filter" or "nat"
+  uint32_t hooknum; // NF_INET_*
+  int32_t priority; // NF_IP_PRI_*, lower runs first
+  uint32_t policy;  // NF_ACCEPT or NF_DROP
+} NftHook;
+
+/* *
+ * Takes cap bytes for the batch from a.
+ * * Returns:
+ * 0 on success, -1 if the arena is too small.
+ */
+int nft_batch_init(NftBatch *b, Arena *a, size_t cap);
+
+/* *
+ * Empties the batch to build another one in the same buffer.
+ */
+void nft_batch_reset(NftBatch *b);
+
+static inline bool nft_batch_ok(const NftBatch *b) {
+  return !b->overflow && b->depth == 0;
+}
+
+void nft_batch_begin(NftBatch *b);
+void nft_batch_end(NftBatch *b);
+
+// Creates the table if it doesn't exist yet
+void nft_table_add(NftBatch *b, uint8_t family, const char *name);
+// Deletes the table and everything in it
+void nft_table_del(NftBatch *b, uint8_t family, const char *name);
+
+/* *
+ * Adds a chain; a base chain (attached to a hook) if hook is not NULL.
+ */
+void nft_chain_add(NftBatch *b, uint8_t family, const char *table,
+                   const char *name, const NftHook *hook);
+
+/* *
+ * Starts a rule appended to the chain. Expressions follow, in order.
+ */
+void nft_rule_begin(NftBatch *b, uint8_t family, const char *table,
+                    const char *chain);
+void nft_rule_end(NftBatch *b);
+
+/* *
+ * Adds a named set of key_len byte keys (NFT_SET_* flags). id refers to it
+ * from lookups in the same batch; with NFT_SET_TIMEOUT, elements expire
+ * after timeout_ms unless they carry their own timeout.
+ */
+void nft_set_add(NftBatch *b, uint8_t family, const char *table,
+                 const char *name, uint32_t id, uint32_t key_type,
+                 uint32_t key_len, uint32_t flags, uint64_t timeout_ms);
+
+/* *
+ * Starts a message adding elements to a set; nft_setelem() for each one.
+ * A message holds at most NFT_SETELEM_MAX bytes of elements: start a new
+ * one before that (every element is NFT_SETELEM_SIZE(key_len) bytes).
+ */
+void nft_setelem_begin(NftBatch *b, uint8_t family, const char *table,
+                       const char *set);
+void nft_setelem(NftBatch *b, const void *key, size_t key_len,
+                 uint64_t timeout_ms);
+void nft_setelem_end(NftBatch *b);
+
+#define NFT_SETELEM_MAX 60000 // nested attribute lengths are 16 bits
+#define NFT_SETELEM_SIZE(key_len)                                              \
+  (3 * NLA_HDRLEN + NLA_ALIGN(key_len) + NLA_HDRLEN + 8)
+
+// Expressions
+void nft_expr_meta(NftBatch *b, uint32_t key, uint32_t dreg);
+void nft_expr_ct(NftBatch *b, uint32_t key, uint32_t dreg);
+void nft_expr_payload(NftBatch *b, uint32_t base, uint32_t offset,
+                      uint32_t len, uint32_t dreg);
+void nft_expr_cmp(NftBatch *b, uint32_t sreg, uint32_t op, const void *data,
+                  size_t len);
+void nft_expr_cmp_u8(NftBatch *b, uint32_t sreg, uint32_t op, uint8_t v);
+void nft_expr_cmp_be16(NftBatch *b, uint32_t sreg, uint32_t op, uint16_t v);
+void nft_expr_bitwise(NftBatch *b, uint32_t sreg, uint32_t dreg,
+                      const void *mask, const void *xor, size_t len);
+void nft_expr_immediate(NftBatch *b, uint32_t dreg, const void *data,
+                        size_t len);
+void nft_expr_verdict(NftBatch *b, int32_t verdict);
+void nft_expr_counter(NftBatch *b);
+void nft_expr_reject(NftBatch *b, uint32_t type, uint8_t icmp_code);
+void nft_expr_redir(NftBatch *b, uint32_t reg_proto_min);
+void nft_expr_lookup(NftBatch *b, const char *set, uint32_t set_id,
+                     uint32_t sreg);
+
+/* *
+ * Opens a netfilter netlink socket (needs CAP_NET_ADMIN to commit).
+ * * Returns:
+ * The socket, or -1 on error (logged).
+ */
+int nft_open(void);
+
+/* *
+ * Sends the batch and waits for the kernel to acknowledge every message.
+ * The messages are renumbered on every commit, so replies left over from an
+ * earlier commit (after a timeout) are not mistaken for this one's.
+ * * Returns:
+ * 0 once the batch is applied, or a negative errno: the kernel's first
+ * error (the batch was rolled back), or the send/receive failure.
+ */
+int nft_commit(int fd, NftBatch *b);
+
+/* *
+ * Lists the rules of a table (all its chains) back from the kernel.
+ * * Returns:
+ * The number of rules, or a negative errno (-ENOENT: no such table).
+ */
+int nft_count_rules(int fd, uint8_t family, const char *table);
+
+void nft_close(int *fd);
+
+#endif // FIREWALL_NFT_H
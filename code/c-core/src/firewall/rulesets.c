@@ -0,0 +1,174 @@
+#define MODULE_NAME "RULESETS"
+
+#include <arpa/inet.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+#include <linux/netfilter_ipv4.h>
+
+#include "rulesets.h"
+
+#define FW_INPUT "input"
+#define FW_PREROUTING "prerouting"
+
+static const char *state_names[STATE_COUNT] = {"closed", "passive-listen",
+                                               "honeypot", "development"};
+
+// ---- rule fragments ----
+
+static void rule(NftBatch *b) {
+  nft_rule_begin(b, FW_FAMILY, FW_TABLE, FW_INPUT);
+}
+
+static void match_l4proto(NftBatch *b, uint8_t proto) {
+  nft_expr_meta(b, NFT_META_L4PROTO, NFT_REG_1);
+  nft_expr_cmp_u8(b, NFT_REG_1, NFT_CMP_EQ, proto);
+}
+
+// th sport/dport: the first two 16-bit fields of both TCP and UDP
+static void match_port(NftBatch *b, uint32_t offset, uint16_t port) {
+  nft_expr_payload(b, NFT_PAYLOAD_TRANSPORT_HEADER, offset, 2, NFT_REG_1);
+  nft_expr_cmp_be16(b, NFT_REG_1, NFT_CMP_EQ, port);
+}
+
+// <proto> dport <port> accept
+static void accept_port(NftBatch *b, uint8_t proto, uint16_t port) {
+  rule(b);
+  match_l4proto(b, proto);
+  match_port(b, 2, port);
+  nft_expr_verdict(b, NF_ACCEPT);
+  nft_rule_end(b);
+}
+
+// udp sport <from> dport <to> accept
+static void accept_udp_reply(NftBatch *b, uint16_t from, uint16_t to) {
+  rule(b);
+  match_l4proto(b, IPPROTO_UDP);
+  match_port(b, 0, from);
+  match_port(b, 2, to);
+  nft_expr_verdict(b, NF_ACCEPT);
+  nft_rule_end(b);
+}
+
+// tcp dport <port> redirect to :<to>
+static void redirect_port(NftBatch *b, uint16_t port, uint16_t to) {
+  nft_rule_begin(b, FW_FAMILY, FW_TABLE, FW_PREROUTING);
+  match_l4proto(b, IPPROTO_TCP);
+  match_port(b, 2, port);
+  nft_expr_counter(b);
+  uint16_t be = htons(to);
+  nft_expr_immediate(b, NFT_REG_1, &be, sizeof(be));
+  nft_expr_redir(b, NFT_REG_1);
+  nft_rule_end(b);
+}
+
+// What every state lets through: replies to our own connections, loopback,
+// address configuration
+static void common_rules(NftBatch *b) {
+  // ct state established,related accept
+  const uint32_t mask = NF_CT_STATE_BIT(IP_CT_ESTABLISHED) |
+                        NF_CT_STATE_BIT(IP_CT_RELATED);
+  const uint32_t zero = 0;
+  rule(b);
+  nft_expr_ct(b, NFT_CT_STATE, NFT_REG_1);
+  nft_expr_bitwise(b, NFT_REG_1, NFT_REG_1, &mask, &zero, sizeof(mask));
+  nft_expr_cmp(b, NFT_REG_1, NFT_CMP_NEQ, &zero, sizeof(zero));
+  nft_expr_verdict(b, NF_ACCEPT);
+  nft_rule_end(b);
+
+  // iif lo accept (the loopback device is always index 1)
+  const uint32_t lo = 1;
+  rule(b);
+  nft_expr_meta(b, NFT_META_IIF, NFT_REG_1);
+  nft_expr_cmp(b, NFT_REG_1, NFT_CMP_EQ, &lo, sizeof(lo));
+  nft_expr_verdict(b, NF_ACCEPT);
+  nft_rule_end(b);
+
+  // icmpv6 type { nd-router-solicit - nd-neighbor-advert } accept
+  rule(b);
+  match_l4proto(b, IPPROTO_ICMPV6);
+  nft_expr_payload(b, NFT_PAYLOAD_TRANSPORT_HEADER, 0, 1, NFT_REG_1);
+  nft_expr_cmp_u8(b, NFT_REG_1, NFT_CMP_GTE, 133);
+  nft_expr_cmp_u8(b, NFT_REG_1, NFT_CMP_LTE, 136);
+  nft_expr_verdict(b, NF_ACCEPT);
+  nft_rule_end(b);
+
+  // DHCP and DHCPv6 server replies
+  accept_udp_reply(b, 67, 68);
+  accept_udp_reply(b, 547, 546);
+}
+
+// ---- per state ----
+
+static void closed_rules(NftBatch *b) {
+  // Refuse rather than drop: nothing here is worth hiding
+  rule(b);
+  match_l4proto(b, IPPROTO_TCP);
+  nft_expr_counter(b);
+  nft_expr_reject(b, NFT_REJECT_TCP_RST, 0);
+  nft_rule_end(b);
+
+  rule(b);
+  nft_expr_counter(b);
+  nft_expr_reject(b, NFT_REJECT_ICMPX_UNREACH, NFT_REJECT_ICMPX_PORT_UNREACH);
+  nft_rule_end(b);
+}
+
+static void honeypot_rules(NftBatch *b) {
+  accept_port(b, IPPROTO_TCP, FW_HONEYPOT_SSH_PORT);
+  accept_port(b, IPPROTO_TCP, FW_HONEYPOT_TELNET_PORT);
+
+  const NftHook nat = {"nat", NF_INET_PRE_ROUTING, NF_IP_PRI_NAT_DST,
+                       NF_ACCEPT};
+  nft_chain_add(b, FW_FAMILY, FW_TABLE, FW_PREROUTING, &nat);
+  redirect_port(b, 22, FW_HONEYPOT_SSH_PORT);
+  redirect_port(b, 23, FW_HONEYPOT_TELNET_PORT);
+}
+
+// ---- public API ----
+
+int ruleset_build(NftBatch *b, SystemState state) {
+  if ((unsigned)state >= STATE_COUNT) {
+    LOG_ERROR("No rule set for state %d", state);
+    return -1;
+  }
+
+  nft_batch_reset(b);
+  nft_batch_begin(b);
+  // Create first, so that the delete can't fail on the first run
+  nft_table_add(b, FW_FAMILY, FW_TABLE);
+  nft_table_del(b, FW_FAMILY, FW_TABLE);
+  nft_table_add(b, FW_FAMILY, FW_TABLE);
+
+  const NftHook input = {"filter", NF_INET_LOCAL_IN, NF_IP_PRI_FILTER,
+                         NF_DROP};
+  nft_chain_add(b, FW_FAMILY, FW_TABLE, FW_INPUT, &input);
+  common_rules(b);
+
+  switch (state) {
+  case STATE_CLOSED:
+    closed_rules(b);
+    break;
+  case STATE_PASSIVE_LISTEN:
+    // The listener sees the attempts on the wire; the policy drops them
+    break;
+  case STATE_HONEYPOT:
+    honeypot_rules(b);
+    break;
+  case STATE_DEVELOPMENT:
+    accept_port(b, IPPROTO_TCP, 22);
+    break;
+  default:
+    break;
+  }
+  nft_batch_end(b);
+
+  if (!nft_batch_ok(b)) {
+    LOG_ERROR("The %s rule set doesn't fit in %zu bytes", state_names[state],
+              b->cap);
+    return -1;
+  }
+  return 0;
+}
+
+const char *ruleset_state_name(SystemState state) {
+  return (unsigned)state < STATE_COUNT ? state_names[state] : "unknown";
+}
@@ -0,0 +1,53 @@
+#ifndef FIREWALL_RULESETS_H
+#define FIREWALL_RULESETS_H
+
+/* ==========================================================================
+ *  Orange Sentry - Firewall rule sets
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  The nf_tables rules of each SystemState, all in one table of their own
+ *  (inet orange-sentry), so nothing else on the host is touched. Every
+ *  state's batch replaces that table whole: it creates the table (a no-op
+ *  if it exists), deletes it with everything in it, and builds it again.
+ *  Committed as one transaction, a state change is a single switch from one
+ *  complete rule set to the next.
+ *
+ *  Every state accepts established traffic, loopback, DHCP and IPv6
+ *  neighbour discovery, then:
+ *    Closed:         refuses everything else (TCP reset, ICMP unreachable)
+ *    Passive Listen: drops everything else silently
+ *    Honeypot:       redirects ports 22 and 23 to the honeypot, drops the rest
+ *    Development:    also accepts SSH, drops the rest
+ *  Outside Honeypot the honeypot's ports are closed like any other: a
+ *  honeypot kept running between honeypot states (the controller's hot
+ *  standby) is only reachable over loopback.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  ruleset_build() once per state at startup, then nft_commit() the batch
+ *  on every transition.
+ *
+ * ========================================================================== */
+
+#include "../../include/sockclient.h"
+#include "nft.h"
+
+#define FW_FAMILY NFPROTO_INET
+#define FW_TABLE "orange-sentry"
+
+#define FW_HONEYPOT_SSH_PORT 2222
+#define FW_HONEYPOT_TELNET_PORT 2223
+
+#define FW_BATCH_SIZE 8192 // bytes; the largest set is about 3 KiB
+
+/* *
+ * Builds the transaction that puts state's rules in place into b (reset
+ * first).
+ * * Returns:
+ * 0 on success, -1 on an unknown state or if the batch doesn't fit.
+ */
+int ruleset_build(NftBatch *b, SystemState state);
+
+const char *ruleset_state_name(SystemState state);
+
+#endif // FIREWALL_RULESETS_H
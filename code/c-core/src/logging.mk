@@ -0,0 +1,17 @@
+# Shared by every module's Makefile, included once TARGET_BIN, BUILD_DIR,
+# CFLAGS and LDFLAGS are set.
+#
+# make LOG_ASYNC=1: logging through per-thread rings and a flusher thread
+# (include/logging.h). The backend is compiled once per program from
+# include/logging.c; link $(LOG_OBJS) with the module's own objects.
+LOG_OBJ := $(BUILD_DIR)/$(notdir $(TARGET_BIN))-logging.o
+
+ifdef LOG_ASYNC
+	CFLAGS += -DLOG_ASYNC
+	LDFLAGS += -lpthread
+	LOG_OBJS := $(LOG_OBJ)
+endif
+
+# A pattern rule, so it never becomes the Makefile's default goal
+$(BUILD_DIR)/%-logging.o: $(INCLUDE_DIR)/logging.c $(INCLUDE_DIR)/logging.h | directories
+	$(CC) $< $(CFLAGS) -c -o $@
@@ -1,7 +1,13 @@
 // This code was written totally by AI. It is not production code, and is for
 // quick testing only
+//
+// Usage: fake_core [burst_size]
+// Sends burst_size MSG_CMD_MQTT_PUB messages in one batch (default 1).
+
+#define _GNU_SOURCE
 
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,15 +15,20 @@
 #include <sys/un.h>
 #include <unistd.h>
 
-// We include the header ONLY to get the IPCMessage struct definition.
-// We DO NOT define SOCK_IPC_IMPLEMENTATION here because we aren't using
-// the client functions. We are building the raw server side here.
+// The server side is built by hand below, but messages go through
+// ipc_client_send/ipc_client_receive so they use the same wire framing.
+#define SOCK_IPC_IMPLEMENTATION
 #include "../../include/sockclient.h"
 
-#define SOCK_PATH "/tmp/test_mqtt.sock"
+// Stands in for the controller, so it listens where modules look for it
+#define SOCK_PATH IPC_CONTROLLER_SOCK_PATH
 
-int main() {
+int main(int argc, char **argv) {
   int server_fd, client_fd;
+  int burst = argc > 1 ? atoi(argv[1]) : 1;
+  if (burst < 1 || burst > 1024) {
+    burst = 1;
+  }
   struct sockaddr_un addr;
 
   // 1. Create the server socket (SOCK_SEQPACKET guarantees message boundaries)
@@ -58,76 +69,119 @@ int main() {
   }
   printf("MQTT Client connected successfully!\n");
 
-  // Give the client a brief moment to fully initialize its Paho connection
-  sleep(1);
-
-  // 5. Build the IPC Message perfectly
-  IPCMessage msg;
-  memset(&msg, 0, sizeof(IPCMessage)); // Crucial: Prevent memory garbage
+  // Give the client a brief moment to fully initialize its Paho connection.
+  // Wait on the socket meanwhile: if the client runs with
+  // OS_IPC_TRANSPORT=shm its first message is the ring offer, which must be
+  // read (and is answered inside ipc_client_receive) before we send anything.
+  struct pollfd hs = {.fd = client_fd, .events = POLLIN};
+  if (poll(&hs, 1, 1000) > 0) {
+    IPCMessage first;
+    if (ipc_client_receive(client_fd, &first) > 0) {
+      if (first.msgtype == MSG_SYS_HELLO) {
+        printf("Module %d said hello\n", first.origin);
+      } else {
+        printf("Unexpected first message from client (Type: %d)\n",
+               first.msgtype);
+      }
+    }
+  }
 
-  msg.origin = MOD_CORE;
-  msg.msgtype = MSG_CMD_MQTT_PUB;
-  msg.payload_len = sizeof(PayloadMQTTPubCMD);
+  // 5. Build the IPC Messages perfectly
+  static IPCMessage burst_msgs[1024];
+  memset(burst_msgs, 0, sizeof(burst_msgs)); // Crucial: Prevent memory garbage
 
   // Fill the payload union
   const char *target_topic = "cyberdeck/teste";
   const char *secret_data = "HACK THE PLANET";
 
-  strncpy(msg.payload.mqtt_pub_cmd.topic, target_topic,
-          sizeof(msg.payload.mqtt_pub_cmd.topic) - 1);
-  memcpy(msg.payload.mqtt_pub_cmd.data, secret_data, strlen(secret_data));
-  msg.payload.mqtt_pub_cmd.data_len = strlen(secret_data);
+  for (int i = 0; i < burst; i++) {
+    IPCMessage *msg = &burst_msgs[i];
+    msg->origin = MOD_CORE;
+    msg->msgtype = MSG_CMD_MQTT_PUB;
+
+    strncpy(msg->payload.mqtt_pub_cmd.topic, target_topic,
+            sizeof(msg->payload.mqtt_pub_cmd.topic) - 1);
+    memcpy(msg->payload.mqtt_pub_cmd.data, secret_data, strlen(secret_data));
+    msg->payload.mqtt_pub_cmd.data_len = strlen(secret_data);
+    msg->payload.mqtt_pub_cmd.msg_id = (uint32_t)i + 1;
+  }
 
-  // 6. Send the raw struct bytes over the Unix Domain Socket
-  printf("Sending MSG_CMD_MQTT_PUB:\n  Topic: '%s'\n  Data: '%s'\n",
-         target_topic, secret_data);
-  ssize_t bytes_sent = send(client_fd, &msg, sizeof(IPCMessage), 0);
+  // 6. Send the framed messages over the Unix Domain Socket in one batch
+  printf("Sending %d x MSG_CMD_MQTT_PUB:\n  Topic: '%s'\n  Data: '%s'\n",
+         burst, target_topic, secret_data);
+  int sent = ipc_client_send_batch(client_fd, burst_msgs, (size_t)burst);
 
-  if (bytes_sent == -1) {
+  if (sent == -1) {
     perror("Failed to send message");
   } else {
-    printf("Successfully injected %zd bytes into the socket.\n", bytes_sent);
+    printf("Successfully injected %d messages into the socket.\n", sent);
   }
 
   printf("Entering listen loop. Blocking until message arrives from MQTT "
          "client...\n");
 
-  IPCMessage recv_msg;
+  static IPCMessage recv_msgs[IPC_BATCH_MAX];
   // ALWAYS zero initialize your structs and buffers!
-  memset(&recv_msg, 0, sizeof(recv_msg));
+  memset(recv_msgs, 0, sizeof(recv_msgs));
 
   char buffer[257]; // 256 bytes of data + 1 byte for the guaranteed '\0'
   memset(buffer, 0, sizeof(buffer));
 
-  while (1) {
-    // This will freeze here until the MQTT daemon sends something
-    ssize_t bytes_read = recv(client_fd, &recv_msg, sizeof(recv_msg), 0);
-
-    if (bytes_read > 0) {
-      if (recv_msg.msgtype == MSG_EVT_MQTT_SUB_MSG) {
-        printf("\n--- Received SUB Event from Client ---\n");
-        printf("Topic: %s\n", recv_msg.payload.mqtt_sub_evt.topic);
+  // With the shared-memory transport messages are signalled on an eventfd;
+  // the socket is still watched for the hangup.
+  struct pollfd pfd[2] = {
+      {.fd = ipc_client_poll_fd(client_fd), .events = POLLIN},
+      {.fd = client_fd, .events = POLLIN},
+  };
+  nfds_t npfd = pfd[0].fd == client_fd ? 1 : 2;
+  int connected = 1;
 
-        uint16_t cpylen = recv_msg.payload.mqtt_sub_evt.data_len;
-        if (cpylen > 256)
-          cpylen = 256; // Bounds check
-
-        memcpy(buffer, recv_msg.payload.mqtt_sub_evt.data, cpylen);
-        buffer[cpylen] = '\0'; // Guarantee string termination!
+  while (connected) {
+    // This will freeze here until the MQTT daemon sends something
+    if (poll(pfd, npfd, -1) == -1) {
+      perror("poll");
+      break;
+    }
 
-        printf("Payload: %s\n", buffer);
-        printf("--------------------------------------\n");
-        // break; // Exit after catching the first message
-      } else {
-        printf("Received a message, but it wasn't a SUB event (Type: %d)\n",
-               recv_msg.msgtype);
+    // Drain everything that arrived in this wakeup
+    int count;
+    while ((count = ipc_client_receive_batch(client_fd, recv_msgs,
+                                             IPC_BATCH_MAX)) > 0) {
+      for (int i = 0; i < count; i++) {
+        IPCMessage *recv_msg = &recv_msgs[i];
+
+        if (recv_msg->msgtype == MSG_EVT_MQTT_SUB_MSG) {
+          printf("\n--- Received SUB Event from Client ---\n");
+          printf("Topic: %s\n", recv_msg->payload.mqtt_sub_evt.topic);
+
+          uint16_t cpylen = recv_msg->payload.mqtt_sub_evt.data_len;
+          if (cpylen > 256)
+            cpylen = 256; // Bounds check
+
+          memcpy(buffer, recv_msg->payload.mqtt_sub_evt.data, cpylen);
+          buffer[cpylen] = '\0'; // Guarantee string termination!
+
+          printf("Payload: %s\n", buffer);
+          printf("--------------------------------------\n");
+          // break; // Exit after catching the first message
+        } else if (recv_msg->msgtype == MSG_SYS_HELLO) {
+          printf("Module %d said hello\n", recv_msg->origin);
+        } else if (recv_msg->msgtype == MSG_EVT_MQTT_PUB_RESULT) {
+          printf("Publish result for msg %u: %s (status %d)\n",
+                 recv_msg->payload.mqtt_pub_result.msg_id,
+                 recv_msg->payload.mqtt_pub_result.status == 0 ? "delivered"
+                                                               : "FAILED",
+                 recv_msg->payload.mqtt_pub_result.status);
+        } else {
+          printf("Received a message, but it wasn't a SUB event (Type: %d)\n",
+                 recv_msg->msgtype);
+        }
       }
-    } else if (bytes_read == 0) {
+    }
+
+    if (count < 0) {
       printf("MQTT Client closed the connection.\n");
-      // break;
-    } else {
-      perror("Socket recv error");
-      // break;
+      connected = 0;
     }
   }
 
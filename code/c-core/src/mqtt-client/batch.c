@@ -0,0 +1,266 @@
+#define MODULE_NAME "MQTT_BATCH"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "batch.h"
+
+#include "../../include/logging.h"
+
+#define LZ_IMPLEMENTATION
+#include "../../include/lz.h"
+
+// A record's length prefix is at most this long (records are < 2^21 bytes)
+#define BATCH_FRAME_HDR_MAX 3
+
+static size_t batch_put_uvarint(uint8_t *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+static size_t batch_body_max(const Batcher *b) {
+  return b->cfg.max_bytes - BATCH_HDR_MAX;
+}
+
+// The batch still taking records for topic
+static Batch *batch_find(Batcher *b, const char *topic) {
+  for (size_t i = 0; i < BATCH_TOPICS; i++) {
+    if (b->batches[i].in_use && !b->batches[i].sealed &&
+        strcmp(b->batches[i].topic, topic) == 0) {
+      return &b->batches[i];
+    }
+  }
+  return NULL;
+}
+
+// Writes the header right in front of the frames at body.
+static uint8_t *batch_put_header(uint8_t *body, uint8_t flags, uint32_t count,
+                                 size_t raw_len) {
+  uint8_t hdr[BATCH_HDR_MAX];
+  size_t n = 0;
+  hdr[n++] = 'O';
+  hdr[n++] = 'B';
+  hdr[n++] = flags;
+  n += batch_put_uvarint(hdr + n, count);
+  if (flags & BATCH_FLAG_LZ) {
+    n += batch_put_uvarint(hdr + n, raw_len);
+  }
+  memcpy(body - n, hdr, n);
+  return body - n;
+}
+
+// Returns the publish callback's result; the batch is emptied unless > 0
+static int batch_send(Batcher *b, Batch *batch) {
+  uint8_t *frames = batch->buf + BATCH_HDR_MAX;
+  const uint8_t *msg = NULL;
+  size_t msg_len = 0;
+  bool lz = false;
+
+  if (b->lz_table != NULL && batch->len > BATCH_FRAME_HDR_MAX) {
+    // Only worth it if it beats the raw batch, raw_len in the header included
+    uint8_t *out = b->scratch + BATCH_HDR_MAX;
+    size_t n = lz_compress(frames, batch->len, out,
+                           batch->len - BATCH_FRAME_HDR_MAX, b->lz_table);
+    if (n > 0) {
+      msg = batch_put_header(out, BATCH_FLAG_LZ, batch->count, batch->len);
+      msg_len = (size_t)(out + n - msg);
+      lz = true;
+    }
+  }
+  if (!lz) {
+    msg = batch_put_header(frames, 0, batch->count, 0);
+    msg_len = (size_t)(frames + batch->len - msg);
+  }
+
+  int rc = b->publish(b->userdata, batch->topic, msg, msg_len);
+  if (rc > 0) {
+    b->retries++;
+    return rc;
+  }
+
+  if (rc == 0) {
+    b->batches_sent++;
+    b->bytes_out += msg_len;
+    b->compressed += lz;
+  } else {
+    LOG_ERROR("Failed to publish a batch of %u records on %s", batch->count,
+              batch->topic);
+    b->failed++;
+  }
+  batch->in_use = false;
+  batch->sealed = false;
+  batch->len = 0;
+  batch->count = 0;
+  return rc;
+}
+
+// Sends the batches of batch_topic due by now_ms, oldest first, so that
+// records never overtake each other; flushes counts those sent.
+// Returns 0 once none is left, > 0 if the window refused one.
+static int batch_send_topic(Batcher *b, const char *batch_topic,
+                            uint64_t now_ms, uint64_t *flushes) {
+  while (1) {
+    Batch *oldest = NULL;
+    for (size_t i = 0; i < BATCH_TOPICS; i++) {
+      Batch *c = &b->batches[i];
+      if (c->in_use && c->deadline_ms <= now_ms &&
+          (oldest == NULL || c->order < oldest->order) &&
+          strcmp(c->topic, batch_topic) == 0) {
+        oldest = c;
+      }
+    }
+    if (oldest == NULL) {
+      return 0;
+    }
+    int rc = batch_send(b, oldest);
+    if (rc > 0) {
+      return rc;
+    }
+    *flushes += rc == 0;
+  }
+}
+
+int batch_init(Batcher *b, Arena *a, const BatchConfig *cfg,
+               BatchPublishFn publish, void *userdata) {
+  if (b == NULL || a == NULL || cfg == NULL || publish == NULL ||
+      cfg->max_bytes > BATCH_MAX_BYTES ||
+      cfg->max_bytes <= BATCH_HDR_MAX + BATCH_FRAME_HDR_MAX ||
+      cfg->max_delay_ms == 0) {
+    LOG_ERROR("Invalid arguments to batch_init");
+    return -1;
+  }
+
+  memset(b, 0, sizeof(Batcher));
+  b->cfg = *cfg;
+  b->publish = publish;
+  b->userdata = userdata;
+
+  for (size_t i = 0; i < BATCH_TOPICS; i++) {
+    b->batches[i].buf = ARENA_NEW_ARRAY(a, uint8_t, cfg->max_bytes);
+    if (b->batches[i].buf == NULL) {
+      LOG_ERROR("Not enough memory for %d batches of %zu bytes", BATCH_TOPICS,
+                cfg->max_bytes);
+      return -1;
+    }
+  }
+
+  if (cfg->compress) {
+    b->scratch = ARENA_NEW_ARRAY(a, uint8_t, cfg->max_bytes);
+    b->lz_table = ARENA_NEW_ARRAY(a, uint32_t, LZ_TABLE_SIZE);
+    if (b->scratch == NULL || b->lz_table == NULL) {
+      LOG_ERROR("Not enough memory for batch compression");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int batch_add(Batcher *b, const char *topic, const void *data, size_t len,
+              uint64_t now_ms) {
+  char batch_topic[SPOOL_TOPIC_MAX];
+  int n = snprintf(batch_topic, sizeof(batch_topic), "%s" BATCH_TOPIC_SUFFIX,
+                   topic);
+  if (n < 0 || (size_t)n >= sizeof(batch_topic)) {
+    b->unbatched++;
+    return -1; // no batch can have this topic
+  }
+  if (len + BATCH_FRAME_HDR_MAX > batch_body_max(b)) {
+    // Published on its own, so whatever is queued for the topic goes first
+    b->unbatched++;
+    return batch_send_topic(b, batch_topic, UINT64_MAX, &b->size_flushes) > 0
+               ? BATCH_WINDOW_FULL
+               : -1;
+  }
+
+  Batch *batch = batch_find(b, batch_topic);
+
+  // Full: send it now, behind any sealed batch of the topic, and start a new
+  // one. If the window refuses it, it is sealed and goes out once there is
+  // room; the record starts a new batch behind it.
+  if (batch != NULL &&
+      batch->len + BATCH_FRAME_HDR_MAX + len > batch_body_max(b)) {
+    if (batch_send_topic(b, batch_topic, UINT64_MAX, &b->size_flushes) > 0 &&
+        batch->in_use) {
+      batch->sealed = true;
+    }
+    batch = NULL;
+  }
+
+  if (batch == NULL) {
+    // Take a free batch, or make one free by sending the oldest
+    Batch *oldest = NULL;
+    for (size_t i = 0; i < BATCH_TOPICS && batch == NULL; i++) {
+      Batch *c = &b->batches[i];
+      if (!c->in_use) {
+        batch = c;
+      } else if (oldest == NULL || c->order < oldest->order) {
+        oldest = c;
+      }
+    }
+    // The oldest batch overall is the oldest of its topic too
+    if (batch == NULL) {
+      int rc = batch_send(b, oldest);
+      if (rc > 0) {
+        b->unbatched++;
+        return BATCH_WINDOW_FULL;
+      }
+      b->size_flushes += rc == 0;
+      batch = oldest;
+    }
+
+    memcpy(batch->topic, batch_topic, (size_t)n + 1);
+    batch->in_use = true;
+    batch->deadline_ms = now_ms + b->cfg.max_delay_ms;
+    batch->order = b->started++;
+  }
+
+  uint8_t *p = batch->buf + BATCH_HDR_MAX + batch->len;
+  size_t hdr = batch_put_uvarint(p, len);
+  memcpy(p + hdr, data, len);
+  batch->len += hdr + len;
+  batch->count++;
+
+  b->records++;
+  b->bytes_in += len;
+  return 0;
+}
+
+size_t batch_flush(Batcher *b, uint64_t now_ms) {
+  uint64_t before = b->deadline_flushes;
+  for (size_t i = 0; i < BATCH_TOPICS; i++) {
+    Batch *batch = &b->batches[i];
+    if (batch->in_use && batch->deadline_ms <= now_ms) {
+      batch_send_topic(b, batch->topic, now_ms, &b->deadline_flushes);
+    }
+  }
+  return (size_t)(b->deadline_flushes - before);
+}
+
+uint64_t batch_next_deadline(const Batcher *b) {
+  uint64_t next = 0;
+  for (size_t i = 0; i < BATCH_TOPICS; i++) {
+    const Batch *batch = &b->batches[i];
+    if (batch->in_use && (next == 0 || batch->deadline_ms < next)) {
+      next = batch->deadline_ms;
+    }
+  }
+  return next;
+}
+
+void batch_log_stats(const Batcher *b) {
+  LOG_INFO("records=%llu batches=%llu (size=%llu deadline=%llu lz=%llu) "
+           "retries=%llu failed=%llu unbatched=%llu",
+           (unsigned long long)b->records,
+           (unsigned long long)b->batches_sent,
+           (unsigned long long)b->size_flushes,
+           (unsigned long long)b->deadline_flushes,
+           (unsigned long long)b->compressed, (unsigned long long)b->retries,
+           (unsigned long long)b->failed, (unsigned long long)b->unbatched);
+  LOG_INFO("bytes in=%llu out=%llu", (unsigned long long)b->bytes_in,
+           (unsigned long long)b->bytes_out);
+}
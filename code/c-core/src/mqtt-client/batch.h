@@ -0,0 +1,144 @@
+#ifndef MQTT_BATCH_H
+#define MQTT_BATCH_H
+
+/* ==========================================================================
+ *  Orange Sentry - MQTT publish batching
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Under a scan flood every alert used to be its own PUBLISH, with its own
+ *  fixed header, topic and broker ack. The batcher collects records per
+ *  topic and publishes them together on <topic>/batch, once the batch is
+ *  full or its oldest record has waited max_delay_ms.
+ *
+ *  Batch message layout:
+ *    "OB"        magic
+ *    flags       bit 0: the frames are LZ compressed (LZ4 block format)
+ *    count       uvarint, records in the batch
+ *    raw_len     uvarint, size of the frames once decompressed (LZ only)
+ *    frames      count times: uvarint length, then the record as published
+ *
+ *  uvarint is LEB128: 7 bits per byte, low bits first, high bit set on all
+ *  bytes but the last.
+ *
+ *  Memory is fixed: one buffer per batch plus the compression scratch space,
+ *  all from an Arena at init.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. batch_init() with the limits and a publish callback.
+ *  2. batch_add() for every record that may wait; publish it directly
+ *     instead if it returns -1. BATCH_WINDOW_FULL means it can't go out yet
+ *     at all: publishing it would overtake records queued for its topic.
+ *  3. batch_flush() when batch_next_deadline() is reached, and with
+ *     UINT64_MAX on shutdown.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/arena.h"
+#include "spool.h"
+
+#define BATCH_TOPICS 4 // topics batched at the same time
+#define BATCH_TOPIC_SUFFIX "/batch"
+#define BATCH_FLAG_LZ 0x01
+#define BATCH_HDR_MAX 13 // magic, flags and two 5-byte uvarints
+// Publishes and spool records carry a 16-bit length
+#define BATCH_MAX_BYTES UINT16_MAX
+// batch_add(): neither queued nor publishable until the window has room
+#define BATCH_WINDOW_FULL 1
+
+/* *
+ * Hands a finished batch to MQTT.
+ * * Returns:
+ * 0 if it was sent, > 0 if it should be retried later (window full), < 0 if
+ * it failed and is dropped.
+ */
+typedef int (*BatchPublishFn)(void *userdata, const char *topic,
+                              const void *data, size_t len);
+
+typedef struct {
+  size_t max_bytes;      // whole message, header included
+  uint32_t max_delay_ms; // age of the oldest record before a flush
+  bool compress;
+} BatchConfig;
+
+typedef struct {
+  char topic[SPOOL_TOPIC_MAX]; // batch topic, suffix included
+  bool in_use;
+  bool sealed; // full but refused by the window; takes no more records
+  uint8_t *buf; // BATCH_HDR_MAX bytes of room for the header, then frames
+  size_t len;   // bytes of frames
+  uint32_t count;
+  uint64_t deadline_ms; // monotonic
+  uint64_t order;       // when it was started; a topic's batches go in order
+} Batch;
+
+typedef struct {
+  Batch batches[BATCH_TOPICS];
+  BatchConfig cfg;
+  uint8_t *scratch;   // compressed batch
+  uint32_t *lz_table; // NULL without compression
+
+  BatchPublishFn publish;
+  void *userdata;
+  uint64_t started; // batches started so far, for Batch.order
+
+  // counters
+  uint64_t records;
+  uint64_t batches_sent;
+  uint64_t bytes_in;  // records, as they would have been published
+  uint64_t bytes_out; // batches, headers included
+  uint64_t size_flushes;
+  uint64_t deadline_flushes;
+  uint64_t compressed; // batches sent compressed
+  uint64_t retries;    // flushes put off by a full window
+  uint64_t failed;     // batches dropped by the publish callback
+  uint64_t unbatched;  // records refused by batch_add()
+} Batcher;
+
+/* *
+ * Allocates the batch buffers from a.
+ * * Returns:
+ * 0 on success, -1 on invalid limits or if the arena is too small.
+ */
+int batch_init(Batcher *b, Arena *a, const BatchConfig *cfg,
+               BatchPublishFn publish, void *userdata);
+
+/* *
+ * Queues one record for topic. Flushes the batch first if the record
+ * doesn't fit in it anymore; if the window refuses that batch, it waits
+ * sealed and the record starts the next one. now_ms is a monotonic clock.
+ * * Returns:
+ * 0 if the record was queued.
+ * -1 if it can't be batched (topic too long, record too big): publish it
+ * directly; anything queued for its topic has been sent ahead of it.
+ * BATCH_WINDOW_FULL if it can't be queued and the window is full (no free
+ * batch, or records of its topic are still waiting).
+ */
+int batch_add(Batcher *b, const char *topic, const void *data, size_t len,
+              uint64_t now_ms);
+
+/* *
+ * Sends every batch whose deadline is at or before now_ms; UINT64_MAX sends
+ * them all. A batch refused with a full window stays queued.
+ * * Returns:
+ * Number of batches sent.
+ */
+size_t batch_flush(Batcher *b, uint64_t now_ms);
+
+/* *
+ * Earliest deadline of the queued batches.
+ * * Returns:
+ * The deadline (monotonic ms), or 0 if nothing is queued.
+ */
+uint64_t batch_next_deadline(const Batcher *b);
+
+/* *
+ * Logs the counters.
+ */
+void batch_log_stats(const Batcher *b);
+
+#endif // MQTT_BATCH_H
@@ -4,43 +4,92 @@
 // standard includes
 #include <signal.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <unistd.h>
 
 // shared includes
 #include "../../include/arena.h"
 
 // local includes
+#include "batch.h"
 #include "mqtt.h"
 
 // Boilerplate stuff
-#define ARENA_SIZE (64 * 1024)
-#define BUFFER_SIZE 512
-static uint8_t client_memory[ARENA_SIZE];
+// Address space only: pages are committed as the context, spool and batcher
+// take them, so this is a ceiling rather than a cost
+#define ARENA_RESERVE (16 * 1024 * 1024)
 
 #include "../../include/logging.h"
 
+// Before the IPC definitions: records.h includes sockclient.h for the types
+#define RECORDS_IMPLEMENTATION
+#include "../../include/records.h"
+
 #define SOCK_IPC_IMPLEMENTATION
 #include "../../include/sockclient.h"
 
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
 // MQTT Stuff
 // TODO make the program configurable via config file
 #define ADDRESS "tcp://192.168.0.180:1883"
 #define ADDRESS_DBG "tcp://127.0.0.1:1883"
 #define CLIENTID "TestClient"
 #define TOPIC "/test"
-#define PAYLOAD "Hello World!"
 #define QOS 1
 #define TIMEOUT 10000
-
-#define SOCK_PATH "/tmp/test_mqtt.sock"
-
-volatile int keepRunning = 1;
-void intHandler(int dummy) { keepRunning = 0; }
+#define HEARTBEAT_TOPIC "/heartbeat"
+#define HEARTBEAT_INTERVAL_MS 30000
+#define INFLIGHT_WINDOW 32
+#define INFLIGHT_SWEEP_MS 1000
+#define SPOOL_PATH "/tmp/orange-sentry-mqtt.spool"
+#define SPOOL_MAX_BYTES (4 * 1024 * 1024)
+
+// Batching is opt-in: "1" batches publishes per topic, "lz" also compresses
+// the batches. Urgent publishes and the ones the sender wants a result for
+// are never batched.
+#define BATCH_ENV "OS_MQTT_BATCH"
+#define BATCH_MAX_DELAY_MS 250
+#define BATCH_RETRY_MS 50 // while a due batch waits for window room
+
+#define SOCK_PATH IPC_CONTROLLER_SOCK_PATH
+
+// State shared by the reactor callbacks
+typedef struct {
+  mqttContext *ctx;
+  int sock_fd;
+  int ipc_fd; // what signals pending IPC messages, see ipc_client_poll_fd()
+  bool ipc_paused; // stopped reading IPC because the publish window is full
+  IPCMessage rcv_msgs[IPC_BATCH_MAX];
+  // rcv_msgs not handled yet, held back by a full window: held_count of
+  // them from held_first on
+  size_t held_first;
+  size_t held_count;
+  uint64_t started_ms; // monotonic, for the heartbeat uptime
+  uint32_t heartbeats;
+
+  Batcher *batcher; // NULL unless batching is enabled
+  int batch_timer_fd;
+  uint64_t batch_armed; // deadline the batch timer is set for, 0 = disarmed
+} ClientLoop;
 
 // Function prototypes
-int get_payload_from_ipc_message(IPCMessage *msg, char *buffer,
-                                 size_t maxBufferSize);
+static uint64_t clock_ms(clockid_t clock);
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_heartbeat(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_mqtt_event(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_inflight_sweep(Reactor *r, int fd, uint32_t events,
+                              void *userdata);
+static void on_batch_timer(Reactor *r, int fd, uint32_t events,
+                           void *userdata);
+static int publish_batch(void *userdata, const char *topic, const void *data,
+                         size_t len);
+static int enable_batching(Reactor *r, ClientLoop *loop, Arena *arena);
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata);
 
 /* Fluxo de funcionamento:
  * inicializar arena -> inicializar fifo pipes -> inicializar e preencher
@@ -51,15 +100,38 @@ int get_payload_from_ipc_message(IPCMessage *msg, char *buffer,
  * coisas do MQTT, dar free nas arenas, retornar a memória ao OS
  *
  * Este será um daemon que vai rodar no background
+ *
+ * The loop is event driven: the IPC socket, SIGINT/SIGTERM (via signalfd) and
+ * the heartbeat timer (via timerfd) all wake the reactor directly, so the
+ * daemon sleeps until there is actual work instead of polling.
+ *
+ * When the broker is unreachable, alerts are kept in a disk spool and sent,
+ * oldest first, once the background reconnect succeeds.
+ *
+ * With OS_MQTT_BATCH set, routine publishes are collected per topic and sent
+ * as one message per batch (see batch.h).
  * */
 
 int main() {
-  signal(SIGINT, intHandler);
-  signal(SIGTERM, intHandler);
+  // Signals must be blocked before Paho spawns its threads so that only the
+  // signalfd ever sees them.
+  Reactor reactor;
+  if (reactor_init(&reactor) != 0) {
+    LOG_ERROR("Failed to initialize reactor");
+    return -1;
+  }
+
+  const int signals[] = {SIGINT, SIGTERM};
+  if (reactor_add_signals(&reactor, signals, 2, on_signal, NULL) < 0) {
+    LOG_ERROR("Failed to register signal handlers");
+    return -1;
+  }
 
   // init arena
   Arena arena;
-  arena_init(&arena, client_memory, ARENA_SIZE);
+  if (arena_reserve(&arena, ARENA_RESERVE) != 0) {
+    return -1;
+  }
 
   // Attmept to connect to controller socket
   int sock_fd = ipc_client_connect(SOCK_PATH);
@@ -68,92 +140,335 @@ int main() {
     return -1;
   }
 
+  if (ipc_client_hello(sock_fd, MOD_MQTT) < 0) {
+    LOG_ERROR("Failed to identify to the controller");
+    return -1;
+  }
+
   // MQTT client initialization
   LOG_DEBUG("Starting MQTT Client");
-  mqttContext *ctx =
-      mqtt_create_context(ADDRESS_DBG, CLIENTID, 20, &arena, sock_fd);
+  mqttContext *ctx = mqtt_create_context(ADDRESS_DBG, CLIENTID, 20, &arena,
+                                         sock_fd, INFLIGHT_WINDOW);
   if (ctx == NULL) {
     LOG_ERROR("Failed to create MQTT client");
     return -1;
   }
 
+  // Without a spool we still run, publishes just fail while offline
+  if (mqtt_enable_spool(ctx, SPOOL_PATH, SPOOL_MAX_BYTES, &arena) != 0) {
+    LOG_WARN("Offline spool unavailable, messages will be lost while the "
+             "broker is unreachable");
+  }
+
   mqtt_subscribe(ctx, TOPIC, QOS);
 
-  // Buffer allocation for reading from FIFO pipes
-  char *charbuffer = arena_alloc(&arena, BUFFER_SIZE);
-  if (charbuffer == NULL) {
-    LOG_ERROR("Failed to allocate memory from arena");
+  ClientLoop loop;
+  memset(&loop, 0, sizeof(ClientLoop));
+  loop.ctx = ctx;
+  loop.sock_fd = sock_fd;
+  loop.ipc_fd = ipc_client_poll_fd(sock_fd);
+  loop.started_ms = clock_ms(CLOCK_MONOTONIC);
+
+  if (reactor_add_fd(&reactor, loop.ipc_fd, EPOLLIN, on_ipc_ready, &loop) !=
+      0) {
+    LOG_ERROR("Failed to watch IPC socket");
     return -1;
   }
-  memset(charbuffer, 0, BUFFER_SIZE);
 
-  char *payload = arena_alloc(&arena, BUFFER_SIZE);
-  if (payload == NULL) {
-    LOG_ERROR("Failed to allocate memory from arena");
+  // On the shared-memory transport the socket only carries hangups
+  if (loop.ipc_fd != sock_fd &&
+      reactor_add_fd(&reactor, sock_fd, 0, on_ipc_ready, &loop) != 0) {
+    LOG_ERROR("Failed to watch IPC socket");
     return -1;
   }
-  memset(payload, 0, BUFFER_SIZE);
 
-  IPCMessage rcv_msg;
-  memset(&rcv_msg, 0, sizeof(IPCMessage));
+  if (reactor_add_fd(&reactor, mqtt_event_fd(ctx), EPOLLIN, on_mqtt_event,
+                     &loop) != 0) {
+    LOG_ERROR("Failed to watch MQTT completion events");
+    return -1;
+  }
 
-  LOG_INFO("Entering main mqttd loop");
-  while (keepRunning) {
-    int rcv_status = ipc_client_receive(sock_fd, &rcv_msg);
-
-    if (rcv_status > 0) {
-      // success case, start treating the message
-
-      if (rcv_msg.msgtype == MSG_CMD_MQTT_PUB) {
-        memset(payload, 0, BUFFER_SIZE);
-        if (get_payload_from_ipc_message(&rcv_msg, payload, BUFFER_SIZE) == 0) {
-          if (mqtt_pub_message(ctx, TOPIC, payload) != 0) {
-            LOG_ERROR("Failed to publish message");
-          }
-        } else {
-          LOG_ERROR("Could not get payload from message");
-        }
-      }
-    }
+  if (reactor_add_timer(&reactor, HEARTBEAT_INTERVAL_MS, on_heartbeat, &loop) <
+      0) {
+    LOG_ERROR("Failed to create heartbeat timer");
+    return -1;
+  }
 
-    else if (rcv_status < 0) {
-      LOG_ERROR("IPC connection lost. Exiting loop");
-      break;
-    }
+  if (reactor_add_timer(&reactor, INFLIGHT_SWEEP_MS, on_inflight_sweep,
+                        &loop) < 0) {
+    LOG_ERROR("Failed to create in-flight sweep timer");
+    return -1;
+  }
 
-    safe_usleep(10000);
+  if (enable_batching(&reactor, &loop, &arena) != 0) {
+    LOG_WARN("Batching unavailable, publishing every message on its own");
   }
 
+  LOG_INFO("Entering main mqttd loop");
+  reactor_run(&reactor);
+
   LOG_DEBUG("Shutting down MQTT Client");
+  if (loop.held_count > 0) {
+    LOG_WARN("%zu messages held back by the publish window are lost",
+             loop.held_count);
+  }
+  if (loop.batcher != NULL) {
+    batch_flush(loop.batcher, UINT64_MAX);
+    batch_log_stats(loop.batcher);
+  }
   mqtt_disconnect_and_free(ctx);
-  arena_reset(&arena);
+  LOG_DEBUG("Arena: %zu bytes used, %zu committed", arena.offset,
+            arena.committed);
+  arena_release(&arena);
   ipc_client_disconnect(&sock_fd);
+  reactor_close(&reactor);
 
   LOG_INFO("MQTT Client stopped");
   return 0;
 }
 
-int get_payload_from_ipc_message(IPCMessage *msg, char *buffer,
-                                 size_t maxBufferSize) {
-  if (msg == NULL) {
-    LOG_ERROR("Invalid pointer to message");
+static uint64_t clock_ms(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int enable_batching(Reactor *r, ClientLoop *loop, Arena *arena) {
+  const char *mode = getenv(BATCH_ENV);
+  if (mode == NULL || (strcmp(mode, "1") != 0 && strcmp(mode, "lz") != 0)) {
+    return 0;
+  }
+
+  BatchConfig cfg = {
+      .max_bytes = BATCH_MAX_BYTES,
+      .max_delay_ms = BATCH_MAX_DELAY_MS,
+      .compress = strcmp(mode, "lz") == 0,
+  };
+  Batcher *batcher = ARENA_NEW(arena, Batcher);
+  if (batcher == NULL ||
+      batch_init(batcher, arena, &cfg, publish_batch, loop) != 0) {
     return -1;
   }
 
-  if (msg->msgtype != MSG_CMD_MQTT_PUB) {
-    LOG_ERROR("Message of wrong type. Is: %d; Should be: %d", msg->msgtype,
-              MSG_CMD_MQTT_PUB);
+  // Created disarmed, set for the earliest batch deadline as needed
+  loop->batch_timer_fd = reactor_add_timer(r, 0, on_batch_timer, loop);
+  if (loop->batch_timer_fd < 0) {
     return -1;
   }
+  loop->batcher = batcher;
+  LOG_INFO("Batching publishes (%zu bytes or %u ms%s)", cfg.max_bytes,
+           cfg.max_delay_ms, cfg.compress ? ", LZ compressed" : "");
+  return 0;
+}
 
-  size_t len_to_copy = msg->payload.mqtt_pub_cmd.data_len;
+static int publish_batch(void *userdata, const char *topic, const void *data,
+                         size_t len) {
+  ClientLoop *loop = (ClientLoop *)userdata;
+  return mqtt_pub_message(loop->ctx, topic, data, len, 0);
+}
 
-  if (len_to_copy >= maxBufferSize) {
-    len_to_copy = maxBufferSize - 1;
+// Points the batch timer at the earliest deadline, if that changed
+static void update_batch_timer(ClientLoop *loop) {
+  uint64_t next = batch_next_deadline(loop->batcher);
+  if (next == loop->batch_armed) {
+    return;
   }
 
-  memcpy(buffer, msg->payload.mqtt_pub_cmd.data, len_to_copy);
-  buffer[len_to_copy] = '\0';
+  uint32_t ms = 0;
+  if (next != 0) {
+    uint64_t now = clock_ms(CLOCK_MONOTONIC);
+    ms = next > now ? (uint32_t)(next - now) : BATCH_RETRY_MS;
+  }
+  if (reactor_timer_set(loop->batch_timer_fd, ms) == 0) {
+    loop->batch_armed = next;
+  }
+}
 
-  return 0;
+// Stops reading IPC until acks free up the window
+static void pause_ipc(Reactor *r, ClientLoop *loop) {
+  if (!loop->ipc_paused && reactor_mod_fd(r, loop->ipc_fd, 0) == 0) {
+    loop->ipc_paused = true;
+    LOG_DEBUG("Publish window full, pausing IPC reads");
+  }
+}
+
+// Publishes or batches one IPC message. Returns false if the window is full
+// and it has to wait, true once it's been dealt with (even if it failed).
+static bool publish_one(ClientLoop *loop, const IPCMessage *msg) {
+  if (msg->msgtype != MSG_CMD_MQTT_PUB) {
+    return true;
+  }
+
+  // Modules pick their own topic; the default one is for the old callers
+  const PayloadMQTTPubCMD *pub = &msg->payload.mqtt_pub_cmd;
+  const char *topic = pub->topic[0] != '\0' ? pub->topic : TOPIC;
+
+  // The payload is published as is, straight from the IPC message
+  size_t len = pub->data_len;
+  if (len > sizeof(pub->data)) {
+    len = sizeof(pub->data);
+  }
+
+  // Batches never report a result, so anything tracked goes on its own.
+  // BATCH_WINDOW_FULL: sent now, it would overtake its topic's batch.
+  if (loop->batcher != NULL && !(pub->flags & MQTT_PUB_URGENT) &&
+      pub->msg_id == 0) {
+    int rc = batch_add(loop->batcher, topic, pub->data, len,
+                       clock_ms(CLOCK_MONOTONIC));
+    if (rc == 0 || rc == BATCH_WINDOW_FULL) {
+      return rc == 0;
+    }
+  }
+
+  int rc = mqtt_pub_message(loop->ctx, topic, pub->data, len, pub->msg_id);
+  if (rc == MQTT_PUB_WINDOW_FULL) {
+    return false;
+  }
+  if (rc != 0) {
+    LOG_ERROR("Failed to publish message");
+  }
+  return true;
+}
+
+// Handles the held messages in order. Returns false, with IPC reads paused,
+// if the window filled up before all of them were.
+static bool publish_held(Reactor *r, ClientLoop *loop) {
+  while (loop->held_count > 0) {
+    if (!publish_one(loop, &loop->rcv_msgs[loop->held_first])) {
+      pause_ipc(r, loop);
+      return false;
+    }
+    loop->held_first++;
+    loop->held_count--;
+  }
+  return true;
+}
+
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata) {
+  ClientLoop *loop = (ClientLoop *)userdata;
+
+  // Drain everything that is queued, IPC_BATCH_MAX messages per syscall; the
+  // socket is level triggered, but handling the whole backlog per wakeup
+  // keeps epoll_wait() calls down. Messages held back earlier go first.
+  bool blocked = !publish_held(r, loop);
+  while (!blocked) {
+    // Backpressure: leave the rest queued in the socket until acks free up
+    // the window, instead of accepting messages we cannot publish yet. While
+    // spooling, messages go to disk and the window doesn't matter.
+    bool spooling = mqtt_spooling(loop->ctx);
+    if (!spooling && mqtt_window_full(loop->ctx)) {
+      pause_ipc(r, loop);
+      break;
+    }
+
+    // Only take as many messages as the window can start publishing now.
+    // Batches flushed on the way take slots too: what no longer fits is
+    // held until acks come back.
+    size_t room = loop->ctx->inflight_window - loop->ctx->inflight_count;
+    if (spooling || room > IPC_BATCH_MAX) {
+      room = IPC_BATCH_MAX;
+    }
+
+    int rcv_count =
+        ipc_client_receive_batch(loop->sock_fd, loop->rcv_msgs, room);
+
+    if (rcv_count == 0) {
+      break;
+    }
+
+    if (rcv_count < 0) {
+      LOG_ERROR("IPC connection lost. Exiting loop");
+      reactor_stop(r);
+      return;
+    }
+
+    loop->held_first = 0;
+    loop->held_count = (size_t)rcv_count;
+    blocked = !publish_held(r, loop);
+  }
+
+  if (loop->batcher != NULL) {
+    update_batch_timer(loop);
+  }
+
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    LOG_ERROR("IPC socket hung up. Exiting loop");
+    reactor_stop(r);
+  }
+}
+
+static void on_heartbeat(Reactor *r, int fd, uint32_t events, void *userdata) {
+  ClientLoop *loop = (ClientLoop *)userdata;
+  reactor_timer_ack(fd);
+
+  if (loop->ctx->status != MQTT_CONNECTED) {
+    LOG_WARN("Skipping heartbeat: broker not connected");
+    return;
+  }
+
+  // Heartbeats are not worth a window slot when alerts are queued, and a
+  // stale one is useless, so never spool them
+  if (mqtt_window_full(loop->ctx) || mqtt_spooling(loop->ctx)) {
+    LOG_DEBUG("Skipping heartbeat: publish window full");
+    return;
+  }
+
+  RecordHeartbeat hb = {
+      .ts_ms = clock_ms(CLOCK_REALTIME),
+      .module = MOD_MQTT,
+      .uptime_s =
+          (uint32_t)((clock_ms(CLOCK_MONOTONIC) - loop->started_ms) / 1000),
+      .seq = ++loop->heartbeats,
+  };
+  uint8_t buf[64];
+  size_t len = record_encode(RECORD_HEARTBEAT, &hb, buf, sizeof(buf));
+  if (len == 0 || mqtt_pub_message(loop->ctx, HEARTBEAT_TOPIC, buf, len, 0) !=
+                      0) {
+    LOG_ERROR("Failed to publish heartbeat");
+  }
+}
+
+static void resume_ipc_if_possible(Reactor *r, ClientLoop *loop) {
+  if (loop->ipc_paused &&
+      (!mqtt_window_full(loop->ctx) || mqtt_spooling(loop->ctx))) {
+    // What was held back goes before anything new is read
+    bool done = publish_held(r, loop);
+    if (loop->batcher != NULL) {
+      update_batch_timer(loop);
+    }
+    if (done && reactor_mod_fd(r, loop->ipc_fd, EPOLLIN) == 0) {
+      loop->ipc_paused = false;
+      LOG_DEBUG("Publish window has room again, resuming IPC reads");
+    }
+  }
+}
+
+static void on_mqtt_event(Reactor *r, int fd, uint32_t events, void *userdata) {
+  ClientLoop *loop = (ClientLoop *)userdata;
+  mqtt_process_completions(loop->ctx);
+  resume_ipc_if_possible(r, loop);
+}
+
+static void on_inflight_sweep(Reactor *r, int fd, uint32_t events,
+                              void *userdata) {
+  ClientLoop *loop = (ClientLoop *)userdata;
+  reactor_timer_ack(fd);
+  mqtt_expire_inflight(loop->ctx);
+  mqtt_flush_spool(loop->ctx);
+  resume_ipc_if_possible(r, loop);
+}
+
+static void on_batch_timer(Reactor *r, int fd, uint32_t events,
+                           void *userdata) {
+  ClientLoop *loop = (ClientLoop *)userdata;
+  reactor_timer_ack(fd);
+  batch_flush(loop->batcher, clock_ms(CLOCK_MONOTONIC));
+  loop->batch_armed = UINT64_MAX; // periodic timer: re-arm or disarm it
+  update_batch_timer(loop);
+}
+
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata) {
+  int signo = reactor_signal_read(fd);
+  LOG_INFO("Received signal %d. Shutting down", signo);
+  reactor_stop(r);
 }
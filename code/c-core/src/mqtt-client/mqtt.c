@@ -1,20 +1,49 @@
 #include <bits/types/struct_timeval.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../../include/arena.h"
 #include "../../vendor/paho.mqtt.c/src/MQTTClient.h"
+#define SLABPOOL_IMPLEMENTATION
 #include "mqtt.h"
 
 #include "../../include/logging.h"
 #include "../../include/sockclient.h"
 
-mqttContext *mqtt_create_context(const char *address, const char *clientID, int keepAliveInterval, Arena *a, int sock_fd) {
+static uint64_t mqtt_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void mqtt_report_result(mqttContext *ctx, uint32_t msg_id,
+                               int32_t status);
+static void *mqtt_reconnect_thread(void *arg);
+
+static void mqtt_wake_main_loop(mqttContext *ctx) {
+  uint64_t one = 1;
+  if (write(ctx->event_fd, &one, sizeof(one)) != sizeof(one)) {
+    LOG_WARN("Failed to signal main loop: %s", strerror(errno));
+  }
+}
+
+mqttContext *mqtt_create_context(const char *address, const char *clientID,
+                                 int keepAliveInterval, Arena *a, int sock_fd,
+                                 size_t inflight_window) {
   int rc;
 
+  if (inflight_window == 0) {
+    LOG_ERROR("In-flight window must be at least 1");
+    return NULL;
+  }
+
   mqttContext *ctx = (mqttContext *)arena_alloc(a, sizeof(mqttContext));
   if (ctx == NULL) {
     LOG_ERROR("Failed to allocate memory for mqttContext");
@@ -23,11 +52,42 @@ mqttContext *mqtt_create_context(const char *address, const char *clientID, int
 
   ctx->status = MQTT_DISCONNECTED;
 
+  // The done queue can briefly hold acks for slots that already timed out,
+  // so give it some headroom over the window.
+  ctx->inflight_window = inflight_window;
+  ctx->inflight = ARENA_NEW_ARRAY(a, mqttInflight, inflight_window);
+  ctx->done_capacity = inflight_window * 2;
+  ctx->done_tokens =
+      ARENA_NEW_ARRAY(a, MQTTClient_deliveryToken, ctx->done_capacity);
+  if (ctx->inflight == NULL || ctx->done_tokens == NULL) {
+    LOG_ERROR("Failed to allocate the in-flight window");
+    return NULL;
+  }
+
+  ctx->inbox_pool =
+      arena_alloc_align(a, sizeof(SlabPool), __alignof__(SlabPool));
+  ctx->inbox =
+      arena_alloc_align(a, sizeof(MpscQueue), __alignof__(MpscQueue));
+  if (ctx->inbox_pool == NULL || ctx->inbox == NULL ||
+      slab_pool_init(ctx->inbox_pool, a, MQTT_INBOX_SLOTS,
+                     sizeof(IPCMessage)) != 0 ||
+      mpsc_init(ctx->inbox, a, MQTT_INBOX_SLOTS) != 0) {
+    LOG_ERROR("Failed to allocate the inbound queue");
+    return NULL;
+  }
+
+  ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ctx->event_fd == -1) {
+    LOG_SYS_ERROR("Failed to create completion eventfd");
+    return NULL;
+  }
+  pthread_mutex_init(&ctx->done_lock, NULL);
+
   rc = MQTTClient_create(&ctx->client, address, clientID,
                          MQTTCLIENT_PERSISTENCE_NONE, NULL);
   if (rc != MQTTCLIENT_SUCCESS) {
     LOG_ERROR("Failed to create MQTT client. RC: %d", rc);
-    free(ctx);
+    close(ctx->event_fd);
     return NULL;
   }
 
@@ -35,41 +95,116 @@ mqttContext *mqtt_create_context(const char *address, const char *clientID, int
 
   // Handle callbacks
   rc = MQTTClient_setCallbacks(ctx->client, ctx, mqtt_on_connection_lost,
-                               mqtt_on_message_arrived, NULL);
+                               mqtt_on_message_arrived,
+                               mqtt_message_delivered);
   if (rc != MQTTCLIENT_SUCCESS) {
     LOG_ERROR("Failed to set callbakcs");
-    free(ctx);
+    MQTTClient_destroy(&ctx->client);
+    close(ctx->event_fd);
     return NULL;
   }
 
   MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
   conn_opts.keepAliveInterval = 30;
   conn_opts.cleansession = 1;
+  // reliable = 1 (the default) makes Paho refuse a publish until the previous
+  // one completed, which would serialize us on the broker RTT again.
+  conn_opts.reliable = 0;
+  conn_opts.maxInflightMessages = (int)inflight_window;
+  conn_opts.connectTimeout = MQTT_CONNECT_TIMEOUT_S;
+  ctx->conn_opts = conn_opts;
+
+  rc = MQTTClient_connect(ctx->client, &ctx->conn_opts);
+  if (rc == MQTTCLIENT_SUCCESS) {
+    LOG_INFO("MQTT client created successfully and connected to %s "
+             "(in-flight window: %zu)",
+             address, inflight_window);
+    ctx->status = MQTT_CONNECTED;
+  } else {
+    LOG_WARN("Failed to connect to MQTT broker %s (RC: %d), retrying in the "
+             "background",
+             address, rc);
+    ctx->status = MQTT_ATTEMPT_CONNECT;
+  }
 
-  rc = MQTTClient_connect(ctx->client, &conn_opts);
-  if (rc != MQTTCLIENT_SUCCESS) {
-    LOG_ERROR("Failed to connect to MQTT broker. RC: %d", rc);
+  pthread_mutex_init(&ctx->conn_lock, NULL);
+  pthread_cond_init(&ctx->conn_cond, NULL);
+  if (pthread_create(&ctx->conn_thread, NULL, mqtt_reconnect_thread, ctx) !=
+      0) {
+    LOG_ERROR("Failed to start the reconnect thread");
+    if (ctx->status == MQTT_CONNECTED) {
+      MQTTClient_disconnect(ctx->client, 0);
+    }
     MQTTClient_destroy(&ctx->client);
-    free(ctx);
+    close(ctx->event_fd);
     return NULL;
   }
 
-  LOG_INFO("MQTT client created successfully and connected to %s", address);
-  ctx->status = MQTT_CONNECTED;
   return ctx;
 }
 
-int mqtt_pub_message(mqttContext *ctx, const char *topic, const char *payload) {
-  if (ctx == NULL || ctx->status != MQTT_CONNECTED) {
-    LOG_ERROR("MQTT client is not connected");
+// The window slot publishing spool record seq, if it is in flight
+static mqttInflight *mqtt_spool_slot(mqttContext *ctx, uint64_t seq) {
+  for (size_t i = 0; i < ctx->inflight_window; i++) {
+    mqttInflight *slot = &ctx->inflight[i];
+    if (slot->in_use && slot->spool_seq == seq) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+static void mqtt_on_spool_evict(void *userdata, uint64_t seq,
+                                uint32_t msg_id) {
+  mqttContext *ctx = (mqttContext *)userdata;
+  LOG_DEBUG("Spool full, evicted message %u", msg_id);
+  mqtt_report_result(ctx, msg_id, MQTT_PUB_ERR_SPOOL_EVICTED);
+  // Still in flight: its ack must not report it a second time
+  mqttInflight *slot = mqtt_spool_slot(ctx, seq);
+  if (slot != NULL) {
+    slot->msg_id = 0;
+  }
+}
+
+int mqtt_enable_spool(mqttContext *ctx, const char *path, size_t max_bytes,
+                      Arena *a) {
+  mqttSpool *spool = ARENA_NEW(a, mqttSpool);
+  if (spool == NULL) {
+    LOG_ERROR("Failed to allocate the spool");
     return -1;
   }
 
+  if (spool_open(spool, path, max_bytes) != 0) {
+    return -1;
+  }
+  spool->on_evict = mqtt_on_spool_evict;
+  spool->evict_userdata = ctx;
+  ctx->spool = spool;
+
+  mqtt_drain_spool(ctx);
+  return 0;
+}
+
+static int mqtt_spool_message(mqttContext *ctx, const char *topic,
+                              const void *data, uint16_t data_len,
+                              uint32_t msg_id) {
+  if (spool_append(ctx->spool, topic, data, data_len, msg_id) != 0) {
+    mqtt_report_result(ctx, msg_id, MQTT_PUB_ERR_SPOOL_EVICTED);
+    return -1;
+  }
+  ctx->spooled++;
+  return 0;
+}
+
+// Hands one message to Paho and takes a window slot for it
+static int mqtt_start_publish(mqttContext *ctx, const char *topic,
+                              const void *data, uint16_t data_len,
+                              uint32_t msg_id, uint64_t spool_seq) {
   MQTTClient_message pubmsg = MQTTClient_message_initializer;
   MQTTClient_deliveryToken token = 0;
 
-  pubmsg.payload = (char *)payload;
-  pubmsg.payloadlen = strlen(payload);
+  pubmsg.payload = (void *)data;
+  pubmsg.payloadlen = data_len;
   pubmsg.qos = 1;
   pubmsg.retained = 0;
 
@@ -80,35 +215,457 @@ int mqtt_pub_message(mqttContext *ctx, const char *topic, const char *payload) {
     return rc;
   }
 
-  rc = MQTTClient_waitForCompletion(ctx->client, token, 10000);
-  if (rc != MQTTCLIENT_SUCCESS) {
-    LOG_ERROR("Failed to publish message. (token %d) RC: %d", token, rc);
+  // The ack may already be sitting in the done queue; that's fine, it is
+  // only matched against this slot on the next mqtt_process_completions().
+  for (size_t i = 0; i < ctx->inflight_window; i++) {
+    mqttInflight *slot = &ctx->inflight[i];
+    if (!slot->in_use) {
+      slot->token = token;
+      slot->msg_id = msg_id;
+      slot->sent_ms = mqtt_now_ms();
+      slot->order = ctx->publish_order++;
+      slot->spool_seq = spool_seq;
+      slot->in_use = true;
+      if (ctx->spool != NULL && spool_seq == 0) {
+        snprintf(slot->topic, sizeof(slot->topic), "%s", topic);
+        memcpy(slot->data, data, data_len);
+        slot->data_len = data_len;
+      }
+      ctx->inflight_count++;
+      break;
+    }
+  }
+
+  ctx->published++;
+  LOG_DEBUG("Message %u handed to Paho with token %d (%zu in flight)", msg_id,
+            token, ctx->inflight_count);
+  return 0;
+}
+
+int mqtt_pub_message(mqttContext *ctx, const char *topic, const void *data,
+                     size_t len, uint32_t msg_id) {
+  if (ctx == NULL || (data == NULL && len > 0)) {
+    LOG_ERROR("Invalid MQTT context or payload");
+    return -1;
+  }
+
+  // Cutting a binary record short would only corrupt it
+  if (len > UINT16_MAX) {
+    LOG_ERROR("Payload of %zu bytes is too large to publish", len);
+    mqtt_report_result(ctx, msg_id, MQTT_PUB_ERR_TOO_LARGE);
+    return -1;
+  }
+
+  // Keep ordering: once anything is spooled, new messages queue behind it.
+  // Payloads too big for a slot copy are spooled too, or a failed publish
+  // couldn't be retried.
+  if (mqtt_spooling(ctx) ||
+      (ctx->spool != NULL && len > MQTT_INFLIGHT_COPY_MAX)) {
+    int rc = mqtt_spool_message(ctx, topic, data, (uint16_t)len, msg_id);
+    mqtt_drain_spool(ctx);
     return rc;
   }
 
-  LOG_INFO("Message with delivery token %d delivered", token);
+  if (ctx->status != MQTT_CONNECTED) {
+    LOG_ERROR("MQTT client is not connected");
+    mqtt_report_result(ctx, msg_id, MQTT_PUB_ERR_CONN_LOST);
+    return -1;
+  }
+
+  if (mqtt_window_full(ctx)) {
+    return MQTT_PUB_WINDOW_FULL;
+  }
+
+  int rc = mqtt_start_publish(ctx, topic, data, (uint16_t)len, msg_id, 0);
+  if (rc != MQTTCLIENT_SUCCESS) {
+    if (ctx->spool != NULL) {
+      return mqtt_spool_message(ctx, topic, data, (uint16_t)len, msg_id);
+    }
+    mqtt_report_result(ctx, msg_id, rc);
+    return rc;
+  }
   return 0;
 }
 
+int mqtt_drain_spool(mqttContext *ctx) {
+  if (ctx->spool == NULL || ctx->status != MQTT_CONNECTED) {
+    return 0;
+  }
+
+  int started = 0;
+  SpoolEntry e;
+  while (!mqtt_window_full(ctx) && spool_next(ctx->spool, &e)) {
+    // After a rewind, records still in flight keep their slot
+    if (mqtt_spool_slot(ctx, e.seq) != NULL) {
+      continue;
+    }
+    if (mqtt_start_publish(ctx, e.topic, e.data, e.data_len, e.msg_id,
+                           e.seq) != MQTTCLIENT_SUCCESS) {
+      // Most likely the connection is going down; start over once it's back
+      spool_rewind(ctx->spool);
+      break;
+    }
+    started++;
+  }
+
+  if (started > 0) {
+    LOG_DEBUG("Drained %d spooled messages (%zu left in spool)", started,
+              spool_count(ctx->spool));
+  }
+  return started;
+}
+
+void mqtt_flush_spool(mqttContext *ctx) {
+  if (ctx->spool != NULL) {
+    spool_sync(ctx->spool);
+  }
+}
+
+static void mqtt_report_result(mqttContext *ctx, uint32_t msg_id,
+                               int32_t status) {
+  if (status == 0) {
+    ctx->delivered++;
+  } else {
+    ctx->failed++;
+  }
+
+  if (msg_id == 0) {
+    return;
+  }
+
+  IPCMessage ipc_msg;
+  memset(&ipc_msg, 0, sizeof(IPCMessage));
+  ipc_msg.origin = MOD_MQTT;
+  ipc_msg.msgtype = MSG_EVT_MQTT_PUB_RESULT;
+  ipc_msg.payload_len = sizeof(PayloadMQTTPubResult);
+  ipc_msg.payload.mqtt_pub_result.msg_id = msg_id;
+  ipc_msg.payload.mqtt_pub_result.status = status;
+
+  if (ipc_client_send(ctx->ipc_socket_fd, &ipc_msg) < 0) {
+    LOG_ERROR("Failed to report publish result of message %u", msg_id);
+  }
+}
+
+static int mqtt_retire_slot(mqttContext *ctx, mqttInflight *slot,
+                            int32_t status) {
+  uint32_t msg_id = slot->msg_id;
+  slot->in_use = false;
+  ctx->inflight_count--;
+  if (slot->spool_seq != 0 && status == 0) {
+    spool_ack(ctx->spool, slot->spool_seq);
+  }
+  mqtt_report_result(ctx, msg_id, status);
+  return 1;
+}
+
+/* Retires slots that will never be acked. With a spool nothing is reported:
+ * spooled messages are simply handed out again after a rewind, and direct
+ * publishes are appended to the spool, in the order they were sent.
+ * */
+static int mqtt_fail_slots(mqttContext *ctx, bool (*match)(mqttInflight *,
+                                                           uint64_t),
+                           uint64_t now, int32_t status) {
+  int freed = 0;
+
+  if (ctx->spool == NULL) {
+    for (size_t i = 0; i < ctx->inflight_window; i++) {
+      mqttInflight *slot = &ctx->inflight[i];
+      if (slot->in_use && match(slot, now)) {
+        if (status == MQTT_PUB_ERR_TIMEOUT) {
+          LOG_WARN("Publish of message %u (token %d) timed out", slot->msg_id,
+                   slot->token);
+        }
+        freed += mqtt_retire_slot(ctx, slot, status);
+      }
+    }
+    return freed;
+  }
+
+  bool rewind = false;
+  while (1) {
+    mqttInflight *oldest = NULL;
+    for (size_t i = 0; i < ctx->inflight_window; i++) {
+      mqttInflight *slot = &ctx->inflight[i];
+      if (slot->in_use && match(slot, now) &&
+          (oldest == NULL || slot->order < oldest->order)) {
+        oldest = slot;
+      }
+    }
+    if (oldest == NULL) {
+      break;
+    }
+
+    if (status == MQTT_PUB_ERR_TIMEOUT) {
+      LOG_WARN("Publish of message %u (token %d) timed out, will retry",
+               oldest->msg_id, oldest->token);
+    }
+    oldest->in_use = false;
+    ctx->inflight_count--;
+    freed++;
+    if (oldest->spool_seq != 0) {
+      rewind = true;
+    } else {
+      mqtt_spool_message(ctx, oldest->topic, oldest->data, oldest->data_len,
+                         oldest->msg_id);
+    }
+  }
+
+  if (rewind) {
+    spool_rewind(ctx->spool);
+  }
+  return freed;
+}
+
+static bool mqtt_slot_any(mqttInflight *slot, uint64_t now) { return true; }
+
+static bool mqtt_slot_expired(mqttInflight *slot, uint64_t now) {
+  return now - slot->sent_ms > MQTT_PUB_TIMEOUT_MS;
+}
+
+// Sends the controller everything the Paho thread queued, IPC_BATCH_MAX
+// messages per syscall. The slabs go back to the pool before the send, so
+// Paho has them again even if the send blocks.
+static void mqtt_forward_inbox(mqttContext *ctx) {
+  size_t depth = mpsc_depth(ctx->inbox);
+  if (depth > ctx->inbox_high_water) {
+    ctx->inbox_high_water = depth;
+  }
+
+  IPCMessage batch[IPC_BATCH_MAX];
+  size_t count;
+  do {
+    Slab *s;
+    count = 0;
+    while (count < IPC_BATCH_MAX && (s = mpsc_pop(ctx->inbox)) != NULL) {
+      memcpy(&batch[count++], s->sArena.buffer, sizeof(IPCMessage));
+      slab_pool_release(ctx->inbox_pool, s);
+    }
+    if (count == 0) {
+      break;
+    }
+
+    int sent = ipc_client_send_batch(ctx->ipc_socket_fd, batch, count);
+    ctx->inbox_batches++;
+    if (sent < (int)count) {
+      size_t lost = count - (size_t)(sent > 0 ? sent : 0);
+      ctx->inbox_send_failed += lost;
+      LOG_ERROR("Failed to send %zu inbound messages to controller", lost);
+    }
+    if (sent > 0) {
+      ctx->inbox_forwarded += (uint64_t)sent;
+      LOG_DEBUG("Forwarded %d inbound messages to controller", sent);
+    }
+  } while (count == IPC_BATCH_MAX);
+}
+
+int mqtt_process_completions(mqttContext *ctx) {
+  uint64_t ignored;
+  if (read(ctx->event_fd, &ignored, sizeof(ignored)) == -1 &&
+      errno != EAGAIN) {
+    LOG_SYS_ERROR("Failed to read completion eventfd");
+  }
+
+  mqtt_forward_inbox(ctx);
+
+  MQTTClient_deliveryToken tokens[ctx->done_capacity];
+  size_t count;
+
+  pthread_mutex_lock(&ctx->done_lock);
+  count = ctx->done_count;
+  memcpy(tokens, ctx->done_tokens, count * sizeof(MQTTClient_deliveryToken));
+  ctx->done_count = 0;
+  pthread_mutex_unlock(&ctx->done_lock);
+
+  int freed = 0;
+  for (size_t t = 0; t < count; t++) {
+    for (size_t i = 0; i < ctx->inflight_window; i++) {
+      mqttInflight *slot = &ctx->inflight[i];
+      if (slot->in_use && slot->token == tokens[t]) {
+        freed += mqtt_retire_slot(ctx, slot, 0);
+        break;
+      }
+    }
+  }
+
+  // With cleansession and no persistence, Paho drops everything that was in
+  // flight when the connection went down.
+  if (ctx->conn_lost_pending) {
+    ctx->conn_lost_pending = false;
+    freed += mqtt_fail_slots(ctx, mqtt_slot_any, 0, MQTT_PUB_ERR_CONN_LOST);
+  }
+
+  if (ctx->reconnected_pending) {
+    ctx->reconnected_pending = false;
+    LOG_INFO("Broker connection restored (%zu messages spooled)",
+             ctx->spool != NULL ? spool_count(ctx->spool) : 0);
+  }
+
+  mqtt_drain_spool(ctx);
+  return freed;
+}
+
+int mqtt_expire_inflight(mqttContext *ctx) {
+  int freed = mqtt_fail_slots(ctx, mqtt_slot_expired, mqtt_now_ms(),
+                              MQTT_PUB_ERR_TIMEOUT);
+  mqtt_drain_spool(ctx);
+  return freed;
+}
+
+// ---- background reconnect ----
+
+// Waits up to ms on conn_cond. Returns true if the context is shutting down.
+static bool mqtt_reconnect_wait(mqttContext *ctx, uint64_t ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&ctx->conn_lock);
+  while (!ctx->conn_stop) {
+    if (pthread_cond_timedwait(&ctx->conn_cond, &ctx->conn_lock, &deadline) ==
+        ETIMEDOUT) {
+      break;
+    }
+  }
+  bool stop = ctx->conn_stop;
+  pthread_mutex_unlock(&ctx->conn_lock);
+  return stop;
+}
+
+static void mqtt_restore_subscriptions(mqttContext *ctx) {
+  pthread_mutex_lock(&ctx->conn_lock);
+  for (size_t i = 0; i < ctx->sub_count; i++) {
+    int rc = MQTTClient_subscribe(ctx->client, ctx->subs[i].topic,
+                                  ctx->subs[i].qos);
+    if (rc != MQTTCLIENT_SUCCESS) {
+      LOG_ERROR("Failed to restore subscription to %s. RC: %d",
+                ctx->subs[i].topic, rc);
+    }
+  }
+  pthread_mutex_unlock(&ctx->conn_lock);
+}
+
+/* Sleeps until the connection is down, then retries with exponential backoff
+ * and jitter (so a fleet of sensors doesn't hammer a broker that just came
+ * back). Paho's connect blocks for up to MQTT_CONNECT_TIMEOUT_S, which is why
+ * this is not done on the main loop.
+ * */
+static void *mqtt_reconnect_thread(void *arg) {
+  mqttContext *ctx = (mqttContext *)arg;
+  unsigned int seed = (unsigned int)mqtt_now_ms() ^ (unsigned int)getpid();
+  uint64_t backoff = MQTT_RECONNECT_MIN_MS;
+
+  while (1) {
+    pthread_mutex_lock(&ctx->conn_lock);
+    while (!ctx->conn_stop && ctx->status == MQTT_CONNECTED) {
+      pthread_cond_wait(&ctx->conn_cond, &ctx->conn_lock);
+    }
+    bool stop = ctx->conn_stop;
+    pthread_mutex_unlock(&ctx->conn_lock);
+    if (stop) {
+      break;
+    }
+
+    uint64_t jitter = backoff / 4;
+    uint64_t delay = backoff - jitter + (uint64_t)rand_r(&seed) % (2 * jitter + 1);
+    LOG_INFO("Reconnecting to the broker in %llu ms",
+             (unsigned long long)delay);
+    if (mqtt_reconnect_wait(ctx, delay)) {
+      break;
+    }
+
+    ctx->status = MQTT_ATTEMPT_CONNECT;
+    int rc = MQTTClient_connect(ctx->client, &ctx->conn_opts);
+    if (rc != MQTTCLIENT_SUCCESS) {
+      LOG_WARN("Reconnect failed. RC: %d", rc);
+      backoff *= 2;
+      if (backoff > MQTT_RECONNECT_MAX_MS) {
+        backoff = MQTT_RECONNECT_MAX_MS;
+      }
+      continue;
+    }
+
+    mqtt_restore_subscriptions(ctx);
+    backoff = MQTT_RECONNECT_MIN_MS;
+    ctx->reconnects++;
+    ctx->reconnected_pending = true;
+    ctx->status = MQTT_CONNECTED;
+    mqtt_wake_main_loop(ctx);
+  }
+
+  return NULL;
+}
+
 void mqtt_disconnect_and_free(mqttContext *ctx) {
   if (ctx == NULL) {
     return;
   }
 
+  pthread_mutex_lock(&ctx->conn_lock);
+  ctx->conn_stop = true;
+  pthread_cond_signal(&ctx->conn_cond);
+  pthread_mutex_unlock(&ctx->conn_lock);
+  pthread_join(ctx->conn_thread, NULL);
+
   if (ctx->status == MQTT_CONNECTED) {
     MQTTClient_disconnect(ctx->client, 10000);
     LOG_INFO("MQTT client disconnected successfully");
   }
 
   MQTTClient_destroy(&ctx->client);
+  // Paho is gone: whatever it queued last can still go out
+  mqtt_forward_inbox(ctx);
+  LOG_INFO("Inbound: %llu received, %llu forwarded in %llu batches, %llu "
+           "dropped, %llu send failures, high water %zu/%d",
+           (unsigned long long)ctx->inbox_received,
+           (unsigned long long)ctx->inbox_forwarded,
+           (unsigned long long)ctx->inbox_batches,
+           (unsigned long long)ctx->inbox_dropped,
+           (unsigned long long)ctx->inbox_send_failed, ctx->inbox_high_water,
+           MQTT_INBOX_SLOTS);
+  close(ctx->event_fd);
+  pthread_mutex_destroy(&ctx->done_lock);
+  pthread_mutex_destroy(&ctx->conn_lock);
+  pthread_cond_destroy(&ctx->conn_cond);
+
+  if (ctx->spool != NULL) {
+    LOG_INFO("Spool: %llu appended, %llu drained, %llu evicted, %zu kept",
+             (unsigned long long)ctx->spool->appended,
+             (unsigned long long)ctx->spool->drained,
+             (unsigned long long)ctx->spool->evicted,
+             spool_count(ctx->spool));
+    spool_close(ctx->spool);
+  }
 }
 
 int mqtt_subscribe(mqttContext *ctx, const char *topic, int qos) {
-  if (ctx == NULL || ctx->status != MQTT_CONNECTED) {
-    LOG_ERROR("Cannot subscribe: MQTT client is not connected");
+  if (ctx == NULL) {
+    LOG_ERROR("Cannot subscribe: invalid MQTT context");
     return -1;
   }
 
+  pthread_mutex_lock(&ctx->conn_lock);
+  bool stored = ctx->sub_count < MQTT_MAX_SUBSCRIPTIONS;
+  if (stored) {
+    mqttSubscription *sub = &ctx->subs[ctx->sub_count++];
+    snprintf(sub->topic, sizeof(sub->topic), "%s", topic);
+    sub->qos = qos;
+  }
+  pthread_mutex_unlock(&ctx->conn_lock);
+
+  if (!stored) {
+    LOG_WARN("Too many subscriptions, %s won't survive a reconnect", topic);
+  }
+
+  if (ctx->status != MQTT_CONNECTED) {
+    LOG_INFO("Broker not connected, will subscribe to %s on connect", topic);
+    return 0;
+  }
+
   int rc = MQTTClient_subscribe(ctx->client, topic, qos);
 
   if (rc != MQTTCLIENT_SUCCESS) {
@@ -120,51 +677,81 @@ int mqtt_subscribe(mqttContext *ctx, const char *topic, int qos) {
   return 0;
 }
 
-volatile MQTTClient_deliveryToken deliveredtoken;
+// Paho thread: the inbox is full, the main loop is behind. Warns at the 1st,
+// 2nd, 4th... drop so a flood doesn't turn into a flood of logs.
+static void mqtt_drop_inbound(mqttContext *ctx, const char *topic) {
+  uint64_t dropped =
+      __atomic_add_fetch(&ctx->inbox_dropped, 1, __ATOMIC_RELAXED);
+  if ((dropped & (dropped - 1)) == 0) {
+    LOG_WARN("Inbox full, dropped a message on %s (%llu so far)", topic,
+             (unsigned long long)dropped);
+  }
+}
 
 void mqtt_message_delivered(void *context, MQTTClient_deliveryToken dt) {
-  LOG_INFO("Message with token value %d delivery confirmed", dt);
-  deliveredtoken = dt;
+  mqttContext *ctx = (mqttContext *)context;
+  LOG_DEBUG("Message with token value %d delivery confirmed", dt);
+
+  pthread_mutex_lock(&ctx->done_lock);
+  bool queued = ctx->done_count < ctx->done_capacity;
+  if (queued) {
+    ctx->done_tokens[ctx->done_count++] = dt;
+  }
+  pthread_mutex_unlock(&ctx->done_lock);
+
+  if (!queued) {
+    // The slot will be failed by mqtt_expire_inflight() instead
+    LOG_WARN("Completion queue full, dropping ack for token %d", dt);
+  }
+  mqtt_wake_main_loop(ctx);
 }
 
 int mqtt_on_message_arrived(void *context, char *topic, int topicLen,
                             MQTTClient_message *msg) {
   mqttContext *ctx = (mqttContext *)context;
+  __atomic_fetch_add(&ctx->inbox_received, 1, __ATOMIC_RELAXED);
+
+  // Zeroed by the allocation
+  Slab *s = slab_pool_acquire(ctx->inbox_pool, 0);
+  IPCMessage *ipc_msg =
+      s != NULL ? ARENA_NEW(&s->sArena, IPCMessage) : NULL;
+  if (ipc_msg == NULL) {
+    mqtt_drop_inbound(ctx, topic);
+    goto done;
+  }
 
-  IPCMessage ipc_msg;
-  memset(&ipc_msg, 0, sizeof(IPCMessage));
-
-  ipc_msg.origin = MOD_MQTT;
-  ipc_msg.msgtype = MSG_EVT_MQTT_SUB_MSG;
+  ipc_msg->origin = MOD_MQTT;
+  ipc_msg->msgtype = MSG_EVT_MQTT_SUB_MSG;
 
   struct timeval tv;
   gettimeofday(&tv, NULL);
-  ipc_msg.timestamp_ms =
+  ipc_msg->timestamp_ms =
       (uint64_t)(tv.tv_sec) * 1000 + (uint64_t)(tv.tv_usec) / 1000;
 
-  size_t max_topic_len = sizeof(ipc_msg.payload.mqtt_sub_evt.topic) - 1;
-  size_t copy_topic_len = (topicLen > max_topic_len) ? max_topic_len : topicLen;
+  // Paho passes 0 unless the topic has embedded NULs
+  size_t topic_len = topicLen > 0 ? (size_t)topicLen : strlen(topic);
+  size_t max_topic_len = sizeof(ipc_msg->payload.mqtt_sub_evt.topic) - 1;
+  size_t copy_topic_len = (topic_len > max_topic_len) ? max_topic_len : topic_len;
 
-  strncpy(ipc_msg.payload.mqtt_sub_evt.topic, topic, copy_topic_len);
-  ipc_msg.payload.mqtt_sub_evt.topic[copy_topic_len] = '\0'; // Garante o nulo
+  memcpy(ipc_msg->payload.mqtt_sub_evt.topic, topic, copy_topic_len);
+  ipc_msg->payload.mqtt_sub_evt.topic[copy_topic_len] = '\0';
 
   uint16_t cpylen = (msg->payloadlen > 256) ? 256 : msg->payloadlen;
-  memcpy(ipc_msg.payload.mqtt_sub_evt.data, msg->payload, cpylen);
-
-  ipc_msg.payload.mqtt_sub_evt.data_len = cpylen;
+  memcpy(ipc_msg->payload.mqtt_sub_evt.data, msg->payload, cpylen);
 
-  ipc_msg.payload_len = sizeof(ipc_msg.payload.mqtt_sub_evt);
+  ipc_msg->payload.mqtt_sub_evt.data_len = cpylen;
 
-  int bytes_written = ipc_client_send(ctx->ipc_socket_fd, &ipc_msg);
+  ipc_msg->payload_len = sizeof(ipc_msg->payload.mqtt_sub_evt);
 
-  if (bytes_written < 0) {
-    LOG_ERROR("Failed to send message to controller");
-    return 0;
-  } else {
-    LOG_INFO("Message successfully sent to controller %d (%d bytes)",
-             ctx->ipc_socket_fd, bytes_written);
+  if (mpsc_push(ctx->inbox, s) != 0) {
+    // Can't happen while the queue has a cell per slab; kept for safety
+    slab_pool_release(ctx->inbox_pool, s);
+    mqtt_drop_inbound(ctx, topic);
+  } else if (mpsc_wake_needed(ctx->inbox)) {
+    mqtt_wake_main_loop(ctx);
   }
 
+done:
   MQTTClient_freeMessage(&msg);
   MQTTClient_free(topic);
 
@@ -174,5 +761,12 @@ int mqtt_on_message_arrived(void *context, char *topic, int topicLen,
 void mqtt_on_connection_lost(void *context, char *cause) {
   LOG_WARN("Connection lost. Cause: %s", cause);
   mqttContext *ctx = (mqttContext *)context;
+
+  pthread_mutex_lock(&ctx->conn_lock);
   ctx->status = MQTT_DISCONNECTED;
+  pthread_cond_signal(&ctx->conn_cond);
+  pthread_mutex_unlock(&ctx->conn_lock);
+
+  ctx->conn_lost_pending = true;
+  mqtt_wake_main_loop(ctx);
 }
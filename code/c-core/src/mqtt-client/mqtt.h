@@ -2,7 +2,12 @@
 #define MQTT_WRAPPER_H
 
 #include "../../include/arena.h"
+#include "../../include/mpsc.h"
+#include "../../include/slabpool.h"
 #include "../../vendor/paho.mqtt.c/src/MQTTClient.h"
+#include "spool.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 enum MqttStatus {
@@ -11,33 +16,212 @@ enum MqttStatus {
   MQTT_ATTEMPT_CONNECT = 2
 };
 
+// Time after which an unacknowledged publish is reported as failed
+#define MQTT_PUB_TIMEOUT_MS 10000
+
+// Background reconnect backoff: doubles from MIN to MAX, +-25% jitter
+#define MQTT_RECONNECT_MIN_MS 500
+#define MQTT_RECONNECT_MAX_MS 60000
+#define MQTT_CONNECT_TIMEOUT_S 5
+
+#define MQTT_MAX_SUBSCRIPTIONS 4
+
+// Inbound messages the Paho thread can have waiting for the main loop (a
+// power of two); past that they are dropped and counted
+#define MQTT_INBOX_SLOTS 64
+
+// Direct publishes up to this size are copied into their in-flight slot;
+// larger ones go through the spool so they can still be retried
+#define MQTT_INFLIGHT_COPY_MAX 256
+
+/* *
+ * One outstanding QoS 1/2 publish, waiting for its broker ack.
+ */
+typedef struct {
+  MQTTClient_deliveryToken token;
+  uint32_t msg_id; // controller correlation id, 0 = don't report
+  uint64_t sent_ms;
+  uint64_t order;     // publish order, to re-spool failures in sequence
+  uint64_t spool_seq; // spool record being delivered, 0 = direct publish
+  bool in_use;
+
+  // copy of a direct publish, kept to re-spool it if it never gets acked
+  char topic[SPOOL_TOPIC_MAX];
+  uint8_t data[MQTT_INFLIGHT_COPY_MAX];
+  uint16_t data_len;
+} mqttInflight;
+
+typedef struct {
+  char topic[SPOOL_TOPIC_MAX];
+  int qos;
+} mqttSubscription;
+
 /* *
  * Structure holding the Paho MQTT client instance,
  * connection status, and the IPC socket file descriptor.
+ *
+ * Publishes are pipelined: up to inflight_window messages can wait for their
+ * broker ack at the same time. Paho reports acks on its own thread through
+ * mqtt_message_delivered(), which only queues the token under done_lock and
+ * pokes event_fd; the main loop then calls mqtt_process_completions().
+ *
+ * Inbound messages take the same road without a lock, so that a slow
+ * controller never holds up Paho's receive thread (and its keepalives):
+ * mqtt_on_message_arrived() builds the IPCMessage in a slab from inbox_pool,
+ * pushes it on the inbox queue and pokes event_fd if the main loop is idle.
+ * mqtt_process_completions() forwards them, IPC_BATCH_MAX per syscall.
+ *
+ * Broker outages never block the main loop: a background thread reconnects
+ * with exponential backoff, restores the subscriptions and pokes event_fd.
+ * With a spool enabled, publishes made meanwhile (and the ones that were in
+ * flight when the connection dropped) go to disk and are drained, in order,
+ * once the broker is back.
  */
 typedef struct mqttContext {
   MQTTClient client;
-  uint8_t status;
+  volatile uint8_t status;
   int ipc_socket_fd;
+
+  // in-flight window, only touched by the main loop
+  mqttInflight *inflight;
+  size_t inflight_window;
+  size_t inflight_count;
+
+  // completions handed over from the Paho thread
+  pthread_mutex_t done_lock;
+  MQTTClient_deliveryToken *done_tokens;
+  size_t done_capacity;
+  size_t done_count;
+  volatile bool conn_lost_pending;
+  volatile bool reconnected_pending;
+  int event_fd;
+
+  // inbound messages handed over from the Paho thread
+  SlabPool *inbox_pool; // MQTT_INBOX_SLOTS IPCMessages
+  MpscQueue *inbox;     // of Slabs from inbox_pool
+
+  // background reconnect; subs and stop are guarded by conn_lock
+  MQTTClient_connectOptions conn_opts;
+  pthread_t conn_thread;
+  pthread_mutex_t conn_lock;
+  pthread_cond_t conn_cond;
+  bool conn_stop;
+  mqttSubscription subs[MQTT_MAX_SUBSCRIPTIONS];
+  size_t sub_count;
+
+  // offline store-and-forward, NULL when disabled
+  mqttSpool *spool;
+  uint64_t publish_order;
+
+  // counters
+  uint64_t published;
+  uint64_t delivered;
+  uint64_t failed;
+  uint64_t spooled;
+  uint64_t reconnects;
+  uint64_t inbox_received; // written by the Paho thread
+  uint64_t inbox_dropped;  // same; inbox full
+  uint64_t inbox_forwarded;
+  uint64_t inbox_send_failed;
+  uint64_t inbox_batches;
+  size_t inbox_high_water;
 } mqttContext;
 
 /* *
  * Initializes the MQTT client, allocates memory, and connects to the broker.
+ * inflight_window is the max number of publishes awaiting a broker ack.
+ * If the broker is unreachable the context starts disconnected and keeps
+ * retrying in the background.
  * * Returns:
  * Pointer to the new mqttContext if successful.
- * NULL if memory allocation fails or connection is refused.
+ * NULL if memory allocation or client creation fails.
  */
 mqttContext *mqtt_create_context(const char *address, const char *clientID,
-                                 int keepAliveInterval, Arena *a, int sock_fd);
+                                 int keepAliveInterval, Arena *a, int sock_fd,
+                                 size_t inflight_window);
 
 /* *
- * Publishes a message to a topic with QoS 1.
- * This function blocks until the message is delivered or a timeout occurs.
+ * Publishes len bytes of data (any content, no terminator needed) to a topic
+ * with QoS 1 without waiting for the ack.
+ * The outcome is reported to the controller as MSG_EVT_MQTT_PUB_RESULT once
+ * the broker acks it or it times out (unless msg_id is 0).
+ * While mqtt_spooling(), the message is appended to the spool instead.
+ * With a spool, payloads over MQTT_INFLIGHT_COPY_MAX are always written to
+ * it first and published from there.
  * * Returns:
- * 0 if the message was delivered successfully.
+ * 0 if the message was handed to Paho or spooled.
+ * MQTT_PUB_WINDOW_FULL if the in-flight window is full (nothing was sent).
  * Non-zero error code if the publication failed.
  */
-int mqtt_pub_message(mqttContext *ctx, const char *topic, const char *payload);
+#define MQTT_PUB_WINDOW_FULL 1
+int mqtt_pub_message(mqttContext *ctx, const char *topic, const void *data,
+                     size_t len, uint32_t msg_id);
+
+/* *
+ * True when no more publishes can be started until acks come back.
+ */
+static inline bool mqtt_window_full(const mqttContext *ctx) {
+  return ctx->inflight_count >= ctx->inflight_window;
+}
+
+/* *
+ * Opens the disk spool at path (at most max_bytes of records) and starts
+ * storing publishes there whenever the broker is unreachable. Records left by
+ * a previous run are drained once connected.
+ * * Returns:
+ * 0 on success, -1 on error (publishing keeps working without a spool).
+ */
+int mqtt_enable_spool(mqttContext *ctx, const char *path, size_t max_bytes,
+                      Arena *a);
+
+/* *
+ * True while publishes go to the spool: the broker is unreachable or older
+ * spooled messages still have to be sent first. The in-flight window does
+ * not apply then, so there is no reason to stop reading IPC.
+ */
+static inline bool mqtt_spooling(const mqttContext *ctx) {
+  return ctx->spool != NULL &&
+         (ctx->status != MQTT_CONNECTED || !spool_drained(ctx->spool));
+}
+
+/* *
+ * Publishes spooled messages, oldest first, while the window has room.
+ * Called by the other mqtt_* functions as needed; call it from a timer too.
+ * * Returns:
+ * Number of messages started.
+ */
+int mqtt_drain_spool(mqttContext *ctx);
+
+/* *
+ * Starts writing the spool back to storage if it changed. Cheap, meant for a
+ * periodic timer.
+ */
+void mqtt_flush_spool(mqttContext *ctx);
+
+/* *
+ * Eventfd that becomes readable when the Paho thread queued completions or
+ * inbound messages.
+ */
+static inline int mqtt_event_fd(const mqttContext *ctx) {
+  return ctx->event_fd;
+}
+
+/* *
+ * Forwards inbound messages to the controller, retires acked publishes and
+ * reports them to the controller, and handles connection loss /
+ * reconnection signalled by the other threads.
+ * Call from the main loop when mqtt_event_fd() is readable.
+ * * Returns:
+ * Number of in-flight slots that were freed.
+ */
+int mqtt_process_completions(mqttContext *ctx);
+
+/* *
+ * Fails every publish that has waited longer than MQTT_PUB_TIMEOUT_MS.
+ * * Returns:
+ * Number of in-flight slots that were freed.
+ */
+int mqtt_expire_inflight(mqttContext *ctx);
 
 /* *
  * Disconnects the client (if connected) and frees all allocated memory.
@@ -47,17 +231,17 @@ void mqtt_disconnect_and_free(mqttContext *ctx);
 
 /* *
  * Callback triggered when a published message delivery is confirmed by the
- * broker.
+ * broker. Runs on the Paho thread: it only queues the token for the main loop.
  */
 void mqtt_message_delivered(void *context, MQTTClient_deliveryToken dt);
 
 /* *
  * Callback triggered when a message arrives from a subscribed topic.
- * Packages the payload into an IPCMessage and sends it to the Main Controller.
+ * Runs on the Paho thread: packages the payload into an IPCMessage and queues
+ * it for the main loop, which sends it to the Main Controller. Never blocks;
+ * if the inbox is full the message is dropped and counted.
  * * Returns:
- * 1 (True) to tell the Paho library the message was successfully processed.
- * 0 (False) to indicate failure, causing Paho to re-deliver QoS 1 or 2
- * messages.
+ * 1 (True): the message is always consumed, queued or dropped.
  */
 int mqtt_on_message_arrived(void *context, char *topic, int topicLen,
                             MQTTClient_message *msg);
@@ -68,8 +252,9 @@ int mqtt_on_message_arrived(void *context, char *topic, int topicLen,
 void mqtt_on_connection_lost(void *context, char *cause);
 
 /* *
- * Subscribes the client to a specific topic.
- * Must be called AFTER a successful connection.
+ * Subscribes the client to a specific topic. The subscription is remembered
+ * and restored after every reconnect; while disconnected it is only
+ * remembered.
  * * Returns:
  * 0 on success.
  * Non-zero error code if the subscription failed.
@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "spool.h"
+
+#include "../../include/logging.h"
+
+#define SPOOL_MAGIC 0x4c4f4f53u      // "SOOL"
+#define SPOOL_VERSION 1
+#define SPOOL_HEADER_SIZE 4096
+#define SPOOL_REC_MAGIC 0x31434552u  // "REC1"
+#define SPOOL_WRAP_MAGIC 0x50415257u // "WRAP": rest of the area is unused
+#define SPOOL_ALIGN 8
+
+typedef struct {
+  uint32_t magic; // written last; 0 while the record is incomplete
+  uint32_t crc;   // crc32 of everything after this field
+  uint64_t seq;
+  uint32_t msg_id;
+  uint16_t topic_len; // including the NUL
+  uint16_t data_len;
+} SpoolRecordHdr;
+
+// ---- helpers ----
+
+static uint32_t crc_table[256];
+
+static void spool_crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t spool_crc32(const uint8_t *p, size_t len) {
+  uint32_t c = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++) {
+    c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+  }
+  return c ^ 0xFFFFFFFFu;
+}
+
+static size_t spool_rec_size(size_t topic_len, size_t data_len) {
+  size_t n = sizeof(SpoolRecordHdr) + topic_len + data_len;
+  return (n + SPOOL_ALIGN - 1) & ~(size_t)(SPOOL_ALIGN - 1);
+}
+
+static uint32_t spool_rec_crc(const SpoolRecordHdr *r) {
+  const uint8_t *start = (const uint8_t *)&r->seq;
+  size_t len = sizeof(SpoolRecordHdr) - offsetof(SpoolRecordHdr, seq) +
+               r->topic_len + r->data_len;
+  return spool_crc32(start, len);
+}
+
+// Offset where the record that logically starts at off really is: records
+// never straddle the end of the area, the writer wraps to 0 instead.
+static uint64_t spool_resolve(const mqttSpool *s, uint64_t off) {
+  if (off + sizeof(SpoolRecordHdr) > s->capacity) {
+    return 0;
+  }
+  uint32_t magic;
+  memcpy(&magic, s->area + off, sizeof(magic));
+  return magic == SPOOL_WRAP_MAGIC ? 0 : off;
+}
+
+static uint64_t spool_advance(const mqttSpool *s, uint64_t off,
+                              size_t rec_size) {
+  off += rec_size;
+  return off >= s->capacity ? 0 : off;
+}
+
+static const SpoolRecordHdr *spool_rec_at(const mqttSpool *s, uint64_t off) {
+  return (const SpoolRecordHdr *)(s->area + off);
+}
+
+// Validates the record at off as the one carrying seq
+static bool spool_rec_valid(const mqttSpool *s, uint64_t off, uint64_t seq) {
+  if (off + sizeof(SpoolRecordHdr) > s->capacity) {
+    return false;
+  }
+  const SpoolRecordHdr *r = spool_rec_at(s, off);
+  if (r->magic != SPOOL_REC_MAGIC || r->seq != seq || r->topic_len == 0 ||
+      r->topic_len > SPOOL_TOPIC_MAX ||
+      off + spool_rec_size(r->topic_len, r->data_len) > s->capacity) {
+    return false;
+  }
+  const char *topic = (const char *)(r + 1);
+  return topic[r->topic_len - 1] == '\0' && spool_rec_crc(r) == r->crc;
+}
+
+// Removes the oldest record. evicted: it was never delivered.
+static void spool_drop_head(mqttSpool *s, bool evicted) {
+  SpoolFileHeader *h = s->hdr;
+  uint64_t off = spool_resolve(s, h->head_off);
+  if (off != h->head_off) {
+    s->used -= s->capacity - h->head_off; // wrap padding
+  }
+
+  const SpoolRecordHdr *r = spool_rec_at(s, off);
+  size_t size = spool_rec_size(r->topic_len, r->data_len);
+  uint32_t msg_id = r->msg_id;
+  uint64_t seq = h->head_seq;
+
+  s->used -= size;
+  s->count--;
+  s->acked[h->head_seq % SPOOL_ACK_SLOTS] = 0;
+  h->head_off = spool_advance(s, off, size);
+  h->head_seq++;
+
+  if (s->cursor_seq < h->head_seq) {
+    s->cursor_seq = h->head_seq;
+    s->cursor_off = h->head_off;
+  }
+
+  if (s->count == 0) {
+    // Empty: start over at the beginning of the area
+    h->head_off = 0;
+    s->tail_off = 0;
+    s->cursor_off = 0;
+    s->used = 0;
+  }
+  s->dirty = true;
+
+  if (evicted) {
+    s->evicted++;
+    if (s->on_evict != NULL) {
+      s->on_evict(s->evict_userdata, seq, msg_id);
+    }
+  } else {
+    s->drained++;
+  }
+}
+
+// Walks the log from head and rebuilds tail/used/count
+static void spool_recover(mqttSpool *s) {
+  SpoolFileHeader *h = s->hdr;
+  uint64_t off = h->head_off;
+  uint64_t seq = h->head_seq;
+
+  while (s->count < SIZE_MAX) {
+    uint64_t at = spool_resolve(s, off);
+    size_t waste = at != off ? s->capacity - off : 0;
+
+    // A stale wrap marker from an older lap would send us back to live
+    // records; only follow it if the next record really is the next one.
+    if (!spool_rec_valid(s, at, seq)) {
+      break;
+    }
+
+    const SpoolRecordHdr *r = spool_rec_at(s, at);
+    size_t size = spool_rec_size(r->topic_len, r->data_len);
+    if (s->used + waste + size > s->capacity) {
+      break;
+    }
+
+    s->used += waste + size;
+    s->count++;
+    off = spool_advance(s, at, size);
+    seq++;
+  }
+
+  s->tail_off = s->count > 0 ? off : h->head_off;
+  s->tail_seq = seq;
+  s->cursor_off = h->head_off;
+  s->cursor_seq = h->head_seq;
+  s->recovered = s->count;
+}
+
+// ---- public API ----
+
+int spool_open(mqttSpool *s, const char *path, size_t capacity) {
+  if (s == NULL || path == NULL || capacity < SPOOL_HEADER_SIZE) {
+    LOG_ERROR("Invalid arguments to spool_open");
+    return -1;
+  }
+
+  memset(s, 0, sizeof(mqttSpool));
+  spool_crc_init();
+
+  capacity &= ~(size_t)(SPOOL_ALIGN - 1);
+  s->capacity = capacity;
+  s->map_len = SPOOL_HEADER_SIZE + capacity;
+
+  s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (s->fd == -1) {
+    LOG_SYS_ERROR("Failed to open spool %s", path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(s->fd, &st) == -1) {
+    LOG_SYS_ERROR("Failed to stat spool %s", path);
+    close(s->fd);
+    return -1;
+  }
+
+  // Reserve every block up front: the spool never grows on the SD card and
+  // appends can't fail with ENOSPC later.
+  if ((size_t)st.st_size != s->map_len) {
+    // A different size: the records of a spool resized since are lost
+    if (st.st_size > 0) {
+      SpoolFileHeader old;
+      bool spool = pread(s->fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old) &&
+                   old.magic == SPOOL_MAGIC;
+      LOG_WARN("Spool %s is %lld bytes, not %zu: %s", path,
+               (long long)st.st_size, s->map_len,
+               spool ? "resized, dropping the records it holds"
+                     : "not a spool, overwriting it");
+    }
+    if (ftruncate(s->fd, 0) == -1 ||
+        posix_fallocate(s->fd, 0, (off_t)s->map_len) != 0) {
+      LOG_SYS_ERROR("Failed to allocate %zu bytes for spool %s", s->map_len,
+                    path);
+      close(s->fd);
+      return -1;
+    }
+  }
+
+  s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+  if (s->map == MAP_FAILED) {
+    LOG_SYS_ERROR("Failed to map spool %s", path);
+    close(s->fd);
+    return -1;
+  }
+  s->hdr = (SpoolFileHeader *)s->map;
+  s->area = s->map + SPOOL_HEADER_SIZE;
+
+  SpoolFileHeader *h = s->hdr;
+  if (h->magic != SPOOL_MAGIC || h->version != SPOOL_VERSION ||
+      h->capacity != capacity || h->head_off >= capacity ||
+      h->head_off % SPOOL_ALIGN != 0) {
+    if (h->magic != 0) {
+      LOG_WARN("Spool %s has an unknown layout, starting empty", path);
+    }
+    memset(h, 0, sizeof(SpoolFileHeader));
+    h->version = SPOOL_VERSION;
+    h->capacity = capacity;
+    h->head_seq = 1;
+    __atomic_store_n(&h->magic, SPOOL_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  spool_recover(s);
+  h->tail_off = s->tail_off;
+
+  LOG_INFO("Spool %s: %zu KiB, %zu records recovered", path, capacity / 1024,
+           s->count);
+  return 0;
+}
+
+int spool_append(mqttSpool *s, const char *topic, const void *data,
+                 uint16_t data_len, uint32_t msg_id) {
+  size_t topic_len = strnlen(topic, SPOOL_TOPIC_MAX - 1) + 1;
+  size_t size = spool_rec_size(topic_len, data_len);
+  if (size > s->capacity) {
+    return -1;
+  }
+
+  // Make room: records never straddle the end, so wrapping wastes the rest
+  // of the area until the head passes it.
+  uint64_t off;
+  size_t waste;
+  while (1) {
+    off = s->tail_off;
+    waste = off + size > s->capacity ? s->capacity - off : 0;
+    if (s->used + waste + size <= s->capacity) {
+      break;
+    }
+    spool_drop_head(s, true);
+  }
+
+  if (waste > 0) {
+    if (waste >= sizeof(uint32_t)) {
+      uint32_t wrap = SPOOL_WRAP_MAGIC;
+      memcpy(s->area + off, &wrap, sizeof(wrap));
+    }
+    s->used += waste;
+    off = 0;
+  }
+
+  SpoolRecordHdr *r = (SpoolRecordHdr *)(s->area + off);
+  r->magic = 0;
+  r->seq = s->tail_seq;
+  r->msg_id = msg_id;
+  r->topic_len = (uint16_t)topic_len;
+  r->data_len = data_len;
+
+  uint8_t *body = (uint8_t *)(r + 1);
+  memcpy(body, topic, topic_len - 1);
+  body[topic_len - 1] = '\0';
+  memcpy(body + topic_len, data, data_len);
+  size_t pad = size - sizeof(SpoolRecordHdr) - topic_len - data_len;
+  memset(body + topic_len + data_len, 0, pad);
+
+  r->crc = spool_rec_crc(r);
+  // Commit point: the record only counts once its magic is in place
+  __atomic_store_n(&r->magic, SPOOL_REC_MAGIC, __ATOMIC_RELEASE);
+
+  if (s->cursor_seq == s->tail_seq) {
+    s->cursor_off = off; // the cursor was waiting at the old tail
+  }
+  s->tail_off = spool_advance(s, off, size);
+  s->tail_seq++;
+  s->used += size;
+  s->count++;
+  s->appended++;
+  s->hdr->tail_off = s->tail_off;
+  s->dirty = true;
+  return 0;
+}
+
+bool spool_next(mqttSpool *s, SpoolEntry *e) {
+  while (s->cursor_seq != s->tail_seq) {
+    if (s->cursor_seq - s->hdr->head_seq >= SPOOL_ACK_SLOTS) {
+      return false; // too many outstanding, wait for acks
+    }
+
+    uint64_t off = spool_resolve(s, s->cursor_off);
+    const SpoolRecordHdr *r = spool_rec_at(s, off);
+    uint64_t seq = s->cursor_seq;
+
+    s->cursor_off = spool_advance(s, off, spool_rec_size(r->topic_len,
+                                                         r->data_len));
+    s->cursor_seq++;
+
+    // After a rewind, skip what the broker already has
+    if (s->acked[seq % SPOOL_ACK_SLOTS]) {
+      continue;
+    }
+
+    e->seq = seq;
+    e->msg_id = r->msg_id;
+    e->topic = (const char *)(r + 1);
+    e->data = (const uint8_t *)(r + 1) + r->topic_len;
+    e->data_len = r->data_len;
+    return true;
+  }
+  return false;
+}
+
+void spool_ack(mqttSpool *s, uint64_t seq) {
+  // Past the cursor is fine: a rewind moves it back over records still in
+  // flight
+  if (seq < s->hdr->head_seq || seq >= s->tail_seq) {
+    return; // evicted meanwhile, or not ours
+  }
+
+  s->acked[seq % SPOOL_ACK_SLOTS] = 1;
+  while (s->count > 0 && s->acked[s->hdr->head_seq % SPOOL_ACK_SLOTS]) {
+    spool_drop_head(s, false);
+  }
+}
+
+void spool_rewind(mqttSpool *s) {
+  s->cursor_off = s->hdr->head_off;
+  s->cursor_seq = s->hdr->head_seq;
+}
+
+void spool_sync(mqttSpool *s) {
+  if (s->dirty) {
+    if (msync(s->map, s->map_len, MS_ASYNC) == -1) {
+      LOG_SYS_ERROR("Failed to schedule spool writeback");
+    }
+    s->dirty = false;
+  }
+}
+
+void spool_close(mqttSpool *s) {
+  if (s == NULL || s->map == NULL) {
+    return;
+  }
+  if (msync(s->map, s->map_len, MS_SYNC) == -1) {
+    LOG_SYS_ERROR("Failed to flush spool");
+  }
+  munmap(s->map, s->map_len);
+  close(s->fd);
+  s->map = NULL;
+}
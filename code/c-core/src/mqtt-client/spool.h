@@ -0,0 +1,143 @@
+#ifndef MQTT_SPOOL_H
+#define MQTT_SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* *
+ * Store-and-forward spool for publishes that can't reach the broker.
+ *
+ * The spool is one preallocated file, mapped with MAP_SHARED: a header page
+ * followed by a circular log of records. Appends only touch the page cache,
+ * so a crash of this process loses nothing; the kernel (and spool_sync())
+ * writes it back to the SD card. Every record carries its sequence number
+ * and a CRC, and the log is re-validated from the oldest record on open, so
+ * a torn write after a power cut only loses the records that were being
+ * written.
+ *
+ * The file never grows: when it is full the oldest records are evicted.
+ *
+ * Records are handed out for publishing in order (spool_next()) and only
+ * leave the spool once the broker acked them (spool_ack()). After a failure
+ * spool_rewind() starts over from the oldest unacked record, so delivery is
+ * at-least-once, like QoS 1 itself.
+ */
+
+#define SPOOL_ACK_SLOTS 256 // max records handed out but not yet acked
+#define SPOOL_TOPIC_MAX 64
+#define SPOOL_DATA_MAX UINT16_MAX // records carry a 16-bit length
+
+/* *
+ * On-disk header, first page of the file. head is authoritative, tail is
+ * only a hint: open scans forward from head to find the real end.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity; // bytes of record area after the header page
+  uint64_t head_off;
+  uint64_t head_seq; // seq of the record at head_off
+  uint64_t tail_off; // hint
+} SpoolFileHeader;
+
+typedef struct {
+  uint64_t seq;
+  uint32_t msg_id;
+  const char *topic; // NUL-terminated, points into the mapping
+  const uint8_t *data;
+  uint16_t data_len;
+} SpoolEntry;
+
+typedef void (*SpoolEvictCallback)(void *userdata, uint64_t seq,
+                                   uint32_t msg_id);
+
+typedef struct {
+  int fd;
+  uint8_t *map;
+  size_t map_len;
+  SpoolFileHeader *hdr;
+  uint8_t *area; // record area
+  size_t capacity;
+
+  // live state; head lives in hdr
+  uint64_t tail_off;
+  uint64_t tail_seq; // seq the next append gets
+  size_t used;       // bytes between head and tail, wrap padding included
+  size_t count;      // records between head and tail
+
+  // drain cursor: next record to hand out
+  uint64_t cursor_off;
+  uint64_t cursor_seq;
+  uint8_t acked[SPOOL_ACK_SLOTS]; // by seq % SPOOL_ACK_SLOTS
+
+  bool dirty;
+  SpoolEvictCallback on_evict;
+  void *evict_userdata;
+
+  // counters
+  uint64_t appended;
+  uint64_t drained;
+  uint64_t evicted;
+  uint64_t recovered;
+} mqttSpool;
+
+/* *
+ * Opens (or creates) the spool file at path with room for capacity bytes of
+ * records, and recovers whatever a previous run left in it.
+ * * Returns:
+ * 0 on success, -1 on error.
+ */
+int spool_open(mqttSpool *s, const char *path, size_t capacity);
+
+/* *
+ * Appends one publish. Evicts the oldest records (reporting them through
+ * on_evict) if there is not enough room.
+ * * Returns:
+ * 0 on success, -1 if the record can never fit.
+ */
+int spool_append(mqttSpool *s, const char *topic, const void *data,
+                 uint16_t data_len, uint32_t msg_id);
+
+/* *
+ * Hands out the next record to publish and moves the drain cursor past it.
+ * Entry pointers stay valid until the next spool_append().
+ * * Returns:
+ * true if e was filled, false if there is nothing left to hand out.
+ */
+bool spool_next(mqttSpool *s, SpoolEntry *e);
+
+/* *
+ * Marks record seq as delivered. The oldest records are released as soon as
+ * they are all acked.
+ */
+void spool_ack(mqttSpool *s, uint64_t seq);
+
+/* *
+ * Moves the drain cursor back to the oldest unacked record.
+ */
+void spool_rewind(mqttSpool *s);
+
+/* *
+ * Records still in the spool (handed out or not).
+ */
+static inline size_t spool_count(const mqttSpool *s) { return s->count; }
+
+/* *
+ * True when every record in the spool has been handed out.
+ */
+static inline bool spool_drained(const mqttSpool *s) {
+  return s->cursor_seq == s->tail_seq;
+}
+
+/* *
+ * Starts writing dirty pages back to storage without waiting.
+ */
+void spool_sync(mqttSpool *s);
+
+/* *
+ * Writes everything back and unmaps the file.
+ */
+void spool_close(mqttSpool *s);
+
+#endif // MQTT_SPOOL_H
@@ -0,0 +1,243 @@
+#define MODULE_NAME "CAPTURE"
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#include "../../include/logging.h"
+
+// Inbound TCP SYN (no ACK) or UDP over IPv4/IPv6, cut to PACKET_SNAPLEN:
+// tcpdump's 'inbound and (tcp[tcpflags] & (tcp-syn|tcp-ack) = tcp-syn or
+// udp)', except that IPv6 extension headers are not followed. Jump offsets
+// count from the next instruction.
+static struct sock_filter probe_filter[] = {
+    /* 0 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, 19),
+    /* 2 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12), // ethertype
+    /* 3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 1, 0),
+    /* 4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 9, 16),
+    // IPv4
+    /* 5 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 14 + 9), // protocol
+    /* 6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 13, 0),
+    /* 7 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 13),
+    /* 8 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 14 + 6), // fragment offset
+    /* 9 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 11, 0),
+    /* 10 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14), // x = IP header length
+    /* 11 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 14 + 13), // TCP flags
+    /* 12 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x12),
+    /* 13 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x02, 6, 7),
+    // IPv6
+    /* 14 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 14 + 6), // next header
+    /* 15 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 4, 0),
+    /* 16 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 4),
+    /* 17 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 14 + 40 + 13), // TCP flags
+    /* 18 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x12),
+    /* 19 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x02, 0, 1),
+    /* 20 */ BPF_STMT(BPF_RET | BPF_K, PACKET_SNAPLEN),
+    /* 21 */ BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static struct sock_filter drop_filter[] = {
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static int capture_attach(Capture *c, struct sock_filter *code, size_t len) {
+  struct sock_fprog prog = {(unsigned short)len, code};
+  if (setsockopt(c->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) ==
+      -1) {
+    LOG_SYS_ERROR("Failed to attach the capture filter");
+    return -1;
+  }
+  return 0;
+}
+
+static inline struct tpacket_block_desc *capture_block(const Capture *c,
+                                                       uint32_t i) {
+  return (struct tpacket_block_desc *)(c->map +
+                                       (size_t)i * c->cfg.block_size);
+}
+
+static inline bool capture_block_ready(const struct tpacket_block_desc *bd) {
+  return __atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+         TP_STATUS_USER;
+}
+
+static inline void capture_block_release(struct tpacket_block_desc *bd) {
+  __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                   __ATOMIC_RELEASE);
+}
+
+int capture_open(Capture *c, const char *ifname, const CaptureConfig *cfg) {
+  memset(c, 0, sizeof(Capture));
+  c->fd = -1;
+  c->cfg = *cfg;
+
+  long page = sysconf(_SC_PAGESIZE);
+  if (cfg->block_count == 0 || cfg->block_size < (uint32_t)page ||
+      (cfg->block_size & (cfg->block_size - 1)) != 0) {
+    LOG_ERROR("Invalid capture ring geometry");
+    return -1;
+  }
+
+  unsigned int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    LOG_SYS_ERROR("Unknown interface %s", ifname);
+    return -1;
+  }
+
+  // Protocol 0 receives nothing until bind(), so no unfiltered frame slips
+  // into the ring while it is being set up
+  c->fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd == -1) {
+    LOG_SYS_ERROR("Failed to open a packet socket (needs CAP_NET_RAW)");
+    return -1;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(c->fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) == -1) {
+    LOG_SYS_ERROR("TPACKET_V3 is not supported");
+    goto fail;
+  }
+
+  if (capture_attach(c, drop_filter, 1) != 0) {
+    goto fail;
+  }
+
+  // frame_size only matters to the kernel's sanity checks in V3: frames are
+  // packed back to back in each block
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = cfg->block_size;
+  req.tp_block_nr = cfg->block_count;
+  req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+  req.tp_frame_nr = (cfg->block_size / req.tp_frame_size) * cfg->block_count;
+  req.tp_retire_blk_tov = cfg->block_timeout_ms;
+  if (setsockopt(c->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) ==
+      -1) {
+    LOG_SYS_ERROR("Failed to set up a %u x %u byte capture ring",
+                  cfg->block_count, cfg->block_size);
+    goto fail;
+  }
+
+  c->map_len = (size_t)cfg->block_size * cfg->block_count;
+  c->map = mmap(NULL, c->map_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, c->fd, 0);
+  if (c->map == MAP_FAILED) {
+    c->map = NULL;
+    LOG_SYS_ERROR("Failed to map the capture ring");
+    goto fail;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = (int)ifindex;
+  if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    LOG_SYS_ERROR("Failed to bind the capture socket to %s", ifname);
+    goto fail;
+  }
+
+  LOG_INFO("Capture ring on %s: %u blocks of %u KiB, %u ms block timeout",
+           ifname, cfg->block_count, cfg->block_size / 1024,
+           cfg->block_timeout_ms);
+  return 0;
+
+fail:
+  capture_close(c);
+  return -1;
+}
+
+int capture_set_active(Capture *c, bool active) {
+  if (active == c->active) {
+    return 0;
+  }
+
+  if (!active) {
+    if (capture_attach(c, drop_filter, 1) != 0) {
+      return -1;
+    }
+    c->active = false;
+    return 0;
+  }
+
+  // Whatever was captured before the pause is stale
+  for (uint32_t i = 0; i < c->cfg.block_count; i++) {
+    struct tpacket_block_desc *bd = capture_block(c, c->next_block);
+    if (!capture_block_ready(bd)) {
+      break;
+    }
+    capture_block_release(bd);
+    c->next_block = (c->next_block + 1) % c->cfg.block_count;
+  }
+  capture_update_stats(c);
+
+  if (capture_attach(c, probe_filter,
+                     sizeof(probe_filter) / sizeof(probe_filter[0])) != 0) {
+    return -1;
+  }
+  c->active = true;
+  return 0;
+}
+
+size_t capture_process(Capture *c, PacketFn fn, void *userdata) {
+  size_t frames = 0;
+
+  for (uint32_t n = 0; n < c->cfg.block_count; n++) {
+    struct tpacket_block_desc *bd = capture_block(c, c->next_block);
+    if (!capture_block_ready(bd)) {
+      break;
+    }
+
+    uint32_t count = bd->hdr.bh1.num_pkts;
+    const uint8_t *p = (const uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+    for (uint32_t i = 0; i < count; i++) {
+      const struct tpacket3_hdr *h = (const struct tpacket3_hdr *)p;
+      uint64_t ts_ns = (uint64_t)h->tp_sec * 1000000000ULL + h->tp_nsec;
+      fn(userdata, p + h->tp_mac, h->tp_snaplen, LINKTYPE_ETHERNET, ts_ns);
+      p += h->tp_next_offset;
+    }
+
+    c->stats.blocks++;
+    if (bd->hdr.bh1.block_status & TP_STATUS_BLK_TMO) {
+      c->stats.timed_out++;
+    }
+    frames += count;
+
+    capture_block_release(bd);
+    c->next_block = (c->next_block + 1) % c->cfg.block_count;
+  }
+  return frames;
+}
+
+void capture_update_stats(Capture *c) {
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+  if (getsockopt(c->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1) {
+    LOG_SYS_ERROR("Failed to read capture statistics");
+    return;
+  }
+  c->stats.packets += st.tp_packets;
+  c->stats.dropped += st.tp_drops;
+  c->stats.ring_full += st.tp_freeze_q_cnt;
+}
+
+void capture_close(Capture *c) {
+  if (c->map != NULL) {
+    munmap(c->map, c->map_len);
+    c->map = NULL;
+  }
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+}
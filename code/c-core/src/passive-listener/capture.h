@@ -0,0 +1,106 @@
+#ifndef LISTENER_CAPTURE_H
+#define LISTENER_CAPTURE_H
+
+/* ==========================================================================
+ *  Orange Sentry - TPACKET_V3 capture ring
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Live capture for the passive listener. An AF_PACKET socket shares a
+ *  memory-mapped ring of blocks with the kernel (TPACKET_V3): the kernel
+ *  packs as many frames as fit into the current block and hands the block
+ *  over when it is full or when block_timeout_ms passes. The fd becomes
+ *  readable then, and capture_process() walks every frame of every ready
+ *  block in place and gives the blocks back. There is no syscall per packet,
+ *  and no copy besides the kernel's.
+ *
+ *  A classic BPF filter runs in the kernel before anything is copied to the
+ *  ring: only frames addressed to this host that are TCP SYNs without ACK or
+ *  UDP datagrams (IPv4 and IPv6) get through, cut to PACKET_SNAPLEN bytes.
+ *  While paused the filter is swapped for one that accepts nothing, so an
+ *  idle ring costs nothing either.
+ *
+ *  Sizing: a gigabit port carries at most ~1.49M minimum-size frames per
+ *  second, ~200 ring bytes each here. The default ring (32 x 1 MiB) holds
+ *  about 100 ms of that, so a loop that is late by less than that loses
+ *  nothing; ring_full in CaptureStats counts the times it was not enough.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. capture_open() on an interface (needs CAP_NET_RAW), starts paused.
+ *  2. capture_set_active() when Passive Listen mode starts and ends.
+ *  3. capture_process() whenever capture_fd() is readable.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+
+typedef struct {
+  uint32_t block_size; // bytes, a power of two and a multiple of the page
+  uint32_t block_count;
+  uint32_t block_timeout_ms; // a partly filled block is handed over after
+} CaptureConfig;
+
+#define CAPTURE_CONFIG_DEFAULT {1u << 20, 32, 50}
+
+typedef struct {
+  uint64_t packets;  // seen by the filter and accepted
+  uint64_t dropped;  // accepted but found no room in the ring
+  uint64_t ring_full; // times the ring was full (kernel queue frozen)
+  uint64_t blocks;   // blocks processed
+  uint64_t timed_out; // of which retired by the timeout, not full
+} CaptureStats;
+
+typedef struct {
+  int fd;
+  uint8_t *map;
+  size_t map_len;
+  CaptureConfig cfg;
+  uint32_t next_block;
+  bool active;
+  CaptureStats stats;
+} Capture;
+
+/* *
+ * Opens the ring on interface ifname, paused.
+ * * Returns:
+ * 0 on success, -1 on error (logged).
+ */
+int capture_open(Capture *c, const char *ifname, const CaptureConfig *cfg);
+
+/* *
+ * Starts (true) or pauses (false) capturing. Frames still in the ring when
+ * capturing starts are stale and are discarded.
+ * * Returns:
+ * 0 on success, -1 on error.
+ */
+int capture_set_active(Capture *c, bool active);
+
+/* *
+ * The fd to wait on for EPOLLIN.
+ */
+static inline int capture_fd(const Capture *c) { return c->fd; }
+
+/* *
+ * Calls fn for every frame in the blocks the kernel handed over, then gives
+ * the blocks back. Handles at most one ring's worth of blocks per call.
+ * * Returns:
+ * Number of frames delivered.
+ */
+size_t capture_process(Capture *c, PacketFn fn, void *userdata);
+
+/* *
+ * Adds the kernel's packet and drop counters (which it resets on every
+ * read) to c->stats.
+ */
+void capture_update_stats(Capture *c);
+
+/* *
+ * Unmaps the ring and closes the socket.
+ */
+void capture_close(Capture *c);
+
+#endif // LISTENER_CAPTURE_H
@@ -0,0 +1,310 @@
+#define MODULE_NAME "FLOWS"
+
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flows.h"
+
+#include "../../include/openaddr.h"
+
+#define FLOW_CACHE_LINE 64
+
+// ---- hash table ----
+
+static inline uint64_t flow_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 33);
+}
+
+// Five word loads instead of 38 byte steps
+static inline uint64_t flow_hash(const FlowTable *t, const FlowKey *k) {
+  uint64_t w[5] = {0};
+  memcpy(w, k, sizeof(FlowKey));
+
+  uint64_t h = t->seed;
+  for (size_t i = 0; i < 5; i++) {
+    h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  return flow_mix(h);
+}
+
+static inline bool flow_used(const FlowEntry *f) {
+  return f->key.ip_version != 0;
+}
+
+static bool flow_slot_used(const void *e) {
+  return flow_used((const FlowEntry *)e);
+}
+
+static bool flow_slot_match(const void *e, const void *key) {
+  return memcmp(&((const FlowEntry *)e)->key, key, sizeof(FlowKey)) == 0;
+}
+
+static uint64_t flow_slot_hash(const void *t, const void *e) {
+  return flow_hash((const FlowTable *)t, &((const FlowEntry *)e)->key);
+}
+
+static const OpenAddrOps flow_ops = {
+    .entry_size = sizeof(FlowEntry),
+    .used = flow_slot_used,
+    .match = flow_slot_match,
+    .hash = flow_slot_hash,
+};
+
+static inline size_t flow_home(const FlowTable *t, const FlowKey *key) {
+  return flow_hash(t, key) & (t->capacity - 1);
+}
+
+// Returns the slot holding the key, or the empty slot ending its probe chain
+static inline size_t flow_probe(const FlowTable *t, const FlowKey *key,
+                                size_t home) {
+  return openaddr_probe(&flow_ops, t->slots, t->capacity, home, key);
+}
+
+static void flow_remove(FlowTable *t, size_t i) {
+  openaddr_remove(&flow_ops, t, t->slots, t->capacity, i);
+  t->count--;
+}
+
+static void flow_key_from(FlowKey *key, const PayloadProbe *p) {
+  memset(key, 0, sizeof(FlowKey));
+  memcpy(key->src_ip, p->src_ip, 16);
+  memcpy(key->dst_ip, p->dst_ip, 16);
+  key->src_port = p->src_port;
+  key->dst_port = p->dst_port;
+  key->proto = p->proto;
+  key->ip_version = p->ip_version;
+}
+
+static void flow_export(FlowTable *t, const FlowEntry *f, uint8_t reason) {
+  PayloadProbe p;
+  memset(&p, 0, sizeof(PayloadProbe));
+  memcpy(p.src_ip, f->key.src_ip, 16);
+  memcpy(p.dst_ip, f->key.dst_ip, 16);
+  p.src_port = f->key.src_port;
+  p.dst_port = f->key.dst_port;
+  p.proto = f->key.proto;
+  p.ip_version = f->key.ip_version;
+  p.ttl = f->ttl;
+  p.tcp_flags = f->tcp_flags;
+  p.tcp_window = f->tcp_window;
+  p.ip_len = f->ip_len;
+  p.packets = f->packets;
+  p.bytes = f->bytes;
+  p.duration_ms = f->duration_ms;
+  p.event_ms = f->last_ms - f->duration_ms;
+  p.end = reason;
+
+  t->ended[reason]++;
+  if (t->export_fn != NULL) {
+    t->export_fn(t->userdata, &p);
+  }
+}
+
+// Evicts the oldest of the next FLOW_EVICT_SCAN live flows after the
+// eviction hand, which then starts from the victim's slot next time: a
+// second hand, so that a burst of evictions keeps moving on instead of
+// scanning the run of slots it has just emptied
+static void flow_evict(FlowTable *t) {
+  size_t mask = t->capacity - 1;
+  size_t victim = t->capacity;
+  size_t live = 0;
+
+  for (size_t n = 0, i = t->evict_hand;
+       n < t->capacity && live < FLOW_EVICT_SCAN; n++, i = (i + 1) & mask) {
+    const FlowEntry *f = &t->slots[i];
+    if (!flow_used(f)) {
+      continue;
+    }
+    live++;
+    if (victim == t->capacity || f->last_ms < t->slots[victim].last_ms) {
+      victim = i;
+    }
+  }
+
+  flow_export(t, &t->slots[victim], PROBE_END_EVICTED);
+  flow_remove(t, victim);
+  t->evict_hand = victim;
+}
+
+// ---- public API ----
+
+size_t flow_table_mem(size_t max_flows) {
+  return openaddr_capacity(max_flows) * sizeof(FlowEntry) + FLOW_CACHE_LINE;
+}
+
+int flow_init(FlowTable *t, Arena *a, const FlowConfig *cfg,
+              FlowExportFn export_fn, void *userdata) {
+  if (t == NULL || a == NULL || cfg == NULL || cfg->max_flows < 2 ||
+      cfg->max_flows > SIZE_MAX / 4 / sizeof(FlowEntry) || cfg->idle_ms < 2 ||
+      cfg->active_ms == 0) {
+    LOG_ERROR("Invalid arguments to flow_init");
+    return -1;
+  }
+
+  memset(t, 0, sizeof(FlowTable));
+  t->cfg = *cfg;
+  t->export_fn = export_fn;
+  t->userdata = userdata;
+  t->capacity = openaddr_capacity(cfg->max_flows);
+  t->sweep_ms = cfg->idle_ms / 2;
+
+  t->slots = (FlowEntry *)arena_alloc_align(
+      a, t->capacity * sizeof(FlowEntry), FLOW_CACHE_LINE);
+  if (t->slots == NULL) {
+    LOG_ERROR("Not enough memory for %zu flows", cfg->max_flows);
+    return -1;
+  }
+
+  if (getrandom(&t->seed, sizeof(t->seed), GRND_NONBLOCK) !=
+      sizeof(t->seed)) {
+    t->seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  }
+  return 0;
+}
+
+static void flow_update_key(FlowTable *t, const PayloadProbe *p,
+                            const FlowKey *key, size_t home) {
+  size_t i = flow_probe(t, key, home);
+  FlowEntry *f = &t->slots[i];
+  t->packets++;
+
+  if (flow_used(f)) {
+    uint64_t first = f->last_ms - f->duration_ms;
+    uint64_t last = p->event_ms > f->last_ms ? p->event_ms : f->last_ms;
+    if (f->packets < UINT32_MAX && p->bytes <= UINT32_MAX - f->bytes &&
+        last - first <= UINT32_MAX) {
+      f->packets++;
+      f->bytes += p->bytes;
+      f->tcp_flags |= p->tcp_flags;
+      f->last_ms = last;
+      f->duration_ms = (uint32_t)(last - first);
+      return;
+    }
+    // A counter is full: report what it holds and start over
+    flow_export(t, f, PROBE_END_ACTIVE);
+    flow_remove(t, i);
+    i = flow_probe(t, key, home);
+  }
+
+  if (t->count == t->cfg.max_flows) {
+    flow_evict(t);
+    // The shift may have moved the end of our probe chain
+    i = flow_probe(t, key, home);
+  }
+
+  f = &t->slots[i];
+  f->key = *key;
+  f->ttl = p->ttl;
+  f->tcp_flags = p->tcp_flags;
+  f->tcp_window = p->tcp_window;
+  f->ip_len = p->ip_len;
+  f->packets = 1;
+  f->bytes = p->bytes;
+  f->duration_ms = 0;
+  f->last_ms = p->event_ms;
+  t->count++;
+  t->created++;
+}
+
+void flow_update(FlowTable *t, const PayloadProbe *p) {
+  FlowKey key;
+  flow_key_from(&key, p);
+  flow_update_key(t, p, &key, flow_home(t, &key));
+}
+
+void flow_update_batch(FlowTable *t, const PayloadProbe *p, size_t n) {
+  FlowKey keys[FLOW_BATCH];
+  size_t homes[FLOW_BATCH];
+
+  for (size_t done = 0; done < n;) {
+    size_t m = n - done < FLOW_BATCH ? n - done : FLOW_BATCH;
+    // Start every cache miss of the batch before waiting on the first one
+    for (size_t i = 0; i < m; i++) {
+      flow_key_from(&keys[i], &p[done + i]);
+      homes[i] = flow_home(t, &keys[i]);
+      __builtin_prefetch(&t->slots[homes[i]], 1);
+    }
+    for (size_t i = 0; i < m; i++) {
+      flow_update_key(t, &p[done + i], &keys[i], homes[i]);
+    }
+    done += m;
+  }
+}
+
+const FlowEntry *flow_lookup(const FlowTable *t, const FlowKey *key) {
+  const FlowEntry *f = &t->slots[flow_probe(t, key, flow_home(t, key))];
+  return flow_used(f) ? f : NULL;
+}
+
+size_t flow_age(FlowTable *t, uint64_t now_ms) {
+  if (t->aged_ms == 0 || now_ms < t->aged_ms) {
+    t->aged_ms = now_ms;
+    return 0;
+  }
+
+  // As many slots as the elapsed time is worth; the remainder carries over
+  uint64_t elapsed = now_ms - t->aged_ms;
+  uint64_t slots;
+  if (elapsed >= t->sweep_ms) {
+    slots = t->capacity;
+    t->aged_ms = now_ms;
+  } else {
+    slots = elapsed * t->capacity / t->sweep_ms;
+    t->aged_ms += slots * t->sweep_ms / t->capacity;
+  }
+
+  size_t mask = t->capacity - 1;
+  size_t exported = 0;
+  // Only moving on counts: removals are bounded by the flows in the table
+  for (uint64_t n = 0; n < slots;) {
+    FlowEntry *f = &t->slots[t->hand];
+    if (flow_used(f)) {
+      uint64_t first = f->last_ms - f->duration_ms;
+      uint8_t reason = 0;
+      if (now_ms > f->last_ms && now_ms - f->last_ms >= t->cfg.idle_ms) {
+        reason = PROBE_END_IDLE;
+      } else if (now_ms > first && now_ms - first >= t->cfg.active_ms) {
+        reason = PROBE_END_ACTIVE;
+      }
+      if (reason != 0) {
+        flow_export(t, f, reason);
+        flow_remove(t, t->hand);
+        exported++;
+        continue; // another flow may have shifted into this slot
+      }
+    }
+    t->hand = (t->hand + 1) & mask;
+    n++;
+  }
+  return exported;
+}
+
+size_t flow_flush(FlowTable *t, uint8_t reason) {
+  size_t exported = 0;
+  for (size_t i = 0; i < t->capacity && exported < t->count; i++) {
+    if (flow_used(&t->slots[i])) {
+      flow_export(t, &t->slots[i], reason);
+      exported++;
+    }
+  }
+  memset(t->slots, 0, t->capacity * sizeof(FlowEntry));
+  t->count = 0;
+  return exported;
+}
+
+void flow_log_stats(const FlowTable *t) {
+  LOG_INFO("packets=%llu flows=%llu live=%zu/%zu", (unsigned long long)t->packets,
+           (unsigned long long)t->created, t->count, t->cfg.max_flows);
+  LOG_INFO("ended idle=%llu active=%llu evicted=%llu stopped=%llu",
+           (unsigned long long)t->ended[PROBE_END_IDLE],
+           (unsigned long long)t->ended[PROBE_END_ACTIVE],
+           (unsigned long long)t->ended[PROBE_END_EVICTED],
+           (unsigned long long)t->ended[PROBE_END_STOPPED]);
+}
@@ -0,0 +1,162 @@
+#ifndef LISTENER_FLOWS_H
+#define LISTENER_FLOWS_H
+
+/* ==========================================================================
+ *  Orange Sentry - Flow table
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Folds connection attempts per 5-tuple (addresses, ports, protocol), so a
+ *  host retrying the same port a thousand times is one record with
+ *  packets = 1000 instead of a thousand records. A flow is reported as a
+ *  PayloadProbe when it ends: idle for idle_ms, open for longer than
+ *  active_ms, its counters full, or evicted to make room.
+ *
+ *  Memory is fixed: one open-addressing table (linear probing, backward
+ *  shift deletion) allocated from an Arena at init, at most half full.
+ *  Every entry is one 64-byte cache line holding the packed key and the
+ *  counters, so a lookup that hits its home slot touches one line, and a
+ *  probe chain walks adjacent lines the prefetcher already fetched. The
+ *  hash is seeded at random: the keys are chosen by whoever is scanning.
+ *  Past the size of the caches every update is a miss to DRAM, so
+ *  flow_update_batch() hashes FLOW_BATCH probes and prefetches all their
+ *  slots before touching the first: the misses overlap instead of queuing.
+ *
+ *  Aging is incremental. A clock hand sweeps the table a few slots per
+ *  flow_age() call, as many as the time since the last call is worth, so
+ *  that the whole table is covered every idle_ms / 2. There is never a
+ *  stop-the-world pass over a million entries: a flow is reported at most
+ *  1.5 x idle_ms after its last packet. When the table is full, the
+ *  oldest of the next FLOW_EVICT_SCAN live flows after a second hand is
+ *  evicted, and that hand moves on to where the victim was.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. flow_init() with the limits and an export callback.
+ *  2. flow_update() for every decoded probe, or flow_update_batch().
+ *  3. flow_age() on a timer (and as packet time moves on), same clock as
+ *     the probes' event_ms.
+ *  4. flow_flush() when capture stops.
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/arena.h"
+#include "../../include/sockclient.h"
+
+#define FLOW_EVICT_SCAN 16
+#define FLOW_BATCH 16 // probes whose slots flow_update_batch() prefetches
+
+// Packed so that it can be compared with one memcmp()
+typedef struct {
+  uint8_t src_ip[16];
+  uint8_t dst_ip[16];
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t proto;
+  uint8_t ip_version; // 0: free slot
+} FlowKey;
+
+typedef struct {
+  FlowKey key;
+  uint8_t ttl;       // of the first packet
+  uint8_t tcp_flags; // ORed
+  uint16_t tcp_window;
+  uint16_t ip_len; // of the first packet
+  uint32_t packets;
+  uint32_t bytes;
+  uint32_t duration_ms; // first packet to last
+  uint64_t last_ms;     // capture time of the last packet
+} FlowEntry;
+
+_Static_assert(sizeof(FlowEntry) == 64, "FlowEntry must fill a cache line");
+
+typedef struct {
+  size_t max_flows; // at least 2
+  uint32_t idle_ms;
+  uint32_t active_ms;
+} FlowConfig;
+
+/* *
+ * Called with every flow that ends, as a ready-to-send record.
+ */
+typedef void (*FlowExportFn)(void *userdata, const PayloadProbe *p);
+
+typedef struct {
+  FlowEntry *slots;
+  size_t capacity; // power of two, at least twice max_flows
+  size_t count;
+  FlowConfig cfg;
+  uint64_t seed;
+
+  size_t hand;       // next slot flow_age() looks at
+  uint64_t aged_ms;  // time flow_age() last moved the hand
+  uint64_t sweep_ms; // time for the hand to go round once
+  size_t evict_hand; // where the search for an eviction victim starts
+
+  FlowExportFn export_fn;
+  void *userdata;
+
+  // counters
+  uint64_t packets;
+  uint64_t created;
+  uint64_t ended[PROBE_END_STOPPED + 1]; // by PROBE_END_*
+} FlowTable;
+
+/* *
+ * Bytes flow_init() takes from its arena for max_flows, alignment included.
+ */
+size_t flow_table_mem(size_t max_flows);
+
+/* *
+ * Allocates the table from a.
+ * * Returns:
+ * 0 on success, -1 on invalid limits or if the arena is too small.
+ */
+int flow_init(FlowTable *t, Arena *a, const FlowConfig *cfg,
+              FlowExportFn export_fn, void *userdata);
+
+/* *
+ * Accounts for one decoded packet (packets = 1), creating its flow if
+ * needed. May export a flow: this one if its counters would overflow, or
+ * the evicted one if the table is full.
+ */
+void flow_update(FlowTable *t, const PayloadProbe *p);
+
+/* *
+ * flow_update() for n probes, the memory accesses of FLOW_BATCH at a time
+ * overlapped.
+ */
+void flow_update_batch(FlowTable *t, const PayloadProbe *p, size_t n);
+
+/* *
+ * Looks a flow up without touching it.
+ * * Returns:
+ * The entry, valid until the next update, age or flush; NULL if absent.
+ */
+const FlowEntry *flow_lookup(const FlowTable *t, const FlowKey *key);
+
+/* *
+ * Moves the aging hand on by as many slots as the time since the last call
+ * is worth, exporting the flows past their idle or active timeout.
+ * * Returns:
+ * Number of flows exported.
+ */
+size_t flow_age(FlowTable *t, uint64_t now_ms);
+
+/* *
+ * Exports every flow with the given PROBE_END_* reason and empties the
+ * table.
+ * * Returns:
+ * Number of flows exported.
+ */
+size_t flow_flush(FlowTable *t, uint8_t reason);
+
+/* *
+ * Logs the counters.
+ */
+void flow_log_stats(const FlowTable *t);
+
+#endif // LISTENER_FLOWS_H
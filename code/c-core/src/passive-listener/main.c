@@ -0,0 +1,382 @@
+// Global defines
+#define MODULE_NAME "LISTENER"
+
+// standard includes
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+// shared includes
+#include "../../include/arena.h"
+#include "../../include/exit-codes.h"
+#include "../../include/logging.h"
+
+// local includes
+#include "capture.h"
+#include "flows.h"
+#include "packet.h"
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "../../include/sockclient.h"
+
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
+// TODO make the program configurable via config file
+#define DEFAULT_IFACE "eth0"
+#define STATS_INTERVAL_MS 10000
+#define SOCK_PATH IPC_CONTROLLER_SOCK_PATH
+
+#define FLOW_AGE_INTERVAL_MS 100
+#define MAX_FLOWS 32768 // a power of two, so the table is exactly 2x
+static const FlowConfig flow_config = {
+    .max_flows = MAX_FLOWS,
+    .idle_ms = 15 * 1000,
+    .active_ms = 2 * 60 * 1000,
+};
+
+#define ARENA_SIZE (MAX_FLOWS * 2 * sizeof(FlowEntry) + 4096)
+static uint8_t listener_memory[ARENA_SIZE];
+
+// State shared by the reactor callbacks
+typedef struct {
+  Capture capture;
+  FlowTable flows;
+  bool replaying; // age flows on packet time rather than on the timer
+  uint16_t sample_rate; // track 1 source in this many (MSG_CMD_SHED)
+
+  // decoded probes, folded into the flow table FLOW_BATCH at a time
+  PayloadProbe pending[FLOW_BATCH];
+  size_t pending_count;
+  int sock_fd; // -1 when replaying: flows are logged instead
+  int ipc_fd;
+
+  // ended flows waiting to go out, flushed in one sendmmsg() per batch
+  IPCMessage batch[IPC_BATCH_MAX];
+  size_t batch_count;
+
+  uint64_t frames;
+  uint64_t probes;
+  uint64_t sampled_out; // probes of sources left out while shedding
+  uint64_t sent;
+  uint64_t send_failed;
+  uint64_t logged; // flows logged with no controller to send them to
+  uint64_t ring_full_logged;
+
+  IPCMessage rcv_msgs[IPC_BATCH_MAX];
+} Listener;
+
+static uint64_t wall_ms(void);
+static void fold_pending(Listener *l);
+static void flush_probes(Listener *l);
+static void on_flow(void *userdata, const PayloadProbe *p);
+static void on_frame(void *userdata, const uint8_t *frame, size_t caplen,
+                     int linktype, uint64_t ts_ns);
+static int replay(Listener *l, const char *path);
+static void on_capture(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_stats(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_age(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata);
+
+/* Passive Listen mode: records who is knocking, without answering. Inbound
+ * TCP SYNs and UDP datagrams are picked off the wire by a TPACKET_V3 ring,
+ * folded per 5-tuple in a flow table, and each flow is forwarded to the
+ * controller as MSG_EVT_PROBE when it ends; dropping the attempts themselves
+ * is left to the firewall. Capture runs between MSG_CMD_START and
+ * MSG_CMD_STOP from the controller. While the controller sheds load
+ * (MSG_CMD_SHED) only a sample of the source addresses is tracked.
+ *
+ * Usage: passive-listener [interface]
+ *        passive-listener -r capture.pcap   (replay a file, then exit)
+ *
+ * A replay runs on its own, without the controller: every flow is logged,
+ * so a capture can be checked offline.
+ * */
+int main(int argc, char **argv) {
+  static Listener l;
+  l.sample_rate = 1;
+  l.replaying = argc > 2 && strcmp(argv[1], "-r") == 0;
+  const char *ifname = argc > 1 && !l.replaying ? argv[1] : DEFAULT_IFACE;
+
+  Arena arena;
+  arena_init(&arena, listener_memory, ARENA_SIZE);
+  if (flow_init(&l.flows, &arena, &flow_config, on_flow, &l) != 0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (l.replaying) {
+    l.sock_fd = -1;
+    return replay(&l, argv[2]) == 0 ? OS_EXIT_SUCCESS : OS_EXIT_GEN_FAILURE;
+  }
+
+  Reactor reactor;
+  if (reactor_init(&reactor) != 0) {
+    LOG_ERROR("Failed to initialize reactor");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  const int signals[] = {SIGINT, SIGTERM};
+  if (reactor_add_signals(&reactor, signals, 2, on_signal, NULL) < 0) {
+    LOG_ERROR("Failed to register signal handlers");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  l.sock_fd = ipc_client_connect(SOCK_PATH);
+  if (l.sock_fd < 1) {
+    LOG_ERROR("Could not connect to the controller. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  if (ipc_client_hello(l.sock_fd, MOD_LISTENER) < 0) {
+    LOG_ERROR("Failed to identify to the controller");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  l.ipc_fd = ipc_client_poll_fd(l.sock_fd);
+
+  const CaptureConfig cfg = CAPTURE_CONFIG_DEFAULT;
+  if (capture_open(&l.capture, ifname, &cfg) != 0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (reactor_add_fd(&reactor, capture_fd(&l.capture), EPOLLIN, on_capture,
+                     &l) != 0 ||
+      reactor_add_timer(&reactor, STATS_INTERVAL_MS, on_stats, &l) < 0 ||
+      reactor_add_timer(&reactor, FLOW_AGE_INTERVAL_MS, on_age, &l) < 0) {
+    LOG_ERROR("Failed to watch the capture ring");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (reactor_add_fd(&reactor, l.ipc_fd, EPOLLIN, on_ipc_ready, &l) != 0 ||
+      (l.ipc_fd != l.sock_fd &&
+       reactor_add_fd(&reactor, l.sock_fd, 0, on_ipc_ready, &l) != 0)) {
+    LOG_ERROR("Failed to watch IPC socket");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  LOG_INFO("Listening on %s, waiting for the controller to start capture",
+           ifname);
+  reactor_run(&reactor);
+
+  capture_update_stats(&l.capture);
+  flow_flush(&l.flows, PROBE_END_STOPPED);
+  flush_probes(&l);
+  flow_log_stats(&l.flows);
+  const CaptureStats *st = &l.capture.stats;
+  LOG_INFO("%llu frames -> %llu probes (%llu left out by sampling); %llu "
+           "flows sent, %llu failed",
+           (unsigned long long)l.frames, (unsigned long long)l.probes,
+           (unsigned long long)l.sampled_out, (unsigned long long)l.sent,
+           (unsigned long long)l.send_failed);
+  LOG_INFO("ring: %llu packets, %llu dropped, %llu times full; %llu blocks "
+           "(%llu by timeout)",
+           (unsigned long long)st->packets, (unsigned long long)st->dropped,
+           (unsigned long long)st->ring_full, (unsigned long long)st->blocks,
+           (unsigned long long)st->timed_out);
+
+  capture_close(&l.capture);
+  ipc_client_disconnect(&l.sock_fd);
+  reactor_close(&reactor);
+  LOG_INFO("Passive listener stopped");
+  return OS_EXIT_SUCCESS;
+}
+
+static uint64_t wall_ms(void) {
+  // The clock the ring timestamps frames with
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void fold_pending(Listener *l) {
+  if (l->pending_count == 0) {
+    return;
+  }
+  flow_update_batch(&l->flows, l->pending, l->pending_count);
+  if (l->replaying) {
+    flow_age(&l->flows, l->pending[l->pending_count - 1].event_ms);
+  }
+  l->pending_count = 0;
+}
+
+static void log_probe(const PayloadProbe *p) {
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  int family = p->ip_version == 6 ? AF_INET6 : AF_INET;
+  if (inet_ntop(family, p->src_ip, src, sizeof(src)) == NULL ||
+      inet_ntop(family, p->dst_ip, dst, sizeof(dst)) == NULL) {
+    return;
+  }
+  LOG_INFO("%s %s:%u -> %s:%u: %u packets, %u bytes, %u ms, end %u",
+           p->proto == IPPROTO_TCP ? "tcp" : "udp", src, p->src_port, dst,
+           p->dst_port, p->packets, p->bytes, p->duration_ms, p->end);
+}
+
+static void flush_probes(Listener *l) {
+  if (l->batch_count == 0) {
+    return;
+  }
+
+  if (l->sock_fd < 0) {
+    for (size_t i = 0; i < l->batch_count; i++) {
+      log_probe(&l->batch[i].payload.probe);
+    }
+    l->logged += l->batch_count;
+    l->batch_count = 0;
+    return;
+  }
+
+  int sent = ipc_client_send_batch(l->sock_fd, l->batch, l->batch_count);
+  if (sent < 0) {
+    sent = 0;
+  }
+  l->sent += (uint64_t)sent;
+  if ((size_t)sent < l->batch_count) {
+    l->send_failed += l->batch_count - (size_t)sent;
+    LOG_ERROR("Failed to forward %zu flows", l->batch_count - (size_t)sent);
+  }
+  l->batch_count = 0;
+}
+
+static void on_flow(void *userdata, const PayloadProbe *p) {
+  Listener *l = (Listener *)userdata;
+
+  IPCMessage *msg = &l->batch[l->batch_count];
+  memset(msg, 0, offsetof(IPCMessage, payload));
+  msg->origin = MOD_LISTENER;
+  msg->msgtype = MSG_EVT_PROBE;
+  msg->payload_len = sizeof(PayloadProbe);
+  msg->payload.probe = *p;
+  l->batch_count++;
+
+  if (l->batch_count == IPC_BATCH_MAX) {
+    flush_probes(l);
+  }
+}
+
+// Whether the source is one of those tracked while shedding. Whole sources
+// are kept or left out, so the flows that are reported are complete, and
+// the choice is seeded like the flow table so that a scanner can't pick
+// addresses that always get through.
+static bool source_sampled(const Listener *l, const PayloadProbe *p) {
+  uint64_t w[2];
+  memcpy(w, p->src_ip, sizeof(w));
+  uint64_t h = (l->flows.seed ^ w[0]) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 29) ^ w[1]) * 0xbf58476d1ce4e5b9ULL;
+  return (h ^ (h >> 32)) % l->sample_rate == 0;
+}
+
+static void on_frame(void *userdata, const uint8_t *frame, size_t caplen,
+                     int linktype, uint64_t ts_ns) {
+  Listener *l = (Listener *)userdata;
+  l->frames++;
+
+  PayloadProbe *p = &l->pending[l->pending_count];
+  if (!packet_parse_probe(frame, caplen, linktype, p)) {
+    return;
+  }
+  p->event_ms = ts_ns / 1000000;
+  l->probes++;
+  if (l->sample_rate > 1 && !source_sampled(l, p)) {
+    l->sampled_out++;
+    return;
+  }
+
+  if (++l->pending_count == FLOW_BATCH) {
+    fold_pending(l);
+  }
+}
+
+static int replay(Listener *l, const char *path) {
+  long frames = pcap_replay(path, on_frame, l);
+  fold_pending(l);
+  flow_flush(&l->flows, PROBE_END_STOPPED);
+  flush_probes(l);
+  if (frames < 0) {
+    return -1;
+  }
+  LOG_INFO("Replayed %ld frames from %s: %llu probes in %llu flows, %llu "
+           "logged",
+           frames, path, (unsigned long long)l->probes,
+           (unsigned long long)l->flows.created,
+           (unsigned long long)l->logged);
+  return 0;
+}
+
+static void on_capture(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Listener *l = (Listener *)userdata;
+  capture_process(&l->capture, on_frame, l);
+  fold_pending(l);
+  flush_probes(l);
+}
+
+static void on_stats(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Listener *l = (Listener *)userdata;
+  reactor_timer_ack(fd);
+
+  capture_update_stats(&l->capture);
+  const CaptureStats *st = &l->capture.stats;
+  if (st->ring_full > l->ring_full_logged) {
+    LOG_WARN("Capture ring overran %llu times (%llu packets dropped so far)",
+             (unsigned long long)(st->ring_full - l->ring_full_logged),
+             (unsigned long long)st->dropped);
+    l->ring_full_logged = st->ring_full;
+  }
+}
+
+static void on_age(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Listener *l = (Listener *)userdata;
+  reactor_timer_ack(fd);
+
+  flow_age(&l->flows, wall_ms());
+  flush_probes(l);
+}
+
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Listener *l = (Listener *)userdata;
+
+  int n;
+  while ((n = ipc_client_receive_batch(l->sock_fd, l->rcv_msgs,
+                                       IPC_BATCH_MAX)) > 0) {
+    for (int i = 0; i < n; i++) {
+      switch (l->rcv_msgs[i].msgtype) {
+      case MSG_CMD_START:
+        if (capture_set_active(&l->capture, true) == 0) {
+          LOG_INFO("Capture started");
+        }
+        break;
+      case MSG_CMD_STOP:
+        if (capture_set_active(&l->capture, false) == 0) {
+          // Drain what the ring still holds, then report every open flow
+          capture_process(&l->capture, on_frame, l);
+          fold_pending(l);
+          size_t open = flow_flush(&l->flows, PROBE_END_STOPPED);
+          flush_probes(l);
+          LOG_INFO("Capture paused, %zu open flows reported", open);
+        }
+        break;
+      case MSG_CMD_SHED: {
+        uint16_t rate = l->rcv_msgs[i].payload.shed.sample_rate;
+        l->sample_rate = rate > 0 ? rate : 1;
+        LOG_INFO("Tracking 1 source in %u (shedding level %u)", l->sample_rate,
+                 l->rcv_msgs[i].payload.shed.level);
+        break;
+      }
+      default:
+        break;
+      }
+    }
+  }
+  if (n < 0 || (events & (EPOLLHUP | EPOLLERR))) {
+    LOG_ERROR("IPC connection lost. Exiting loop");
+    reactor_stop(r);
+  }
+}
+
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata) {
+  int signo = reactor_signal_read(fd);
+  LOG_INFO("Received signal %d. Shutting down", signo);
+  reactor_stop(r);
+}
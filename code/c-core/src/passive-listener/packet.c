@@ -0,0 +1,226 @@
+#define MODULE_NAME "PACKET"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "packet.h"
+
+#include "../../include/logging.h"
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_ACK 0x10
+
+#define PCAP_MAGIC_US 0xa1b2c3d4u
+#define PCAP_MAGIC_NS 0xa1b23c4du
+
+static inline uint16_t rd16(const uint8_t *p) {
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// ---- decoding ----
+
+// Finds the IP header; returns its offset or -1
+static long packet_ip_offset(const uint8_t *frame, size_t caplen,
+                             int linktype) {
+  size_t off;
+  uint16_t type;
+
+  switch (linktype) {
+  case LINKTYPE_RAW:
+    return 0;
+  case LINKTYPE_LINUX_SLL:
+    if (caplen < 16) {
+      return -1;
+    }
+    type = rd16(frame + 14);
+    off = 16;
+    break;
+  case LINKTYPE_ETHERNET:
+    if (caplen < 14) {
+      return -1;
+    }
+    type = rd16(frame + 12);
+    off = 14;
+    // Up to two VLAN tags (the NIC usually strips them already)
+    for (int tags = 0;
+         tags < 2 && (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ);
+         tags++) {
+      if (caplen < off + 4) {
+        return -1;
+      }
+      type = rd16(frame + off + 2);
+      off += 4;
+    }
+    break;
+  default:
+    return -1;
+  }
+
+  return type == ETHERTYPE_IPV4 || type == ETHERTYPE_IPV6 ? (long)off : -1;
+}
+
+// Fills the transport fields; false if it isn't a connection attempt
+static bool packet_parse_l4(const uint8_t *l4, size_t len, PayloadProbe *out) {
+  out->packets = 1;
+  out->bytes = out->ip_len;
+
+  if (out->proto == IPPROTO_UDP) {
+    if (len < 8) {
+      return false;
+    }
+    out->src_port = rd16(l4);
+    out->dst_port = rd16(l4 + 2);
+    return true;
+  }
+
+  if (out->proto != IPPROTO_TCP || len < 20) {
+    return false;
+  }
+  uint8_t flags = l4[13];
+  if (!(flags & TCP_FLAG_SYN) || (flags & TCP_FLAG_ACK)) {
+    return false;
+  }
+  out->src_port = rd16(l4);
+  out->dst_port = rd16(l4 + 2);
+  out->tcp_flags = flags;
+  out->tcp_window = rd16(l4 + 14);
+  return true;
+}
+
+bool packet_parse_probe(const uint8_t *frame, size_t caplen, int linktype,
+                        PayloadProbe *out) {
+  long off = packet_ip_offset(frame, caplen, linktype);
+  if (off < 0 || (size_t)off >= caplen) {
+    return false;
+  }
+  const uint8_t *ip = frame + off;
+  size_t len = caplen - (size_t)off;
+
+  memset(out, 0, sizeof(PayloadProbe));
+
+  if (ip[0] >> 4 == 4) {
+    size_t ihl = (size_t)(ip[0] & 0x0f) * 4;
+    // Later fragments carry no transport header
+    if (len < 20 || ihl < 20 || len < ihl || (rd16(ip + 6) & 0x1fff) != 0) {
+      return false;
+    }
+    out->ip_version = 4;
+    out->ip_len = rd16(ip + 2);
+    out->ttl = ip[8];
+    out->proto = ip[9];
+    memcpy(out->src_ip, ip + 12, 4);
+    memcpy(out->dst_ip, ip + 16, 4);
+    return packet_parse_l4(ip + ihl, len - ihl, out);
+  }
+
+  if (ip[0] >> 4 == 6) {
+    // Extension headers are not followed: scanners don't send them
+    if (len < 40) {
+      return false;
+    }
+    out->ip_version = 6;
+    out->ip_len = (uint16_t)(rd16(ip + 4) + 40);
+    out->proto = ip[6];
+    out->ttl = ip[7];
+    memcpy(out->src_ip, ip + 8, 16);
+    memcpy(out->dst_ip, ip + 24, 16);
+    return packet_parse_l4(ip + 40, len - 40, out);
+  }
+
+  return false;
+}
+
+// ---- pcap replay ----
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} PcapFileHeader;
+
+typedef struct {
+  uint32_t ts_sec;
+  uint32_t ts_frac; // us or ns, depending on the magic
+  uint32_t caplen;
+  uint32_t len;
+} PcapRecordHeader;
+
+long pcap_replay(const char *path, PacketFn fn, void *userdata) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    LOG_SYS_ERROR("Failed to open %s", path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(PcapFileHeader)) {
+    LOG_ERROR("%s is not a pcap file", path);
+    close(fd);
+    return -1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    LOG_SYS_ERROR("Failed to map %s", path);
+    return -1;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  PcapFileHeader fh;
+  memcpy(&fh, map, sizeof(fh));
+  bool swap = fh.magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+              fh.magic == __builtin_bswap32(PCAP_MAGIC_NS);
+  uint32_t magic = swap ? __builtin_bswap32(fh.magic) : fh.magic;
+  uint32_t linktype = swap ? __builtin_bswap32(fh.linktype) : fh.linktype;
+  if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+    LOG_ERROR("%s is not a pcap file (pcapng isn't supported)", path);
+    munmap(map, size);
+    return -1;
+  }
+  if (linktype != LINKTYPE_ETHERNET && linktype != LINKTYPE_RAW &&
+      linktype != LINKTYPE_LINUX_SLL) {
+    LOG_ERROR("%s: unsupported link type %u", path, linktype);
+    munmap(map, size);
+    return -1;
+  }
+  uint64_t frac_ns = magic == PCAP_MAGIC_NS ? 1 : 1000;
+
+  long frames = 0;
+  size_t off = sizeof(PcapFileHeader);
+  while (size - off >= sizeof(PcapRecordHeader)) {
+    PcapRecordHeader rh;
+    memcpy(&rh, map + off, sizeof(rh));
+    if (swap) {
+      rh.ts_sec = __builtin_bswap32(rh.ts_sec);
+      rh.ts_frac = __builtin_bswap32(rh.ts_frac);
+      rh.caplen = __builtin_bswap32(rh.caplen);
+    }
+    off += sizeof(rh);
+    if (rh.caplen > size - off) {
+      LOG_WARN("%s: truncated record after %ld frames", path, frames);
+      break;
+    }
+
+    uint64_t ts_ns = (uint64_t)rh.ts_sec * 1000000000ULL + rh.ts_frac * frac_ns;
+    fn(userdata, map + off, rh.caplen, (int)linktype, ts_ns);
+    off += rh.caplen;
+    frames++;
+  }
+
+  munmap(map, size);
+  return frames;
+}
@@ -0,0 +1,66 @@
+#ifndef LISTENER_PACKET_H
+#define LISTENER_PACKET_H
+
+/* ==========================================================================
+ *  Orange Sentry - Probe decoding and pcap replay
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Turns captured frames into PayloadProbe records: the headers of an
+ *  inbound TCP SYN (without ACK) or UDP datagram, over IPv4 or IPv6.
+ *  Anything else is not a connection attempt and is skipped. Only the
+ *  headers are read, so a capture snap length of PACKET_SNAPLEN is enough.
+ *
+ *  The same decoder serves the live ring (capture.h) and pcap_replay(),
+ *  which feeds a classic libpcap file through it without needing libpcap
+ *  or a network: the whole pipeline can be tested offline. pcapng files
+ *  are not supported (convert them with `editcap -F pcap`).
+ *
+ *  USAGE INSTRUCTIONS:
+ *
+ *      PayloadProbe p;
+ *      if (packet_parse_probe(frame, caplen, LINKTYPE_ETHERNET, &p)) ...
+ *
+ *      pcap_replay("scan.pcap", on_frame, userdata);
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/sockclient.h"
+
+// Link-layer header types (tcpdump.org/linktypes.html)
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101 // bare IPv4 or IPv6
+#define LINKTYPE_LINUX_SLL 113 // "tcpdump -i any"
+
+// Enough for Ethernet + one VLAN tag + IPv6 + a full TCP header
+#define PACKET_SNAPLEN 128
+
+/* *
+ * Called with every frame of a capture. ts_ns is the capture time in ns
+ * since the epoch.
+ */
+typedef void (*PacketFn)(void *userdata, const uint8_t *frame, size_t caplen,
+                         int linktype, uint64_t ts_ns);
+
+/* *
+ * Decodes a frame into a probe record, event_ms excepted.
+ * * Returns:
+ * true if the frame is a TCP SYN without ACK or a UDP datagram, false if it
+ * is anything else or truncated.
+ */
+bool packet_parse_probe(const uint8_t *frame, size_t caplen, int linktype,
+                        PayloadProbe *out);
+
+/* *
+ * Calls fn for every frame of a pcap file, in file order.
+ * * Returns:
+ * Number of frames read, or -1 if the file can't be read or isn't a pcap
+ * file with a supported link type. A truncated last record ends the replay.
+ */
+long pcap_replay(const char *path, PacketFn fn, void *userdata);
+
+#endif // LISTENER_PACKET_H
@@ -0,0 +1,180 @@
+#define MODULE_NAME "SURICATA"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "eve.h"
+
+#include "../../include/jsonscan.h"
+
+// ---- field conversion ----
+
+static uint8_t eve_parse_proto(const char *p, size_t len) {
+  static const struct {
+    const char *name;
+    uint8_t num;
+  } protos[] = {{"TCP", 6},  {"UDP", 17},  {"ICMP", 1},    {"IPv6-ICMP", 58},
+                {"GRE", 47}, {"ESP", 50},  {"SCTP", 132},  {"AH", 51}};
+
+  for (size_t i = 0; i < sizeof(protos) / sizeof(protos[0]); i++) {
+    if (strlen(protos[i].name) == len && memcmp(protos[i].name, p, len) == 0) {
+      return protos[i].num;
+    }
+  }
+
+  // Protocols Suricata has no name for are logged as their number
+  int v = len > 0 && len <= 3 ? json_digits(p, (int)len) : -1;
+  return v > 0 && v < 256 ? (uint8_t)v : 0;
+}
+
+// Returns the address family found, 0 if it isn't an address
+static int eve_parse_ip(const char *p, size_t len, uint8_t out[16]) {
+  char tmp[INET6_ADDRSTRLEN];
+  if (len == 0 || len >= sizeof(tmp)) {
+    return 0;
+  }
+  memcpy(tmp, p, len);
+  tmp[len] = '\0';
+
+  if (memchr(tmp, ':', len) == NULL) {
+    return inet_pton(AF_INET, tmp, out) == 1 ? 4 : 0;
+  }
+  return inet_pton(AF_INET6, tmp, out) == 1 ? 6 : 0;
+}
+
+static bool eve_parse_alert_object(JsonScan *s, PayloadIDSAlert *out,
+                                   bool *have_sid) {
+  if (!json_expect(s, '{')) {
+    return false;
+  }
+  json_skip_ws(s);
+  if (s->p < s->end && *s->p == '}') {
+    s->p++;
+    return true;
+  }
+
+  bool ok = true;
+  do {
+    const char *key;
+    size_t klen;
+    if (!json_scan_string(s, &key, &klen) || !json_expect(s, ':')) {
+      return false;
+    }
+
+    uint64_t v;
+    if (JSON_KEY_IS(key, klen, "signature_id")) {
+      if (!json_scan_uint(s, &v)) {
+        return false;
+      }
+      out->signature_id = (uint32_t)v;
+      *have_sid = true;
+    } else if (JSON_KEY_IS(key, klen, "severity")) {
+      if (!json_scan_uint(s, &v)) {
+        return false;
+      }
+      out->severity = v > UINT8_MAX ? UINT8_MAX : (uint8_t)v;
+    } else if (!json_skip_value(s)) {
+      return false;
+    }
+  } while (json_next_member(s, &ok));
+
+  return ok;
+}
+
+int eve_parse_alert(const char *line, size_t len, PayloadIDSAlert *out) {
+  JsonScan s = {line, line + len};
+  memset(out, 0, sizeof(PayloadIDSAlert));
+
+  if (!json_expect(&s, '{')) {
+    return -1;
+  }
+
+  bool is_alert = false;
+  bool have_sid = false;
+  int src_family = 0, dst_family = 0;
+  bool ok = true;
+
+  do {
+    const char *key;
+    size_t klen;
+    if (!json_scan_string(&s, &key, &klen) || !json_expect(&s, ':')) {
+      return -1;
+    }
+
+    const char *val;
+    size_t vlen;
+    uint64_t num;
+
+    if (JSON_KEY_IS(key, klen, "event_type")) {
+      if (!json_scan_string(&s, &val, &vlen)) {
+        return -1;
+      }
+      // Most records are flows, DNS, HTTP...: stop reading them right here
+      if (!JSON_KEY_IS(val, vlen, "alert")) {
+        return 0;
+      }
+      is_alert = true;
+    } else if (JSON_KEY_IS(key, klen, "timestamp")) {
+      if (!json_scan_string(&s, &val, &vlen)) {
+        return -1;
+      }
+      out->event_ms = json_parse_timestamp_ms(val, vlen);
+    } else if (JSON_KEY_IS(key, klen, "src_ip")) {
+      if (!json_scan_string(&s, &val, &vlen)) {
+        return -1;
+      }
+      src_family = eve_parse_ip(val, vlen, out->src_ip);
+    } else if (JSON_KEY_IS(key, klen, "dest_ip")) {
+      if (!json_scan_string(&s, &val, &vlen)) {
+        return -1;
+      }
+      dst_family = eve_parse_ip(val, vlen, out->dst_ip);
+    } else if (JSON_KEY_IS(key, klen, "src_port")) {
+      if (!json_scan_uint(&s, &num)) {
+        return -1;
+      }
+      out->src_port = (uint16_t)num;
+    } else if (JSON_KEY_IS(key, klen, "dest_port")) {
+      if (!json_scan_uint(&s, &num)) {
+        return -1;
+      }
+      out->dst_port = (uint16_t)num;
+    } else if (JSON_KEY_IS(key, klen, "proto")) {
+      json_skip_ws(&s);
+      if (s.p < s.end && *s.p == '"') {
+        if (!json_scan_string(&s, &val, &vlen)) {
+          return -1;
+        }
+        out->proto = eve_parse_proto(val, vlen);
+      } else if (json_scan_uint(&s, &num)) {
+        out->proto = num < 256 ? (uint8_t)num : 0;
+      } else {
+        return -1;
+      }
+    } else if (JSON_KEY_IS(key, klen, "alert")) {
+      if (!eve_parse_alert_object(&s, out, &have_sid)) {
+        return -1;
+      }
+    } else if (!json_skip_value(&s)) {
+      return -1;
+    }
+  } while (json_next_member(&s, &ok));
+
+  if (!ok) {
+    return -1;
+  }
+  if (!is_alert) {
+    return 0;
+  }
+  if (!have_sid) {
+    return -1;
+  }
+  if (src_family == dst_family) {
+    out->ip_version = (uint8_t)src_family;
+  } else {
+    // mixed or missing addresses: don't forward half of them
+    memset(out->src_ip, 0, sizeof(out->src_ip));
+    memset(out->dst_ip, 0, sizeof(out->dst_ip));
+  }
+  return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef SURICATA_EVE_H
+#define SURICATA_EVE_H
+
+#include <stddef.h>
+
+#include "../../include/sockclient.h"
+
+/* *
+ * Extracts alerts from Suricata's eve.json records (one JSON object per
+ * line).
+ *
+ * Records are scanned in place with jsonscan.h: nothing is copied or
+ * allocated per line, and a record that is not an alert is given up as soon
+ * as its event_type has been seen.
+ */
+
+#define EVE_READ_BUF_SIZE (256 * 1024) // also the longest line we accept
+
+/* *
+ * Parses one eve.json record (without the newline).
+ * * Returns:
+ * 1 if it is an alert and out was filled.
+ * 0 if it is a valid record of another type.
+ * -1 if it is malformed or an alert without a signature id.
+ */
+int eve_parse_alert(const char *line, size_t len, PayloadIDSAlert *out);
+
+#endif // SURICATA_EVE_H
@@ -0,0 +1,213 @@
+// Global defines
+#define MODULE_NAME "SURICATA"
+
+// standard includes
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+// shared includes
+#include "../../include/arena.h"
+#include "../../include/exit-codes.h"
+#include "../../include/logging.h"
+
+// local includes
+#include "eve.h"
+
+#define FILETAIL_IMPLEMENTATION
+#include "../../include/filetail.h"
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "../../include/sockclient.h"
+
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
+#define ARENA_SIZE (EVE_READ_BUF_SIZE + 64 * 1024)
+static uint8_t ingester_memory[ARENA_SIZE];
+
+// TODO make the program configurable via config file
+#define EVE_PATH "/var/log/suricata/eve.json"
+#define CHECK_INTERVAL_MS 1000
+#define SOCK_PATH IPC_CONTROLLER_SOCK_PATH
+
+// State shared by the reactor callbacks
+typedef struct {
+  Reactor *reactor;
+  FileTail tail;
+  int sock_fd;
+  int ipc_fd;
+
+  // alerts waiting to go out, flushed in one sendmmsg() per batch
+  IPCMessage batch[IPC_BATCH_MAX];
+  size_t batch_count;
+  uint64_t alerts;
+  uint64_t malformed;
+  uint64_t sent;
+  uint64_t send_failed;
+
+  IPCMessage rcv_msgs[IPC_BATCH_MAX];
+} Ingester;
+
+static void flush_alerts(Ingester *in);
+static void on_eve_line(void *userdata, const char *line, size_t len);
+static void on_eve_event(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_check(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata);
+
+/* Follows Suricata's eve.json and forwards every alert to the controller as
+ * MSG_EVT_IDS_ALERT. The path can be given as the only argument.
+ *
+ * Alerts found while handling one wakeup are sent together; if the
+ * controller falls behind, sends block and the file itself is the buffer, so
+ * nothing is dropped.
+ * */
+int main(int argc, char **argv) {
+  const char *eve_path = argc > 1 ? argv[1] : EVE_PATH;
+
+  Reactor reactor;
+  if (reactor_init(&reactor) != 0) {
+    LOG_ERROR("Failed to initialize reactor");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  const int signals[] = {SIGINT, SIGTERM};
+  if (reactor_add_signals(&reactor, signals, 2, on_signal, NULL) < 0) {
+    LOG_ERROR("Failed to register signal handlers");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  Arena arena;
+  arena_init(&arena, ingester_memory, ARENA_SIZE);
+
+  static Ingester in;
+  in.reactor = &reactor;
+
+  in.sock_fd = ipc_client_connect(SOCK_PATH);
+  if (in.sock_fd < 1) {
+    LOG_ERROR("Could not connect to the controller. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  if (ipc_client_hello(in.sock_fd, MOD_SURICATA) < 0) {
+    LOG_ERROR("Failed to identify to the controller");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  in.ipc_fd = ipc_client_poll_fd(in.sock_fd);
+
+  if (filetail_open(&in.tail, eve_path, &arena, EVE_READ_BUF_SIZE, false,
+                    on_eve_line, &in) != 0) {
+    LOG_ERROR("Failed to follow %s", eve_path);
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (reactor_add_fd(&reactor, filetail_fd(&in.tail), EPOLLIN, on_eve_event,
+                     &in) != 0 ||
+      reactor_add_timer(&reactor, CHECK_INTERVAL_MS, on_check, &in) < 0) {
+    LOG_ERROR("Failed to watch %s", eve_path);
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (reactor_add_fd(&reactor, in.ipc_fd, EPOLLIN, on_ipc_ready, &in) != 0 ||
+      (in.ipc_fd != in.sock_fd &&
+       reactor_add_fd(&reactor, in.sock_fd, 0, on_ipc_ready, &in) != 0)) {
+    LOG_ERROR("Failed to watch IPC socket");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  LOG_INFO("Following %s", eve_path);
+  reactor_run(&reactor);
+
+  flush_alerts(&in);
+  LOG_INFO("%llu lines, %llu alerts (%llu sent, %llu failed), %llu "
+           "malformed, %llu overlong, %llu rotations",
+           (unsigned long long)in.tail.lines, (unsigned long long)in.alerts,
+           (unsigned long long)in.sent, (unsigned long long)in.send_failed,
+           (unsigned long long)(in.malformed + in.tail.truncated),
+           (unsigned long long)in.tail.overlong,
+           (unsigned long long)in.tail.rotations);
+
+  filetail_close(&in.tail);
+  ipc_client_disconnect(&in.sock_fd);
+  reactor_close(&reactor);
+  LOG_INFO("Suricata ingester stopped");
+  return OS_EXIT_SUCCESS;
+}
+
+static void flush_alerts(Ingester *in) {
+  if (in->batch_count == 0) {
+    return;
+  }
+
+  int sent = ipc_client_send_batch(in->sock_fd, in->batch, in->batch_count);
+  if (sent < 0) {
+    sent = 0;
+  }
+  in->sent += (uint64_t)sent;
+  if ((size_t)sent < in->batch_count) {
+    in->send_failed += in->batch_count - (size_t)sent;
+    LOG_ERROR("Failed to forward %zu alerts", in->batch_count - (size_t)sent);
+  }
+  in->batch_count = 0;
+}
+
+static void on_eve_line(void *userdata, const char *line, size_t len) {
+  Ingester *in = (Ingester *)userdata;
+
+  // Parse straight into the outgoing message; it only counts if it's an alert
+  IPCMessage *msg = &in->batch[in->batch_count];
+  int rc = eve_parse_alert(line, len, &msg->payload.ids_alert);
+  if (rc <= 0) {
+    in->malformed += rc < 0;
+    return;
+  }
+
+  in->alerts++;
+  in->batch_count++;
+  memset(msg, 0, offsetof(IPCMessage, payload));
+  msg->origin = MOD_SURICATA;
+  msg->msgtype = MSG_EVT_IDS_ALERT;
+  msg->timestamp_ms = msg->payload.ids_alert.event_ms;
+  msg->payload_len = sizeof(PayloadIDSAlert);
+
+  if (in->batch_count == IPC_BATCH_MAX) {
+    flush_alerts(in);
+  }
+}
+
+static void on_eve_event(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Ingester *in = (Ingester *)userdata;
+  if (filetail_process(&in->tail) < 0) {
+    reactor_stop(r);
+  }
+  flush_alerts(in);
+}
+
+static void on_check(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Ingester *in = (Ingester *)userdata;
+  reactor_timer_ack(fd);
+  filetail_check(&in->tail);
+  flush_alerts(in);
+}
+
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata) {
+  Ingester *in = (Ingester *)userdata;
+
+  // Nothing is addressed to us yet; just notice when the controller goes away
+  int n;
+  while ((n = ipc_client_receive_batch(in->sock_fd, in->rcv_msgs,
+                                       IPC_BATCH_MAX)) > 0) {
+  }
+  if (n < 0 || (events & (EPOLLHUP | EPOLLERR))) {
+    LOG_ERROR("IPC connection lost. Exiting loop");
+    reactor_stop(r);
+  }
+}
+
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata) {
+  int signo = reactor_signal_read(fd);
+  LOG_INFO("Received signal %d. Shutting down", signo);
+  reactor_stop(r);
+}
@@ -0,0 +1,208 @@
+// Global defines
+#define MODULE_NAME "SYSSTATS"
+
+// standard includes
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+// shared includes
+#include "../../include/exit-codes.h"
+#include "../../include/logging.h"
+
+// local includes
+#include "sampler.h"
+
+#define SOCK_IPC_IMPLEMENTATION
+#include "../../include/sockclient.h"
+
+#define REACTOR_IMPLEMENTATION
+#include "../../include/reactor.h"
+
+#define SOCK_PATH IPC_CONTROLLER_SOCK_PATH
+
+#define MIN_INTERVAL_MS 100
+#define SELF_BUDGET_PPM 1000 // 0.1% of one core
+
+// Sampling interval in each state: slow when nothing is exposed, every
+// second when someone may be attacking
+static uint32_t state_interval_ms[STATE_COUNT] = {
+    [STATE_CLOSED] = 10000,
+    [STATE_PASSIVE_LISTEN] = 5000,
+    [STATE_HONEYPOT] = 1000,
+    [STATE_DEVELOPMENT] = 1000,
+};
+
+// State shared by the reactor callbacks
+typedef struct {
+  Sampler sampler;
+  SystemState state;
+  int timer_fd;
+  int sock_fd;
+  int ipc_fd;
+  uint64_t over_budget; // samples that cost more than SELF_BUDGET_PPM
+
+  IPCMessage rcv_msgs[IPC_BATCH_MAX];
+} SysStats;
+
+static int parse_intervals(const char *arg);
+static void on_sample_timer(Reactor *r, int fd, uint32_t events,
+                            void *userdata);
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata);
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata);
+
+/* Samples the board's CPU, memory, load, temperature, softirq and network
+ * counters and sends them to the controller as MSG_EVT_SYSSTATS. Every
+ * procfs and sysfs file stays open and is re-read with one pread(), so a
+ * sample costs a few tens of microseconds.
+ *
+ * The interval follows the controller's state (MSG_CMD_SET_STATE); the
+ * module starts with the Closed one. The defaults can be replaced, in
+ * milliseconds, for the Closed, Passive listen, Honeypot and Development
+ * states in that order.
+ *
+ * Usage: sysstats [closed,passive,honeypot,dev]
+ * */
+int main(int argc, char **argv) {
+  static SysStats st;
+  st.state = STATE_CLOSED;
+
+  if (argc > 1 && parse_intervals(argv[1]) != 0) {
+    LOG_ERROR("Usage: %s [closed,passive,honeypot,dev] (ms, at least %d)",
+              argv[0], MIN_INTERVAL_MS);
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  if (sampler_open(&st.sampler) != 0) {
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  Reactor reactor;
+  if (reactor_init(&reactor) != 0) {
+    LOG_ERROR("Failed to initialize reactor");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  const int signals[] = {SIGINT, SIGTERM};
+  if (reactor_add_signals(&reactor, signals, 2, on_signal, NULL) < 0) {
+    LOG_ERROR("Failed to register signal handlers");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  st.sock_fd = ipc_client_connect(SOCK_PATH);
+  if (st.sock_fd < 1) {
+    LOG_ERROR("Could not connect to the controller. Quitting.");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  if (ipc_client_hello(st.sock_fd, MOD_SYSSTATS) < 0) {
+    LOG_ERROR("Failed to identify to the controller");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  st.ipc_fd = ipc_client_poll_fd(st.sock_fd);
+
+  if (reactor_add_fd(&reactor, st.ipc_fd, EPOLLIN, on_ipc_ready, &st) != 0 ||
+      (st.ipc_fd != st.sock_fd &&
+       reactor_add_fd(&reactor, st.sock_fd, 0, on_ipc_ready, &st) != 0)) {
+    LOG_ERROR("Failed to watch IPC socket");
+    return OS_EXIT_GEN_FAILURE;
+  }
+  st.timer_fd = reactor_add_timer(&reactor, state_interval_ms[st.state],
+                                  on_sample_timer, &st);
+  if (st.timer_fd < 0) {
+    LOG_ERROR("Failed to start the sampling timer");
+    return OS_EXIT_GEN_FAILURE;
+  }
+
+  LOG_INFO("Sampling every %u ms", state_interval_ms[st.state]);
+  reactor_run(&reactor);
+
+  LOG_INFO("%llu samples, %llu read errors, %llu over the %d ppm budget",
+           (unsigned long long)st.sampler.samples,
+           (unsigned long long)st.sampler.read_errors,
+           (unsigned long long)st.over_budget, SELF_BUDGET_PPM);
+  sampler_close(&st.sampler);
+  ipc_client_disconnect(&st.sock_fd);
+  reactor_close(&reactor);
+  LOG_INFO("System stats module stopped");
+  return OS_EXIT_SUCCESS;
+}
+
+static int parse_intervals(const char *arg) {
+  const char *p = arg;
+  for (int s = 0; s < STATE_COUNT; s++) {
+    char *end;
+    unsigned long ms = strtoul(p, &end, 10);
+    if (end == p || ms < MIN_INTERVAL_MS || ms > UINT32_MAX ||
+        *end != (s == STATE_COUNT - 1 ? '\0' : ',')) {
+      return -1;
+    }
+    state_interval_ms[s] = (uint32_t)ms;
+    p = end + 1;
+  }
+  return 0;
+}
+
+static void on_sample_timer(Reactor *r, int fd, uint32_t events,
+                            void *userdata) {
+  SysStats *st = (SysStats *)userdata;
+  reactor_timer_ack(fd);
+
+  IPCMessage msg;
+  memset(&msg, 0, offsetof(IPCMessage, payload));
+  msg.origin = MOD_SYSSTATS;
+  msg.msgtype = MSG_EVT_SYSSTATS;
+  msg.payload_len = sizeof(PayloadSysStats);
+  sampler_sample(&st->sampler, &msg.payload.sysstats);
+
+  // Logged the 1st, 2nd, 4th, 8th... time: a slow board shouldn't get slower
+  uint32_t ppm = msg.payload.sysstats.self_ppm;
+  uint64_t over = ppm > SELF_BUDGET_PPM ? ++st->over_budget : 0;
+  if (over > 0 && (over & (over - 1)) == 0) {
+    LOG_WARN("Sampling used %u ppm of a core, over the %d ppm budget (%llu "
+             "times so far)",
+             ppm, SELF_BUDGET_PPM, (unsigned long long)over);
+  }
+
+  if (ipc_client_send(st->sock_fd, &msg) < 0) {
+    LOG_ERROR("Failed to send the sample");
+  }
+}
+
+static void on_set_state(SysStats *st, const PayloadState *state) {
+  if (state->state >= STATE_COUNT) {
+    LOG_WARN("Asked for unknown state %u", state->state);
+    return;
+  }
+  // Not a step of the controller's transitions: nothing to report back
+  st->state = (SystemState)state->state;
+  uint32_t ms = state_interval_ms[st->state];
+  if (reactor_timer_set(st->timer_fd, ms) == 0) {
+    LOG_INFO("Sampling every %u ms", ms);
+  }
+}
+
+static void on_ipc_ready(Reactor *r, int fd, uint32_t events, void *userdata) {
+  SysStats *st = (SysStats *)userdata;
+
+  int n;
+  while ((n = ipc_client_receive_batch(st->sock_fd, st->rcv_msgs,
+                                       IPC_BATCH_MAX)) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (st->rcv_msgs[i].msgtype == MSG_CMD_SET_STATE) {
+        on_set_state(st, &st->rcv_msgs[i].payload.state);
+      }
+    }
+  }
+  if (n < 0 || (events & (EPOLLHUP | EPOLLERR))) {
+    LOG_ERROR("IPC connection lost. Exiting loop");
+    reactor_stop(r);
+  }
+}
+
+static void on_signal(Reactor *r, int fd, uint32_t events, void *userdata) {
+  int signo = reactor_signal_read(fd);
+  LOG_INFO("Received signal %d. Shutting down", signo);
+  reactor_stop(r);
+}
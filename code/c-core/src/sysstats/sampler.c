@@ -0,0 +1,330 @@
+#define MODULE_NAME "SAMPLER"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../include/logging.h"
+#include "sampler.h"
+
+static const char *const proc_paths[PROC_FILE_COUNT] = {
+    [PROC_STAT] = "/proc/stat",       [PROC_SOFTIRQS] = "/proc/softirqs",
+    [PROC_NET_DEV] = "/proc/net/dev", [PROC_MEMINFO] = "/proc/meminfo",
+    [PROC_LOADAVG] = "/proc/loadavg", [PROC_THERMAL] = SAMPLER_THERMAL_ZONE,
+};
+
+// ---- parsing ----
+
+typedef struct {
+  const char *p;
+  const char *end;
+} Cursor;
+
+static void skip_spaces(Cursor *c) {
+  while (c->p < c->end && (*c->p == ' ' || *c->p == '\t')) {
+    c->p++;
+  }
+}
+
+static bool parse_u64(Cursor *c, uint64_t *v) {
+  skip_spaces(c);
+  if (c->p >= c->end || *c->p < '0' || *c->p > '9') {
+    return false;
+  }
+  uint64_t n = 0;
+  while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+    n = n * 10 + (uint64_t)(*c->p++ - '0');
+  }
+  *v = n;
+  return true;
+}
+
+static void next_line(Cursor *c) {
+  const char *nl = memchr(c->p, '\n', (size_t)(c->end - c->p));
+  c->p = nl != NULL ? nl + 1 : c->end;
+}
+
+static bool has_prefix(const Cursor *c, const char *prefix, size_t len) {
+  return (size_t)(c->end - c->p) >= len && memcmp(c->p, prefix, len) == 0;
+}
+
+// Moves past the label ending in ':' that starts the line, blanks first.
+// Returns the label's length, 0 if there's none.
+static size_t parse_label(Cursor *c, const char **label) {
+  skip_spaces(c);
+  *label = c->p;
+  const char *colon = c->p;
+  while (colon < c->end && *colon != ':' && *colon != '\n') {
+    colon++;
+  }
+  if (colon >= c->end || *colon != ':') {
+    return 0;
+  }
+  c->p = colon + 1;
+  return (size_t)(colon - *label);
+}
+
+int sampler_parse_stat(const char *buf, size_t len, SamplerReading *r) {
+  Cursor c = {buf, buf + len};
+  bool found = false;
+  r->core_count = 0;
+  // cpu  user nice system idle iowait irq softirq steal guest guest_nice
+  while (c.p < c.end && has_prefix(&c, "cpu", 3)) {
+    c.p += 3;
+    CpuTimes *t = &r->all;
+    uint64_t core;
+    if (c.p < c.end && *c.p != ' ') {
+      if (!parse_u64(&c, &core) || core >= SYSSTATS_MAX_CPUS) {
+        next_line(&c);
+        continue;
+      }
+      t = &r->cores[core];
+      r->core_count = core + 1 > r->core_count ? (uint8_t)(core + 1)
+                                               : r->core_count;
+    } else {
+      found = true;
+    }
+    uint64_t v[8] = {0};
+    for (size_t i = 0; i < 8 && parse_u64(&c, &v[i]); i++) {
+    }
+    t->busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+    t->idle = v[3];
+    t->iowait = v[4];
+    t->softirq = v[6];
+    next_line(&c);
+  }
+  return found ? 0 : -1;
+}
+
+void sampler_parse_softirqs(const char *buf, size_t len, SamplerReading *r) {
+  Cursor c = {buf, buf + len};
+  next_line(&c); // CPU0 CPU1 ...
+  while (c.p < c.end) {
+    const char *label;
+    size_t n = parse_label(&c, &label);
+    uint64_t *sum = NULL;
+    if (n == 6 && memcmp(label, "NET_RX", 6) == 0) {
+      sum = &r->softirq_net_rx;
+    } else if (n == 6 && memcmp(label, "NET_TX", 6) == 0) {
+      sum = &r->softirq_net_tx;
+    }
+    if (sum != NULL) {
+      uint64_t v;
+      for (*sum = 0; parse_u64(&c, &v);) {
+        *sum += v;
+      }
+    }
+    next_line(&c);
+  }
+}
+
+void sampler_parse_net_dev(const char *buf, size_t len, SamplerReading *r) {
+  Cursor c = {buf, buf + len};
+  next_line(&c); // Inter-|   Receive ...
+  next_line(&c); //  face |bytes ...
+  r->net_rx_bytes = r->net_tx_bytes = 0;
+  r->net_rx_packets = r->net_rx_drops = 0;
+  while (c.p < c.end) {
+    const char *name;
+    size_t n = parse_label(&c, &name);
+    if (n > 0 && !(n == 2 && memcmp(name, "lo", 2) == 0)) {
+      // rx: bytes packets errs drop fifo frame compressed multicast
+      // tx: bytes packets ...
+      uint64_t v[10] = {0};
+      for (size_t i = 0; i < 10 && parse_u64(&c, &v[i]); i++) {
+      }
+      r->net_rx_bytes += v[0];
+      r->net_rx_packets += v[1];
+      r->net_rx_drops += v[3];
+      r->net_tx_bytes += v[8];
+    }
+    next_line(&c);
+  }
+}
+
+void sampler_parse_meminfo(const char *buf, size_t len, uint32_t *total_kb,
+                           uint32_t *available_kb) {
+  Cursor c = {buf, buf + len};
+  int found = 0;
+  *total_kb = *available_kb = 0;
+  while (c.p < c.end && found < 2) {
+    uint32_t *out = NULL;
+    if (has_prefix(&c, "MemTotal:", 9)) {
+      out = total_kb;
+      c.p += 9;
+    } else if (has_prefix(&c, "MemAvailable:", 13)) {
+      out = available_kb;
+      c.p += 13;
+    }
+    uint64_t v;
+    if (out != NULL && parse_u64(&c, &v)) {
+      *out = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+      found++;
+    }
+    next_line(&c);
+  }
+}
+
+void sampler_parse_loadavg(const char *buf, size_t len, uint16_t load[3]) {
+  // 0.52 0.58 0.59 1/234 5678
+  Cursor c = {buf, buf + len};
+  for (int i = 0; i < 3; i++) {
+    uint64_t whole = 0, frac = 0;
+    parse_u64(&c, &whole);
+    if (c.p < c.end && *c.p == '.') {
+      c.p++;
+      const char *start = c.p;
+      parse_u64(&c, &frac);
+      frac = c.p - start == 1 ? frac * 10 : frac; // always 2 digits
+    }
+    uint64_t x100 = whole * 100 + frac;
+    load[i] = x100 > UINT16_MAX ? UINT16_MAX : (uint16_t)x100;
+  }
+}
+
+static int32_t parse_temp(const char *buf, size_t len) {
+  Cursor c = {buf, buf + len};
+  bool negative = len > 0 && buf[0] == '-';
+  c.p += negative;
+  uint64_t v;
+  if (!parse_u64(&c, &v) || v > INT32_MAX) {
+    return SYSSTATS_TEMP_UNKNOWN;
+  }
+  return negative ? -(int32_t)v : (int32_t)v;
+}
+
+// ---- reading ----
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// The file's current contents in s->buf. Returns the length, 0 if none.
+static size_t read_file(Sampler *s, ProcFile f) {
+  if (s->fds[f] < 0) {
+    return 0;
+  }
+  ssize_t n = pread(s->fds[f], s->buf, sizeof(s->buf) - 1, 0);
+  if (n < 0) {
+    s->read_errors++;
+    return 0;
+  }
+  s->buf[n] = '\0';
+  return (size_t)n;
+}
+
+static int read_counters(Sampler *s, SamplerReading *r) {
+  memset(r, 0, sizeof(*r));
+  size_t len = read_file(s, PROC_STAT);
+  int rc = sampler_parse_stat(s->buf, len, r);
+  len = read_file(s, PROC_SOFTIRQS);
+  sampler_parse_softirqs(s->buf, len, r);
+  len = read_file(s, PROC_NET_DEV);
+  sampler_parse_net_dev(s->buf, len, r);
+  r->wall_ns = clock_ns(CLOCK_MONOTONIC);
+  r->self_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  return rc;
+}
+
+// ---- API ----
+
+int sampler_open(Sampler *s) {
+  memset(s, 0, sizeof(*s));
+  for (int f = 0; f < PROC_FILE_COUNT; f++) {
+    s->fds[f] = open(proc_paths[f], O_RDONLY | O_CLOEXEC);
+    if (s->fds[f] < 0 && f == PROC_THERMAL) {
+      s->fds[f] = open(SAMPLER_THERMAL_FALLBACK, O_RDONLY | O_CLOEXEC);
+    }
+    if (s->fds[f] < 0) {
+      LOG_WARN("%s can't be read, not reported: %s", proc_paths[f],
+               strerror(errno));
+    }
+  }
+  if (s->fds[PROC_STAT] < 0 || read_counters(s, &s->prev) != 0) {
+    LOG_ERROR("No CPU counters in /proc/stat");
+    sampler_close(s);
+    return -1;
+  }
+  return 0;
+}
+
+static uint16_t permille(uint64_t part, uint64_t total) {
+  return total == 0 ? 0 : (uint16_t)(part * 1000 / total);
+}
+
+static uint16_t cpu_permille(const CpuTimes *now, const CpuTimes *prev,
+                             uint64_t part_now, uint64_t part_prev) {
+  uint64_t total = (now->busy + now->idle + now->iowait) -
+                   (prev->busy + prev->idle + prev->iowait);
+  return permille(part_now - part_prev, total);
+}
+
+static uint32_t per_second(uint64_t now, uint64_t prev, uint64_t wall_ns) {
+  if (wall_ns == 0 || now < prev) { // counters reset (an interface went away)
+    return 0;
+  }
+  uint64_t rate = (now - prev) * 1000000000ULL / wall_ns;
+  return rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate;
+}
+
+void sampler_sample(Sampler *s, PayloadSysStats *out) {
+  SamplerReading now;
+  read_counters(s, &now);
+  const SamplerReading *prev = &s->prev;
+  uint64_t wall_ns = now.wall_ns - prev->wall_ns;
+
+  memset(out, 0, sizeof(*out));
+  out->interval_ms = (uint32_t)(wall_ns / 1000000);
+  out->cpu_busy = cpu_permille(&now.all, &prev->all, now.all.busy,
+                               prev->all.busy);
+  out->cpu_iowait = cpu_permille(&now.all, &prev->all, now.all.iowait,
+                                 prev->all.iowait);
+  out->cpu_softirq = cpu_permille(&now.all, &prev->all, now.all.softirq,
+                                  prev->all.softirq);
+  out->cpu_count = now.core_count < prev->core_count ? now.core_count
+                                                     : prev->core_count;
+  for (uint8_t i = 0; i < out->cpu_count; i++) {
+    out->core_busy[i] = cpu_permille(&now.cores[i], &prev->cores[i],
+                                     now.cores[i].busy, prev->cores[i].busy);
+  }
+
+  out->net_rx_bytes = per_second(now.net_rx_bytes, prev->net_rx_bytes, wall_ns);
+  out->net_tx_bytes = per_second(now.net_tx_bytes, prev->net_tx_bytes, wall_ns);
+  out->net_rx_packets =
+      per_second(now.net_rx_packets, prev->net_rx_packets, wall_ns);
+  out->net_rx_drops = per_second(now.net_rx_drops, prev->net_rx_drops, wall_ns);
+  out->softirq_net_rx =
+      per_second(now.softirq_net_rx, prev->softirq_net_rx, wall_ns);
+  out->softirq_net_tx =
+      per_second(now.softirq_net_tx, prev->softirq_net_tx, wall_ns);
+
+  size_t len = read_file(s, PROC_MEMINFO);
+  sampler_parse_meminfo(s->buf, len, &out->mem_total_kb,
+                        &out->mem_available_kb);
+  len = read_file(s, PROC_LOADAVG);
+  sampler_parse_loadavg(s->buf, len, out->load_x100);
+  len = read_file(s, PROC_THERMAL);
+  out->temp_mc = parse_temp(s->buf, len);
+
+  // Everything above is the cost of this sample, and part of the next one
+  uint64_t self_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  if (wall_ns > 0) {
+    out->self_ppm =
+        (uint32_t)((self_ns - prev->self_cpu_ns) * 1000000ULL / wall_ns);
+  }
+  s->prev = now;
+  s->samples++;
+}
+
+void sampler_close(Sampler *s) {
+  for (int f = 0; f < PROC_FILE_COUNT; f++) {
+    if (s->fds[f] >= 0) {
+      close(s->fds[f]);
+      s->fds[f] = -1;
+    }
+  }
+}
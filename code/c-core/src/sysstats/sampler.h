@@ -0,0 +1,116 @@
+#ifndef SYSSTATS_SAMPLER_H
+#define SYSSTATS_SAMPLER_H
+
+/* ==========================================================================
+ *  Orange Sentry - System stats sampler
+ * ==========================================================================
+ *
+ *  SUMMARY:
+ *  Reads the board's counters from procfs and sysfs and turns two
+ *  consecutive readings into a PayloadSysStats:
+ *    /proc/stat        CPU time, in total and per core
+ *    /proc/softirqs    NET_RX / NET_TX softirqs
+ *    /proc/net/dev     bytes, packets and drops of every interface but lo
+ *    /proc/meminfo     MemTotal, MemAvailable
+ *    /proc/loadavg     load averages
+ *    thermal zone      CPU temperature
+ *
+ *  Every file is opened once and kept open; a sample is one pread() at
+ *  offset 0 per file, which makes the kernel regenerate it, and a parser
+ *  written for that file's layout: no fopen/fclose, no stdio buffering, no
+ *  scanf. Missing files (no thermal zone in a VM, say) are reported as
+ *  zero or SYSSTATS_TEMP_UNKNOWN and never retried.
+ *
+ *  The sampler also accounts for itself: the CPU time its process used
+ *  between two samples, in millionths of one core.
+ *
+ *  USAGE INSTRUCTIONS:
+ *  1. sampler_open() once; the first reading is taken then.
+ *  2. sampler_sample() at every interval.
+ *  3. sampler_close().
+ *
+ * ========================================================================== */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/sockclient.h"
+
+// The Orange Pi's CPU sensor; zone 0 is tried when it doesn't exist
+#define SAMPLER_THERMAL_ZONE "/sys/class/thermal/thermal_zone1/temp"
+#define SAMPLER_THERMAL_FALLBACK "/sys/class/thermal/thermal_zone0/temp"
+#define SAMPLER_BUF_SIZE 8192 // /proc/stat's cpu lines come first
+
+typedef enum {
+  PROC_STAT,
+  PROC_SOFTIRQS,
+  PROC_NET_DEV,
+  PROC_MEMINFO,
+  PROC_LOADAVG,
+  PROC_THERMAL,
+  PROC_FILE_COUNT
+} ProcFile;
+
+typedef struct {
+  uint64_t busy; // user, nice, system, irq, softirq, steal
+  uint64_t idle;
+  uint64_t iowait;
+  uint64_t softirq;
+} CpuTimes;
+
+// The monotonic counters of one reading
+typedef struct {
+  CpuTimes all;
+  CpuTimes cores[SYSSTATS_MAX_CPUS];
+  uint8_t core_count;
+  uint64_t softirq_net_rx;
+  uint64_t softirq_net_tx;
+  uint64_t net_rx_bytes;
+  uint64_t net_tx_bytes;
+  uint64_t net_rx_packets;
+  uint64_t net_rx_drops;
+  uint64_t wall_ns;
+  uint64_t self_cpu_ns;
+} SamplerReading;
+
+typedef struct {
+  int fds[PROC_FILE_COUNT]; // -1: not available here
+  SamplerReading prev;
+  char buf[SAMPLER_BUF_SIZE];
+
+  // counters
+  uint64_t samples;
+  uint64_t read_errors;
+} Sampler;
+
+/* *
+ * Opens every file and takes the first reading.
+ * * Returns:
+ * 0 on success, -1 if /proc/stat can't be read.
+ */
+int sampler_open(Sampler *s);
+
+/* *
+ * Reads everything again and fills out with what changed since the last
+ * reading, and with the current memory, load and temperature.
+ */
+void sampler_sample(Sampler *s, PayloadSysStats *out);
+
+void sampler_close(Sampler *s);
+
+// Parsers, one per file layout, exposed for the benchmark
+
+/* *
+ * Reads the "cpu" and "cpuN" lines of /proc/stat.
+ * * Returns:
+ * 0 on success, -1 if the aggregate line is missing.
+ */
+int sampler_parse_stat(const char *buf, size_t len, SamplerReading *r);
+void sampler_parse_softirqs(const char *buf, size_t len, SamplerReading *r);
+void sampler_parse_net_dev(const char *buf, size_t len, SamplerReading *r);
+void sampler_parse_meminfo(const char *buf, size_t len, uint32_t *total_kb,
+                           uint32_t *available_kb);
+void sampler_parse_loadavg(const char *buf, size_t len, uint16_t load[3]);
+
+#endif // SYSSTATS_SAMPLER_H